@@ -14,7 +14,13 @@
 
 /* include all of the parts */
 #include <vrt/atomic.h>
+#include <vrt/journal.h>
+#include <vrt/memory.h>
+#include <vrt/pipeline.h>
 #include <vrt/queue.h>
+#include <vrt/relay.h>
+#include <vrt/shard.h>
+#include <vrt/scheduler.h>
 #include <vrt/value.h>
 #include <vrt/yield.h>
 
@@ -15,6 +15,67 @@
 #include <libcork/threads.h>
 
 
+/*
+ * There are two implementations of our atomic operations.  By default, we use
+ * the GCC __atomic builtins (which match the C11 memory model) to load cursors
+ * with acquire semantics and store them with release semantics.  On x86 these
+ * compile into plain mov instructions, since the hardware already provides
+ * those guarantees; on weaker architectures the compiler emits whatever fences
+ * are needed.
+ *
+ * If you define VRT_ATOMIC_FENCES (or the compiler doesn't have the __atomic
+ * builtins), we use explicit memory barriers around volatile loads and stores
+ * instead.
+ */
+
+#if !defined(VRT_ATOMIC_FENCES) && !defined(__ATOMIC_ACQUIRE)
+#define VRT_ATOMIC_FENCES  1
+#endif
+
+#if !defined(VRT_ATOMIC_FENCES)
+
+#define VRT_ATOMIC_BACKEND  "acquire/release atomics"
+
+/* Keeps any load or store after the barrier from being reordered before any
+ * load before the barrier. */
+CORK_ATTR_UNUSED
+static inline void
+vrt_atomic_read_barrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+/* Keeps any load or store before the barrier from being reordered after any
+ * store after the barrier. */
+CORK_ATTR_UNUSED
+static inline void
+vrt_atomic_write_barrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* A full memory barrier, which (unlike the read and write barriers) also keeps
+ * a later load from being reordered before an earlier store. */
+CORK_ATTR_UNUSED
+static inline void
+vrt_atomic_full_barrier(void)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#define vrt_atomic_load_relaxed(ptr) \
+    (__atomic_load_n((ptr), __ATOMIC_RELAXED))
+#define vrt_atomic_store_relaxed(ptr, v) \
+    (__atomic_store_n((ptr), (v), __ATOMIC_RELAXED))
+#define vrt_atomic_load_acquire(ptr) \
+    (__atomic_load_n((ptr), __ATOMIC_ACQUIRE))
+#define vrt_atomic_store_release(ptr, v) \
+    (__atomic_store_n((ptr), (v), __ATOMIC_RELEASE))
+
+#else /* VRT_ATOMIC_FENCES */
+
+#define VRT_ATOMIC_BACKEND  "memory fences"
+
 /*
  * __sync_synchronize doesn't emit a memory fence instruction in GCC <=
  * 4.3.  It also implements a full memory barrier.  So, on x86_64, which
@@ -81,6 +142,78 @@ vrt_atomic_write_barrier(void)
 #error "No memory barrier implementation!"
 #endif
 
+CORK_ATTR_UNUSED
+static inline void
+vrt_atomic_full_barrier(void)
+{
+    __sync_synchronize();
+}
+
+/* Without the __atomic builtins, we rely on the variables being volatile to
+ * keep the compiler from caching or eliding the loads and stores. */
+#define vrt_atomic_load_relaxed(ptr) \
+    (*(ptr))
+#define vrt_atomic_store_relaxed(ptr, v) \
+    (*(ptr) = (v))
+/* An acquire load needs its barrier after the load, so that nothing that
+ * follows can be hoisted above it; a release store needs its barrier before
+ * the store, so that nothing that precedes it can sink below it. */
+#define vrt_atomic_load_acquire(ptr) \
+    __extension__ ({ \
+        __typeof__(*(ptr))  __vrt_tmp = *(ptr); \
+        vrt_atomic_read_barrier(); \
+        __vrt_tmp; \
+    })
+#define vrt_atomic_store_release(ptr, v) \
+    do { \
+        vrt_atomic_write_barrier(); \
+        *(ptr) = (v); \
+    } while (0)
+
+#endif /* VRT_ATOMIC_FENCES */
+
+
+/*-----------------------------------------------------------------------
+ * Asymmetric barriers
+ */
+
+/* Some handshakes have one side that runs all the time (publishing a batch,
+ * say) and another that hardly ever does (going to sleep, or attaching a new
+ * client).  Each side stores its own flag and then loads the other's, so
+ * normally both sides need a full barrier in between.  On Linux, the
+ * membarrier system call lets the rare side pay for both: it forces a full
+ * barrier on every other running thread in the process, so the common side
+ * only has to keep the compiler from reordering its store and load.
+ *
+ * Call vrt_atomic_asymmetric_init before starting any thread that uses these
+ * barriers.  If membarrier isn't available, both barriers are plain full
+ * barriers.  Neither of them works for memory that's shared with another
+ * process. */
+
+/** Whether vrt_atomic_heavy_barrier is using membarrier. */
+extern bool  vrt_atomic_asymmetric;
+
+/** Find out whether we can use membarrier.  It's safe to call this more than
+ * once. */
+void
+vrt_atomic_asymmetric_init(void);
+
+/** The barrier for the side of a handshake that runs all the time. */
+CORK_ATTR_UNUSED
+static inline void
+vrt_atomic_light_barrier(void)
+{
+    if (CORK_LIKELY(vrt_atomic_asymmetric)) {
+        __asm__ __volatile__ ("" ::: "memory");
+    } else {
+        vrt_atomic_full_barrier();
+    }
+}
+
+/** The barrier for the side of a handshake that hardly ever runs. */
+void
+vrt_atomic_heavy_barrier(void);
+
 
 /*-----------------------------------------------------------------------
  * Padded values
@@ -97,18 +230,14 @@ CORK_ATTR_UNUSED
 static inline int
 vrt_padded_int_get(struct vrt_padded_int *padded)
 {
-    /* We need a read barrier before reading */
-    vrt_atomic_read_barrier();
-    return padded->value;
+    return vrt_atomic_load_acquire(&padded->value);
 }
 
 CORK_ATTR_UNUSED
 static inline void
 vrt_padded_int_set(struct vrt_padded_int *padded, int v)
 {
-    /* We need a write barrier after writing */
-    padded->value = v;
-    vrt_atomic_write_barrier();
+    vrt_atomic_store_release(&padded->value, v);
 }
 
 CORK_ATTR_UNUSED
@@ -0,0 +1,562 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_CORO_HH
+#define VRT_CORO_HH
+
+/* C++20 coroutine support.  This lets you write a queue client as a
+ * coroutine, which suspends itself (instead of yielding its thread) whenever
+ * it would have to wait:
+ *
+ *     vrt::task consume(vrt::consumer c)
+ *     {
+ *         for (;;) {
+ *             auto  next = co_await c.next();
+ *             if (next.rc != 0) {
+ *                 co_return;
+ *             }
+ *             ...process next.value...
+ *         }
+ *     }
+ *
+ * Each wrapped client belongs to an executor, which keeps track of the
+ * coroutines that are waiting for the queue, and resumes them once they can
+ * make progress.  vrt::loop is a simple executor that runs all of its
+ * coroutines on the thread that calls vrt::loop::run, and that sleeps until
+ * one of its queues notifies it when none of them can run.  Thousands of
+ * clients can share a handful of loops (and therefore threads) this way.
+ * You can also write your own executor, using a vrt_notifier to find out
+ * when to retry its suspended clients. */
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <vrt/queue.h>
+#include <vrt/yield.h>
+}
+
+
+namespace vrt {
+
+/*-----------------------------------------------------------------------
+ * Tasks
+ */
+
+/* A coroutine that an executor runs to completion.  The task doesn't start
+ * until you pass it to vrt::loop::spawn (or schedule its handle on some
+ * other executor), and its frame is destroyed as soon as it finishes.
+ * Exceptions that escape from a task terminate the program. */
+class task {
+  public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type>  handle;
+
+    struct promise_type {
+        task
+        get_return_object()
+        {
+            return task(handle::from_promise(*this));
+        }
+
+        std::suspend_always
+        initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never
+        final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void
+        return_void()
+        {
+        }
+
+        void
+        unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+
+    task(task &&other) : handle_(other.handle_)
+    {
+        other.handle_ = nullptr;
+    }
+
+    ~task()
+    {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    /** Give up ownership of the coroutine, so that an executor can run it. */
+    std::coroutine_handle<>
+    release()
+    {
+        handle  h = handle_;
+        handle_ = nullptr;
+        return h;
+    }
+
+  private:
+    explicit task(handle h) : handle_(h)
+    {
+    }
+
+    handle  handle_;
+};
+
+
+/*-----------------------------------------------------------------------
+ * Executors
+ */
+
+/* A queue operation that a coroutine is waiting on. */
+class waiter {
+  public:
+    /** Try the operation again.  Returns true if it has finished (either
+     * successfully or with an error), in which case handle can be resumed. */
+    virtual bool
+    poll() = 0;
+
+    /** The coroutine that's waiting for the operation. */
+    std::coroutine_handle<>  handle;
+
+  protected:
+    ~waiter() = default;
+};
+
+/* Decides when (and on which thread) to resume the coroutines that are
+ * waiting on queue operations. */
+class executor {
+  public:
+    virtual ~executor() = default;
+
+    /** Resume a coroutine at some point in the future. */
+    virtual void
+    schedule(std::coroutine_handle<> handle) = 0;
+
+    /** Resume w.handle once w.poll() returns true.  The executor must call
+     * poll from the thread that should resume the coroutine. */
+    virtual void
+    park(waiter &w) = 0;
+};
+
+/* An executor that runs all of its coroutines on a single thread. */
+class loop : public executor {
+  public:
+    loop()
+    {
+        vrt_eventcount_init(&wakeup_);
+    }
+
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    /** Ask a queue to wake up the loop when it makes progress.  You must
+     * call this for every queue that the loop's coroutines use, before any
+     * of the queue's clients start running, and the loop must outlive the
+     * queue's clients. */
+    void
+    watch(struct vrt_queue *q)
+    {
+        notifiers_.emplace_back(new notifier(this, q));
+        vrt_queue_add_notifier(q, notifiers_.back().get());
+    }
+
+    void
+    schedule(std::coroutine_handle<> handle) override
+    {
+        ready_.push_back(handle);
+    }
+
+    void
+    park(waiter &w) override
+    {
+        parked_.push_back(&w);
+    }
+
+    /** Start a task on this loop. */
+    void
+    spawn(task t)
+    {
+        schedule(t.release());
+    }
+
+    /** Run coroutines until all of them have finished. */
+    void
+    run()
+    {
+        while (!ready_.empty() || !parked_.empty()) {
+            while (!ready_.empty()) {
+                std::coroutine_handle<>  handle = ready_.front();
+                ready_.pop_front();
+                handle.resume();
+            }
+
+            if (parked_.empty() || poll_parked()) {
+                continue;
+            }
+
+            /* Nothing can run.  Arm our notifiers, check one more time (in
+             * case something happened before we armed them), and then sleep
+             * until one of them fires. */
+            unsigned int  key = vrt_eventcount_prepare_wait(&wakeup_);
+            for (auto &n : notifiers_) {
+                vrt_queue_arm_notifier(n->queue, n.get());
+            }
+            if (poll_parked()) {
+                continue;
+            }
+            vrt_eventcount_wait(&wakeup_, key, VRT_WAIT_FOREVER);
+        }
+    }
+
+  private:
+    struct notifier : vrt_notifier {
+        notifier(loop *owner, struct vrt_queue *queue)
+            : owner(owner), queue(queue)
+        {
+            notify = &notifier::fire;
+        }
+
+        static void
+        fire(struct vrt_notifier *self)
+        {
+            notifier  *n = static_cast<notifier *>(self);
+            vrt_eventcount_notify(&n->owner->wakeup_);
+        }
+
+        loop  *owner;
+        struct vrt_queue  *queue;
+    };
+
+    /* Moves every parked coroutine that can make progress onto the ready
+     * list.  Returns whether there were any. */
+    bool
+    poll_parked()
+    {
+        bool  found = false;
+        size_t  kept = 0;
+        for (waiter *w : parked_) {
+            if (w->poll()) {
+                ready_.push_back(w->handle);
+                found = true;
+            } else {
+                parked_[kept++] = w;
+            }
+        }
+        parked_.resize(kept);
+        return found;
+    }
+
+    std::deque<std::coroutine_handle<>>  ready_;
+    std::vector<waiter *>  parked_;
+    std::vector<std::unique_ptr<notifier>>  notifiers_;
+    struct vrt_eventcount  wakeup_;
+};
+
+
+/*-----------------------------------------------------------------------
+ * Awaitable operations
+ */
+
+/* The outcome of a queue operation.  rc is 0 on success, or one of the usual
+ * queue result codes (VRT_QUEUE_EOF, VRT_QUEUE_FLUSH, or -1 for an error);
+ * value is only filled in if rc is 0. */
+template <typename T>
+struct result {
+    int  rc;
+    T  value;
+};
+
+/* A contiguous range of values, as returned by vrt_consumer_next_batch. */
+struct batch {
+    vrt_value_id  first;
+    unsigned int  count;
+};
+
+/* The base of all of our awaitables.  We try the non-blocking variant of the
+ * operation right away, and only suspend if it returns VRT_QUEUE_AGAIN. */
+class operation : public waiter {
+  public:
+    explicit operation(executor &exec) : exec_(exec)
+    {
+    }
+
+    bool
+    await_ready()
+    {
+        return poll();
+    }
+
+    void
+    await_suspend(std::coroutine_handle<> handle)
+    {
+        this->handle = handle;
+        exec_.park(*this);
+    }
+
+  protected:
+    /* Records the result code of a non-blocking call, and returns whether
+     * the operation is finished. */
+    bool
+    finish(int rc)
+    {
+        rc_ = rc;
+        return rc != VRT_QUEUE_AGAIN;
+    }
+
+    executor  &exec_;
+    int  rc_ = 0;
+};
+
+class claim_operation : public operation {
+  public:
+    claim_operation(executor &exec, struct vrt_producer *p)
+        : operation(exec), p_(p)
+    {
+    }
+
+    bool
+    poll() override
+    {
+        return finish(vrt_producer_try_claim(p_, &value_));
+    }
+
+    result<struct vrt_value *>
+    await_resume()
+    {
+        return { rc_, value_ };
+    }
+
+  private:
+    struct vrt_producer  *p_;
+    struct vrt_value  *value_ = nullptr;
+};
+
+class claim_many_operation : public operation {
+  public:
+    claim_many_operation(executor &exec, struct vrt_producer *p,
+                         unsigned int count, struct vrt_value **values)
+        : operation(exec), p_(p), count_(count), values_(values)
+    {
+    }
+
+    bool
+    poll() override
+    {
+        return finish(vrt_producer_try_claim_many
+                      (p_, count_, values_, &claimed_));
+    }
+
+    result<unsigned int>
+    await_resume()
+    {
+        return { rc_, claimed_ };
+    }
+
+  private:
+    struct vrt_producer  *p_;
+    unsigned int  count_;
+    struct vrt_value  **values_;
+    unsigned int  claimed_ = 0;
+};
+
+class eof_operation : public operation {
+  public:
+    eof_operation(executor &exec, struct vrt_producer *p)
+        : operation(exec), p_(p)
+    {
+    }
+
+    bool
+    poll() override
+    {
+        return finish(vrt_producer_try_eof(p_));
+    }
+
+    int
+    await_resume()
+    {
+        return rc_;
+    }
+
+  private:
+    struct vrt_producer  *p_;
+};
+
+class next_operation : public operation {
+  public:
+    next_operation(executor &exec, struct vrt_consumer *c)
+        : operation(exec), c_(c)
+    {
+    }
+
+    bool
+    poll() override
+    {
+        return finish(vrt_consumer_try_next(c_, &value_));
+    }
+
+    result<struct vrt_value *>
+    await_resume()
+    {
+        return { rc_, value_ };
+    }
+
+  private:
+    struct vrt_consumer  *c_;
+    struct vrt_value  *value_ = nullptr;
+};
+
+class next_batch_operation : public operation {
+  public:
+    next_batch_operation(executor &exec, struct vrt_consumer *c)
+        : operation(exec), c_(c)
+    {
+    }
+
+    bool
+    poll() override
+    {
+        return finish(vrt_consumer_try_next_batch
+                      (c_, &batch_.first, &batch_.count));
+    }
+
+    result<batch>
+    await_resume()
+    {
+        return { rc_, batch_ };
+    }
+
+  private:
+    struct vrt_consumer  *c_;
+    batch  batch_ = {};
+};
+
+
+/*-----------------------------------------------------------------------
+ * Clients
+ */
+
+/* A producer whose blocking operations suspend the calling coroutine.  This
+ * doesn't own the underlying vrt_producer, which still belongs to its
+ * queue.  Only the operations that can block are awaitable; publishing never
+ * has to wait, so it's a plain function call. */
+class producer {
+  public:
+    producer(struct vrt_producer *p, executor &exec) : p_(p), exec_(&exec)
+    {
+    }
+
+    struct vrt_producer *
+    get() const
+    {
+        return p_;
+    }
+
+    /** co_await to claim the next value. */
+    claim_operation
+    claim()
+    {
+        return claim_operation(*exec_, p_);
+    }
+
+    /** co_await to claim up to count values, which are stored into values.
+     * The result is the number of values that were actually claimed. */
+    claim_many_operation
+    claim_many(unsigned int count, struct vrt_value **values)
+    {
+        return claim_many_operation(*exec_, p_, count, values);
+    }
+
+    /** co_await to send an EOF. */
+    eof_operation
+    eof()
+    {
+        return eof_operation(*exec_, p_);
+    }
+
+    int
+    publish()
+    {
+        return vrt_producer_publish(p_);
+    }
+
+    int
+    publish_many(unsigned int count)
+    {
+        return vrt_producer_publish_many(p_, count);
+    }
+
+    int
+    skip()
+    {
+        return vrt_producer_skip(p_);
+    }
+
+    int
+    flush()
+    {
+        return vrt_producer_flush(p_);
+    }
+
+  private:
+    struct vrt_producer  *p_;
+    executor  *exec_;
+};
+
+/* A consumer whose blocking operations suspend the calling coroutine.  This
+ * doesn't own the underlying vrt_consumer, which still belongs to its
+ * queue. */
+class consumer {
+  public:
+    consumer(struct vrt_consumer *c, executor &exec) : c_(c), exec_(&exec)
+    {
+    }
+
+    struct vrt_consumer *
+    get() const
+    {
+        return c_;
+    }
+
+    /** co_await to retrieve the next value. */
+    next_operation
+    next()
+    {
+        return next_operation(*exec_, c_);
+    }
+
+    /** co_await to retrieve the next batch of values. */
+    next_batch_operation
+    next_batch()
+    {
+        return next_batch_operation(*exec_, c_);
+    }
+
+  private:
+    struct vrt_consumer  *c_;
+    executor  *exec_;
+};
+
+}  // namespace vrt
+
+
+#endif /* VRT_CORO_HH */
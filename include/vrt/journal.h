@@ -0,0 +1,146 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_JOURNAL_H
+#define VRT_JOURNAL_H
+
+#include <libcork/core.h>
+
+#include <vrt/memory.h>
+#include <vrt/queue.h>
+#include <vrt/value.h>
+
+
+/*-----------------------------------------------------------------------
+ * Journals
+ */
+
+/* A journal is a consumer that appends every value that a queue publishes
+ * to a series of memory-mapped segment files, using the value type's
+ * serialize hook.  Each value gets a journal sequence number, starting at 1
+ * and continuing across restarts.
+ *
+ * The journal works through the queue one batch at a time, and only lets
+ * its cursor move past a batch once the whole batch is in the journal (and,
+ * with VRT_JOURNAL_SYNC, on disk).  So if you make your other consumers
+ * depend on the journal's consumer, they'll never process a value that
+ * hasn't been journaled.  Those consumers can use
+ * vrt_journal_value_sequence to find out where each value is in the journal,
+ * and save that position as a checkpoint.
+ *
+ * When you restart, create the journal on the same directory before
+ * starting the queue; it picks up where the old journal left off.  Then use
+ * vrt_journal_replay to re-inject everything after the oldest checkpoint,
+ * before producing any new values.  Replayed values keep their old sequence
+ * numbers, and aren't written to the journal a second time, so each consumer
+ * can skip the values that it had already processed. */
+
+/** Flush each batch (and each new segment file's directory entry) to disk
+ * before letting any dependent consumers see it.  Without this, the kernel
+ * writes the segments back whenever it likes, so the journal survives a
+ * crash of the process, but not of the machine. */
+#define VRT_JOURNAL_SYNC  0x0001
+
+struct vrt_journal {
+    /** The journal's consumer of the queue */
+    struct vrt_consumer  *consumer;
+
+    /** The directory that holds the segment files */
+    const char  *path;
+
+    /** The size of each segment file */
+    size_t  segment_size;
+
+    /** The VRT_JOURNAL flags that the journal was created with */
+    unsigned int  flags;
+
+    /** The segment that we're appending to, where its next record goes, and
+     * how much of it has been flushed to disk */
+    struct vrt_memory  segment;
+    size_t  offset;
+    size_t  synced_offset;
+
+    /** The sequence number of the last value in the journal */
+    uint64_t  last_sequence;
+
+    /** The range of sequence numbers that vrt_journal_replay is
+     * re-injecting.  These are already in the journal, so we don't write
+     * them again. */
+    uint64_t  replay_next;
+    uint64_t  replay_last;
+
+    /** The sequence number of each value in the queue, indexed by slot */
+    uint64_t  *sequences;
+};
+
+/** Create a new journal for a queue, whose segment files live in path,
+ * each of which holds segment_size bytes.  (Use 0 for the default.)  We
+ * create the directory if it doesn't exist; if it already contains a
+ * journal, we append to it.  Each record is checksummed, and if the last
+ * segment ends with a torn or damaged record, we drop it and everything
+ * after it.  (If a crash left the last segment without even a header, we
+ * start that segment over.)  The journal's consumer belongs to the queue,
+ * and is freed along with it; the caller should set its yield strategy just
+ * like for any other client.  Returns NULL if the queue's value type can't
+ * be serialized, or if we can't open the journal; in that case we don't
+ * leave a consumer behind in the queue. */
+struct vrt_journal *
+vrt_journal_new(const char *name, struct vrt_queue *q, const char *path,
+                size_t segment_size, unsigned int flags);
+
+/** Free a journal, closing its segment files. */
+void
+vrt_journal_free(struct vrt_journal *journal);
+
+/** Append values to the journal until we see an EOF.  This is meant to be
+ * run in its own thread. */
+int
+vrt_journal_run(struct vrt_journal *journal);
+
+/** Return the journal sequence number of a value.  This is only valid for
+ * consumers that depend (directly or indirectly) on the journal's consumer,
+ * and only while they're processing the value. */
+#define vrt_journal_value_sequence(journal, id) \
+    ((journal)->sequences[(id) & (journal)->consumer->queue->value_mask])
+
+/** Return the sequence number of the last value in the journal.  This is
+ * only safe to call before the journal starts running, or after it has
+ * finished. */
+#define vrt_journal_last_sequence(journal) \
+    ((journal)->last_sequence)
+
+/** Re-inject every value in the journal whose sequence number is after
+ * @ref after, using a producer of the journal's queue.  You must do this
+ * before any producer publishes any new values.  We don't send an EOF when
+ * we're done, so you can keep using the producer for new values. */
+int
+vrt_journal_replay(struct vrt_journal *journal, struct vrt_producer *p,
+                   uint64_t after);
+
+
+/*-----------------------------------------------------------------------
+ * Checkpoints
+ */
+
+/** Record that the consumer with the given name has processed every value
+ * up through sequence number @ref sequence in the journal at path.  The
+ * checkpoint is flushed to disk before we return. */
+int
+vrt_journal_save_checkpoint(const char *path, const char *name,
+                            uint64_t sequence);
+
+/** Load the most recent checkpoint for the consumer with the given name.
+ * If it has never saved one, this is 0, meaning that it needs every value
+ * in the journal. */
+int
+vrt_journal_load_checkpoint(const char *path, const char *name,
+                            uint64_t *sequence);
+
+
+#endif /* VRT_JOURNAL_H */
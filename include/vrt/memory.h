@@ -0,0 +1,103 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_MEMORY_H
+#define VRT_MEMORY_H
+
+#include <libcork/core.h>
+
+
+/*-----------------------------------------------------------------------
+ * Memory regions
+ */
+
+/* These flags control how a queue allocates the memory for its ring buffer
+ * (and, for value types that are stored inline, the values themselves).  If
+ * you don't provide any flags, we use the normal heap allocator. */
+
+/** Ask for transparent huge pages. */
+#define VRT_MEMORY_HUGE_PAGES  0x0001
+
+/** Ask for explicit huge pages from the kernel's hugetlb pool.  If the pool
+ * doesn't have enough pages, we fall back on transparent huge pages. */
+#define VRT_MEMORY_HUGETLB  0x0002
+
+/** Touch every page of the region when it's allocated, so that the first lap
+ * around the ring doesn't take any page faults. */
+#define VRT_MEMORY_PREFAULT  0x0004
+
+/** Lock the region into RAM.  If we're not allowed to (because of
+ * RLIMIT_MEMLOCK, for instance), we log a warning and carry on. */
+#define VRT_MEMORY_MLOCK  0x0008
+
+/** A block of memory that holds part of a queue. */
+struct vrt_memory {
+    /** The start of the usable memory */
+    void  *ptr;
+
+    /** The number of usable bytes */
+    size_t  size;
+
+    /** The memory mapping that contains ptr, or NULL if we allocated this
+     * region from the heap. */
+    void  *map;
+    size_t  map_size;
+
+    /** The subset of the requested flags that we were actually able to
+     * satisfy. */
+    unsigned int  flags;
+
+    /** The NUMA node that the region is bound to, or -1 if it isn't bound
+     * to any particular node. */
+    int  node;
+};
+
+/** Pass this as a NUMA node to use the kernel's default placement policy. */
+#define VRT_NUMA_NODE_ANY  -1
+
+/** Allocate a zero-filled region of memory, whose start is aligned to
+ * alignment (which must be a power of 2).  If node isn't VRT_NUMA_NODE_ANY,
+ * we bind the region's pages to that NUMA node before touching any of them.
+ * (If we can't, we log a warning and leave the region unbound.)  Aborts if
+ * the memory can't be allocated. */
+void
+vrt_memory_alloc(struct vrt_memory *mem, size_t size, size_t alignment,
+                 unsigned int flags, int node);
+
+/** Map the first size bytes of a shared memory object (such as one created
+ * with shm_open) or a file into a region, so that other processes that map
+ * the same object see the same memory, and so that writes to a file reach
+ * the file.  Returns an error if we can't map it.  Free
+ * the region with vrt_memory_free as usual; that doesn't affect any other
+ * process's mapping. */
+int
+vrt_memory_map_shared(struct vrt_memory *mem, int fd, size_t size);
+
+/** Free a region of memory.  It's safe to call this on a region that was
+ * zero-filled and never allocated. */
+void
+vrt_memory_free(struct vrt_memory *mem);
+
+/** Return how many bytes of the region are currently backed by huge pages.
+ * This involves reading from /proc, so don't call it on a hot path. */
+size_t
+vrt_memory_huge_size(const struct vrt_memory *mem);
+
+/** Return the number of NUMA nodes in the current machine.  On machines (or
+ * platforms) without NUMA support, this is 1. */
+unsigned int
+vrt_numa_node_count(void);
+
+/** Return the NUMA node that the calling thread is currently running on, or 0
+ * if we can't tell. */
+int
+vrt_numa_current_node(void);
+
+
+#endif /* VRT_MEMORY_H */
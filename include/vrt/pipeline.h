@@ -0,0 +1,156 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_PIPELINE_H
+#define VRT_PIPELINE_H
+
+#include <pthread.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <vrt/queue.h>
+#include <vrt/yield.h>
+
+
+/*-----------------------------------------------------------------------
+ * Pipelines
+ */
+
+/* A pipeline describes the clients of a queue as a graph of stages, and
+ * takes care of running them.  Each stage is a producer or consumer that
+ * runs in its own thread; you give each stage the function to run, and
+ * (optionally) a yield strategy and the CPU that its thread should be pinned
+ * to.  Consumer stages can depend on other consumer stages, which gives you
+ * the usual diamond and multi-step layouts:
+ *
+ *     vrt_pipeline_add_dependency(step2, step1);
+ *     vrt_pipeline_add_dependency(step3, step2);
+ *
+ * Nothing is wired up until you call vrt_pipeline_start, which checks the
+ * whole graph first: there must be at least one producer and one consumer,
+ * the dependencies can't contain a cycle, and every pinned CPU must be one
+ * that the process is allowed to run on.  Each stage's function should return
+ * once it's finished (for consumers, once they see an EOF), and
+ * vrt_pipeline_join waits for all of them. */
+
+/* Use this as a stage's CPU to let the kernel place its thread. */
+#define VRT_CPU_ANY  (-1)
+
+struct vrt_stage;
+typedef cork_array(struct vrt_stage *)  vrt_stage_array;
+
+struct vrt_stage {
+    /** The name of the stage */
+    const char  *name;
+
+    /** The stage's producer, if it's a producer stage */
+    struct vrt_producer  *producer;
+
+    /** The stage's consumer, if it's a consumer stage */
+    struct vrt_consumer  *consumer;
+
+    /** The function to run in the stage's thread, and its parameter */
+    void *
+    (*run)(void *);
+    void  *ud;
+
+    /** The CPU to pin the stage's thread to, or VRT_CPU_ANY */
+    int  cpu;
+
+    /** The stages that this one depends on */
+    vrt_stage_array  dependencies;
+
+    /* The stage's thread, once the pipeline is running */
+    pthread_t  thread;
+    bool  started;
+
+    /* Used while checking the graph for cycles, and while stopping a
+     * pipeline whose stages couldn't all start */
+    unsigned int  mark;
+};
+
+struct vrt_pipeline {
+    /** The name of the pipeline */
+    const char  *name;
+
+    /** The queue that the pipeline's stages use */
+    struct vrt_queue  *queue;
+
+    /** The pipeline's stages, in the order that they were added */
+    vrt_stage_array  stages;
+
+    /** Whether the pipeline has been started */
+    bool  started;
+};
+
+/** Create a new pipeline for the given queue.  The pipeline doesn't own the
+ * queue, which must outlive it. */
+struct vrt_pipeline *
+vrt_pipeline_new(const char *name, struct vrt_queue *q);
+
+/** Free a pipeline.  If it's still running, we wait for its stages to
+ * finish first. */
+void
+vrt_pipeline_free(struct vrt_pipeline *pl);
+
+/** Add a producer stage.  The stage's producer is created right away, so
+ * that you can hand it to run's parameter before starting the pipeline.
+ * batch_size is the producer's batch size.  (Use 0 for the default.) */
+struct vrt_stage *
+vrt_pipeline_add_producer(struct vrt_pipeline *pl, const char *name,
+                          unsigned int batch_size,
+                          void *(*run)(void *), void *ud);
+
+/** Add a consumer stage.  The stage's consumer is created right away, so
+ * that you can hand it to run's parameter before starting the pipeline. */
+struct vrt_stage *
+vrt_pipeline_add_consumer(struct vrt_pipeline *pl, const char *name,
+                          void *(*run)(void *), void *ud);
+
+/** Make one consumer stage depend on another, so that it only sees values
+ * that dep has finished with.  Both must be consumer stages of the same
+ * pipeline. */
+int
+vrt_pipeline_add_dependency(struct vrt_stage *stage, struct vrt_stage *dep);
+
+/** Set the yield strategy that a stage's client uses.  The client takes
+ * ownership of the strategy.  Stages without one use
+ * vrt_yield_strategy_threaded. */
+void
+vrt_stage_set_yield(struct vrt_stage *stage, struct vrt_yield_strategy *yield);
+
+/** Pin a stage's thread to the given CPU (or VRT_CPU_ANY). */
+void
+vrt_stage_set_cpu(struct vrt_stage *stage, int cpu);
+
+/** Check the pipeline's graph, wire up its dependencies, start the queue
+ * (see vrt_queue_start), and then start one (possibly pinned) thread for
+ * each stage.  Returns an error, without starting anything, if the graph
+ * isn't valid, or if we can't wire up the stages or start the queue; you can
+ * fix the problem and try again.  If one of the threads can't be started or
+ * pinned to its CPU, we also return an error, but by then the queue is
+ * running.  So we stand in for each stage that didn't start, sending its EOF
+ * or throwing away its values, until the stages that did start have seen
+ * every EOF; their functions should then return as usual, and
+ * vrt_pipeline_join (or vrt_pipeline_free) waits for them.  Once the queue
+ * has started, you can't start the pipeline again. */
+int
+vrt_pipeline_start(struct vrt_pipeline *pl);
+
+/** Wait for every stage of a running pipeline to finish. */
+int
+vrt_pipeline_join(struct vrt_pipeline *pl);
+
+/** Start the pipeline and wait for it to finish. */
+int
+vrt_pipeline_run(struct vrt_pipeline *pl);
+
+
+#endif /* VRT_PIPELINE_H */
@@ -10,11 +10,14 @@
 #ifndef VRT_QUEUE_H
 #define VRT_QUEUE_H
 
+#include <pthread.h>
+
 #include <bowsprit.h>
 #include <libcork/core.h>
 #include <libcork/ds.h>
 
 #include <vrt/atomic.h>
+#include <vrt/memory.h>
 #include <vrt/value.h>
 #include <vrt/yield.h>
 
@@ -41,17 +44,101 @@ vrt_testing_mode(void);
  * FLUSH. */
 #define VRT_QUEUE_FLUSH  -3
 
+/** The result code used to signify that a non-blocking operation couldn't
+ * succeed right now (or before its deadline), and should be retried. */
+#define VRT_QUEUE_AGAIN  -4
+
 struct vrt_producer;
 struct vrt_consumer;
+struct vrt_consumer_group;
+struct vrt_notifier;
+struct vrt_shared_header;
 
 typedef cork_array(struct vrt_producer *)  vrt_producer_array;
 typedef cork_array(struct vrt_consumer *)  vrt_consumer_array;
+typedef cork_array(struct vrt_consumer_group *)  vrt_consumer_group_array;
+typedef cork_array(struct vrt_padded_int *)  vrt_cursor_array;
+typedef cork_array(struct vrt_notifier *)  vrt_notifier_array;
+
+/** A snapshot of the cursors that producers have to check before they can
+ * reuse a slot in the queue.  Whenever the set of gating cursors changes, we
+ * publish a new snapshot instead of modifying the current one, so that
+ * producers can scan it without taking any locks.  Once the queue has
+ * started, producers might still be looking at an old snapshot, so we keep
+ * them around (linked together via previous) until every producer has moved
+ * on to a newer one.  Each snapshot has a version number, which goes up by
+ * one each time we publish a new one. */
+struct vrt_gating_set {
+    size_t  count;
+    struct vrt_padded_int  **cursors;
+    struct vrt_gating_set  *previous;
+    unsigned int  version;
+};
+
+/** The parts of a queue that its producers and consumers update as they
+ * run.  This normally lives inside of the queue itself, but a shared queue
+ * keeps it in its shared memory region, so that clients in other processes
+ * can see it. */
+struct vrt_queue_control {
+    /** The last item that has been claimed by a producer.  This will
+     * only be updated if we have multiple producers; if there's only
+     * one, it doesn't need to coordinate with anyone, and keeps track
+     * of its last claimed value internally. */
+    struct vrt_padded_int  last_claimed_id;
+
+    /** The next value ID that can be written into the queue.  This is
+     * only updated if we have a single producer; see published_ids for the
+     * multiple-producer case. */
+    struct vrt_padded_int  cursor;
+
+    /** Notified whenever a producer publishes values, for the benefit of
+     * consumers that are sleeping until there's something to process. */
+    struct vrt_eventcount  published;
+
+    /** Notified whenever a consumer moves its cursor forward, for the
+     * benefit of producers that are sleeping until there's room in the
+     * queue, and of consumers that are sleeping until their dependencies
+     * have caught up. */
+    struct vrt_eventcount  consumed;
+};
 
 /** A FIFO queue modeled after the Java Disruptor project. */
 struct vrt_queue {
-    /** The array of values managed by this queue. */
+    /** The array of values managed by this queue.  This is only used if
+     * the queue's value type allocates each value separately. */
     struct vrt_value  **values;
 
+    /** The contiguous array of values managed by this queue.  This is only
+     * used if the queue's value type stores its values inline. */
+    char  *value_slab;
+
+    /** The distance in bytes between consecutive values in value_slab. */
+    size_t  value_stride;
+
+    /** The memory that holds either values or value_slab. */
+    struct vrt_memory  value_memory;
+
+    /** The memory that holds published_ids. */
+    struct vrt_memory  stamp_memory;
+
+    /** The VRT_MEMORY flags that we use to allocate the queue's memory. */
+    unsigned int  memory_flags;
+
+    /** The NUMA node that the queue's memory should live on, or
+     * VRT_NUMA_NODE_ANY. */
+    int  numa_node;
+
+    /** If the queue lives in a shared memory region, the region's header,
+     * and the memory that holds the region.  (See vrt_queue_new_shared.)
+     * The values, control, published_ids, and the consumers' cursors all
+     * point into the region. */
+    struct vrt_shared_header  *shared;
+    struct vrt_memory  shared_memory;
+
+    /** The name of the shared memory region, if we created it, and so have
+     * to remove it when the queue is freed. */
+    const char  *shared_name;
+
     /** One less than the size of this queue.  The actual value count
      * will always be a power of 2, so this value will always be an
      * AND-mask that lets you easily calculate (x % value_count). */
@@ -66,18 +153,88 @@ struct vrt_queue {
     /** The consumers feeding this queue. */
     vrt_consumer_array  consumers;
 
+    /** The consumer groups of this queue. */
+    vrt_consumer_group_array  groups;
+
+    /** The cursors that a producer must check before it can overwrite a
+     * slot.  This contains the cursor of each consumer group, and of each
+     * attached consumer that isn't in a group and that no other attached
+     * consumer depends on.  (If another consumer depends on it, that
+     * consumer's cursor can never be ahead of it, so we only need to check
+     * the other one.) */
+    vrt_cursor_array  gating_cursors;
+
+    /** The snapshot of gating_cursors that producers actually read.  (If
+     * there's exactly one gating cursor, producers read it directly rather
+     * than scanning the snapshot.) */
+    struct vrt_gating_set  *volatile gating;
+
+    /** Whether the queue's topology has been frozen by vrt_queue_start. */
+    bool  started;
+
+    /** Whether the queue has been started, and currently has a single
+     * producer.  Its claims and publishes can then skip the producer's
+     * function pointers and call the single-producer implementations
+     * directly.  This changes as producers attach and detach. */
+    volatile bool  single_producer;
+
+    /** The number of producers that consumers have to hear an EOF from.
+     * This can include a producer that's still attaching, and so isn't in
+     * the producers array yet. */
+    volatile unsigned int  producer_count;
+
+    /** The number of producers that haven't detached from the queue. */
+    volatile unsigned int  active_producer_count;
+
+    /** Set by a lone producer while it's between claiming a batch and
+     * publishing it.  A producer that wants to attach to the queue waits
+     * for this to clear before switching everyone over to the
+     * multiple-producer implementations. */
+    struct vrt_padded_int  lone_busy;
+
+    /** Serializes changes to the queue's topology once it has started. */
+    pthread_mutex_t  topology_lock;
+
     /** The last item that we know every consumer has finished
      * processing. */
     vrt_value_id  last_consumed_id;
 
-    /** The last item that has been claimed by a producer.  This will
-     * only be updated if we have multiple producers; if there's only
-     * one, it doesn't need to coordinate with anyone, and keeps track
-     * of its last claimed value internally. */
-    struct vrt_padded_int  last_claimed_id;
-
-    /** The next value ID that can be written into the queue. */
-    struct vrt_padded_int  cursor;
+    /** The queue's cursors and event counts.  This points at
+     * control_storage, unless the queue lives in shared memory. */
+    struct vrt_queue_control  *control;
+    struct vrt_queue_control  control_storage;
+
+    /** A publication stamp for each slot in the queue.  This is only
+     * allocated if we have multiple producers.  Each producer publishes a
+     * value by storing its ID into the value's slot, which means that
+     * producers never have to wait for each other to publish.  Consumers
+     * use the stamps to find the last value that has been published
+     * without any unpublished values before it. */
+    volatile vrt_value_id  *volatile published_ids;
+
+    /** The consumers that have asked for an eventfd.  Whoever wakes up the
+     * waiters of one of the event counts above also signals the eventfds of
+     * any of these consumers that are armed. */
+    vrt_consumer_array  eventfd_consumers;
+
+    /** A partition tag for each slot in the queue, which partitioned
+     * consumer groups use to decide which member gets each value.  This is
+     * only allocated once the queue has a partitioned group.  Tags live in
+     * their own array so that a member can skip over the values that belong
+     * to other members without touching them. */
+    uint32_t  *partitions;
+
+    /** The memory that holds partitions. */
+    struct vrt_memory  partition_memory;
+
+    /** If set, producers use this to find the partition key of each value
+     * that they publish. */
+    uint64_t
+    (*partition_key)(struct vrt_value *value);
+
+    /** The notifiers that have been added to this queue.  Like the eventfd
+     * consumers, these are told about wakeups of either event count. */
+    vrt_notifier_array  notifiers;
 
     /** A name for the queue */
     const char  *name;
@@ -91,35 +248,143 @@ struct vrt_queue *
 vrt_queue_new(const char *name, struct vrt_value_type *value_type,
               unsigned int value_count);
 
+/** Allocate a new queue, using the given VRT_MEMORY flags to allocate its
+ * ring buffer.  If the value type stores its values inline, the flags apply
+ * to the values, too; otherwise each value is still allocated separately
+ * from the heap.  Note that asking for huge pages rounds each of the queue's
+ * memory regions up to a whole number of huge pages. */
+struct vrt_queue *
+vrt_queue_new_with_flags(const char *name, struct vrt_value_type *value_type,
+                         unsigned int value_count, unsigned int memory_flags);
+
+/** Allocate a new queue whose memory is bound to the given NUMA node (or
+ * VRT_NUMA_NODE_ANY).  As with vrt_queue_new_with_flags, separately
+ * allocated values come from the heap, and so aren't bound to the node; use
+ * a value type that stores its values inline if that matters to you.  The
+ * producers and consumers of the queue should run on CPUs of the same node;
+ * use a vrt_relay to feed consumers on other nodes. */
+struct vrt_queue *
+vrt_queue_new_on_node(const char *name, struct vrt_value_type *value_type,
+                      unsigned int value_count, unsigned int memory_flags,
+                      int numa_node);
+
+/** Allocate a new queue in a named shared memory region, so that producers
+ * and consumers in other processes can use it without copying any values.
+ * (Other processes use vrt_queue_open_shared to get their own view of the
+ * queue.)  The region holds the values themselves, so the value type must
+ * store its values inline, and the values can't contain any pointers.
+ *
+ * A shared queue's topology is fixed when it's created: it has exactly @ref
+ * producer_count producers and @ref consumer_count consumers, spread across
+ * any number of processes, each of which adds its share using
+ * vrt_producer_new and vrt_consumer_new.  Producers wait for every consumer,
+ * including the ones that haven't been added yet, so that no consumer misses
+ * any values, and consumers wait for an EOF from every producer.  Shared
+ * queues don't support consumer groups, work pools, dependencies, or
+ * attaching and detaching clients; and notifiers and eventfds only hear
+ * about clients in the same process.
+ *
+ * The region's name is removed when the creator frees its queue, but the
+ * region itself sticks around until every process has freed theirs. */
+struct vrt_queue *
+vrt_queue_new_shared(const char *name, struct vrt_value_type *value_type,
+                     unsigned int value_count, unsigned int producer_count,
+                     unsigned int consumer_count);
+
+/** Open a shared queue that some other process created using
+ * vrt_queue_new_shared.  The value type must have the same size and
+ * alignment as the one that the queue was created with. */
+struct vrt_queue *
+vrt_queue_open_shared(const char *name, struct vrt_value_type *value_type);
+
 /** Free a queue. */
 void
 vrt_queue_free(struct vrt_queue *q);
 
+/** Statistics about the memory that a queue has allocated for itself. */
+struct vrt_queue_memory_stats {
+    /** The total number of bytes in the queue's memory regions */
+    size_t  size;
+    /** The number of those bytes that are backed by huge pages */
+    size_t  huge_page_size;
+    /** The number of those bytes that have been prefaulted */
+    size_t  prefaulted_size;
+    /** The number of those bytes that are locked into RAM */
+    size_t  locked_size;
+    /** The number of those bytes that are bound to the queue's NUMA node */
+    size_t  bound_size;
+};
+
+/** Fill in stats with how much of the memory that we asked for with the
+ * queue's VRT_MEMORY flags we actually got.  This reads from /proc, so
+ * don't call it on a hot path. */
+void
+vrt_queue_get_memory_stats(struct vrt_queue *q,
+                           struct vrt_queue_memory_stats *stats);
+
+/** Freeze the queue's topology.  Once you call this, you can't add any more
+ * producers, consumers, groups, work pools, or dependencies to the queue
+ * (though you can still attach and detach individual producers and
+ * consumers; see vrt_producer_attach and vrt_consumer_attach).  In return,
+ * we choose specialized implementations for the clients that the queue does
+ * have: a lone producer doesn't have to coordinate with anyone, producers
+ * that only have to check a single consumer's cursor read it directly, and
+ * likewise for consumers that depend on a single other consumer.  You
+ * should call this after setting up the queue's clients, but before any of
+ * them start running.  (Queues that are never started still work, but
+ * always use the general implementations.)  It's an error to start a queue
+ * without any producers or consumers, or with a work pool that doesn't have
+ * any workers.  Calling this more than once has no effect. */
+int
+vrt_queue_start(struct vrt_queue *q);
+
+/** Have the queue's producers call @ref key on each value that they
+ * publish, and use the result as the value's partition key.  (This replaces
+ * any key set with @c vrt_producer_set_partition.)  You must call this
+ * before any of the queue's producers start running. */
+void
+vrt_queue_set_partition_key(struct vrt_queue *q,
+                            uint64_t (*key)(struct vrt_value *value));
+
 /* Have the queue keep track of various statistics using the given Bowsprit
  * context. */
 void
 vrt_queue_set_bws_ctx(struct vrt_queue *q, struct bws_ctx *ctx);
 
-/* Compare two integers on the modular-arithmetic ring that fits into an int. */
-#define vrt_mod_lt(a, b) (0 < ((b)-(a)))
-#define vrt_mod_le(a, b) (0 <= ((b)-(a)))
+/* Compare two integers on the modular-arithmetic ring that fits into an int.
+ * We subtract as unsigned ints, since signed overflow is undefined, and the
+ * compiler is otherwise free to turn these into plain comparisons. */
+#define vrt_mod_lt(a, b) \
+    (0 < (int) ((unsigned int) (b) - (unsigned int) (a)))
+#define vrt_mod_le(a, b) \
+    (0 <= (int) ((unsigned int) (b) - (unsigned int) (a)))
 
 /** Return the number of values managed by the queue. */
 #define vrt_queue_size(q) \
     ((q)->value_mask + 1)
 
 /** Retrieve the value with the given ID. */
-#define vrt_queue_get(q, id) \
-    ((q)->values[(id) & (q)->value_mask])
+CORK_ATTR_UNUSED
+static inline struct vrt_value *
+vrt_queue_get(struct vrt_queue *q, vrt_value_id id)
+{
+    unsigned int  index = id & q->value_mask;
+    if (q->value_slab != NULL) {
+        return (struct vrt_value *) (q->value_slab + index * q->value_stride);
+    } else {
+        return q->values[index];
+    }
+}
 
 /** Return the ID of the value that was most recently published into the
  * queue.  This function involves a memory barrier, and so it should be
- * called sparingly. */
+ * called sparingly.  (If the queue has multiple producers, the cursor isn't
+ * used; consumers check the queue's published_ids instead.) */
 CORK_ATTR_UNUSED
 static inline vrt_value_id
 vrt_queue_get_cursor(struct vrt_queue *q)
 {
-    return vrt_padded_int_get(&q->cursor);
+    return vrt_padded_int_get(&q->control->cursor);
 }
 
 /** Set the ID of the value that was most recently published into the
@@ -130,7 +395,7 @@ CORK_ATTR_UNUSED
 static inline void
 vrt_queue_set_cursor(struct vrt_queue *q, vrt_value_id value)
 {
-    vrt_padded_int_set(&q->cursor, value);
+    vrt_padded_int_set(&q->control->cursor, value);
 }
 
 
@@ -165,6 +430,11 @@ struct vrt_producer {
      */
     vrt_value_id  last_claimed_id;
 
+    /** The ID of the last value that the producer has made visible to
+     * consumers.  If this is before the start of the current batch, then we
+     * haven't published any of the batch yet. */
+    vrt_value_id  last_published_id;
+
     /**
      * The function that the producer will use to claim a value ID from
      * the queue.  This is filled in by the vrt_queue_add_producer
@@ -180,12 +450,26 @@ struct vrt_producer {
     int
     (*claim)(struct vrt_queue *q, struct vrt_producer *self);
 
+    /**
+     * The function that the producer will use to claim a value ID from
+     * the queue without blocking past a deadline.  (A deadline of 0 means
+     * not to wait at all.)  If the queue is full, this returns
+     * VRT_QUEUE_AGAIN without claiming anything.  This is filled in by the
+     * vrt_queue_add_producer function, just like claim.
+     */
+    int
+    (*try_claim)(struct vrt_queue *q, struct vrt_producer *self,
+                 uint64_t deadline);
+
     /**
      * The function that the producer will use to publish a value ID to
      * the queue.  This is filled in by the vrt_queue_add_producer
      * function.  The particular function used depends on how many
      * producers are connected to the queue.  (If there's only one, we
-     * can use a faster implementation.)
+     * can use a faster implementation.)  This publishes every value in the
+     * current batch up through last_published_id, which is usually the end
+     * of the batch, but can be earlier if the producer has a publish
+     * interval.
      */
     int
     (*publish)(struct vrt_queue *q, struct vrt_producer *self,
@@ -194,10 +478,30 @@ struct vrt_producer {
     /** The number of values to claim at once. */
     unsigned int  batch_size;
 
+    /** If nonzero, we publish the values in a batch as soon as this many of
+     * them have been produced, instead of waiting for the end of the
+     * batch. */
+    unsigned int  publish_interval;
+
     /** The yield strategy to use when the producer operations would
      * block. */
     struct vrt_yield_strategy  *yield;
 
+    /** Whether the producer has detached from its queue. */
+    bool  detached;
+
+    /** The version of the last snapshot of the queue's gating cursors that
+     * the producer finished scanning.  It never looks at an older snapshot
+     * again, so once every producer has moved past a snapshot, we can free
+     * it. */
+    volatile unsigned int  gating_version;
+
+    /** Whether the producer has sent its EOF, and if so, the EOF's ID.
+     * Consumers that attach to a running queue use these to figure out
+     * which EOFs they've already missed. */
+    volatile int  sent_eof;
+    vrt_value_id  eof_id;
+
     /** A name for the producer */
     const char  *name;
 
@@ -239,12 +543,66 @@ vrt_producer_new(const char *name, unsigned int batch_size,
 void
 vrt_producer_free(struct vrt_producer *p);
 
+/** How long vrt_producer_attach waits for a lone producer to publish its
+ * current batch, in nanoseconds. */
+#define VRT_PRODUCER_ATTACH_TIMEOUT  UINT64_C(1000000000)
+
+/** Allocate a new producer for a queue that might already be running.  If
+ * the queue hasn't been started, this is the same as vrt_producer_new.
+ * Otherwise the new producer joins the queue's existing producers; if there
+ * was only one of them, we wait for it to publish its current batch, and
+ * then switch both of them over to the multiple-producer implementations.
+ * (If it doesn't publish the batch within VRT_PRODUCER_ATTACH_TIMEOUT
+ * nanoseconds, we give up and return an error; you can try again later.)
+ * The queue's consumers won't see their final EOF until the new producer
+ * sends one, too.  It's an error to attach a producer once every other
+ * producer has sent its EOF, since some consumers might have already
+ * finished.  (Like all producers, the new one belongs to the queue, and is
+ * freed along with it.) */
+struct vrt_producer *
+vrt_producer_attach(const char *name, unsigned int batch_size,
+                    struct vrt_queue *q);
+
+/** Detach a producer from its queue.  This sends the producer's EOF, after
+ * which you can't use the producer anymore.  If only one producer is left,
+ * it switches back to the single-producer implementations the next time it
+ * claims a batch. */
+int
+vrt_producer_detach(struct vrt_producer *p);
+
+/** Make values visible to consumers before the end of the batch that they
+ * belong to.  The producer still claims batch_size values at a time, but
+ * publishes them every @ref interval values, rather than only once the whole
+ * batch has been produced.  That puts a bound on how long a value can sit
+ * unpublished when values are produced slowly, without having to flush (and
+ * waste the rest of the batch on holes).  Each publish wakes up any sleeping
+ * consumers, though, so smaller intervals cost more.  An interval of 1
+ * publishes every value right away; 0 (the default) only publishes whole
+ * batches.  You can change this at any time from the producer's thread. */
+void
+vrt_producer_set_publish_interval(struct vrt_producer *p,
+                                  unsigned int interval);
+
 /** Claim the next value managed by the producer's queue.  If this
  * returns without an error, a value instance will be loaded into @ref
  * value.  The caller has full control over the contents of this value. */
 int
 vrt_producer_claim(struct vrt_producer *p, struct vrt_value **value);
 
+/** Claim the next value managed by the producer's queue, without blocking.
+ * If the queue is full, this returns VRT_QUEUE_AGAIN immediately. */
+int
+vrt_producer_try_claim(struct vrt_producer *p, struct vrt_value **value);
+
+/** Claim the next value managed by the producer's queue, waiting no later
+ * than @ref deadline (as measured by vrt_now_ns) for space to free up.  If
+ * the queue is still full at the deadline, this returns VRT_QUEUE_AGAIN.
+ * (How closely we meet the deadline depends on the producer's yield
+ * strategy.) */
+int
+vrt_producer_claim_until(struct vrt_producer *p, struct vrt_value **value,
+                         uint64_t deadline);
+
 /** Publish the most recently claimed value.  This function won't return
  * until the value is successfully published to the queue's consumers.
  * Once this function returns, the caller no longer has any rights to
@@ -253,17 +611,70 @@ vrt_producer_claim(struct vrt_producer *p, struct vrt_value **value);
 int
 vrt_producer_publish(struct vrt_producer *p);
 
+/** Claim up to @ref count values at once.  The claimed values are loaded
+ * into @ref values, and the number of values actually claimed is stored in
+ * @ref claimed.  We never claim values from more than one of the producer's
+ * batches at a time, so this might claim fewer values than you ask for; in
+ * that case, publish the values that you got, and then claim the rest.  (If
+ * @ref count is nonzero, we always claim at least one value.) */
+int
+vrt_producer_claim_many(struct vrt_producer *p, unsigned int count,
+                        struct vrt_value **values, unsigned int *claimed);
+
+/** Claim up to @ref count values at once, without blocking.  If we'd have to
+ * wait for space to free up, this returns VRT_QUEUE_AGAIN immediately.
+ * Otherwise it behaves just like @c vrt_producer_claim_many. */
+int
+vrt_producer_try_claim_many(struct vrt_producer *p, unsigned int count,
+                            struct vrt_value **values, unsigned int *claimed);
+
+/** Publish the @ref count most recently claimed values.  These must have
+ * been claimed by a single call to @c vrt_producer_claim_many (or, if @ref
+ * count is 1, @c vrt_producer_claim). */
+int
+vrt_producer_publish_many(struct vrt_producer *p, unsigned int count);
+
 /** Skip the value that was just claimed. */
 int
 vrt_producer_skip(struct vrt_producer *p);
 
+/** Set the partition key of a value that the producer has claimed but not
+ * yet published.  Values with the same key always go to the same member of
+ * a partitioned consumer group.  If you don't set a key, the value goes to
+ * every member of the group.  This does nothing if the queue doesn't have
+ * any partitioned groups. */
+void
+vrt_producer_set_partition(struct vrt_producer *p, struct vrt_value *value,
+                           uint64_t key);
+
 /** Signal that this producer won't produce any more values. */
 int
 vrt_producer_eof(struct vrt_producer *p);
 
+/** Signal that this producer won't produce any more values, without
+ * blocking.  If there isn't room in the queue for the EOF, this returns
+ * VRT_QUEUE_AGAIN immediately, and you should try again later. */
+int
+vrt_producer_try_eof(struct vrt_producer *p);
+
 int
 vrt_producer_flush(struct vrt_producer *p);
 
+/** Publish every value that the producer has produced so far, without
+ * waiting for the rest of the current batch to be filled in.  Any values in
+ * the batch that haven't been produced yet are published as holes.  Unlike
+ * vrt_producer_flush, this doesn't send a FLUSH message to the consumers. */
+int
+vrt_producer_publish_batch(struct vrt_producer *p);
+
+/** Publish every value that the producer has produced so far, without
+ * filling in the rest of the current batch.  The rest of the batch stays
+ * claimed, and the producer keeps filling it in as usual.  This is like
+ * calling vrt_producer_publish with a publish interval of 1, but you can
+ * decide when to do it after you've produced the values. */
+int
+vrt_producer_publish_partial(struct vrt_producer *p);
+
 
 /*-----------------------------------------------------------------------
  * Consumers
@@ -300,8 +711,10 @@ struct vrt_consumer {
     unsigned int  index;
 
     /** The last value that we've told that world that we've finished
-     * consuming */
-    struct vrt_padded_int  cursor;
+     * consuming.  This points at cursor_storage, unless the queue lives in
+     * shared memory. */
+    struct vrt_padded_int  *cursor;
+    struct vrt_padded_int  cursor_storage;
 
     /** The last value that we know is available for processing.  This
      * field is not thread-safe, and allows us to process a chunk of
@@ -319,10 +732,69 @@ struct vrt_consumer {
      * consumers have processed it. */
     vrt_consumer_array  dependencies;
 
+    /** Once the queue has been started, and if this consumer has exactly
+     * one dependency, this points at it, so that we can read its cursor
+     * directly rather than scanning dependencies. */
+    struct vrt_consumer  *dependency;
+
+    /** Whether any other consumer depends on this one. */
+    bool  is_dependency;
+
+    /** Whether the consumer has detached from its queue. */
+    bool  detached;
+
+    /** The consumer group that this consumer belongs to, if any. */
+    struct vrt_consumer_group  *group;
+
+    /** If the consumer belongs to a partitioned group, the number of members
+     * in the group, and this consumer's index among them.  partition_count
+     * is 0 otherwise. */
+    unsigned int  partition_count;
+    unsigned int  partition_index;
+
+    /** Whether this consumer is a work pool.  A work pool doesn't process
+     * any values itself; it hands each value to one of its workers. */
+    bool  is_pool;
+
+    /** The work pool that this consumer is a worker in, if any. */
+    struct vrt_consumer  *pool;
+
+    /** If this consumer is a work pool, the workers in the pool. */
+    vrt_consumer_array  workers;
+
+    /** If this consumer is a work pool, the last value that has been handed
+     * out to one of its workers.  The workers claim values by moving this
+     * forward. */
+    struct vrt_padded_int  work_id;
+
     /** The yield strategy to use when the consumer operations would
      * block. */
     struct vrt_yield_strategy  *yield;
 
+    /** An eventfd that's signalled when there might be new values to
+     * process, or -1 if the consumer doesn't have one. */
+    int  eventfd;
+
+    /** If nonzero, we update our cursor once we've finished this many
+     * values since the last update, even if we still have values available
+     * to process. */
+    unsigned int  commit_count;
+
+    /** If nonzero, we update our cursor once this many nanoseconds have
+     * passed since the last update, even if we still have values available
+     * to process.  commit_deadline is when the next update is due. */
+    uint64_t  commit_ns;
+    uint64_t  commit_deadline;
+
+    /** Whether we update our cursor at the end of each batch returned by
+     * vrt_consumer_next_batch. */
+    bool  commit_batches;
+
+    /** Whether the consumer is waiting for its eventfd to be signalled.
+     * Whoever clears this is responsible for signalling the eventfd, which
+     * means that there's at most one write per arm. */
+    volatile int  armed;
+
     /** A name for the consumer */
     const char  *name;
 
@@ -346,6 +818,17 @@ struct vrt_consumer {
 
     /* The number of times that we've yielded during a blocking operation */
     struct bws_derive  *yields;
+
+    /* The number of times that our eventfd has been signalled */
+    struct bws_derive  *notifications;
+
+    /* The number of values that we've skipped because they belong to some
+     * other member of our partitioned group */
+    struct bws_derive  *skipped;
+
+    /* The number of times that we've updated our cursor before running out
+     * of available values */
+    struct bws_derive  *commits;
 };
 
 /** Allocate a new consumer that will drain the given queue. */
@@ -356,9 +839,61 @@ vrt_consumer_new(const char *name, struct vrt_queue *q);
 void
 vrt_consumer_free(struct vrt_consumer *c);
 
-/** Adds a dependency to a consumer */
-#define vrt_consumer_add_dependency(c1, c2) \
-    (cork_array_append(&(c1)->dependencies, (c2)))
+/** Remove a consumer from a queue that hasn't been started yet, and free
+ * it.  This is mostly useful for backing out of a partially constructed
+ * set of clients.  It's an error to remove a consumer that another consumer
+ * depends on, or that belongs to a group or work pool.  A shared queue's
+ * consumer gives its slot back, so that this or another process can add a
+ * different one; it's an error if a later slot has already been taken. */
+int
+vrt_consumer_remove(struct vrt_consumer *c);
+
+/** Allocate a new consumer for a queue that might already be running.  If
+ * the queue hasn't been started, this is the same as vrt_consumer_new.
+ * Otherwise the new consumer starts with the values published after it
+ * attaches, and producers start waiting for it from then on.  A consumer
+ * that attaches to a running queue can't have any dependencies, or belong to
+ * a group or work pool.  It's an error to attach a consumer once every
+ * producer has sent its EOF.  (Like all consumers, the new one belongs to
+ * the queue, and is freed along with it.) */
+struct vrt_consumer *
+vrt_consumer_attach(const char *name, struct vrt_queue *q);
+
+/** Detach a consumer from its queue, so that producers no longer wait for
+ * it.  You can't use the consumer after detaching it.  It's an error to
+ * detach a consumer that belongs to a group or work pool, that another
+ * attached consumer depends on, or that's the only consumer that producers
+ * are waiting on. */
+int
+vrt_consumer_detach(struct vrt_consumer *c);
+
+/** Adds a dependency to a consumer.  Returns an error if the queue has
+ * already been started. */
+int
+vrt_consumer_add_dependency(struct vrt_consumer *c1, struct vrt_consumer *c2);
+
+/** Allocate a new work pool that will drain the given queue.  Each value in
+ * the queue is processed by exactly one of the pool's workers, which you add
+ * using @c vrt_consumer_pool_add.  The pool itself is a consumer, whose
+ * cursor is the last value that every worker has finished with; producers
+ * only have to check that one cursor, and other consumers can depend on the
+ * whole pool via @c vrt_consumer_add_dependency.  (Likewise, add any
+ * dependencies of the workers to the pool, not to the workers themselves.)
+ * You can't retrieve values from the pool directly. */
+struct vrt_consumer *
+vrt_consumer_pool_new(const char *name, struct vrt_queue *q);
+
+/** Add a consumer to a work pool as one of its workers.  The worker must
+ * belong to the same queue as the pool, and can only be in one pool (and
+ * not in a consumer group).  You must add all of a pool's workers before
+ * any of them start consuming values.
+ *
+ * Each FLUSH or hole is seen by whichever worker claims it.  Once every
+ * producer has sent an EOF, though, every worker gets VRT_QUEUE_EOF.  A
+ * worker's batches (from @c vrt_consumer_next_batch) are always a single
+ * value long. */
+int
+vrt_consumer_pool_add(struct vrt_consumer *pool, struct vrt_consumer *c);
 
 /** Retrieve the next value from the consumer's queue.  If this function
  * returns successfully, then @ref value will be filled in with the next
@@ -369,6 +904,117 @@ vrt_consumer_free(struct vrt_consumer *c);
 int
 vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value);
 
+/** Retrieve the next value from the consumer's queue, without blocking.  If
+ * there aren't any values available, this returns VRT_QUEUE_AGAIN
+ * immediately.  Otherwise it behaves just like @c vrt_consumer_next. */
+int
+vrt_consumer_try_next(struct vrt_consumer *c, struct vrt_value **value);
+
+/** Retrieve the next value from the consumer's queue, waiting no later than
+ * @ref deadline (as measured by vrt_now_ns) for one to become available.  If
+ * there still isn't one at the deadline, this returns VRT_QUEUE_AGAIN. */
+int
+vrt_consumer_next_until(struct vrt_consumer *c, struct vrt_value **value,
+                        uint64_t deadline);
+
+/** Return an eventfd that becomes readable when there might be new values
+ * for this consumer to process.  This lets you drive a consumer from an
+ * epoll (or similar) event loop: drain the consumer using @c
+ * vrt_consumer_try_next until it returns VRT_QUEUE_AGAIN, then call @c
+ * vrt_consumer_arm, and then wait for the eventfd to become readable.  The
+ * eventfd is created the first time you call this function, which must
+ * happen before any of the queue's clients start running.  Returns -1 if
+ * we can't create the eventfd (or if the platform doesn't support them). */
+int
+vrt_consumer_eventfd(struct vrt_consumer *c);
+
+/** Ask for the consumer's eventfd to be signalled when there are new values
+ * to process.  Returns false if there are already values available, in
+ * which case the consumer isn't armed, and you should drain it again before
+ * waiting on the eventfd.  The eventfd is signalled at most once for each
+ * call to this function. */
+bool
+vrt_consumer_arm(struct vrt_consumer *c);
+
+/** Reset the consumer's eventfd once it has become readable. */
+int
+vrt_consumer_eventfd_clear(struct vrt_consumer *c);
+
+/** Retrieve a batch of values from the consumer's queue.  If this function
+ * returns successfully, then @ref first and @ref count will be filled in with
+ * a range of values that are all ready to be processed; use
+ * `vrt_queue_get(c->queue, first + i)` to get each one.  The batch ends
+ * either at the last value that's currently available, or just before the
+ * next FLUSH, EOF or hole, so it's never empty.  As with @c
+ * vrt_consumer_next, the values are only valid until the next call to @c
+ * vrt_consumer_next or @c vrt_consumer_next_batch, and the return value is
+ * VRT_QUEUE_EOF or VRT_QUEUE_FLUSH if there's a control message instead of a
+ * batch.  The consumer's cursor is only updated between batches, so this
+ * lets you amortize any per-batch work across the whole batch.
+ *
+ * For a member of a partitioned group, the batch also includes any values
+ * in that range that belong to the other members, which you must skip using
+ * @c vrt_consumer_owns_value.  (The first value is always the member's
+ * own.) */
+int
+vrt_consumer_next_batch(struct vrt_consumer *c, vrt_value_id *first,
+                        unsigned int *count);
+
+/* A partition tag is 0 for a value that should go to every member of a
+ * partitioned group.  Otherwise the top bit is set, and the rest is a hash of
+ * the value's partition key. */
+#define VRT_PARTITION_ALL  0
+#define VRT_PARTITION_HASH_MASK  0x7fffffffU
+
+/* Maps a tag to one of count members.  This scales the hash into [0, count)
+ * with a multiply and a shift, which is much cheaper than a modulus. */
+#define vrt_partition_owner(tag, count) \
+    ((unsigned int) \
+     (((uint64_t) ((tag) & VRT_PARTITION_HASH_MASK) * (count)) >> 31))
+
+/** Return whether the consumer should process a value in a batch from @c
+ * vrt_consumer_next_batch.  This is only ever false for a member of a
+ * partitioned group, when the value belongs to another member. */
+CORK_ATTR_UNUSED
+static inline bool
+vrt_consumer_owns_value(struct vrt_consumer *c, vrt_value_id id)
+{
+    uint32_t  tag;
+    if (c->partition_count == 0) {
+        return true;
+    }
+    tag = c->queue->partitions[id & c->queue->value_mask];
+    return tag == VRT_PARTITION_ALL ||
+        vrt_partition_owner(tag, c->partition_count) == c->partition_index;
+}
+
+/** Retrieve a batch of values from the consumer's queue, without blocking.
+ * If there aren't any values available, this returns VRT_QUEUE_AGAIN
+ * immediately.  Otherwise it behaves just like @c vrt_consumer_next_batch. */
+int
+vrt_consumer_try_next_batch(struct vrt_consumer *c, vrt_value_id *first,
+                            unsigned int *count);
+
+/** Have the consumer update its cursor while it works through a long run
+ * of available values.  Normally a consumer only tells producers how far it
+ * has gotten once it runs out of values that it knows are available, so a
+ * consumer that has fallen behind holds on to every slot in the run until
+ * it has processed all of them.  With a commit interval, it also updates its
+ * cursor once it has processed @ref count values, or once @ref ns
+ * nanoseconds have passed, since the last update, so that producers can
+ * reuse those slots sooner.  Either limit can be 0 to disable it.  (The time
+ * limit means reading the clock for every value.)  A worker in a work pool
+ * only uses @ref count. */
+void
+vrt_consumer_set_commit_interval(struct vrt_consumer *c, unsigned int count,
+                                 uint64_t ns);
+
+/** Have the consumer update its cursor at the end of each batch returned by
+ * @c vrt_consumer_next_batch, rather than waiting until it runs out of
+ * available values. */
+void
+vrt_consumer_set_commit_batches(struct vrt_consumer *c, bool commit);
+
 /** Return the ID of the value that was most recently processed by this
  * consumer.  This function involves a memory barrier, and so it should
  * be called sparingly. */
@@ -376,7 +1022,7 @@ CORK_ATTR_UNUSED
 static inline vrt_value_id
 vrt_consumer_get_cursor(struct vrt_consumer *c)
 {
-    return vrt_padded_int_get(&c->cursor);
+    return vrt_padded_int_get(c->cursor);
 }
 
 /** Set the ID of the value that was most recently processed by this
@@ -387,8 +1033,118 @@ CORK_ATTR_UNUSED
 static inline void
 vrt_consumer_set_cursor(struct vrt_consumer *c, vrt_value_id value)
 {
-    vrt_padded_int_set(&c->cursor, value);
+    vrt_padded_int_set(c->cursor, value);
 }
 
 
+/*-----------------------------------------------------------------------
+ * Consumer groups
+ */
+
+/**
+ * A consumer group keeps track of the minimum cursor of several consumers.
+ * Before it can reuse a slot in the ring buffer, a producer has to make sure
+ * that every consumer has finished with the slot's previous value.  Without
+ * groups, that means reading the cursor of every consumer, each of which
+ * lives in its own cache line.  A producer only reads a group's aggregated
+ * cursor, which the group's members keep up to date whenever they publish
+ * their own cursors.  This moves the cost of the scan off of the producers,
+ * and spreads it across the consumers, which is a good trade-off when a
+ * queue has lots of consumers.
+ */
+struct vrt_consumer_group {
+    /** The queue that this group's consumers feed from */
+    struct vrt_queue  *queue;
+
+    /** The consumers in this group */
+    vrt_consumer_array  members;
+
+    /** The smallest cursor of any member of the group.  This only ever
+     * moves forward. */
+    struct vrt_padded_int  cursor;
+
+    /** Whether each value goes to only one member, based on its partition
+     * key. */
+    bool  partitioned;
+
+    /** A name for the group */
+    const char  *name;
+};
+
+/** Allocate a new consumer group.  The group belongs to the queue, and will
+ * be freed along with it. */
+struct vrt_consumer_group *
+vrt_consumer_group_new(const char *name, struct vrt_queue *q);
+
+/** Allocate a new partitioned consumer group.  Each value goes to just one
+ * member of the group, chosen by hashing the value's partition key (see @c
+ * vrt_producer_set_partition and @c vrt_queue_set_partition_key), so that
+ * each member sees all of the values for its keys, in order.  Values without
+ * a key, and all FLUSH, EOF and hole markers, go to every member.  Members
+ * skip over the other members' values without reading them.  You must
+ * create any partitioned groups before the queue's producers start. */
+struct vrt_consumer_group *
+vrt_consumer_group_new_partitioned(const char *name, struct vrt_queue *q);
+
+/** Free a consumer group */
+void
+vrt_consumer_group_free(struct vrt_consumer_group *g);
+
+/** Add a consumer to a group.  The consumer must belong to the same queue as
+ * the group, and can only be in one group.  You must add all of a group's
+ * members before any of them start consuming values. */
+int
+vrt_consumer_group_add(struct vrt_consumer_group *g, struct vrt_consumer *c);
+
+/** Return the ID of the last value that every member of the group has
+ * finished processing. */
+CORK_ATTR_UNUSED
+static inline vrt_value_id
+vrt_consumer_group_get_cursor(struct vrt_consumer_group *g)
+{
+    return vrt_padded_int_get(&g->cursor);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Notifiers
+ */
+
+/**
+ * A notifier lets code that isn't a queue client find out when the queue
+ * might have made progress.  This is how you drive a queue's producers and
+ * consumers from some other scheduling mechanism (an event loop, say, or a
+ * set of coroutines) without dedicating a thread to each of them.
+ *
+ * The protocol is the same as for an eventfd consumer: check whether your
+ * clients can make progress (using the non-blocking variants of claim and
+ * next); if none of them can, arm the notifier and check again; and if they
+ * still can't, wait for the notifier to fire.  A notifier fires at most once
+ * for each time that you arm it, and it can fire spuriously.
+ */
+struct vrt_notifier {
+    /** Called when the queue wakes up its waiters.  This is called from the
+     * thread of whichever client published or consumed values, so it must
+     * be thread-safe, and must not block. */
+    void
+    (*notify)(struct vrt_notifier *self);
+
+    /** Whether we should call notify on the next wakeup.  This is set by
+     * vrt_queue_arm_notifier, and cleared right before notify is called. */
+    volatile int  armed;
+};
+
+/** Add a notifier to a queue.  The queue doesn't take control of the
+ * notifier; you must keep it around until the queue is freed.  You must add
+ * every notifier before any of the queue's clients start running. */
+void
+vrt_queue_add_notifier(struct vrt_queue *q, struct vrt_notifier *n);
+
+/** Arm a notifier, so that it fires the next time the queue wakes up its
+ * waiters.  After arming the notifier, you must check your clients again
+ * before waiting for it to fire. */
+void
+vrt_queue_arm_notifier(struct vrt_queue *q, struct vrt_notifier *n);
+
+
 #endif /* VRT_QUEUE_H */
@@ -0,0 +1,70 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_RELAY_H
+#define VRT_RELAY_H
+
+#include <libcork/core.h>
+
+#include <vrt/queue.h>
+
+
+/*-----------------------------------------------------------------------
+ * Relays
+ */
+
+/* A relay copies every value from a source queue into a mirror queue.  The
+ * usual reason to do this is NUMA placement: if a queue has consumers on
+ * several nodes, you can give each remote node a mirror queue that's bound to
+ * that node, and a relay (running on that node) that feeds it.  Each value
+ * then only crosses the interconnect once per node, rather than once per
+ * consumer, and the source queue's producers only have to read the relay's
+ * cursor, rather than the cursor of every remote consumer.
+ *
+ * Both queues must use the same value type, and it must store its values
+ * inline, so that the relay knows how many bytes to copy.  FLUSH and EOF
+ * messages are passed along to the mirror queue.  Whenever the relay catches
+ * up with the source queue, it publishes whatever it's copied so far, so a
+ * partially filled batch never sits in the relay waiting for more values.
+ * The rest of that batch stays claimed for the values that come next, rather
+ * than being published as holes. */
+
+struct vrt_relay {
+    /** The relay's consumer of the source queue */
+    struct vrt_consumer  *consumer;
+
+    /** The relay's producer for the mirror queue */
+    struct vrt_producer  *producer;
+
+    /** The number of bytes to copy from each value (everything after the
+     * vrt_value header) */
+    size_t  payload_size;
+};
+
+/** Create a new relay from src into mirror.  The relay's consumer and
+ * producer belong to their queues, and are freed along with them; the caller
+ * should set their yield strategies just like for any other client.
+ * batch_size is the mirror producer's batch size.  (Use 0 for the default.)
+ * Returns NULL if the two queues can't be relayed. */
+struct vrt_relay *
+vrt_relay_new(const char *name, struct vrt_queue *src,
+              struct vrt_queue *mirror, unsigned int batch_size);
+
+/** Free a relay. */
+void
+vrt_relay_free(struct vrt_relay *relay);
+
+/** Copy values from the source queue into the mirror queue until we see an
+ * EOF, which is passed along to the mirror queue.  This is meant to be run in
+ * its own thread. */
+int
+vrt_relay_run(struct vrt_relay *relay);
+
+
+#endif /* VRT_RELAY_H */
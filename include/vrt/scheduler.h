@@ -0,0 +1,77 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_SCHEDULER_H
+#define VRT_SCHEDULER_H
+
+#include <libcork/core.h>
+
+#include <vrt/yield.h>
+
+
+/*-----------------------------------------------------------------------
+ * Schedulers
+ */
+
+/* A scheduler runs a set of tasks (usually the clients of one or more
+ * queues) on a fixed pool of worker threads.  Each task is a coroutine with
+ * its own stack.  When a task has to wait, its yield strategy switches back
+ * to the worker thread, which picks up some other task instead of spinning.
+ * This lets you run a pipeline with more stages than you have cores.
+ *
+ * Each worker has its own run queue.  A worker that runs out of tasks steals
+ * them from the other workers, so tasks migrate between threads; a task
+ * must not assume that it stays on the same thread across a yield. */
+
+struct vrt_scheduler;
+
+/** Create a new scheduler with the given number of worker threads.  (Use 0
+ * for one worker per online CPU.) */
+struct vrt_scheduler *
+vrt_scheduler_new(unsigned int thread_count);
+
+/** Free a scheduler.  You can't free a scheduler while it's running. */
+void
+vrt_scheduler_free(struct vrt_scheduler *s);
+
+/** Add a task to the scheduler.  The task will call run(ud) when the
+ * scheduler starts.  You must add every task before calling
+ * vrt_scheduler_run. */
+void
+vrt_scheduler_add(struct vrt_scheduler *s, const char *name,
+                  void *(*run)(void *), void *ud);
+
+/** Run every task until they all finish.  Returns an error if we can't
+ * start the worker threads. */
+int
+vrt_scheduler_run(struct vrt_scheduler *s);
+
+/** Return whether the caller is running as a scheduler task. */
+bool
+vrt_scheduler_in_task(void);
+
+/** Switch from the current task back to its worker thread, which will run
+ * the task again once it has given every other runnable task a turn.  If
+ * the caller isn't a scheduler task, this yields the current thread
+ * instead. */
+void
+vrt_scheduler_yield(void);
+
+/* A yield strategy that switches to another task every time it has to wait.
+ * If the wait drags on, it also yields the worker's thread, in case the task
+ * that it's waiting for belongs to a worker that isn't currently running.
+ * And if a worker goes through a whole round of tasks that are all still
+ * waiting, it backs off (yielding and then sleeping its thread, just like
+ * when it has no tasks at all) until one of them gets past its wait.
+ * (Outside of a scheduler, it just yields the thread.) */
+struct vrt_yield_strategy *
+vrt_yield_strategy_coroutine(void);
+
+
+#endif /* VRT_SCHEDULER_H */
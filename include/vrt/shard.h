@@ -0,0 +1,286 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_SHARD_H
+#define VRT_SHARD_H
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include <vrt/queue.h>
+#include <vrt/value.h>
+#include <vrt/yield.h>
+
+
+/*-----------------------------------------------------------------------
+ * Sharded queues
+ */
+
+/* A sharded queue stripes one logical stream of values across several
+ * independent queues (its "shards").  Each shard has its own ring buffer and
+ * its own sequencer, so producers that feed different shards never touch
+ * the same cache lines, which is what limits the throughput of a single
+ * queue with lots of producers.
+ *
+ * A sharded producer either feeds a single shard (so that each shard can
+ * have a lone producer), or routes each value to a shard by key, so that all
+ * of the values with the same key end up in the same shard, in the order
+ * that they were produced.  On the other side, you can either give each
+ * shard its own consumers (using vrt_sharded_queue_shard and the usual
+ * consumer functions), or use a sharded consumer, which merges the values
+ * from every shard.  There's no ordering between values in different
+ * shards, unless you ask the sharded consumer to merge them by timestamp.
+ *
+ * A sharded queue where every producer has its own shard (a "lane") is a
+ * fan-in: none of the producers contend with each other, and each lane gets
+ * the single-producer fast paths.  Use vrt_sharded_producer_new_lane to
+ * build one of these. */
+
+struct vrt_sharded_producer;
+struct vrt_sharded_consumer;
+
+typedef cork_array(struct vrt_sharded_producer *)  vrt_sharded_producer_array;
+typedef cork_array(struct vrt_sharded_consumer *)  vrt_sharded_consumer_array;
+
+struct vrt_sharded_queue {
+    /** The name of the sharded queue */
+    const char  *name;
+
+    /** The number of shards */
+    unsigned int  shard_count;
+
+    /** The shards themselves */
+    struct vrt_queue  **shards;
+
+    /** The sharded producers and consumers of this queue */
+    vrt_sharded_producer_array  producers;
+    vrt_sharded_consumer_array  consumers;
+};
+
+/** Allocate a new sharded queue with shard_count shards, each of which can
+ * hold (at least) shard_size values of the given type. */
+struct vrt_sharded_queue *
+vrt_sharded_queue_new(const char *name, struct vrt_value_type *value_type,
+                      unsigned int shard_count, unsigned int shard_size);
+
+/** Free a sharded queue, along with its shards and all of their clients. */
+void
+vrt_sharded_queue_free(struct vrt_sharded_queue *sq);
+
+/** Return one of the queue's shards. */
+#define vrt_sharded_queue_shard(sq, index)  ((sq)->shards[(index)])
+
+/** Return the shard that values with the given key are routed to. */
+unsigned int
+vrt_sharded_queue_shard_for_key(struct vrt_sharded_queue *sq, uint64_t key);
+
+/** Start every shard of the queue.  (See vrt_queue_start.) */
+int
+vrt_sharded_queue_start(struct vrt_sharded_queue *sq);
+
+
+/*-----------------------------------------------------------------------
+ * Sharded producers
+ */
+
+struct vrt_sharded_producer {
+    /** The sharded queue that this producer feeds */
+    struct vrt_sharded_queue  *queue;
+
+    /** The producer for each shard, or NULL for shards that this producer
+     * doesn't feed. */
+    struct vrt_producer  **producers;
+
+    /** The shard that vrt_sharded_producer_claim uses */
+    unsigned int  home;
+
+    /** Whether this producer can route values to any shard */
+    bool  keyed;
+
+    /** The producer that claimed the most recent value */
+    struct vrt_producer  *current;
+
+    /** The yield strategy that all of the shards' producers use.  (The
+     * producers only ever run in one thread at a time, so they can share
+     * it.) */
+    struct vrt_yield_strategy  *yield;
+
+    /** A name for the producer */
+    const char  *name;
+};
+
+/** Allocate a new producer that can route values to any shard of the queue.
+ * This creates a producer for every shard, each of which claims batch_size
+ * values at a time.  Values that you claim with vrt_sharded_producer_claim
+ * go to the producer's home shard; producers are assigned home shards in
+ * round-robin order. */
+struct vrt_sharded_producer *
+vrt_sharded_producer_new(const char *name, unsigned int batch_size,
+                         struct vrt_sharded_queue *sq);
+
+/** Allocate a new producer that only feeds one shard of the queue.  If each
+ * shard only has one of these, then each shard gets to use the faster
+ * single-producer implementations. */
+struct vrt_sharded_producer *
+vrt_sharded_producer_new_on_shard(const char *name, unsigned int batch_size,
+                                  struct vrt_sharded_queue *sq,
+                                  unsigned int shard);
+
+/** Allocate a new producer that gets a shard all to itself.  This uses the
+ * first shard that doesn't have any producers yet; it's an error if there
+ * aren't any left. */
+struct vrt_sharded_producer *
+vrt_sharded_producer_new_lane(const char *name, unsigned int batch_size,
+                              struct vrt_sharded_queue *sq);
+
+/** Set the yield strategy that the producer uses.  The producer takes
+ * ownership of the strategy. */
+void
+vrt_sharded_producer_set_yield(struct vrt_sharded_producer *sp,
+                               struct vrt_yield_strategy *yield);
+
+/** Claim the next value in the producer's home shard. */
+int
+vrt_sharded_producer_claim(struct vrt_sharded_producer *sp,
+                           struct vrt_value **value);
+
+/** Claim the next value in the shard for the given key.  It's an error to
+ * call this for a producer that only feeds one shard. */
+int
+vrt_sharded_producer_claim_key(struct vrt_sharded_producer *sp, uint64_t key,
+                               struct vrt_value **value);
+
+/** Claim the next value in the producer's home shard, without blocking.  If
+ * the shard is full, this returns VRT_QUEUE_AGAIN immediately. */
+int
+vrt_sharded_producer_try_claim(struct vrt_sharded_producer *sp,
+                               struct vrt_value **value);
+
+/** Publish the most recently claimed value.  (See vrt_producer_publish.)
+ * Each shard's producer claims its own batches, so a keyed producer that
+ * spreads its values across many shards can leave each of them sitting in a
+ * partially filled batch for a while; use vrt_sharded_producer_publish_batch
+ * or a publish interval if that matters. */
+int
+vrt_sharded_producer_publish(struct vrt_sharded_producer *sp);
+
+/** Set the publish interval of each of the shards' producers.  (See
+ * vrt_producer_set_publish_interval.) */
+void
+vrt_sharded_producer_set_publish_interval(struct vrt_sharded_producer *sp,
+                                          unsigned int interval);
+
+/** Publish every value that the producer has produced so far, in every
+ * shard.  (See vrt_producer_publish_batch.) */
+int
+vrt_sharded_producer_publish_batch(struct vrt_sharded_producer *sp);
+
+/** Send a FLUSH to every shard that the producer feeds. */
+int
+vrt_sharded_producer_flush(struct vrt_sharded_producer *sp);
+
+/** Signal that this producer won't produce any more values, in any of the
+ * shards that it feeds. */
+int
+vrt_sharded_producer_eof(struct vrt_sharded_producer *sp);
+
+
+/*-----------------------------------------------------------------------
+ * Sharded consumers
+ */
+
+struct vrt_sharded_consumer {
+    /** The sharded queue that this consumer drains */
+    struct vrt_sharded_queue  *queue;
+
+    /** The consumer for each shard */
+    struct vrt_consumer  **consumers;
+
+    /** Whether we've seen the final EOF from each shard, and how many
+     * shards that's true for */
+    bool  *finished;
+    unsigned int  finished_count;
+
+    /** The shard that we're currently draining, and how many values we've
+     * taken from it since we switched to it.  We switch to the next shard
+     * whenever the current one is empty, or once we've taken a full burst
+     * from it, so that a busy shard can't starve the others. */
+    unsigned int  current;
+    unsigned int  burst;
+
+    /** If set, we merge the shards in the order of this timestamp, instead
+     * of draining them round-robin. */
+    uint64_t
+    (*timestamp)(struct vrt_value *value);
+
+    /** When merging, the oldest value that we've retrieved from each shard
+     * but haven't returned yet, or NULL */
+    struct vrt_value  **heads;
+
+    /** Fires whenever any of the shards might have new values.  The same
+     * notifier is added to every shard. */
+    struct vrt_notifier  notifier;
+
+    /** Notified by our notifier, for the benefit of our yield strategy */
+    struct vrt_eventcount  wakeup;
+
+    /** The yield strategy to use when there's nothing to process in any of
+     * the shards */
+    struct vrt_yield_strategy  *yield;
+
+    /** A name for the consumer */
+    const char  *name;
+};
+
+/** Allocate a new consumer that drains every shard of the queue.  This
+ * creates a consumer for each shard.  You must create it before any of the
+ * queue's clients start running. */
+struct vrt_sharded_consumer *
+vrt_sharded_consumer_new(const char *name, struct vrt_sharded_queue *sq);
+
+/** Set the yield strategy that the consumer uses.  The consumer takes
+ * ownership of the strategy. */
+void
+vrt_sharded_consumer_set_yield(struct vrt_sharded_consumer *sc,
+                               struct vrt_yield_strategy *yield);
+
+/** Merge the shards in order of the timestamp that @ref timestamp returns
+ * for each value, instead of draining them round-robin.  As long as each
+ * shard's values are in timestamp order, the merged values will be too.
+ * That means that we can't return anything until every shard either has a
+ * value for us or has finished, so an idle shard holds up the others.  You
+ * must call this before the consumer starts running. */
+void
+vrt_sharded_consumer_set_merge(struct vrt_sharded_consumer *sc,
+                               uint64_t (*timestamp)(struct vrt_value *value));
+
+/** Retrieve the next value from any of the shards.  This returns
+ * VRT_QUEUE_FLUSH if one of the shards has a FLUSH message, and only returns
+ * VRT_QUEUE_EOF once every shard has seen an EOF from each of its
+ * producers.  (Shards that don't have any producers don't count.)  As with
+ * vrt_consumer_next, the value is only valid until the next call. */
+int
+vrt_sharded_consumer_next(struct vrt_sharded_consumer *sc,
+                          struct vrt_value **value);
+
+/** Retrieve the next value from any of the shards, without blocking.  If none
+ * of them have any values available, this returns VRT_QUEUE_AGAIN
+ * immediately. */
+int
+vrt_sharded_consumer_try_next(struct vrt_sharded_consumer *sc,
+                              struct vrt_value **value);
+
+/** Retrieve the next value from any of the shards, waiting no later than
+ * @ref deadline (as measured by vrt_now_ns). */
+int
+vrt_sharded_consumer_next_until(struct vrt_sharded_consumer *sc,
+                                struct vrt_value **value, uint64_t deadline);
+
+
+#endif /* VRT_SHARD_H */
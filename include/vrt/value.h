@@ -11,6 +11,8 @@
 #ifndef VRT_VALUE_H
 #define VRT_VALUE_H
 
+#include <sys/types.h>
+
 #include <libcork/core.h>
 
 
@@ -32,7 +34,18 @@ typedef int  vrt_value_id;
 
 /* Each Varon-T disruptor queue manages a list of _values_.  The queue
  * manages the lifecycle of the value.  Each value type must implement the
- * following interface.  */
+ * following interface.
+ *
+ * A value type can either allocate each of its instances separately (using
+ * new_value and free_value), or it can declare a fixed value_size, in which
+ * case the queue lays out all of its values inline in a single contiguous,
+ * cache-line-aligned array.  Inline values are zero-filled when the queue is
+ * created, and new_value and free_value are never called for them.
+ *
+ * A value type can also say how to serialize its instances, so that they can
+ * be written to a vrt_journal and replayed later.  A type that stores its
+ * values inline doesn't have to; by default, we copy everything after the
+ * vrt_value header byte for byte.  */
 struct vrt_value_type {
     /** Allocate an instance of this type. */
     struct vrt_value *
@@ -41,8 +54,37 @@ struct vrt_value_type {
     /** Free an instance of this type. */
     void
     (*free_value)(struct vrt_value_type *type, struct vrt_value *value);
+
+    /** The size of each instance of this type, if the queue should store
+     * its values inline.  If this is 0, we use new_value and free_value to
+     * allocate each value separately. */
+    size_t  value_size;
+
+    /** The alignment of each inline instance of this type.  If this is
+     * smaller than a vrt_value_id (including if it's 0), we align each
+     * instance to sizeof(vrt_value_id) instead. */
+    size_t  value_alignment;
+
+    /** Write the contents of an instance (not including its vrt_value
+     * header) into buf, which has room for size bytes.  Returns the number
+     * of bytes that the contents need, which might be more than size, in
+     * which case the contents weren't written; or -1 on error.  This can be
+     * NULL for inline types. */
+    ssize_t
+    (*serialize)(struct vrt_value_type *type, struct vrt_value *value,
+                 void *buf, size_t size);
+
+    /** Fill in an instance from size bytes of serialized contents.  This
+     * can be NULL for inline types. */
+    int
+    (*deserialize)(struct vrt_value_type *type, struct vrt_value *value,
+                   const void *buf, size_t size);
 };
 
+/** Return whether a value type stores its values inline in the queue. */
+#define vrt_value_type_is_inline(type) \
+    ((type)->value_size != 0)
+
 /** Instantiate a new value of the given type. */
 #define vrt_value_new(type) \
     ((type)->new_value((type)))
@@ -13,6 +13,110 @@
 
 #include <libcork/core.h>
 
+#include <vrt/atomic.h>
+
+
+/*-----------------------------------------------------------------------
+ * Event counts
+ */
+
+/* An event count lets a queue client go to sleep until some other client
+ * tells it that something interesting has happened (a new value has been
+ * published, or a consumer has moved its cursor forward).  The notifying side
+ * only has to make a system call when someone is actually asleep, so clients
+ * that never block only pay for a load of a mostly read-only cache line.  (The
+ * waiting side uses vrt_atomic_heavy_barrier, so the notifying side can get
+ * away with the light one.  Event counts in shared memory need a full
+ * barrier on both sides.)
+ *
+ * The two low bits of the sequence number are set whenever there might be a
+ * client waiting on the event count: one for clients that are asleep on the
+ * futex, and one for clients that have asked to be told about notifications
+ * some other way (an eventfd, say).  Every notification that finds either bit
+ * set bumps the sequence number, clears both bits, and wakes up the waiters;
+ * we only make the futex system call if someone might be asleep on it. */
+
+/** Someone might be asleep in vrt_eventcount_wait. */
+#define VRT_EVENTCOUNT_SLEEPING  0x1
+/** Someone is armed with vrt_eventcount_prepare_arm. */
+#define VRT_EVENTCOUNT_ARMED  0x2
+#define VRT_EVENTCOUNT_WAITERS \
+    (VRT_EVENTCOUNT_SLEEPING | VRT_EVENTCOUNT_ARMED)
+
+struct vrt_eventcount {
+    /** Whether the event count lives in memory that's shared between
+     * processes, in which case we can't use process-private futexes. */
+    bool  shared;
+    char  __pad0[64 - sizeof(bool) - sizeof(unsigned int)];
+    volatile unsigned int  seq;
+    char  __pad1[64 - sizeof(unsigned int)];
+};
+
+/** Initialize an event count. */
+void
+vrt_eventcount_init(struct vrt_eventcount *ev);
+
+/** Initialize an event count that lives in memory that's shared between
+ * processes.  Clients in any of the processes can wait on it. */
+void
+vrt_eventcount_init_shared(struct vrt_eventcount *ev);
+
+/** Announce that we're about to wait on an event count.  You must check
+ * whatever condition you're waiting for _after_ calling this function, and
+ * then only call vrt_eventcount_wait if it's still not true; otherwise you
+ * can miss a notification that happens in between. */
+unsigned int
+vrt_eventcount_prepare_wait(struct vrt_eventcount *ev);
+
+/** Announce that we want to hear about the next notification, but won't be
+ * sleeping in vrt_eventcount_wait; the caller must find out that a
+ * notification happened some other way (by checking the return value of
+ * vrt_eventcount_notify, for instance).  As with vrt_eventcount_prepare_wait,
+ * you must check your condition _after_ calling this function. */
+void
+vrt_eventcount_prepare_arm(struct vrt_eventcount *ev);
+
+/** Sleep until someone notifies the event count (if they haven't already
+ * done so since we got key from vrt_eventcount_prepare_wait), or until the
+ * deadline (as measured by vrt_now_ns) passes.  Wakeups can be spurious, so
+ * you must check your condition again afterwards. */
+void
+vrt_eventcount_wait(struct vrt_eventcount *ev, unsigned int key,
+                    uint64_t deadline);
+
+/** Wake up everyone waiting on an event count.  You should usually call
+ * vrt_eventcount_notify instead.  Returns the VRT_EVENTCOUNT_WAITERS bits
+ * that we cleared; if several threads race to wake the same waiters, only
+ * one of them will get a nonzero result. */
+unsigned int
+vrt_eventcount_wake(struct vrt_eventcount *ev);
+
+/** Tell anyone waiting on the event count that something has happened.
+ * Call this after making the change visible to other threads.  Returns the
+ * VRT_EVENTCOUNT_WAITERS bits for the kinds of waiters that we woke up, or 0
+ * if there weren't any.  We wake up sleepers ourselves; if the result
+ * includes VRT_EVENTCOUNT_ARMED, it's up to the caller to tell the armed
+ * waiters. */
+CORK_ATTR_UNUSED
+static inline unsigned int
+vrt_eventcount_notify(struct vrt_eventcount *ev)
+{
+    /* The barrier keeps the load of the sequence number from being reordered
+     * before whatever store the caller is notifying us about.  Waiters have a
+     * matching barrier between setting the waiter bit and checking their
+     * condition, so one side or the other will always see the change. */
+    if (CORK_UNLIKELY(ev->shared)) {
+        vrt_atomic_full_barrier();
+    } else {
+        vrt_atomic_light_barrier();
+    }
+    if (CORK_UNLIKELY(vrt_atomic_load_relaxed(&ev->seq) &
+                      VRT_EVENTCOUNT_WAITERS)) {
+        return vrt_eventcount_wake(ev);
+    }
+    return 0;
+}
+
 
 /*-----------------------------------------------------------------------
  * Yielding strategies
@@ -31,11 +135,28 @@ struct vrt_yield_strategy {
     /** Frees this yield strategy. */
     void
     (*free)(struct vrt_yield_strategy *self);
+
+    /** Waits for something to happen to an event count.  This is optional;
+     * strategies that don't ever sleep can leave it NULL, in which case we
+     * call yield instead.  key starts off as 0 in each wait loop, and belongs
+     * to the strategy; to sleep, the strategy should first set it from
+     * vrt_eventcount_prepare_wait and return, so that the caller checks its
+     * condition again, and then pass it to vrt_eventcount_wait on the next
+     * call. */
+    int
+    (*wait)(struct vrt_yield_strategy *self, bool first,
+            struct vrt_eventcount *ev, unsigned int *key, uint64_t deadline,
+            const char *queue_name, const char *name);
 };
 
 #define vrt_yield_strategy_yield(self, first, qn, n) \
     ((self)->yield((self), (first), (qn), (n)))
 
+#define vrt_yield_strategy_wait(self, first, ev, key, deadline, qn, n) \
+    (((self)->wait == NULL)? \
+     (self)->yield((self), (first), (qn), (n)): \
+     (self)->wait((self), (first), (ev), (key), (deadline), (qn), (n)))
+
 #define vrt_yield_strategy_free(self) \
     ((self)->free((self)))
 
@@ -56,5 +177,34 @@ vrt_yield_strategy_threaded(void);
 struct vrt_yield_strategy *
 vrt_yield_strategy_hybrid(void);
 
+/* A yield strategy that spins for a short while, and then goes to sleep
+ * until another client publishes a value or moves its cursor.  An idle queue
+ * doesn't use any CPU, and waking up only takes as long as a futex wakeup.
+ * (On platforms without futexes, this falls back on thread yields.) */
+struct vrt_yield_strategy *
+vrt_yield_strategy_blocking(void);
+
+/* A yield strategy that learns how long each client usually has to wait, and
+ * spins for about that long (as measured by the clock, not by a loop count)
+ * before yielding to other threads, and then going to sleep like the
+ * blocking strategy.  If waits are usually too long to be worth spinning
+ * for, it gets out of the way almost immediately. */
+struct vrt_yield_strategy *
+vrt_yield_strategy_adaptive(void);
+
+
+/*-----------------------------------------------------------------------
+ * Deadlines
+ */
+
+/** Return the current time, in nanoseconds, from a monotonic clock.  The
+ * deadlines that you pass into the `_until` variants of the queue functions
+ * are measured against this clock. */
+uint64_t
+vrt_now_ns(void);
+
+/** A deadline that never passes. */
+#define VRT_WAIT_FOREVER  UINT64_MAX
+
 
 #endif /* VRT_YIELD_H */
@@ -0,0 +1,71 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#endif
+
+#include <libcork/core.h>
+
+#include "vrt/atomic.h"
+
+
+/*-----------------------------------------------------------------------
+ * Asymmetric barriers
+ */
+
+bool  vrt_atomic_asymmetric = false;
+
+static pthread_once_t  asymmetric_once = PTHREAD_ONCE_INIT;
+
+static void
+vrt_atomic_find_membarrier(void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+    /* The expedited command interrupts the other CPUs that are running our
+     * threads, instead of waiting for every CPU to schedule something, so it
+     * only takes a few microseconds.  We have to register before we can use
+     * it. */
+    long  commands = syscall(SYS_membarrier, MEMBARRIER_CMD_QUERY, 0);
+    if (commands < 0 ||
+        !(commands & MEMBARRIER_CMD_PRIVATE_EXPEDITED) ||
+        !(commands & MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED)) {
+        return;
+    }
+    if (syscall(SYS_membarrier,
+                MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0) != 0) {
+        return;
+    }
+    vrt_atomic_asymmetric = true;
+#endif
+}
+
+void
+vrt_atomic_asymmetric_init(void)
+{
+    pthread_once(&asymmetric_once, vrt_atomic_find_membarrier);
+}
+
+void
+vrt_atomic_heavy_barrier(void)
+{
+#if defined(__linux__) && defined(SYS_membarrier)
+    if (CORK_LIKELY(vrt_atomic_asymmetric)) {
+        /* This can only fail if we passed in a bad command, and we've already
+         * checked that this one is supported. */
+        syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0);
+        return;
+    }
+#endif
+    vrt_atomic_full_barrier();
+}
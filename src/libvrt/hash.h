@@ -0,0 +1,36 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#ifndef VRT_HASH_H
+#define VRT_HASH_H
+
+#include <libcork/core.h>
+
+
+/*-----------------------------------------------------------------------
+ * Hashing keys
+ */
+
+/* The splitmix64 finalizer.  Keys that only differ in a few bits still end
+ * up with completely different hashes, so callers can spread them across
+ * partitions or shards using just the high bits. */
+CORK_ATTR_UNUSED
+static inline uint64_t
+vrt_hash_key(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= UINT64_C(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
+    return key;
+}
+
+
+#endif /* VRT_HASH_H */
@@ -0,0 +1,762 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <clogger.h>
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/atomic.h"
+#include "vrt/journal.h"
+#include "vrt/memory.h"
+#include "vrt/queue.h"
+#include "vrt/value.h"
+
+#define CLOG_CHANNEL  "vrt"
+
+
+/*-----------------------------------------------------------------------
+ * Segment files
+ */
+
+#define DEFAULT_SEGMENT_SIZE  (64 * 1024 * 1024)
+
+/* Each segment file starts with a header, which is followed by records.  A
+ * segment file is named after the sequence number of its first record, so
+ * that we can list them in order. */
+struct vrt_journal_segment_header {
+    uint32_t  magic;
+    uint32_t  version;
+    uint64_t  first_sequence;
+};
+
+#define VRT_JOURNAL_MAGIC  0x4a747256
+#define VRT_JOURNAL_VERSION  1
+#define SEGMENT_HEADER_SIZE  64
+
+/* Each record holds one serialized value, padded out to a multiple of 8
+ * bytes, along with a CRC-32 of its size and contents.  We fill in the
+ * record's sequence number last, so a record whose sequence number isn't the
+ * one we expect (including the zeroes at the end of a new segment), or whose
+ * checksum doesn't match, marks the end of the segment. */
+struct vrt_journal_record {
+    uint64_t  sequence;
+    uint32_t  size;
+    uint32_t  checksum;
+};
+
+#define vrt_journal_record_size(size) \
+    (sizeof(struct vrt_journal_record) + (((size) + 7) & ~((size_t) 7)))
+
+typedef cork_array(uint64_t)  vrt_sequence_array;
+
+static uint32_t  crc_table[256];
+static pthread_once_t  crc_table_once = PTHREAD_ONCE_INIT;
+
+static void
+vrt_journal_fill_crc_table(void)
+{
+    uint32_t  i;
+    for (i = 0; i < 256; i++) {
+        uint32_t  crc = i;
+        unsigned int  j;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1)? (crc >> 1) ^ 0xedb88320: crc >> 1;
+        }
+        crc_table[i] = crc;
+    }
+}
+
+static uint32_t
+vrt_journal_crc(uint32_t crc, const void *vbuf, size_t size)
+{
+    const uint8_t  *buf = vbuf;
+    crc = ~crc;
+    while (size-- > 0) {
+        crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static uint32_t
+vrt_journal_record_checksum(const struct vrt_journal_record *record)
+{
+    uint32_t  crc = vrt_journal_crc(0, &record->size, sizeof(record->size));
+    return vrt_journal_crc(crc, record + 1, record->size);
+}
+
+static void
+vrt_journal_segment_path(const char *path, uint64_t first,
+                         char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%016" PRIx64 ".seg", path, first);
+}
+
+static int
+vrt_journal_compare_sequences(const void *vleft, const void *vright)
+{
+    const uint64_t  *left = vleft;
+    const uint64_t  *right = vright;
+    return (*left < *right)? -1: (*left > *right)? 1: 0;
+}
+
+/* Fills in the first sequence number of each of the segment files in a
+ * journal directory, in order. */
+static int
+vrt_journal_list_segments(const char *path, vrt_sequence_array *firsts)
+{
+    DIR  *dir;
+    struct dirent  *entry;
+
+    dir = opendir(path);
+    if (CORK_UNLIKELY(dir == NULL)) {
+        cork_system_error_set();
+        return -1;
+    }
+
+    while ((entry = readdir(dir)) != NULL) {
+        uint64_t  first;
+        if (strlen(entry->d_name) == 20 &&
+            strcmp(entry->d_name + 16, ".seg") == 0 &&
+            sscanf(entry->d_name, "%16" SCNx64, &first) == 1) {
+            cork_array_append(firsts, first);
+        }
+    }
+    closedir(dir);
+
+    if (!cork_array_is_empty(firsts)) {
+        qsort(&cork_array_at(firsts, 0), cork_array_size(firsts),
+              sizeof(uint64_t), vrt_journal_compare_sequences);
+    }
+    return 0;
+}
+
+/* Flushes a directory's entries to disk, so that a file that we've just
+ * created or renamed in it survives a crash of the machine. */
+static int
+vrt_journal_sync_directory(const char *path)
+{
+    int  fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (CORK_UNLIKELY(fd == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    if (CORK_UNLIKELY(fsync(fd) == -1)) {
+        cork_system_error_set();
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/* Returns whether a segment file never got as far as having its header
+ * written to disk, which can happen if the machine crashes just after we
+ * create it.  Such a segment can't hold any records yet. */
+static bool
+vrt_journal_segment_is_blank(const char *path, uint64_t first)
+{
+    char  filename[PATH_MAX];
+    struct vrt_journal_segment_header  header;
+    ssize_t  size;
+    int  fd;
+
+    vrt_journal_segment_path(path, first, filename, sizeof(filename));
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        /* Let vrt_journal_open_segment report the error. */
+        return false;
+    }
+    memset(&header, 0, sizeof(header));
+    size = pread(fd, &header, sizeof(header), 0);
+    close(fd);
+    return size >= 0 && header.magic == 0 && header.version == 0 &&
+        header.first_sequence == 0;
+}
+
+/* Maps an existing segment file. */
+static int
+vrt_journal_open_segment(const char *path, uint64_t first,
+                         struct vrt_memory *mem)
+{
+    char  filename[PATH_MAX];
+    struct stat  st;
+    struct vrt_journal_segment_header  *header;
+    int  fd;
+    int  rc;
+
+    vrt_journal_segment_path(path, first, filename, sizeof(filename));
+    fd = open(filename, O_RDWR);
+    if (CORK_UNLIKELY(fd == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    if (CORK_UNLIKELY(fstat(fd, &st) == -1)) {
+        cork_system_error_set();
+        close(fd);
+        return -1;
+    }
+    if (CORK_UNLIKELY(st.st_size < SEGMENT_HEADER_SIZE)) {
+        close(fd);
+        goto bad_segment;
+    }
+    rc = vrt_memory_map_shared(mem, fd, st.st_size);
+    close(fd);
+    rii_check(rc);
+
+    header = mem->ptr;
+    if (CORK_UNLIKELY(header->magic != VRT_JOURNAL_MAGIC ||
+                      header->version != VRT_JOURNAL_VERSION ||
+                      header->first_sequence != first)) {
+        vrt_memory_free(mem);
+        goto bad_segment;
+    }
+    return 0;
+
+bad_segment:
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR, "%s isn't a journal segment", filename);
+    return -1;
+}
+
+/* Flushes everything that we've appended to the current segment since the
+ * last time we called this. */
+static int
+vrt_journal_sync(struct vrt_journal *journal)
+{
+    size_t  page_size = sysconf(_SC_PAGESIZE);
+    size_t  start = journal->synced_offset & ~(page_size - 1);
+    if (journal->synced_offset == journal->offset) {
+        return 0;
+    }
+    if (CORK_UNLIKELY(msync((char *) journal->segment.ptr + start,
+                            journal->offset - start, MS_SYNC) == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    journal->synced_offset = journal->offset;
+    return 0;
+}
+
+/* Creates and maps a new, empty segment file, whose first record will have
+ * the given sequence number, and starts appending to it. */
+static int
+vrt_journal_create_segment(struct vrt_journal *journal, uint64_t first)
+{
+    char  filename[PATH_MAX];
+    struct vrt_journal_segment_header  *header;
+    int  fd;
+    int  rc;
+
+    vrt_journal_segment_path
+        (journal->path, first, filename, sizeof(filename));
+    fd = open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (CORK_UNLIKELY(fd == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    if (CORK_UNLIKELY(ftruncate(fd, journal->segment_size) == -1)) {
+        cork_system_error_set();
+        close(fd);
+        return -1;
+    }
+    rc = vrt_memory_map_shared(&journal->segment, fd, journal->segment_size);
+    close(fd);
+    rii_check(rc);
+
+    clog_debug("<%s> Start journal segment %s",
+               journal->consumer->name, filename);
+    header = journal->segment.ptr;
+    header->magic = VRT_JOURNAL_MAGIC;
+    header->version = VRT_JOURNAL_VERSION;
+    header->first_sequence = first;
+    journal->offset = SEGMENT_HEADER_SIZE;
+    journal->synced_offset = 0;
+    if (journal->flags & VRT_JOURNAL_SYNC) {
+        /* The header has to hit the disk before the directory entry does,
+         * or a crash could leave us with a segment that we can't open. */
+        rii_check(vrt_journal_sync(journal));
+        rii_check(vrt_journal_sync_directory(journal->path));
+    }
+    return 0;
+}
+
+/* Returns the record at offset in a segment, if it's the intact record with
+ * the given sequence number, or NULL if it isn't. */
+static struct vrt_journal_record *
+vrt_journal_record_at(struct vrt_memory *mem, size_t offset,
+                      uint64_t sequence)
+{
+    struct vrt_journal_record  *record;
+    if (offset + sizeof(struct vrt_journal_record) > mem->size) {
+        return NULL;
+    }
+    record = (struct vrt_journal_record *) ((char *) mem->ptr + offset);
+    if (vrt_atomic_load_acquire(&record->sequence) != sequence ||
+        offset + vrt_journal_record_size(record->size) > mem->size ||
+        record->checksum != vrt_journal_record_checksum(record)) {
+        return NULL;
+    }
+    return record;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Serialization
+ */
+
+static ssize_t
+vrt_journal_serialize(struct vrt_value_type *type, struct vrt_value *value,
+                      void *buf, size_t size)
+{
+    size_t  payload_size;
+    if (type->serialize != NULL) {
+        return type->serialize(type, value, buf, size);
+    }
+
+    payload_size = type->value_size - sizeof(struct vrt_value);
+    if (payload_size <= size) {
+        memcpy(buf, value + 1, payload_size);
+    }
+    return payload_size;
+}
+
+static int
+vrt_journal_deserialize(struct vrt_value_type *type, struct vrt_value *value,
+                        const void *buf, size_t size)
+{
+    size_t  payload_size;
+    if (type->deserialize != NULL) {
+        return type->deserialize(type, value, buf, size);
+    }
+
+    payload_size = type->value_size - sizeof(struct vrt_value);
+    if (CORK_UNLIKELY(size != payload_size)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Journal record has %zu bytes, but values have %zu",
+             size, payload_size);
+        return -1;
+    }
+    memcpy(value + 1, buf, payload_size);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Journals
+ */
+
+void
+vrt_journal_free(struct vrt_journal *journal)
+{
+    vrt_memory_free(&journal->segment);
+    if (journal->path != NULL) {
+        cork_strfree(journal->path);
+    }
+    if (journal->sequences != NULL) {
+        cork_cfree(journal->sequences,
+                   vrt_queue_size(journal->consumer->queue),
+                   sizeof(uint64_t));
+    }
+    cork_delete(struct vrt_journal, journal);
+}
+
+/* Maps the newest segment of an existing journal, and finds where its last
+ * intact record ends, so that we can keep appending after it. */
+static int
+vrt_journal_resume_segment(struct vrt_journal *journal, uint64_t first)
+{
+    struct vrt_journal_record  *record;
+    size_t  offset = SEGMENT_HEADER_SIZE;
+    uint64_t  sequence = first;
+
+    rii_check(vrt_journal_open_segment
+              (journal->path, first, &journal->segment));
+    while ((record = vrt_journal_record_at
+            (&journal->segment, offset, sequence)) != NULL) {
+        offset += vrt_journal_record_size(record->size);
+        sequence++;
+    }
+
+    /* If the scan stopped at a torn or damaged record, rather than at the
+     * zeroes after the last one, throw it away along with everything after
+     * it, so that none of it can look like part of the journal once we start
+     * appending over it. */
+    record = (struct vrt_journal_record *)
+        ((char *) journal->segment.ptr + offset);
+    if (offset + sizeof(struct vrt_journal_record) <= journal->segment.size &&
+        (record->sequence != 0 || record->size != 0)) {
+        clog_warning("<%s> Truncate journal %s after sequence %" PRIu64,
+                     journal->consumer->name, journal->path, sequence - 1);
+        memset(record, 0, journal->segment.size - offset);
+    }
+    journal->last_sequence = sequence - 1;
+    journal->offset = offset;
+    journal->synced_offset = offset;
+    return 0;
+}
+
+struct vrt_journal *
+vrt_journal_new(const char *name, struct vrt_queue *q, const char *path,
+                size_t segment_size, unsigned int flags)
+{
+    struct vrt_journal  *journal;
+    struct vrt_value_type  *type = q->value_type;
+    vrt_sequence_array  firsts;
+
+    if (CORK_UNLIKELY(!vrt_value_type_is_inline(type) &&
+                      (type->serialize == NULL ||
+                       type->deserialize == NULL))) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Journal %s needs a value type that can be serialized", name);
+        return NULL;
+    }
+    if (segment_size == 0) {
+        segment_size = DEFAULT_SEGMENT_SIZE;
+    }
+    if (CORK_UNLIKELY(segment_size < SEGMENT_HEADER_SIZE +
+                      sizeof(struct vrt_journal_record))) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Journal segments must be bigger than %zu bytes",
+             SEGMENT_HEADER_SIZE + sizeof(struct vrt_journal_record));
+        return NULL;
+    }
+    if (CORK_UNLIKELY(mkdir(path, 0777) == -1 && errno != EEXIST)) {
+        cork_system_error_set();
+        return NULL;
+    }
+
+    journal = cork_new(struct vrt_journal);
+    memset(journal, 0, sizeof(struct vrt_journal));
+    journal->path = cork_strdup(path);
+    journal->segment_size = segment_size;
+    journal->flags = flags;
+    journal->replay_next = 1;
+    journal->replay_last = 0;
+    cork_array_init(&firsts);
+    pthread_once(&crc_table_once, vrt_journal_fill_crc_table);
+    ep_check(journal->consumer = vrt_consumer_new(name, q));
+    vrt_consumer_set_commit_batches(journal->consumer, true);
+
+    /* Pick up where any earlier journal in this directory left off. */
+    ei_check(vrt_journal_list_segments(path, &firsts));
+    if (cork_array_is_empty(&firsts)) {
+        ei_check(vrt_journal_create_segment(journal, 1));
+        journal->last_sequence = 0;
+    } else {
+        uint64_t  first =
+            cork_array_at(&firsts, cork_array_size(&firsts) - 1);
+
+        /* If the newest segment's header never made it to disk, then
+         * neither did any of its records, so start it over. */
+        if (vrt_journal_segment_is_blank(path, first)) {
+            char  filename[PATH_MAX];
+            vrt_journal_segment_path(path, first, filename, sizeof(filename));
+            clog_warning("[%s] Recreate blank journal segment %s",
+                         q->name, filename);
+            if (CORK_UNLIKELY(unlink(filename) == -1)) {
+                cork_system_error_set();
+                goto error;
+            }
+            ei_check(vrt_journal_create_segment(journal, first));
+            journal->last_sequence = first - 1;
+        } else {
+            ei_check(vrt_journal_resume_segment(journal, first));
+        }
+    }
+
+    journal->sequences = cork_calloc(vrt_queue_size(q), sizeof(uint64_t));
+    cork_array_done(&firsts);
+    clog_debug("[%s] Journal values into %s after sequence %" PRIu64,
+               q->name, path, journal->last_sequence);
+    return journal;
+
+error:
+    cork_array_done(&firsts);
+    /* Don't leave the queue waiting on a consumer that will never run. */
+    if (journal->consumer != NULL) {
+        vrt_consumer_remove(journal->consumer);
+    }
+    vrt_journal_free(journal);
+    return NULL;
+}
+
+/* Appends a value to the journal, starting a new segment if it doesn't fit
+ * in the current one. */
+static int
+vrt_journal_append(struct vrt_journal *journal, struct vrt_value *value,
+                   uint64_t sequence)
+{
+    struct vrt_value_type  *type = journal->consumer->queue->value_type;
+    struct vrt_journal_record  *record;
+    ssize_t  size;
+
+    while (true) {
+        size_t  available = journal->segment.size - journal->offset;
+        record = (struct vrt_journal_record *)
+            ((char *) journal->segment.ptr + journal->offset);
+        if (available >= sizeof(struct vrt_journal_record)) {
+            size = vrt_journal_serialize
+                (type, value, record + 1,
+                 available - sizeof(struct vrt_journal_record));
+            if (CORK_UNLIKELY(size < 0)) {
+                return -1;
+            }
+            if (vrt_journal_record_size(size) <= available) {
+                break;
+            }
+        }
+
+        if (CORK_UNLIKELY(journal->offset == SEGMENT_HEADER_SIZE)) {
+            cork_error_set_printf
+                (CORK_UNKNOWN_ERROR,
+                 "Value %" PRIu64 " doesn't fit in a %zu-byte "
+                 "journal segment", sequence, journal->segment.size);
+            return -1;
+        }
+        if (journal->flags & VRT_JOURNAL_SYNC) {
+            rii_check(vrt_journal_sync(journal));
+        }
+        vrt_memory_free(&journal->segment);
+        rii_check(vrt_journal_create_segment(journal, sequence));
+    }
+
+    record->size = size;
+    record->checksum = vrt_journal_record_checksum(record);
+    vrt_atomic_store_release(&record->sequence, sequence);
+    journal->offset += vrt_journal_record_size(size);
+    return 0;
+}
+
+int
+vrt_journal_run(struct vrt_journal *journal)
+{
+    struct vrt_consumer  *c = journal->consumer;
+    struct vrt_queue  *q = c->queue;
+    bool  sync = (journal->flags & VRT_JOURNAL_SYNC) != 0;
+    int  rc;
+
+    while (true) {
+        vrt_value_id  first;
+        unsigned int  count;
+        unsigned int  i;
+
+        /* Our cursor only moves past a batch once we ask for the next one,
+         * so everything in this batch is journaled (and synced) before any
+         * consumer that depends on us can see it. */
+        rc = vrt_consumer_next_batch(c, &first, &count);
+        if (rc == VRT_QUEUE_EOF) {
+            clog_debug("<%s> Journal EOF", c->name);
+            return vrt_journal_sync(journal);
+        } else if (rc == VRT_QUEUE_FLUSH) {
+            rii_check(vrt_journal_sync(journal));
+            continue;
+        }
+        rii_check(rc);
+
+        for (i = 0; i < count; i++) {
+            vrt_value_id  id = (unsigned int) first + i;
+            uint64_t  sequence;
+            if (CORK_UNLIKELY(journal->replay_next <= journal->replay_last)) {
+                /* A value that vrt_journal_replay is re-injecting. */
+                sequence = journal->replay_next++;
+            } else {
+                sequence = ++journal->last_sequence;
+                rii_check(vrt_journal_append
+                          (journal, vrt_queue_get(q, id), sequence));
+            }
+            journal->sequences[id & q->value_mask] = sequence;
+        }
+
+        if (sync) {
+            rii_check(vrt_journal_sync(journal));
+        }
+    }
+}
+
+/* Re-injects a single value from the journal. */
+static int
+vrt_journal_replay_record(struct vrt_producer *p,
+                          struct vrt_journal_record *record)
+{
+    struct vrt_value  *value;
+    rii_check(vrt_producer_claim(p, &value));
+    rii_check(vrt_journal_deserialize
+              (p->queue->value_type, value, record + 1, record->size));
+    return vrt_producer_publish(p);
+}
+
+int
+vrt_journal_replay(struct vrt_journal *journal, struct vrt_producer *p,
+                   uint64_t after)
+{
+    struct vrt_queue  *q = journal->consumer->queue;
+    vrt_sequence_array  firsts;
+    struct vrt_memory  mem;
+    uint64_t  sequence = after + 1;
+    size_t  i;
+
+    if (CORK_UNLIKELY(p->queue != q)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Producer %s doesn't feed the queue of journal %s",
+             p->name, journal->consumer->name);
+        return -1;
+    }
+    if (after >= journal->last_sequence) {
+        return 0;
+    }
+
+    /* The journal's consumer can't see any of the replayed values until we
+     * publish them, so it's safe to tell it what's coming. */
+    clog_debug("<%s> Replay journal values %" PRIu64 "-%" PRIu64,
+               p->name, sequence, journal->last_sequence);
+    journal->replay_next = sequence;
+    journal->replay_last = journal->last_sequence;
+
+    cork_array_init(&firsts);
+    ei_check(vrt_journal_list_segments(journal->path, &firsts));
+    for (i = 0; i < cork_array_size(&firsts); i++) {
+        uint64_t  current = cork_array_at(&firsts, i);
+        size_t  offset = SEGMENT_HEADER_SIZE;
+        struct vrt_journal_record  *record;
+
+        /* Skip any segments that end before the values that we want. */
+        if (i + 1 < cork_array_size(&firsts) &&
+            cork_array_at(&firsts, i + 1) <= sequence) {
+            continue;
+        }
+        if (sequence > journal->replay_last) {
+            break;
+        }
+
+        ei_check(vrt_journal_open_segment(journal->path, current, &mem));
+        while (current <= journal->replay_last &&
+               (record = vrt_journal_record_at(&mem, offset, current))
+               != NULL) {
+            if (current == sequence) {
+                if (CORK_UNLIKELY(vrt_journal_replay_record(p, record) != 0)) {
+                    vrt_memory_free(&mem);
+                    goto error;
+                }
+                sequence++;
+            }
+            offset += vrt_journal_record_size(record->size);
+            current++;
+        }
+        vrt_memory_free(&mem);
+    }
+    cork_array_done(&firsts);
+
+    if (CORK_UNLIKELY(sequence <= journal->replay_last)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Journal %s is missing value %" PRIu64,
+             journal->path, sequence);
+        return -1;
+    }
+    return vrt_producer_publish_batch(p);
+
+error:
+    cork_array_done(&firsts);
+    return -1;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Checkpoints
+ */
+
+static void
+vrt_journal_checkpoint_path(const char *path, const char *name,
+                            char *buf, size_t size)
+{
+    snprintf(buf, size, "%s/%s.checkpoint", path, name);
+}
+
+int
+vrt_journal_save_checkpoint(const char *path, const char *name,
+                            uint64_t sequence)
+{
+    char  filename[PATH_MAX];
+    char  temp_filename[PATH_MAX + sizeof(".tmp")];
+    char  contents[32];
+    int  length;
+    int  fd;
+
+    /* Write the new checkpoint to a temporary file and then move it into
+     * place, so that a crash leaves either the old checkpoint or the new
+     * one. */
+    vrt_journal_checkpoint_path(path, name, filename, sizeof(filename));
+    snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", filename);
+    length = snprintf(contents, sizeof(contents), "%" PRIu64 "\n", sequence);
+
+    fd = open(temp_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (CORK_UNLIKELY(fd == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    if (CORK_UNLIKELY(write(fd, contents, length) != length ||
+                      fsync(fd) == -1)) {
+        cork_system_error_set();
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    if (CORK_UNLIKELY(rename(temp_filename, filename) == -1)) {
+        cork_system_error_set();
+        return -1;
+    }
+    return vrt_journal_sync_directory(path);
+}
+
+int
+vrt_journal_load_checkpoint(const char *path, const char *name,
+                            uint64_t *sequence)
+{
+    char  filename[PATH_MAX];
+    FILE  *file;
+    int  rc;
+
+    vrt_journal_checkpoint_path(path, name, filename, sizeof(filename));
+    file = fopen(filename, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            *sequence = 0;
+            return 0;
+        }
+        cork_system_error_set();
+        return -1;
+    }
+
+    rc = fscanf(file, "%" SCNu64, sequence);
+    fclose(file);
+    if (CORK_UNLIKELY(rc != 1)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR, "Invalid journal checkpoint %s", filename);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,392 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+#include <clogger.h>
+#include <libcork/core.h>
+
+#include "vrt/memory.h"
+
+#define CLOG_CHANNEL  "vrt"
+
+
+/* The size of a transparent huge page.  This is 2MB on every platform that
+ * we currently care about. */
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS  MAP_ANON
+#endif
+
+/* We call mbind(2) directly, rather than going through libnuma, so that we
+ * don't pick up another dependency just for this one system call. */
+#if defined(__linux__) && defined(SYS_mbind)
+#define HAVE_MBIND  1
+#define MPOL_BIND  2
+#define MAX_NUMA_NODES  1024
+#else
+#define HAVE_MBIND  0
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Heap regions
+ */
+
+static void
+vrt_memory_alloc_heap(struct vrt_memory *mem, size_t size, size_t alignment)
+{
+    void  *ptr;
+    if (alignment < sizeof(void *)) {
+        alignment = sizeof(void *);
+    }
+    if (posix_memalign(&ptr, alignment, size) != 0) {
+        cork_abort("Cannot allocate %zu bytes", size);
+    }
+    memset(ptr, 0, size);
+    mem->ptr = ptr;
+    mem->size = size;
+    mem->map = NULL;
+    mem->map_size = 0;
+    mem->flags = 0;
+    mem->node = VRT_NUMA_NODE_ANY;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Mapped regions
+ */
+
+static size_t
+round_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/* Maps an anonymous region of at least size bytes that starts on an alignment
+ * boundary.  We map a bit more than we need, and then unmap the slop on either
+ * side of the aligned region. */
+static void *
+vrt_memory_map_aligned(size_t size, size_t alignment)
+{
+    size_t  page_size = sysconf(_SC_PAGESIZE);
+    size_t  padded_size;
+    uintptr_t  start;
+    uintptr_t  aligned;
+    void  *map;
+
+    if (alignment <= page_size) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return (map == MAP_FAILED)? NULL: map;
+    }
+
+    padded_size = size + alignment;
+    map = mmap(NULL, padded_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    start = (uintptr_t) map;
+    aligned = round_up(start, alignment);
+    if (aligned > start) {
+        munmap(map, aligned - start);
+    }
+    if (aligned + size < start + padded_size) {
+        munmap((void *) (aligned + size),
+               start + padded_size - aligned - size);
+    }
+    return (void *) aligned;
+}
+
+#if defined(MAP_HUGETLB)
+static void *
+vrt_memory_map_hugetlb(size_t size)
+{
+    void  *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    return (map == MAP_FAILED)? NULL: map;
+}
+#endif
+
+/* Binds a region's pages to a particular NUMA node.  This only affects pages
+ * that haven't been faulted in yet, so it has to happen before we touch the
+ * region. */
+static int
+vrt_memory_bind(void *ptr, size_t size, int node)
+{
+#if HAVE_MBIND
+    unsigned long  mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    unsigned long  bits = 8 * sizeof(unsigned long);
+    if (node < 0 || node >= MAX_NUMA_NODES) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(mask, 0, sizeof(mask));
+    mask[node / bits] = 1UL << (node % bits);
+    return syscall(SYS_mbind, ptr, size, MPOL_BIND, mask,
+                   MAX_NUMA_NODES + 1, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Writes to every page in the region, so that the kernel has to fault them
+ * all in now, rather than when the queue first uses them.  (Reading wouldn't
+ * be enough, since the kernel would just map in its shared zero page.) */
+static void
+vrt_memory_prefault(void *ptr, size_t size)
+{
+    size_t  page_size = sysconf(_SC_PAGESIZE);
+    volatile char  *bytes = ptr;
+    size_t  i;
+    for (i = 0; i < size; i += page_size) {
+        bytes[i] = 0;
+    }
+}
+
+static void
+vrt_memory_alloc_mapped(struct vrt_memory *mem, size_t size, size_t alignment,
+                        unsigned int flags, int node)
+{
+    size_t  page_size = sysconf(_SC_PAGESIZE);
+    bool  want_huge = (flags & (VRT_MEMORY_HUGE_PAGES | VRT_MEMORY_HUGETLB));
+
+    memset(mem, 0, sizeof(struct vrt_memory));
+    mem->node = VRT_NUMA_NODE_ANY;
+    mem->size = size;
+    mem->map_size = round_up(size, want_huge? HUGE_PAGE_SIZE: page_size);
+    if (want_huge && alignment < HUGE_PAGE_SIZE) {
+        alignment = HUGE_PAGE_SIZE;
+    }
+
+#if defined(MAP_HUGETLB)
+    if (flags & VRT_MEMORY_HUGETLB) {
+        mem->map = vrt_memory_map_hugetlb(mem->map_size);
+        if (mem->map != NULL) {
+            mem->flags |= VRT_MEMORY_HUGETLB;
+        } else {
+            clog_info("Cannot allocate %zu bytes of hugetlb pages (%s); "
+                      "using transparent huge pages instead",
+                      mem->map_size, strerror(errno));
+            flags |= VRT_MEMORY_HUGE_PAGES;
+        }
+    }
+#else
+    if (flags & VRT_MEMORY_HUGETLB) {
+        flags |= VRT_MEMORY_HUGE_PAGES;
+    }
+#endif
+
+    if (mem->map == NULL) {
+        mem->map = vrt_memory_map_aligned(mem->map_size, alignment);
+        if (CORK_UNLIKELY(mem->map == NULL)) {
+            cork_abort("Cannot map %zu bytes (%s)",
+                       mem->map_size, strerror(errno));
+        }
+
+#if defined(MADV_HUGEPAGE)
+        /* This must happen before we touch any of the pages, since the
+         * kernel decides whether to use a huge page when it first faults in
+         * each part of the region. */
+        if (flags & VRT_MEMORY_HUGE_PAGES) {
+            if (madvise(mem->map, mem->map_size, MADV_HUGEPAGE) == 0) {
+                mem->flags |= VRT_MEMORY_HUGE_PAGES;
+            } else {
+                clog_info("Cannot request transparent huge pages (%s)",
+                          strerror(errno));
+            }
+        }
+#endif
+    }
+
+    mem->ptr = mem->map;
+
+    if (node != VRT_NUMA_NODE_ANY) {
+        if (vrt_memory_bind(mem->map, mem->map_size, node) == 0) {
+            mem->node = node;
+        } else {
+            clog_warning("Cannot bind %zu bytes to NUMA node %d (%s)",
+                         mem->map_size, node, strerror(errno));
+        }
+    }
+
+    if (flags & VRT_MEMORY_PREFAULT) {
+        vrt_memory_prefault(mem->map, mem->map_size);
+        mem->flags |= VRT_MEMORY_PREFAULT;
+    }
+
+    if (flags & VRT_MEMORY_MLOCK) {
+        if (mlock(mem->map, mem->map_size) == 0) {
+            mem->flags |= VRT_MEMORY_MLOCK;
+        } else {
+            clog_warning("Cannot lock %zu bytes into memory (%s)",
+                         mem->map_size, strerror(errno));
+        }
+    }
+}
+
+int
+vrt_memory_map_shared(struct vrt_memory *mem, int fd, size_t size)
+{
+    size_t  page_size = sysconf(_SC_PAGESIZE);
+    void  *map;
+
+    memset(mem, 0, sizeof(struct vrt_memory));
+    mem->node = VRT_NUMA_NODE_ANY;
+    map = mmap(NULL, round_up(size, page_size), PROT_READ | PROT_WRITE,
+               MAP_SHARED, fd, 0);
+    if (CORK_UNLIKELY(map == MAP_FAILED)) {
+        cork_system_error_set();
+        return -1;
+    }
+
+    mem->ptr = map;
+    mem->size = size;
+    mem->map = map;
+    mem->map_size = round_up(size, page_size);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Public interface
+ */
+
+void
+vrt_memory_alloc(struct vrt_memory *mem, size_t size, size_t alignment,
+                 unsigned int flags, int node)
+{
+    if (flags == 0 && node == VRT_NUMA_NODE_ANY) {
+        vrt_memory_alloc_heap(mem, size, alignment);
+    } else {
+        vrt_memory_alloc_mapped(mem, size, alignment, flags, node);
+    }
+}
+
+void
+vrt_memory_free(struct vrt_memory *mem)
+{
+    if (mem->map != NULL) {
+        munmap(mem->map, mem->map_size);
+    } else if (mem->ptr != NULL) {
+        free(mem->ptr);
+    }
+    memset(mem, 0, sizeof(struct vrt_memory));
+    mem->node = VRT_NUMA_NODE_ANY;
+}
+
+size_t
+vrt_memory_huge_size(const struct vrt_memory *mem)
+{
+#if defined(__linux__)
+    uintptr_t  start = (uintptr_t) mem->ptr;
+    uintptr_t  end;
+    uintptr_t  vma_start = 0;
+    uintptr_t  vma_end = 0;
+    size_t  result = 0;
+    char  line[256];
+    FILE  *smaps;
+
+    if (mem->ptr == NULL) {
+        return 0;
+    }
+    if (mem->flags & VRT_MEMORY_HUGETLB) {
+        return mem->map_size;
+    }
+
+    /* Add up the AnonHugePages entries of every mapping that overlaps our
+     * region.  If the kernel has merged our region with one of its
+     * neighbors, we can't tell which of the mapping's huge pages are ours,
+     * so we clamp the result to the size of the overlap. */
+    end = start + ((mem->map != NULL)? mem->map_size: mem->size);
+    smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        unsigned long  a;
+        unsigned long  b;
+        size_t  kb;
+        if (sscanf(line, "%lx-%lx ", &a, &b) == 2) {
+            vma_start = a;
+            vma_end = b;
+        } else if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            if (vma_start < end && start < vma_end) {
+                uintptr_t  lo = (vma_start > start)? vma_start: start;
+                uintptr_t  hi = (vma_end < end)? vma_end: end;
+                size_t  huge = kb * 1024;
+                result += (huge < hi - lo)? huge: hi - lo;
+            }
+        }
+    }
+
+    fclose(smaps);
+    return result;
+#else
+    return (mem->flags & VRT_MEMORY_HUGETLB)? mem->map_size: 0;
+#endif
+}
+
+
+/*-----------------------------------------------------------------------
+ * NUMA topology
+ */
+
+unsigned int
+vrt_numa_node_count(void)
+{
+#if defined(__linux__)
+    unsigned int  count = 0;
+    struct dirent  *entry;
+    DIR  *dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return 1;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        unsigned int  node;
+        char  extra;
+        if (sscanf(entry->d_name, "node%u%c", &node, &extra) == 1) {
+            count++;
+        }
+    }
+    closedir(dir);
+    return (count == 0)? 1: count;
+#else
+    return 1;
+#endif
+}
+
+int
+vrt_numa_current_node(void)
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned int  cpu;
+    unsigned int  node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+        return node;
+    }
+#endif
+    return 0;
+}
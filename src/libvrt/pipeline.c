@@ -0,0 +1,467 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+
+#include <clogger.h>
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/pipeline.h"
+#include "vrt/queue.h"
+#include "vrt/yield.h"
+
+#define CLOG_CHANNEL  "vrt"
+
+
+/*-----------------------------------------------------------------------
+ * Stages
+ */
+
+static struct vrt_stage *
+vrt_stage_new(const char *name, void *(*run)(void *), void *ud)
+{
+    struct vrt_stage  *stage = cork_new(struct vrt_stage);
+    stage->name = cork_strdup(name);
+    stage->producer = NULL;
+    stage->consumer = NULL;
+    stage->run = run;
+    stage->ud = ud;
+    stage->cpu = VRT_CPU_ANY;
+    cork_array_init(&stage->dependencies);
+    stage->started = false;
+    stage->mark = 0;
+    return stage;
+}
+
+static void
+vrt_stage_free(struct vrt_stage *stage)
+{
+    cork_strfree(stage->name);
+    cork_array_done(&stage->dependencies);
+    cork_delete(struct vrt_stage, stage);
+}
+
+void
+vrt_stage_set_yield(struct vrt_stage *stage, struct vrt_yield_strategy *yield)
+{
+    struct vrt_yield_strategy  **slot = (stage->producer != NULL)?
+        &stage->producer->yield: &stage->consumer->yield;
+    if (*slot != NULL) {
+        vrt_yield_strategy_free(*slot);
+    }
+    *slot = yield;
+}
+
+void
+vrt_stage_set_cpu(struct vrt_stage *stage, int cpu)
+{
+    stage->cpu = cpu;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Pipelines
+ */
+
+struct vrt_pipeline *
+vrt_pipeline_new(const char *name, struct vrt_queue *q)
+{
+    struct vrt_pipeline  *pl = cork_new(struct vrt_pipeline);
+    pl->name = cork_strdup(name);
+    pl->queue = q;
+    cork_array_init(&pl->stages);
+    pl->started = false;
+    clog_debug("[%s] Create pipeline for %s", name, q->name);
+    return pl;
+}
+
+void
+vrt_pipeline_free(struct vrt_pipeline *pl)
+{
+    size_t  i;
+    vrt_pipeline_join(pl);
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        vrt_stage_free(cork_array_at(&pl->stages, i));
+    }
+    cork_array_done(&pl->stages);
+    cork_strfree(pl->name);
+    cork_delete(struct vrt_pipeline, pl);
+}
+
+struct vrt_stage *
+vrt_pipeline_add_producer(struct vrt_pipeline *pl, const char *name,
+                          unsigned int batch_size,
+                          void *(*run)(void *), void *ud)
+{
+    struct vrt_stage  *stage;
+    struct vrt_producer  *p;
+    rpp_check(p = vrt_producer_new(name, batch_size, pl->queue));
+    stage = vrt_stage_new(name, run, ud);
+    stage->producer = p;
+    cork_array_append(&pl->stages, stage);
+    return stage;
+}
+
+struct vrt_stage *
+vrt_pipeline_add_consumer(struct vrt_pipeline *pl, const char *name,
+                          void *(*run)(void *), void *ud)
+{
+    struct vrt_stage  *stage;
+    struct vrt_consumer  *c;
+    rpp_check(c = vrt_consumer_new(name, pl->queue));
+    stage = vrt_stage_new(name, run, ud);
+    stage->consumer = c;
+    cork_array_append(&pl->stages, stage);
+    return stage;
+}
+
+int
+vrt_pipeline_add_dependency(struct vrt_stage *stage, struct vrt_stage *dep)
+{
+    if (CORK_UNLIKELY(stage->consumer == NULL || dep->consumer == NULL ||
+                      stage->consumer->queue != dep->consumer->queue)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Stage %s can't depend on %s; "
+             "both must be consumers of the same queue",
+             stage->name, dep->name);
+        return -1;
+    }
+    cork_array_append(&stage->dependencies, dep);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Checking the graph
+ */
+
+#define VRT_STAGE_UNVISITED  0
+#define VRT_STAGE_VISITING  1
+#define VRT_STAGE_VISITED  2
+
+/* Used by vrt_pipeline_abort for the stages that it has finished standing in
+ * for. */
+#define VRT_STAGE_FINISHED  3
+
+/* A depth-first search from stage; if we find a stage that's still on the
+ * search path, the dependencies contain a cycle. */
+static int
+vrt_pipeline_check_cycles(struct vrt_pipeline *pl, struct vrt_stage *stage)
+{
+    size_t  i;
+    if (stage->mark == VRT_STAGE_VISITED) {
+        return 0;
+    } else if (stage->mark == VRT_STAGE_VISITING) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Pipeline %s has a dependency cycle through stage %s",
+             pl->name, stage->name);
+        return -1;
+    }
+
+    stage->mark = VRT_STAGE_VISITING;
+    for (i = 0; i < cork_array_size(&stage->dependencies); i++) {
+        rii_check(vrt_pipeline_check_cycles
+                  (pl, cork_array_at(&stage->dependencies, i)));
+    }
+    stage->mark = VRT_STAGE_VISITED;
+    return 0;
+}
+
+static int
+vrt_pipeline_check_cpus(struct vrt_pipeline *pl)
+{
+    size_t  i;
+    size_t  j;
+
+#if defined(__linux__)
+    cpu_set_t  allowed;
+    if (CORK_UNLIKELY(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)) {
+        cork_system_error_set();
+        return -1;
+    }
+#endif
+
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        if (stage->cpu == VRT_CPU_ANY) {
+            continue;
+        }
+
+#if defined(__linux__)
+        if (CORK_UNLIKELY(stage->cpu < 0 || stage->cpu >= CPU_SETSIZE ||
+                          !CPU_ISSET(stage->cpu, &allowed))) {
+            cork_error_set_printf
+                (CORK_UNKNOWN_ERROR,
+                 "Stage %s of pipeline %s can't run on CPU %d",
+                 stage->name, pl->name, stage->cpu);
+            return -1;
+        }
+#else
+        clog_warning("[%s] Can't pin threads on this platform", stage->name);
+#endif
+
+        /* Sharing a CPU isn't an error, but if either stage spins while it
+         * waits, it will steal cycles from the other one. */
+        for (j = 0; j < i; j++) {
+            struct vrt_stage  *other = cork_array_at(&pl->stages, j);
+            if (other->cpu == stage->cpu) {
+                clog_warning("[%s] Stages %s and %s share CPU %d",
+                             pl->name, other->name, stage->name, stage->cpu);
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+vrt_pipeline_check(struct vrt_pipeline *pl)
+{
+    size_t  i;
+    size_t  producer_count = 0;
+    size_t  consumer_count = 0;
+
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        if (stage->producer != NULL) {
+            producer_count++;
+        } else {
+            consumer_count++;
+        }
+        stage->mark = VRT_STAGE_UNVISITED;
+    }
+
+    if (CORK_UNLIKELY(producer_count == 0 || consumer_count == 0)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Pipeline %s needs at least one producer and one consumer",
+             pl->name);
+        return -1;
+    }
+
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        rii_check(vrt_pipeline_check_cycles
+                  (pl, cork_array_at(&pl->stages, i)));
+    }
+
+    return vrt_pipeline_check_cpus(pl);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Running a pipeline
+ */
+
+static bool
+vrt_consumer_has_dependency(struct vrt_consumer *c, struct vrt_consumer *dep)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&c->dependencies); i++) {
+        if (cork_array_at(&c->dependencies, i) == dep) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int
+vrt_stage_start(struct vrt_pipeline *pl, struct vrt_stage *stage)
+{
+    int  rc;
+    pthread_attr_t  attr;
+
+    pthread_attr_init(&attr);
+#if defined(__linux__)
+    if (stage->cpu != VRT_CPU_ANY) {
+        cpu_set_t  cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(stage->cpu, &cpus);
+        rc = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        if (CORK_UNLIKELY(rc != 0)) {
+            pthread_attr_destroy(&attr);
+            cork_error_set_printf
+                (CORK_UNKNOWN_ERROR,
+                 "Cannot pin stage %s of pipeline %s to CPU %d (%s)",
+                 stage->name, pl->name, stage->cpu, strerror(rc));
+            return -1;
+        }
+    }
+#endif
+
+    rc = pthread_create(&stage->thread, &attr, stage->run, stage->ud);
+    pthread_attr_destroy(&attr);
+    if (CORK_UNLIKELY(rc != 0)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Cannot start stage %s of pipeline %s (%s)",
+             stage->name, pl->name, strerror(rc));
+        return -1;
+    }
+
+    stage->started = true;
+    if (stage->cpu == VRT_CPU_ANY) {
+        clog_debug("[%s] Start stage %s", pl->name, stage->name);
+    } else {
+        clog_debug("[%s] Start stage %s on CPU %d",
+                   pl->name, stage->name, stage->cpu);
+    }
+    return 0;
+}
+
+/* Works through (and throws away) every value that a consumer can see right
+ * now.  Returns 0 once it has seen the EOF from every producer. */
+static int
+vrt_consumer_drain(struct vrt_consumer *c)
+{
+    struct vrt_value  *v;
+    int  rc;
+    while ((rc = vrt_consumer_try_next(c, &v)) == 0 ||
+           rc == VRT_QUEUE_FLUSH) {
+    }
+    return (rc == VRT_QUEUE_EOF)? 0: rc;
+}
+
+/* Called once the queue has started, when some of the pipeline's stages
+ * couldn't.  We stand in for each stage that didn't start: producer stages
+ * send their EOFs, and consumer stages throw away whatever they're given.
+ * That way the stages that did start see every EOF and finish, so the
+ * pipeline can still be joined. */
+static void
+vrt_pipeline_abort(struct vrt_pipeline *pl)
+{
+    size_t  i;
+    bool  pending = true;
+
+    clog_debug("[%s] Stop the stages that did start", pl->name);
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        stage->mark = VRT_STAGE_UNVISITED;
+    }
+
+    while (pending) {
+        pending = false;
+        for (i = 0; i < cork_array_size(&pl->stages); i++) {
+            struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+            int  rc;
+            if (stage->started || stage->mark == VRT_STAGE_FINISHED) {
+                continue;
+            }
+
+            if (stage->producer != NULL) {
+                rc = vrt_producer_try_eof(stage->producer);
+            } else {
+                rc = vrt_consumer_drain(stage->consumer);
+            }
+
+            if (rc == VRT_QUEUE_AGAIN) {
+                pending = true;
+            } else {
+                if (CORK_UNLIKELY(rc != 0)) {
+                    clog_error("[%s] Cannot stop stage %s",
+                               pl->name, stage->name);
+                }
+                stage->mark = VRT_STAGE_FINISHED;
+            }
+        }
+        if (pending) {
+            sched_yield();
+        }
+    }
+}
+
+int
+vrt_pipeline_start(struct vrt_pipeline *pl)
+{
+    size_t  i;
+    size_t  j;
+
+    if (CORK_UNLIKELY(pl->started)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Pipeline %s has already been started", pl->name);
+        return -1;
+    }
+    rii_check(vrt_pipeline_check(pl));
+
+    /* Wire up the dependencies and yield strategies, and then freeze the
+     * queue's topology, before any of the threads start.  We don't count the
+     * pipeline as started until all of that succeeds, so the caller can try
+     * again; that means we might have already added some of the
+     * dependencies. */
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        for (j = 0; j < cork_array_size(&stage->dependencies); j++) {
+            struct vrt_stage  *dep = cork_array_at(&stage->dependencies, j);
+            if (!vrt_consumer_has_dependency(stage->consumer,
+                                             dep->consumer)) {
+                rii_check(vrt_consumer_add_dependency
+                          (stage->consumer, dep->consumer));
+            }
+        }
+        if (stage->producer != NULL && stage->producer->yield == NULL) {
+            stage->producer->yield = vrt_yield_strategy_threaded();
+        } else if (stage->consumer != NULL && stage->consumer->yield == NULL) {
+            stage->consumer->yield = vrt_yield_strategy_threaded();
+        }
+    }
+
+    rii_check(vrt_queue_start(pl->queue));
+    pl->started = true;
+
+    /* Start the consumers first, so that they're ready and waiting by the
+     * time the producers fill up the queue. */
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        if (stage->consumer != NULL) {
+            ei_check(vrt_stage_start(pl, stage));
+        }
+    }
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        if (stage->producer != NULL) {
+            ei_check(vrt_stage_start(pl, stage));
+        }
+    }
+    return 0;
+
+error:
+    vrt_pipeline_abort(pl);
+    return -1;
+}
+
+int
+vrt_pipeline_join(struct vrt_pipeline *pl)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&pl->stages); i++) {
+        struct vrt_stage  *stage = cork_array_at(&pl->stages, i);
+        if (stage->started) {
+            pthread_join(stage->thread, NULL);
+            stage->started = false;
+            clog_debug("[%s] Stage %s finished", pl->name, stage->name);
+        }
+    }
+    return 0;
+}
+
+int
+vrt_pipeline_run(struct vrt_pipeline *pl)
+{
+    rii_check(vrt_pipeline_start(pl));
+    return vrt_pipeline_join(pl);
+}
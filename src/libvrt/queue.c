@@ -8,6 +8,18 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
 
 #include <bowsprit.h>
 #include <clogger.h>
@@ -16,13 +28,16 @@
 #include <libcork/helpers/errors.h>
 
 #include "vrt/atomic.h"
+#include "vrt/memory.h"
 #include "vrt/queue.h"
 #include "vrt/yield.h"
+#include "hash.h"
 
 #define CLOG_CHANNEL  "vrt"
 
 
 #define MINIMUM_QUEUE_SIZE  16
+#define CACHE_LINE_SIZE  64
 #define DEFAULT_QUEUE_SIZE  65536
 #define DEFAULT_BATCH_SIZE  4096
 
@@ -74,41 +89,251 @@ min_power_of_2(unsigned int in)
     return r;
 }
 
+/** Returns the number of values that a queue should hold if the caller asks
+ * for size of them. */
+static unsigned int
+vrt_queue_value_count(unsigned int size)
+{
+    if (size == 0) {
+        return DEFAULT_QUEUE_SIZE;
+    }
+    if (size < MINIMUM_QUEUE_SIZE) {
+        size = MINIMUM_QUEUE_SIZE;
+    }
+    return min_power_of_2(size);
+}
+
+/* Returns the distance between consecutive values of an inline value type,
+ * which is the type's size padded out to its alignment.  Also fills in the
+ * alignment of the array as a whole, which always starts on a cache line
+ * boundary. */
+static size_t
+vrt_value_type_stride(struct vrt_value_type *type, size_t *slab_alignment)
+{
+    size_t  alignment;
+
+    alignment = type->value_alignment;
+    if (alignment < sizeof(vrt_value_id)) {
+        alignment = sizeof(vrt_value_id);
+    }
+    assert((alignment & (alignment - 1)) == 0);
+    assert(type->value_size >= sizeof(struct vrt_value));
+
+    *slab_alignment = alignment;
+    if (*slab_alignment < CACHE_LINE_SIZE) {
+        *slab_alignment = CACHE_LINE_SIZE;
+    }
+    return (type->value_size + alignment - 1) & ~(alignment - 1);
+}
+
+/* The start of a queue that lives in shared memory.  The rest of the region
+ * holds a cursor for each consumer, the publication stamps (if there's more
+ * than one producer), and the values themselves, in that order.  Everything
+ * in here has to make sense to every process that maps the region, so we
+ * only store offsets, never pointers. */
+struct vrt_shared_header {
+    uint32_t  magic;
+    uint32_t  version;
+
+    /** Set once the creator has finished initializing the region */
+    volatile uint32_t  ready;
+
+    uint32_t  value_count;
+    uint32_t  value_size;
+    uint32_t  value_stride;
+    uint32_t  producer_count;
+    uint32_t  consumer_count;
+    vrt_value_id  start_id;
+
+    /** How many of the producer and consumer slots have been taken */
+    volatile unsigned int  producers_added;
+    volatile unsigned int  consumers_added;
+
+    uint64_t  cursors_offset;
+    uint64_t  stamps_offset;
+    uint64_t  values_offset;
+    uint64_t  size;
+
+    struct vrt_queue_control  control;
+};
+
+#define VRT_SHARED_MAGIC  0x56727451
+#define VRT_SHARED_VERSION  1
+
+#define vrt_shared_cursors(header) \
+    ((struct vrt_padded_int *) \
+     ((char *) (header) + (header)->cursors_offset))
+
+/* The number of producers that the queue has to hear an EOF from.  A shared
+ * queue's producers might live in other processes, so we can't count them
+ * ourselves. */
+#define vrt_queue_producer_count(q) \
+    ((q)->shared != NULL? \
+     (q)->shared->producer_count: \
+     vrt_atomic_load_relaxed(&(q)->producer_count))
+
+/* Allocates a single contiguous array to hold all of the values in a queue
+ * whose value type stores its values inline. */
+static void
+vrt_queue_init_value_slab(struct vrt_queue *q, unsigned int value_count)
+{
+    size_t  slab_alignment;
+    q->value_stride = vrt_value_type_stride(q->value_type, &slab_alignment);
+    vrt_memory_alloc(&q->value_memory, value_count * q->value_stride,
+                     slab_alignment, q->memory_flags, q->numa_node);
+    q->value_slab = q->value_memory.ptr;
+    clog_debug("[%s] Store values inline (%zu bytes each)",
+               q->name, q->value_stride);
+}
+
+/* Frees a snapshot of the gating cursors, along with any older snapshots
+ * that it's holding on to. */
+static void
+vrt_gating_set_free(struct vrt_gating_set *gating)
+{
+    while (gating != NULL) {
+        struct vrt_gating_set  *previous = gating->previous;
+        cork_free(gating, sizeof(struct vrt_gating_set) +
+                  gating->count * sizeof(struct vrt_padded_int *));
+        gating = previous;
+    }
+}
+
+/* Frees the old snapshots of the gating cursors that no producer can still
+ * be looking at.  Each producer records the version of the last snapshot
+ * that it finished scanning (with release semantics, so we can't free a
+ * snapshot out from under a scan), and never goes back to an older one.
+ * Detached producers don't scan anything.  The caller must hold the topology
+ * lock. */
+static void
+vrt_queue_reclaim_gating_sets(struct vrt_queue *q)
+{
+    size_t  i;
+    struct vrt_gating_set  *gating = q->gating;
+    unsigned int  oldest = gating->version;
+
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        if (!p->detached) {
+            unsigned int  version =
+                vrt_atomic_load_acquire(&p->gating_version);
+            if (vrt_mod_lt(version, oldest)) {
+                oldest = version;
+            }
+        }
+    }
+
+    while (gating != NULL && vrt_mod_lt(oldest, gating->version)) {
+        gating = gating->previous;
+    }
+    if (gating != NULL && gating->previous != NULL) {
+        clog_debug("[%s] Free gating cursors older than version %u",
+                   q->name, gating->version);
+        vrt_gating_set_free(gating->previous);
+        gating->previous = NULL;
+    }
+}
+
+/* Hands a new snapshot of the queue's gating cursors to its producers.
+ * Before the queue has started, no one can be looking at the old snapshot,
+ * so we free it right away.  Afterwards, a producer might still be scanning
+ * it, so we hang on to it until every producer has moved on. */
+static void
+vrt_queue_publish_gating_set(struct vrt_queue *q)
+{
+    size_t  count = cork_array_size(&q->gating_cursors);
+    struct vrt_gating_set  *old = q->gating;
+    struct vrt_gating_set  *gating =
+        cork_malloc(sizeof(struct vrt_gating_set) +
+                    count * sizeof(struct vrt_padded_int *));
+    gating->count = count;
+    gating->cursors = (struct vrt_padded_int **) (gating + 1);
+    if (count > 0) {
+        memcpy(gating->cursors, &cork_array_at(&q->gating_cursors, 0),
+               count * sizeof(struct vrt_padded_int *));
+    }
+    gating->previous = q->started? old: NULL;
+    gating->version = (old == NULL)? 0: old->version + 1;
+    vrt_atomic_store_release(&q->gating, gating);
+    if (q->started) {
+        vrt_queue_reclaim_gating_sets(q);
+    } else {
+        vrt_gating_set_free(old);
+    }
+}
 
 struct vrt_queue *
 vrt_queue_new(const char *name, struct vrt_value_type *value_type,
               unsigned int size)
+{
+    return vrt_queue_new_with_flags(name, value_type, size, 0);
+}
+
+struct vrt_queue *
+vrt_queue_new_with_flags(const char *name, struct vrt_value_type *value_type,
+                         unsigned int size, unsigned int memory_flags)
+{
+    return vrt_queue_new_on_node
+        (name, value_type, size, memory_flags, VRT_NUMA_NODE_ANY);
+}
+
+/* Allocates a new queue, without its values or control block. */
+static struct vrt_queue *
+vrt_queue_alloc(const char *name, struct vrt_value_type *value_type,
+                unsigned int value_count)
 {
     struct vrt_queue  *q = cork_new(struct vrt_queue);
     memset(q, 0, sizeof(struct vrt_queue));
     q->name = cork_strdup(name);
     q->ctx = NULL;
-
-    unsigned int  value_count;
-    if (size == 0) {
-        value_count = DEFAULT_QUEUE_SIZE;
-    } else {
-        if (size < MINIMUM_QUEUE_SIZE) {
-            size = MINIMUM_QUEUE_SIZE;
-        }
-        value_count = min_power_of_2(size);
-    }
+    q->numa_node = VRT_NUMA_NODE_ANY;
     q->value_mask = value_count - 1;
-    q->last_consumed_id = starting_value;
-    q->last_claimed_id.value = q->last_consumed_id;
-    q->cursor.value = q->last_consumed_id;
     q->value_type = value_type;
-
-    q->values = cork_calloc(value_count, sizeof(struct vrt_value *));
-    clog_debug("[%s] Create queue with %u entries", q->name, value_count);
+    pthread_mutex_init(&q->topology_lock, NULL);
 
     cork_pointer_array_init(&q->producers, (cork_free_f) vrt_producer_free);
-    cork_pointer_array_init(&q->consumers, (cork_free_f) vrt_consumer_free);
+    /* We free the consumers ourselves, so that vrt_consumer_remove can
+     * rebuild this array without freeing the ones it keeps. */
+    cork_array_init(&q->consumers);
+    cork_pointer_array_init
+        (&q->groups, (cork_free_f) vrt_consumer_group_free);
+    cork_array_init(&q->gating_cursors);
+    cork_array_init(&q->eventfd_consumers);
+    cork_array_init(&q->notifiers);
+    vrt_queue_publish_gating_set(q);
+    return q;
+}
 
-    unsigned int  i;
-    for (i = 0; i < value_count; i++) {
-        q->values[i] = vrt_value_new(value_type);
-        cork_abort_if_null(q->values[i], "Cannot allocate values");
+struct vrt_queue *
+vrt_queue_new_on_node(const char *name, struct vrt_value_type *value_type,
+                      unsigned int size, unsigned int memory_flags,
+                      int numa_node)
+{
+    unsigned int  value_count = vrt_queue_value_count(size);
+    struct vrt_queue  *q = vrt_queue_alloc(name, value_type, value_count);
+    q->memory_flags = memory_flags;
+    q->numa_node = numa_node;
+    q->last_consumed_id = starting_value;
+    q->control = &q->control_storage;
+    q->control->last_claimed_id.value = q->last_consumed_id;
+    q->control->cursor.value = q->last_consumed_id;
+    vrt_eventcount_init(&q->control->published);
+    vrt_eventcount_init(&q->control->consumed);
+
+    clog_debug("[%s] Create queue with %u entries", q->name, value_count);
+
+    if (vrt_value_type_is_inline(value_type)) {
+        vrt_queue_init_value_slab(q, value_count);
+    } else {
+        unsigned int  i;
+        vrt_memory_alloc(&q->value_memory,
+                         value_count * sizeof(struct vrt_value *),
+                         CACHE_LINE_SIZE, q->memory_flags, q->numa_node);
+        q->values = q->value_memory.ptr;
+        for (i = 0; i < value_count; i++) {
+            q->values[i] = vrt_value_new(value_type);
+            cork_abort_if_null(q->values[i], "Cannot allocate values");
+        }
     }
 
     return q;
@@ -125,7 +350,16 @@ vrt_queue_free(struct vrt_queue *q)
     }
 
     cork_array_done(&q->producers);
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        vrt_consumer_free(cork_array_at(&q->consumers, i));
+    }
     cork_array_done(&q->consumers);
+    cork_array_done(&q->groups);
+    cork_array_done(&q->gating_cursors);
+    cork_array_done(&q->eventfd_consumers);
+    cork_array_done(&q->notifiers);
+    vrt_gating_set_free(q->gating);
+    pthread_mutex_destroy(&q->topology_lock);
 
     if (q->values != NULL) {
         for (i = 0; i < value_count; i++) {
@@ -133,8 +367,16 @@ vrt_queue_free(struct vrt_queue *q)
                 vrt_value_free(q->value_type, q->values[i]);
             }
         }
+    }
 
-        cork_cfree(q->values, value_count, sizeof(struct vrt_value *));
+    vrt_memory_free(&q->value_memory);
+    vrt_memory_free(&q->stamp_memory);
+    vrt_memory_free(&q->partition_memory);
+    vrt_memory_free(&q->shared_memory);
+
+    if (q->shared_name != NULL) {
+        shm_unlink(q->shared_name);
+        cork_strfree(q->shared_name);
     }
 
     cork_delete(struct vrt_queue, q);
@@ -146,46 +388,291 @@ vrt_queue_set_bws_ctx(struct vrt_queue *q, struct bws_ctx *ctx)
     q->ctx = ctx;
 }
 
+static void
+vrt_queue_add_memory_stats(const struct vrt_memory *mem,
+                           struct vrt_queue_memory_stats *stats)
+{
+    size_t  size = (mem->map != NULL)? mem->map_size: mem->size;
+    stats->size += size;
+    stats->huge_page_size += vrt_memory_huge_size(mem);
+    if (mem->flags & VRT_MEMORY_PREFAULT) {
+        stats->prefaulted_size += size;
+    }
+    if (mem->flags & VRT_MEMORY_MLOCK) {
+        stats->locked_size += size;
+    }
+    if (mem->node != VRT_NUMA_NODE_ANY) {
+        stats->bound_size += size;
+    }
+}
+
+void
+vrt_queue_get_memory_stats(struct vrt_queue *q,
+                           struct vrt_queue_memory_stats *stats)
+{
+    memset(stats, 0, sizeof(struct vrt_queue_memory_stats));
+    vrt_queue_add_memory_stats(&q->value_memory, stats);
+    vrt_queue_add_memory_stats(&q->stamp_memory, stats);
+    vrt_queue_add_memory_stats(&q->partition_memory, stats);
+    vrt_queue_add_memory_stats(&q->shared_memory, stats);
+}
+
+/* Each of the cursors that we're finding the minimum of lives in its own cache
+ * line, so there's nothing for SIMD instructions to work with.  Instead, we
+ * load each cursor without any ordering constraints, and issue a single read
+ * barrier for the whole scan (rather than one per cursor).  We also measure
+ * each cursor relative to the first one, so that a plain signed minimum
+ * respects the modular ordering of IDs.  That lets the compiler turn
+ * the reduction into conditional moves instead of branches. */
+
 static vrt_value_id
 vrt_minimum_cursor(vrt_consumer_array *cs)
 {
     /* We know there's always at least one consumer */
-    unsigned int  i;
-    vrt_value_id  minimum =
-        vrt_consumer_get_cursor(cork_array_at(cs, 0));
-    for (i = 1; i < cork_array_size(cs); i++) {
+    size_t  i;
+    size_t  count = cork_array_size(cs);
+    vrt_value_id  base;
+    int  minimum_delta = 0;
+
+    base = vrt_atomic_load_relaxed(&cork_array_at(cs, 0)->cursor->value);
+    for (i = 1; i < count; i++) {
         vrt_value_id  id =
-            vrt_consumer_get_cursor(cork_array_at(cs, i));
-        if (vrt_mod_lt(id, minimum)) {
-            minimum = id;
+            vrt_atomic_load_relaxed(&cork_array_at(cs, i)->cursor->value);
+        int  delta = (int) ((unsigned int) id - (unsigned int) base);
+        minimum_delta = (delta < minimum_delta)? delta: minimum_delta;
+    }
+    vrt_atomic_read_barrier();
+    return (unsigned int) base + minimum_delta;
+}
+
+static vrt_value_id
+vrt_minimum_gating_cursor(struct vrt_gating_set *gating)
+{
+    /* We know there's always at least one gating cursor */
+    size_t  i;
+    size_t  count = gating->count;
+    vrt_value_id  base;
+    int  minimum_delta = 0;
+
+    base = vrt_atomic_load_relaxed(&gating->cursors[0]->value);
+    for (i = 1; i < count; i++) {
+        vrt_value_id  id = vrt_atomic_load_relaxed(&gating->cursors[i]->value);
+        int  delta = (int) ((unsigned int) id - (unsigned int) base);
+        minimum_delta = (delta < minimum_delta)? delta: minimum_delta;
+    }
+    vrt_atomic_read_barrier();
+    return (unsigned int) base + minimum_delta;
+}
+
+/* Returns the last value that every gating cursor has moved past.  If
+ * there's a single gating cursor, we read it directly.  If the set of gating
+ * cursors changes while we're reading them, we start over with the new set,
+ * since a consumer that has just attached might be behind every cursor in
+ * the old one.  (Reading the cursors has acquire semantics, so we can't check
+ * for a new set until we've finished reading them.)  If p isn't NULL, we
+ * record that it has finished with every older set. */
+static vrt_value_id
+vrt_queue_find_last_consumed_id(struct vrt_queue *q, struct vrt_producer *p)
+{
+    struct vrt_gating_set  *gating = vrt_atomic_load_acquire(&q->gating);
+    while (true) {
+        struct vrt_gating_set  *current;
+        vrt_value_id  minimum = (gating->count == 1)?
+            vrt_padded_int_get(gating->cursors[0]):
+            vrt_minimum_gating_cursor(gating);
+        current = vrt_atomic_load_acquire(&q->gating);
+        if (CORK_LIKELY(current == gating)) {
+            if (p != NULL) {
+                vrt_atomic_store_release(&p->gating_version, gating->version);
+            }
+            return minimum;
+        }
+        gating = current;
+    }
+}
+
+/* Returns an error if the queue's topology has been frozen. */
+static int
+vrt_queue_check_not_started(struct vrt_queue *q, const char *what,
+                            const char *name)
+{
+    if (CORK_UNLIKELY(q->started)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Can't add %s %s to queue %s once it has started",
+             what, name, q->name);
+        return -1;
+    }
+    return 0;
+}
+
+/* Recalculates the set of cursors that producers have to check before they
+ * can reuse a slot in the queue, without handing it to the producers yet.
+ * Detached consumers don't hold anyone back, and neither do their
+ * dependencies, unless some other consumer depends on them too. */
+static void
+vrt_queue_collect_gating_cursors(struct vrt_queue *q)
+{
+    size_t  i;
+    size_t  j;
+    cork_array_clear(&q->gating_cursors);
+
+    if (q->shared != NULL) {
+        /* Producers have to wait for every consumer of a shared queue,
+         * including the ones in other processes, and the ones that haven't
+         * been added yet. */
+        struct vrt_padded_int  *cursors = vrt_shared_cursors(q->shared);
+        for (i = 0; i < q->shared->consumer_count; i++) {
+            cork_array_append(&q->gating_cursors, &cursors[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        cork_array_at(&q->consumers, i)->is_dependency = false;
+    }
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        if (!c->detached) {
+            for (j = 0; j < cork_array_size(&c->dependencies); j++) {
+                cork_array_at(&c->dependencies, j)->is_dependency = true;
+            }
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&q->groups); i++) {
+        struct vrt_consumer_group  *g = cork_array_at(&q->groups, i);
+        if (!cork_array_is_empty(&g->members)) {
+            cork_array_append(&q->gating_cursors, &g->cursor);
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        if (!c->detached && c->group == NULL && c->pool == NULL &&
+            !c->is_dependency) {
+            cork_array_append(&q->gating_cursors, c->cursor);
+        }
+    }
+
+    clog_debug("[%s] Producers check %zu cursors",
+               q->name, cork_array_size(&q->gating_cursors));
+}
+
+/* Recalculates the set of gating cursors and hands it to the producers.  We
+ * have to call this whenever we add, attach, or detach a consumer or group,
+ * or change the dependencies between consumers. */
+static void
+vrt_queue_update_gating_cursors(struct vrt_queue *q)
+{
+    vrt_queue_collect_gating_cursors(q);
+    vrt_queue_publish_gating_set(q);
+}
+
+/* Sets up the publication stamps that we use once a queue has more than one
+ * producer.  Every slot is stamped with the ID of the value that it held one
+ * lap before the current cursor, so that no slot looks like it holds a newer
+ * value that has already been published.  (If the queue has had multiple
+ * producers before, we reuse the stamps that we allocated then.) */
+static void
+vrt_queue_stamp_slots(struct vrt_queue *q, volatile vrt_value_id *stamps)
+{
+    unsigned int  i;
+    unsigned int  value_count = vrt_queue_size(q);
+    vrt_value_id  cursor = vrt_queue_get_cursor(q);
+    for (i = 0; i < value_count; i++) {
+        vrt_value_id  id = cursor - i;
+        stamps[id & q->value_mask] = id;
+    }
+}
+
+static void
+vrt_queue_init_published_ids(struct vrt_queue *q)
+{
+    if (q->stamp_memory.ptr == NULL) {
+        vrt_memory_alloc(&q->stamp_memory,
+                         vrt_queue_size(q) * sizeof(vrt_value_id),
+                         CACHE_LINE_SIZE, q->memory_flags, q->numa_node);
+    }
+    vrt_queue_stamp_slots(q, q->stamp_memory.ptr);
+    vrt_atomic_store_release(&q->published_ids, q->stamp_memory.ptr);
+}
+
+/* Returns the ID of the last value that has been published into the queue,
+ * such that every value before it has also been published.  The consumer
+ * calling this function has already processed last_consumed_id. */
+static vrt_value_id
+vrt_queue_find_last_published_id(struct vrt_queue *q,
+                                  vrt_value_id last_consumed_id)
+{
+    unsigned int  i;
+    unsigned int  claimed_count;
+    volatile vrt_value_id  *published_ids =
+        vrt_atomic_load_acquire(&q->published_ids);
+
+    /* If there's only a single producer, it publishes values in order, so
+     * the cursor tells us everything we need to know. */
+    if (published_ids == NULL) {
+        return vrt_queue_get_cursor(q);
+    }
+
+    /* Otherwise we scan forward from the last value we've consumed, and stop
+     * at the first value that has been claimed but not yet published.  (We
+     * count with unsigned offsets, since the IDs can wrap around.) */
+    claimed_count =
+        (unsigned int) vrt_padded_int_get(&q->control->last_claimed_id) -
+        (unsigned int) last_consumed_id;
+    for (i = 0; i < claimed_count; i++) {
+        vrt_value_id  id = (unsigned int) last_consumed_id + i + 1;
+        if (vrt_atomic_load_relaxed(&published_ids[id & q->value_mask])
+                != id) {
+            break;
         }
     }
-    return minimum;
+
+    /* Make sure that we don't read the contents of any of these values
+     * until after we've seen their stamps. */
+    vrt_atomic_read_barrier();
+    return (unsigned int) last_consumed_id + i;
 }
 
-#define vrt_queue_find_last_consumed_id(q) \
-    (vrt_minimum_cursor(&(q)->consumers))
+/* Returns whether a wait loop should give up, rather than yielding and trying
+ * again.  We only need to check the clock for deadlines in the future. */
+static inline bool
+vrt_deadline_passed(uint64_t deadline)
+{
+    return (deadline != VRT_WAIT_FOREVER) &&
+        (deadline == 0 || vrt_now_ns() >= deadline);
+}
 
-/* Waits for the slot given by the producer's last_claimed_id to become
- * free.  (This happens when every consumer has finished processing the
- * previous value that would've used the same slot in the ring buffer. */
+/* Waits for the slots up through last_claimed_id to become free.  (This
+ * happens when every consumer has finished processing the previous value that
+ * would've used the same slot in the ring buffer.)  Returns VRT_QUEUE_AGAIN if
+ * that doesn't happen before the deadline. */
 static int
-vrt_wait_for_slot(struct vrt_queue *q, struct vrt_producer *p)
+vrt_wait_for_slot(struct vrt_queue *q, struct vrt_producer *p,
+                  vrt_value_id last_claimed_id, uint64_t deadline)
 {
     bool  first = true;
-    vrt_value_id  wrapped_id = p->last_claimed_id - vrt_queue_size(q);
+    unsigned int  key = 0;
+    vrt_value_id  wrapped_id = last_claimed_id - vrt_queue_size(q);
     if (vrt_mod_lt(q->last_consumed_id, wrapped_id)) {
         clog_debug("<%s> Wait for value %d to be consumed",
                    p->name, wrapped_id);
-        vrt_value_id  minimum = vrt_queue_find_last_consumed_id(q);
+        vrt_value_id  minimum = vrt_queue_find_last_consumed_id(q, p);
         while (vrt_mod_lt(minimum, wrapped_id)) {
             clog_trace("<%s> Last consumed value is %d (wait)",
                        p->name, minimum);
+            if (vrt_deadline_passed(deadline)) {
+                q->last_consumed_id = minimum;
+                return VRT_QUEUE_AGAIN;
+            }
             bws_derive_inc(p->yields);
-            rii_check(vrt_yield_strategy_yield
-                      (p->yield, first, q->name, p->name));
+            rii_check(vrt_yield_strategy_wait
+                      (p->yield, first, &q->control->consumed, &key, deadline,
+                       q->name, p->name));
             first = false;
-            minimum = vrt_queue_find_last_consumed_id(q);
+            minimum = vrt_queue_find_last_consumed_id(q, p);
         }
         bws_derive_inc(p->claimed_batches);
         q->last_consumed_id = minimum;
@@ -213,17 +700,111 @@ vrt_claim_single_threaded(struct vrt_queue *q, struct vrt_producer *p)
 
     /* But we do have to wait until the slots for these new values are
      * free. */
-    return vrt_wait_for_slot(q, p);
+    return vrt_wait_for_slot(q, p, p->last_claimed_id, VRT_WAIT_FOREVER);
+}
+
+static int
+vrt_try_claim_single_threaded(struct vrt_queue *q, struct vrt_producer *p,
+                              uint64_t deadline)
+{
+    /* Same as above, but we don't commit to the new batch until we know
+     * that its slots are free. */
+    vrt_value_id  last_claimed_id = p->last_claimed_id + p->batch_size;
+    rii_check(vrt_wait_for_slot(q, p, last_claimed_id, deadline));
+    p->last_claimed_id = last_claimed_id;
+    clog_trace("<%s> Claim values %d-%d (single-threaded)",
+               p->name, p->last_claimed_id - p->batch_size + 1,
+               p->last_claimed_id);
+    return 0;
+}
+
+/* Once a queue has started, another producer might attach to it at any
+ * time, and the lone producer has to let the newcomer know when it's safe to
+ * take over.  It marks itself busy from the time that it claims a batch
+ * until it publishes it, and then checks whether anyone has attached.  The
+ * barrier makes sure that either we see the new producer, or the new
+ * producer sees that we're busy; vrt_queue_attach_producer pays for the
+ * expensive side of it.  If someone has attached, we wait for them to switch
+ * us over to the multiple-producer implementations (or to give up).  Returns
+ * whether we can still claim the next batch on our own. */
+static bool
+vrt_producer_enter_lone(struct vrt_queue *q, struct vrt_producer *p)
+{
+    while (true) {
+        vrt_atomic_store_relaxed(&q->lone_busy.value, 1);
+        vrt_atomic_light_barrier();
+        if (CORK_LIKELY(vrt_atomic_load_relaxed
+                        (&q->active_producer_count) == 1)) {
+            return true;
+        }
+
+        clog_debug("<%s> Wait for another producer to attach", p->name);
+        vrt_padded_int_set(&q->lone_busy, 0);
+        while (vrt_atomic_load_acquire(&q->single_producer)) {
+            /* The producer that was attaching might have given up. */
+            if (vrt_atomic_load_acquire(&q->active_producer_count) == 1) {
+                break;
+            }
+            sched_yield();
+        }
+        if (!vrt_atomic_load_acquire(&q->single_producer)) {
+            return false;
+        }
+    }
+}
+
+static int
+vrt_claim_lone(struct vrt_queue *q, struct vrt_producer *p)
+{
+    int  rc;
+    if (CORK_UNLIKELY(!vrt_producer_enter_lone(q, p))) {
+        return p->claim(q, p);
+    }
+    rc = vrt_claim_single_threaded(q, p);
+    if (CORK_UNLIKELY(rc != 0)) {
+        vrt_padded_int_set(&q->lone_busy, 0);
+    }
+    return rc;
+}
+
+static int
+vrt_try_claim_lone(struct vrt_queue *q, struct vrt_producer *p,
+                   uint64_t deadline)
+{
+    int  rc;
+    if (CORK_UNLIKELY(!vrt_producer_enter_lone(q, p))) {
+        return p->try_claim(q, p, deadline);
+    }
+    rc = vrt_try_claim_single_threaded(q, p, deadline);
+    if (rc != 0) {
+        /* We didn't claim anything, so we're not busy after all. */
+        vrt_padded_int_set(&q->lone_busy, 0);
+    }
+    return rc;
 }
 
+static bool
+vrt_producer_become_lone(struct vrt_queue *q, struct vrt_producer *p);
+
+/* Whether every other producer of a running queue seems to have detached, in
+ * which case we should try to switch back to single-producer mode. */
+#define vrt_producer_is_lone(q) \
+    (CORK_UNLIKELY((q)->started && \
+                   vrt_atomic_load_relaxed(&(q)->active_producer_count) == 1))
+
 static int
 vrt_claim_multi_threaded(struct vrt_queue *q, struct vrt_producer *p)
 {
+    if (vrt_producer_is_lone(q) && vrt_producer_become_lone(q, p)) {
+        return vrt_claim_lone(q, p);
+    }
+
     /* If there are multiple producerwe have to use an atomic
      * increment to claim the next batch of records. */
     p->last_claimed_id =
-        vrt_padded_int_atomic_add(&q->last_claimed_id, p->batch_size);
+        vrt_padded_int_atomic_add(&q->control->last_claimed_id, p->batch_size);
     p->last_produced_id = p->last_claimed_id - p->batch_size;
+    p->last_published_id = p->last_produced_id;
     if (p->batch_size == 1) {
         clog_trace("<%s> Claim value %d (multi-threaded)",
                    p->name, p->last_claimed_id);
@@ -233,7 +814,104 @@ vrt_claim_multi_threaded(struct vrt_queue *q, struct vrt_producer *p)
     }
 
     /* Then wait until the slots for these new values are free. */
-    return vrt_wait_for_slot(q, p);
+    return vrt_wait_for_slot(q, p, p->last_claimed_id, VRT_WAIT_FOREVER);
+}
+
+static int
+vrt_try_claim_multi_threaded(struct vrt_queue *q, struct vrt_producer *p,
+                             uint64_t deadline)
+{
+    /* Once we've incremented the queue's last_claimed_id, the batch is ours,
+     * and we can't give it back.  So instead of an atomic increment, we wait
+     * for the next batch's slots to be free, and only then try to claim it
+     * with a compare-and-swap.  If another producer beats us to it, we try
+     * again with the batch after that. */
+    if (vrt_producer_is_lone(q) && vrt_producer_become_lone(q, p)) {
+        return vrt_try_claim_lone(q, p, deadline);
+    }
+    while (true) {
+        vrt_value_id  current =
+            vrt_padded_int_get(&q->control->last_claimed_id);
+        vrt_value_id  last_claimed_id = current + p->batch_size;
+        rii_check(vrt_wait_for_slot(q, p, last_claimed_id, deadline));
+        if (cork_int_atomic_cas(&q->control->last_claimed_id.value,
+                                current, last_claimed_id) == current) {
+            p->last_claimed_id = last_claimed_id;
+            p->last_produced_id = current;
+            p->last_published_id = current;
+            clog_trace("<%s> Claim values %d-%d (multi-threaded)",
+                       p->name, p->last_produced_id + 1, p->last_claimed_id);
+            return 0;
+        }
+    }
+}
+
+/* Returns the event count that's notified when there might be new values
+ * for a consumer to process.  (A worker in a work pool uses the pool's
+ * dependencies, not its own.) */
+static inline struct vrt_eventcount *
+vrt_consumer_wakeup_event(struct vrt_consumer *c)
+{
+    struct vrt_consumer  *gate = (c->pool == NULL)? c: c->pool;
+    return cork_array_is_empty(&gate->dependencies)?
+        &c->queue->control->published: &c->queue->control->consumed;
+}
+
+/* Signals the eventfd of every armed consumer that's waiting on ev. */
+static void
+vrt_queue_signal_eventfds(struct vrt_queue *q, struct vrt_eventcount *ev)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&q->eventfd_consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->eventfd_consumers, i);
+        if (vrt_consumer_wakeup_event(c) == ev && c->armed &&
+            cork_int_atomic_cas(&c->armed, 1, 0) == 1) {
+            uint64_t  one = 1;
+            bws_derive_inc(c->notifications);
+            if (CORK_UNLIKELY(write(c->eventfd, &one, sizeof(one)) < 0)) {
+                clog_warning("<%s> Cannot signal eventfd (%s)",
+                             c->name, strerror(errno));
+            }
+        }
+    }
+}
+
+/* Fires every armed notifier. */
+static void
+vrt_queue_signal_notifiers(struct vrt_queue *q)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&q->notifiers); i++) {
+        struct vrt_notifier  *n = cork_array_at(&q->notifiers, i);
+        if (n->armed && cork_int_atomic_cas(&n->armed, 1, 0) == 1) {
+            n->notify(n);
+        }
+    }
+}
+
+/* Wakes up anyone waiting on one of the queue's event counts. */
+static inline void
+vrt_queue_notify(struct vrt_queue *q, struct vrt_eventcount *ev)
+{
+    if (vrt_eventcount_notify(ev) & VRT_EVENTCOUNT_ARMED) {
+        if (!cork_array_is_empty(&q->eventfd_consumers)) {
+            vrt_queue_signal_eventfds(q, ev);
+        }
+        if (!cork_array_is_empty(&q->notifiers)) {
+            vrt_queue_signal_notifiers(q);
+        }
+    }
+}
+
+/* Returns the ID of the last value in the producer's current batch that it
+ * has already published, or the ID just before the batch if it hasn't
+ * published any of them yet. */
+static inline vrt_value_id
+vrt_producer_find_last_published_id(struct vrt_producer *p)
+{
+    vrt_value_id  batch_start = p->last_claimed_id - p->batch_size;
+    return vrt_mod_lt(p->last_published_id, batch_start)?
+        batch_start: p->last_published_id;
 }
 
 static int
@@ -247,6 +925,11 @@ vrt_publish_single_threaded(struct vrt_queue *q, struct vrt_producer *p,
     clog_debug("<%s> Signal publication of value %d (single-threaded)",
                p->name, last_published_id);
     vrt_queue_set_cursor(q, last_published_id);
+    p->last_published_id = last_published_id;
+    if (CORK_LIKELY(last_published_id == p->last_claimed_id)) {
+        vrt_padded_int_set(&q->lone_busy, 0);
+    }
+    vrt_queue_notify(q, &q->control->published);
     return 0;
 }
 
@@ -254,37 +937,125 @@ static int
 vrt_publish_multi_threaded(struct vrt_queue *q, struct vrt_producer *p,
                            vrt_value_id last_published_id)
 {
-    bool  first = true;
-    vrt_value_id  expected_cursor;
-    vrt_value_id  current_cursor;
-
-    /* If there are multiple publisherthen we have to wait until all
-     * of the values before the chunk that we claimed have been
-     * published.  (If we don't, there will be a hole in the sequence of
-     * published records.) */
-    expected_cursor = last_published_id - p->batch_size;
-    current_cursor = vrt_queue_get_cursor(q);
-    clog_debug("<%s> Wait for value %d to be published",
-               p->name, expected_cursor);
-
-    while (vrt_mod_lt(current_cursor, expected_cursor)) {
-        clog_trace("<%s> Last published value is %d (wait)",
-                   p->name, current_cursor);
-        bws_derive_inc(p->yields);
-        rii_check(vrt_yield_strategy_yield
-                  (p->yield, first, q->name, p->name));
-        first = false;
-        current_cursor = vrt_queue_get_cursor(q);
+    unsigned int  i;
+    unsigned int  count;
+    vrt_value_id  first_published_id =
+        vrt_producer_find_last_published_id(p) + 1;
+
+    /* If there are multiple producers, we stamp each value in our chunk as
+     * published.  Consumers work out for themselves how far the contiguous
+     * run of published values extends, so we don't have to wait for the
+     * producers that claimed the chunks before ours. */
+    clog_debug("<%s> Signal publication of values %d-%d (multi-threaded)",
+               p->name, first_published_id, last_published_id);
+
+    /* Make sure the contents of the values are visible before any of the
+     * stamps are. */
+    vrt_atomic_write_barrier();
+    count = (unsigned int) last_published_id -
+        (unsigned int) first_published_id + 1;
+    for (i = 0; i < count; i++) {
+        vrt_value_id  id = (unsigned int) first_published_id + i;
+        vrt_atomic_store_relaxed(&q->published_ids[id & q->value_mask], id);
     }
-
-    clog_debug("<%s> Last published value is %d", p->name, current_cursor);
-    clog_debug("<%s> Signal publication of value %d (multi-threaded)",
-               p->name, last_published_id);
-    vrt_queue_set_cursor(q, last_published_id);
+    p->last_published_id = last_published_id;
+    vrt_queue_notify(q, &q->control->published);
     return 0;
 }
 
-static int
+/* Once a queue has been started with a single producer, we know which claim
+ * and publish implementations it needs, so we call them directly (letting the
+ * compiler inline them) instead of through the producer's function
+ * pointers. */
+#define vrt_producer_do_claim(q, p) \
+    ((q)->single_producer? \
+     vrt_claim_lone((q), (p)): \
+     (p)->claim((q), (p)))
+
+#define vrt_producer_do_try_claim(q, p, deadline) \
+    ((q)->single_producer? \
+     vrt_try_claim_lone((q), (p), (deadline)): \
+     (p)->try_claim((q), (p), (deadline)))
+
+#define vrt_producer_do_publish(q, p, last_published_id) \
+    ((q)->single_producer? \
+     vrt_publish_single_threaded((q), (p), (last_published_id)): \
+     (p)->publish((q), (p), (last_published_id)))
+
+/* Starts a producer off right after last_id.  Until it claims its first
+ * batch, it doesn't have anything of its own to publish. */
+static void
+vrt_producer_start_after(struct vrt_producer *p, vrt_value_id last_id)
+{
+    p->last_claimed_id = last_id;
+    p->last_produced_id = last_id;
+    p->last_published_id = last_id;
+}
+
+/* Use the faster claim and publish methods that are optimized for the
+ * single-producer case. */
+static void
+vrt_producer_use_single_threaded(struct vrt_producer *p)
+{
+    p->claim = vrt_claim_single_threaded;
+    p->try_claim = vrt_try_claim_single_threaded;
+    p->publish = vrt_publish_single_threaded;
+}
+
+/* Use the slower, but multiple-producer-capable, implementations of claim
+ * and publish. */
+static void
+vrt_producer_use_multi_threaded(struct vrt_producer *p)
+{
+    p->claim = vrt_claim_multi_threaded;
+    p->try_claim = vrt_try_claim_multi_threaded;
+    p->publish = vrt_publish_multi_threaded;
+}
+
+/* Puts the queue into single-producer mode, with p as its lone producer,
+ * picking up right after the last value that anyone has claimed.  The caller
+ * has to make sure that every claimed value has already been published. */
+static void
+vrt_queue_use_lone_producer(struct vrt_queue *q, struct vrt_producer *p)
+{
+    vrt_value_id  last_id;
+    if (q->published_ids == NULL) {
+        last_id = vrt_queue_get_cursor(q);
+    } else {
+        /* The cursor hasn't moved since we switched to multiple-producer
+         * mode, so bring it up to date before consumers start using it
+         * again. */
+        last_id = vrt_padded_int_get(&q->control->last_claimed_id);
+        vrt_queue_set_cursor(q, last_id);
+        vrt_atomic_store_release(&q->published_ids, NULL);
+    }
+    clog_debug("<%s> Claim values on our own after %d", p->name, last_id);
+    vrt_producer_start_after(p, last_id);
+    vrt_producer_use_single_threaded(p);
+    vrt_atomic_store_release(&q->single_producer, true);
+}
+
+/* Called by a producer of a running queue that's in multiple-producer mode
+ * when it looks like every other producer has detached.  If that's still
+ * true once we hold the topology lock, we switch back to single-producer
+ * mode.  Each detached producer has published everything it claimed, and so
+ * have we (since we're claiming a new batch), so the last value that anyone
+ * has claimed is also the last value that has been published.  Returns
+ * whether we switched. */
+static bool
+vrt_producer_become_lone(struct vrt_queue *q, struct vrt_producer *p)
+{
+    bool  lone;
+    pthread_mutex_lock(&q->topology_lock);
+    lone = (q->active_producer_count == 1 && !q->single_producer);
+    if (lone) {
+        vrt_queue_use_lone_producer(q, p);
+    }
+    pthread_mutex_unlock(&q->topology_lock);
+    return lone;
+}
+
+static void
 vrt_queue_add_producer(struct vrt_queue *q, struct vrt_producer *p)
 {
     clog_debug("[%s] Add producer %s", q->name, p->name);
@@ -293,33 +1064,127 @@ vrt_queue_add_producer(struct vrt_queue *q, struct vrt_producer *p)
     cork_array_append(&q->producers, p);
     p->queue = q;
     p->index = cork_array_size(&q->producers) - 1;
+    q->producer_count++;
+
+    /* A shared queue's producers were counted when it was created, no
+     * matter which processes they live in. */
+    if (q->shared != NULL) {
+        vrt_producer_start_after(p, q->shared->start_id);
+        if (q->shared->producer_count == 1) {
+            vrt_producer_use_single_threaded(p);
+        } else {
+            vrt_producer_use_multi_threaded(p);
+        }
+        return;
+    }
+
+    q->active_producer_count++;
 
     /* Choose the right claim and publish implementations for this
      * producer. */
     if (p->index == 0) {
-        /* If this is the first producer, use faster claim and publish
-         * methods that are optimized for the single-producer case. */
-        p->claim = vrt_claim_single_threaded;
-        p->publish = vrt_publish_single_threaded;
+        vrt_producer_use_single_threaded(p);
     } else {
-        /* Otherwise we need to use slower, but multiple-producer-
-         * capable, implementations of claim and publish. */
-        p->claim = vrt_claim_multi_threaded;
-        p->publish = vrt_publish_multi_threaded;
+        vrt_producer_use_multi_threaded(p);
 
         /* If this is the second producer, then we need to update the
-         * first producer to also use the slower implementations. */
+         * first producer to also use the slower implementations, and start
+         * keeping track of publications slot by slot. */
         if (p->index == 1) {
             struct vrt_producer  *first = cork_array_at(&q->producers, 0);
-            first->claim = vrt_claim_multi_threaded;
-            first->publish = vrt_publish_multi_threaded;
+            vrt_producer_use_multi_threaded(first);
+            vrt_queue_init_published_ids(q);
         }
     }
+}
+
+/* Adds a producer to a running queue.  The caller must hold the topology
+ * lock.  Consumers start counting the new producer right away, but we only
+ * add it to the producers array once it's ready to go.  If we have to wait
+ * for a lone producer, and it doesn't publish its current batch in time, we
+ * stop counting the new producer and return an error. */
+static int
+vrt_queue_attach_producer(struct vrt_queue *q, struct vrt_producer *p)
+{
+    size_t  i;
+    unsigned int  active_count;
+    uint64_t  deadline;
 
+    clog_debug("[%s] Attach producer %s", q->name, p->name);
+    p->queue = q;
+    p->index = cork_array_size(&q->producers);
+    q->producer_count++;
+
+    /* Pairs with the barriers in vrt_producer_enter_lone and
+     * vrt_producer_eof.  We hardly ever attach a producer, so we pay for
+     * both sides. */
+    active_count = q->active_producer_count++;
+    vrt_atomic_heavy_barrier();
+
+    if (active_count == 0) {
+        /* Every other producer has detached, so we've got the queue to
+         * ourselves. */
+        vrt_queue_use_lone_producer(q, p);
+    } else if (q->single_producer) {
+        /* There's a lone producer that doesn't know about us yet.  Once it
+         * has published its current batch, it will wait for us to switch
+         * it over to the multiple-producer implementations. */
+        struct vrt_producer  *lone = NULL;
+        for (i = 0; i < p->index; i++) {
+            struct vrt_producer  *other = cork_array_at(&q->producers, i);
+            if (!other->detached) {
+                lone = other;
+            }
+        }
+        assert(lone != NULL);
+
+        clog_debug("[%s] Wait for %s to publish its batch",
+                   q->name, lone->name);
+        deadline = vrt_now_ns() + VRT_PRODUCER_ATTACH_TIMEOUT;
+        while (vrt_padded_int_get(&q->lone_busy) != 0) {
+            if (deadline != 0 && vrt_now_ns() >= deadline) {
+                /* Back out, and then make sure that the lone producer
+                 * hasn't sent its EOF in the meantime; if it has, some
+                 * consumer might have already counted us while processing
+                 * it.  It's about to publish the EOF, though, so we can just
+                 * keep waiting. */
+                q->producer_count--;
+                q->active_producer_count--;
+                vrt_atomic_heavy_barrier();
+                if (!vrt_atomic_load_relaxed(&lone->sent_eof)) {
+                    cork_error_set_printf
+                        (CORK_UNKNOWN_ERROR,
+                         "Can't attach producer %s to queue %s; "
+                         "%s didn't publish its batch in time",
+                         p->name, q->name, lone->name);
+                    return -1;
+                }
+                q->producer_count++;
+                q->active_producer_count++;
+                vrt_atomic_heavy_barrier();
+                deadline = 0;
+            }
+            sched_yield();
+        }
+        vrt_padded_int_set(&q->control->last_claimed_id,
+                           vrt_queue_get_cursor(q));
+        vrt_queue_init_published_ids(q);
+        vrt_producer_start_after(p, vrt_queue_get_cursor(q));
+        vrt_producer_use_multi_threaded(lone);
+        vrt_producer_use_multi_threaded(p);
+        vrt_atomic_store_release(&q->single_producer, false);
+    } else {
+        /* Our IDs might be a long way behind the queue's by now, so start
+         * from the queue's latest claim. */
+        vrt_producer_start_after
+            (p, vrt_padded_int_get(&q->control->last_claimed_id));
+        vrt_producer_use_multi_threaded(p);
+    }
+    cork_array_append(&q->producers, p);
     return 0;
 }
 
-static int
+static void
 vrt_queue_add_consumer(struct vrt_queue *q, struct vrt_consumer *c)
 {
     clog_debug("[%s] Add consumer %s", q->name, c->name);
@@ -328,26 +1193,370 @@ vrt_queue_add_consumer(struct vrt_queue *q, struct vrt_consumer *c)
     cork_array_append(&q->consumers, c);
     c->queue = q;
     c->index = cork_array_size(&q->consumers) - 1;
-    return 0;
+    vrt_queue_update_gating_cursors(q);
 }
 
-
-/*-----------------------------------------------------------------------
- * Producers
- */
-
-struct vrt_producer *
-vrt_producer_new(const char *name, unsigned int batch_size,
-                 struct vrt_queue *q)
+int
+vrt_queue_start(struct vrt_queue *q)
 {
-    struct vrt_producer  *p;
-    unsigned int  maximum_batch_size;
+    size_t  i;
 
-    p = cork_new(struct vrt_producer);
-    memset(p, 0, sizeof(struct vrt_producer));
+    if (q->started) {
+        return 0;
+    }
+
+    /* (A shared queue's producers might all live in other processes.) */
+    if (CORK_UNLIKELY((q->shared == NULL &&
+                       cork_array_is_empty(&q->producers)) ||
+                      cork_array_is_empty(&q->gating_cursors))) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Queue %s needs at least one producer and one consumer",
+             q->name);
+        return -1;
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        if (CORK_UNLIKELY(c->is_pool && cork_array_is_empty(&c->workers))) {
+            cork_error_set_printf
+                (CORK_UNKNOWN_ERROR,
+                 "Work pool %s in queue %s doesn't have any workers",
+                 c->name, q->name);
+            return -1;
+        }
+    }
+
+    /* Now that the topology can't change, pick the fast paths that it
+     * allows. */
+    q->started = true;
+    q->single_producer = (vrt_queue_producer_count(q) == 1);
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        if (cork_array_size(&c->dependencies) == 1) {
+            c->dependency = cork_array_at(&c->dependencies, 0);
+        }
+    }
+
+    clog_debug("[%s] Start queue with %zu producers and %zu gating cursors",
+               q->name, cork_array_size(&q->producers),
+               cork_array_size(&q->gating_cursors));
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Shared-memory queues
+ */
+
+static size_t
+vrt_shared_round_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/* Points a newly allocated queue at the contents of a shared memory region,
+ * taking ownership of the mapping. */
+static void
+vrt_queue_use_shared(struct vrt_queue *q, struct vrt_memory *mem)
+{
+    struct vrt_shared_header  *header = mem->ptr;
+    q->shared = header;
+    q->shared_memory = *mem;
+    q->control = &header->control;
+    q->last_consumed_id = header->start_id;
+    q->value_slab = (char *) header + header->values_offset;
+    q->value_stride = header->value_stride;
+    if (header->stamps_offset != 0) {
+        q->published_ids = (volatile vrt_value_id *)
+            ((char *) header + header->stamps_offset);
+    }
+    q->active_producer_count = header->producer_count;
+    vrt_queue_update_gating_cursors(q);
+}
+
+struct vrt_queue *
+vrt_queue_new_shared(const char *name, struct vrt_value_type *value_type,
+                     unsigned int value_count, unsigned int producer_count,
+                     unsigned int consumer_count)
+{
+    struct vrt_queue  *q;
+    struct vrt_shared_header  *header;
+    struct vrt_memory  mem;
+    struct vrt_padded_int  *cursors;
+    char  path[256];
+    size_t  stride;
+    size_t  slab_alignment;
+    size_t  offset;
+    unsigned int  i;
+    int  fd = -1;
+
+    if (CORK_UNLIKELY(!vrt_value_type_is_inline(value_type))) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Shared queue %s must store its values inline", name);
+        return NULL;
+    }
+    if (CORK_UNLIKELY(producer_count == 0 || consumer_count == 0)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Queue %s needs at least one producer and one consumer", name);
+        return NULL;
+    }
+
+    /* Lay out the region: the header, then the consumers' cursors, then the
+     * publication stamps, then the values. */
+    value_count = vrt_queue_value_count(value_count);
+    stride = vrt_value_type_stride(value_type, &slab_alignment);
+    offset = vrt_shared_round_up
+        (sizeof(struct vrt_shared_header), CACHE_LINE_SIZE);
+    offset += consumer_count * sizeof(struct vrt_padded_int);
+    if (producer_count > 1) {
+        offset += vrt_shared_round_up
+            (value_count * sizeof(vrt_value_id), CACHE_LINE_SIZE);
+    }
+    offset = vrt_shared_round_up(offset, slab_alignment);
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (CORK_UNLIKELY(fd == -1)) {
+        cork_system_error_set();
+        goto error;
+    }
+    if (CORK_UNLIKELY(ftruncate(fd, offset + value_count * stride) == -1)) {
+        cork_system_error_set();
+        goto error;
+    }
+    ei_check(vrt_memory_map_shared(&mem, fd, offset + value_count * stride));
+    close(fd);
+    fd = -1;
+
+    header = mem.ptr;
+    header->magic = VRT_SHARED_MAGIC;
+    header->version = VRT_SHARED_VERSION;
+    header->value_count = value_count;
+    header->value_size = value_type->value_size;
+    header->value_stride = stride;
+    header->producer_count = producer_count;
+    header->consumer_count = consumer_count;
+    header->start_id = starting_value;
+    header->producers_added = 0;
+    header->consumers_added = 0;
+    header->cursors_offset = vrt_shared_round_up
+        (sizeof(struct vrt_shared_header), CACHE_LINE_SIZE);
+    header->stamps_offset = (producer_count == 1)? 0:
+        header->cursors_offset +
+        consumer_count * sizeof(struct vrt_padded_int);
+    header->values_offset = offset;
+    header->size = mem.size;
+
+    header->control.last_claimed_id.value = starting_value;
+    header->control.cursor.value = starting_value;
+    vrt_eventcount_init_shared(&header->control.published);
+    vrt_eventcount_init_shared(&header->control.consumed);
+    cursors = vrt_shared_cursors(header);
+    for (i = 0; i < consumer_count; i++) {
+        cursors[i].value = starting_value;
+    }
+
+    clog_debug("[%s] Create shared queue %s with %u entries",
+               name, path, value_count);
+    q = vrt_queue_alloc(name, value_type, value_count);
+    q->shared_name = cork_strdup(path);
+    vrt_queue_use_shared(q, &mem);
+    if (q->published_ids != NULL) {
+        vrt_queue_stamp_slots(q, q->published_ids);
+    }
+
+    /* Only let other processes open the queue once it's ready. */
+    vrt_atomic_store_release(&header->ready, 1);
+    return q;
+
+error:
+    if (fd != -1) {
+        close(fd);
+        shm_unlink(path);
+    }
+    return NULL;
+}
+
+struct vrt_queue *
+vrt_queue_open_shared(const char *name, struct vrt_value_type *value_type)
+{
+    struct vrt_queue  *q;
+    struct vrt_shared_header  *header;
+    struct vrt_memory  mem;
+    struct stat  st;
+    char  path[256];
+    size_t  slab_alignment;
+    int  fd;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDWR, 0);
+    if (CORK_UNLIKELY(fd == -1)) {
+        cork_system_error_set();
+        return NULL;
+    }
+    if (CORK_UNLIKELY(fstat(fd, &st) == -1)) {
+        cork_system_error_set();
+        close(fd);
+        return NULL;
+    }
+    if (CORK_UNLIKELY(st.st_size < (off_t) sizeof(struct vrt_shared_header))) {
+        close(fd);
+        goto bad_region;
+    }
+    if (CORK_UNLIKELY(vrt_memory_map_shared(&mem, fd, st.st_size) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    header = mem.ptr;
+    if (CORK_UNLIKELY(!vrt_atomic_load_acquire(&header->ready) ||
+                      header->magic != VRT_SHARED_MAGIC ||
+                      header->version != VRT_SHARED_VERSION ||
+                      header->size != mem.size)) {
+        vrt_memory_free(&mem);
+        goto bad_region;
+    }
+
+    if (CORK_UNLIKELY(!vrt_value_type_is_inline(value_type) ||
+                      header->value_size != value_type->value_size ||
+                      header->value_stride !=
+                      vrt_value_type_stride(value_type, &slab_alignment))) {
+        vrt_memory_free(&mem);
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Value type doesn't match the one in shared queue %s", name);
+        return NULL;
+    }
+
+    clog_debug("[%s] Open shared queue with %u entries",
+               name, header->value_count);
+    q = vrt_queue_alloc(name, value_type, header->value_count);
+    vrt_queue_use_shared(q, &mem);
+    return q;
+
+bad_region:
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR,
+         "%s isn't a shared queue, or hasn't been initialized yet", name);
+    return NULL;
+}
+
+/* Takes one of the producer or consumer slots in a shared queue.  The other
+ * processes using the queue might be taking them at the same time. */
+static int
+vrt_queue_reserve_shared(struct vrt_queue *q, volatile unsigned int *added,
+                         unsigned int count, const char *what,
+                         const char *name, unsigned int *slot)
+{
+    unsigned int  current = vrt_atomic_load_relaxed(added);
+    while (CORK_LIKELY(current < count)) {
+        unsigned int  old = cork_uint_atomic_cas(added, current, current + 1);
+        if (old == current) {
+            *slot = current;
+            return 0;
+        }
+        current = old;
+    }
+
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR,
+         "Can't add %s %s to shared queue %s; it already has all %u of them",
+         what, name, q->name, count);
+    return -1;
+}
+
+/* Returns an error if the queue lives in shared memory, and so can't
+ * support the feature that we're about to add. */
+static int
+vrt_queue_check_not_shared(struct vrt_queue *q, const char *what,
+                           const char *name)
+{
+    if (CORK_UNLIKELY(q->shared != NULL)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Can't add %s %s to shared queue %s",
+             what, name, q->name);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Partitions
+ */
+
+/* Turns a partition key into a tag (see VRT_PARTITION_ALL). */
+static inline uint32_t
+vrt_partition_tag(uint64_t key)
+{
+    return (uint32_t) (vrt_hash_key(key) >> 33) |
+           (VRT_PARTITION_HASH_MASK + 1);
+}
+
+/* Allocates the partition tags once the queue has a partitioned group. */
+static void
+vrt_queue_init_partitions(struct vrt_queue *q)
+{
+    if (q->partitions == NULL) {
+        vrt_memory_alloc(&q->partition_memory,
+                         vrt_queue_size(q) * sizeof(uint32_t),
+                         CACHE_LINE_SIZE, q->memory_flags, q->numa_node);
+        q->partitions = q->partition_memory.ptr;
+    }
+}
+
+/* Resets the partition tag of a value that a producer has just claimed. */
+static inline void
+vrt_queue_clear_partition(struct vrt_queue *q, vrt_value_id id)
+{
+    if (CORK_UNLIKELY(q->partitions != NULL)) {
+        q->partitions[id & q->value_mask] = VRT_PARTITION_ALL;
+    }
+}
+
+/* Fills in the partition tag of a value that a producer is about to publish,
+ * if the queue has a key function. */
+static inline void
+vrt_queue_tag_partition(struct vrt_queue *q, vrt_value_id id)
+{
+    if (CORK_UNLIKELY(q->partition_key != NULL && q->partitions != NULL)) {
+        struct vrt_value  *v = vrt_queue_get(q, id);
+        q->partitions[id & q->value_mask] =
+            (v->special == VRT_VALUE_NONE)?
+            vrt_partition_tag(q->partition_key(v)): VRT_PARTITION_ALL;
+    }
+}
+
+void
+vrt_queue_set_partition_key(struct vrt_queue *q,
+                            uint64_t (*key)(struct vrt_value *value))
+{
+    q->partition_key = key;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Producers
+ */
+
+/* Allocates a new producer, without adding it to its queue. */
+static struct vrt_producer *
+vrt_producer_alloc(const char *name, unsigned int batch_size,
+                   struct vrt_queue *q)
+{
+    struct vrt_producer  *p;
+    unsigned int  maximum_batch_size;
+
+    p = cork_new(struct vrt_producer);
+    memset(p, 0, sizeof(struct vrt_producer));
 
     p->name = cork_strdup(name);
-    ei_check(vrt_queue_add_producer(q, p));
+    p->gating_version = q->gating->version;
 
     if (batch_size == 0) {
         batch_size = DEFAULT_BATCH_SIZE;
@@ -358,8 +1567,7 @@ vrt_producer_new(const char *name, unsigned int batch_size,
     }
     clog_trace("<%s> Batch size is %u", name, batch_size);
 
-    p->last_produced_id = starting_value;
-    p->last_claimed_id = starting_value;
+    vrt_producer_start_after(p, starting_value);
     p->batch_size = batch_size;
     p->yield = NULL;
 
@@ -391,14 +1599,23 @@ vrt_producer_new(const char *name, unsigned int batch_size,
     }
 
     return p;
+}
 
-error:
-    if (p->name != NULL) {
-        cork_strfree(p->name);
+struct vrt_producer *
+vrt_producer_new(const char *name, unsigned int batch_size,
+                 struct vrt_queue *q)
+{
+    struct vrt_producer  *p;
+    unsigned int  slot = 0;
+    rpi_check(vrt_queue_check_not_started(q, "producer", name));
+    if (q->shared != NULL) {
+        rpi_check(vrt_queue_reserve_shared
+                  (q, &q->shared->producers_added, q->shared->producer_count,
+                   "producer", name, &slot));
     }
-
-    cork_delete(struct vrt_producer, p);
-    return NULL;
+    p = vrt_producer_alloc(name, batch_size, q);
+    vrt_queue_add_producer(q, p);
+    return p;
 }
 
 void
@@ -422,7 +1639,7 @@ static int
 vrt_producer_claim_raw(struct vrt_queue *q, struct vrt_producer *p)
 {
     if (p->last_produced_id == p->last_claimed_id) {
-        rii_check(p->claim(q, p));
+        rii_check(vrt_producer_do_claim(q, p));
     }
     p->last_produced_id++;
     clog_trace("<%s> Claimed value %d (%d is available)\n",
@@ -439,17 +1656,76 @@ vrt_producer_claim(struct vrt_producer *p, struct vrt_value **value)
     v = vrt_queue_get(p->queue, p->last_produced_id);
     v->id = p->last_produced_id;
     v->special = VRT_VALUE_NONE;
+    vrt_queue_clear_partition(p->queue, v->id);
+    *value = v;
+    return 0;
+}
+
+/* Like vrt_producer_claim_raw, but gives up with VRT_QUEUE_AGAIN if we'd have
+ * to wait past the deadline for a new batch. */
+static int
+vrt_producer_try_claim_raw(struct vrt_queue *q, struct vrt_producer *p,
+                           uint64_t deadline)
+{
+    if (p->last_produced_id == p->last_claimed_id) {
+        rii_check(vrt_producer_do_try_claim(q, p, deadline));
+    }
+    p->last_produced_id++;
+    clog_trace("<%s> Claimed value %d (%d is available)\n",
+               p->name, p->last_produced_id, p->last_claimed_id);
+    return 0;
+}
+
+static int
+vrt_producer_claim_deadline(struct vrt_producer *p, struct vrt_value **value,
+                            uint64_t deadline)
+{
+    struct vrt_value  *v;
+    rii_check(vrt_producer_try_claim_raw(p->queue, p, deadline));
+    bws_derive_inc(p->claims);
+    v = vrt_queue_get(p->queue, p->last_produced_id);
+    v->id = p->last_produced_id;
+    v->special = VRT_VALUE_NONE;
+    vrt_queue_clear_partition(p->queue, v->id);
     *value = v;
     return 0;
 }
 
 int
-vrt_producer_publish(struct vrt_producer *p)
+vrt_producer_try_claim(struct vrt_producer *p, struct vrt_value **value)
+{
+    return vrt_producer_claim_deadline(p, value, 0);
+}
+
+int
+vrt_producer_claim_until(struct vrt_producer *p, struct vrt_value **value,
+                         uint64_t deadline)
+{
+    return vrt_producer_claim_deadline(p, value, deadline);
+}
+
+void
+vrt_producer_set_publish_interval(struct vrt_producer *p,
+                                  unsigned int interval)
+{
+    clog_debug("<%s> Publish every %u values", p->name, interval);
+    p->publish_interval = interval;
+}
+
+/* Publishes the values that the producer has produced so far, if that
+ * finishes off the current batch, or if enough of them have piled up since
+ * the last time we published. */
+static int
+vrt_producer_publish_produced(struct vrt_producer *p)
 {
-    bws_derive_inc(p->publishes);
     if (p->last_produced_id == p->last_claimed_id) {
         bws_derive_inc(p->published_batches);
-        return p->publish(p->queue, p, p->last_claimed_id);
+        return vrt_producer_do_publish(p->queue, p, p->last_claimed_id);
+    } else if (p->publish_interval != 0 &&
+               (unsigned int) p->last_produced_id -
+               (unsigned int) vrt_producer_find_last_published_id(p) >=
+               p->publish_interval) {
+        return vrt_producer_do_publish(p->queue, p, p->last_produced_id);
     } else {
         clog_trace("<%s> Wait to publish %d until end of batch (at %d)",
                    p->name, p->last_produced_id, p->last_claimed_id);
@@ -457,6 +1733,100 @@ vrt_producer_publish(struct vrt_producer *p)
     }
 }
 
+int
+vrt_producer_publish(struct vrt_producer *p)
+{
+    bws_derive_inc(p->publishes);
+    vrt_queue_tag_partition(p->queue, p->last_produced_id);
+    return vrt_producer_publish_produced(p);
+}
+
+/* Hands out up to count values from the batch that we've already claimed. */
+static int
+vrt_producer_hand_out(struct vrt_producer *p, unsigned int count,
+                      struct vrt_value **values, unsigned int *claimed)
+{
+    struct vrt_queue  *q = p->queue;
+    unsigned int  i;
+    unsigned int  available;
+
+    /* Only hand out values from the batch that we've already claimed. */
+    available = (unsigned int) p->last_claimed_id -
+        (unsigned int) p->last_produced_id;
+    if (count > available) {
+        count = available;
+    }
+
+    for (i = 0; i < count; i++) {
+        vrt_value_id  id = (unsigned int) p->last_produced_id + i + 1;
+        struct vrt_value  *v = vrt_queue_get(q, id);
+        v->id = id;
+        v->special = VRT_VALUE_NONE;
+        vrt_queue_clear_partition(q, id);
+        values[i] = v;
+    }
+
+    p->last_produced_id = (unsigned int) p->last_produced_id + count;
+    bws_derive_add(p->claims, count);
+    clog_trace("<%s> Claimed values %d-%d (%d is available)\n",
+               p->name, values[0]->id, p->last_produced_id,
+               p->last_claimed_id);
+    *claimed = count;
+    return 0;
+}
+
+int
+vrt_producer_claim_many(struct vrt_producer *p, unsigned int count,
+                        struct vrt_value **values, unsigned int *claimed)
+{
+    if (CORK_UNLIKELY(count == 0)) {
+        *claimed = 0;
+        return 0;
+    }
+
+    if (p->last_produced_id == p->last_claimed_id) {
+        rii_check(vrt_producer_do_claim(p->queue, p));
+    }
+    return vrt_producer_hand_out(p, count, values, claimed);
+}
+
+int
+vrt_producer_try_claim_many(struct vrt_producer *p, unsigned int count,
+                            struct vrt_value **values, unsigned int *claimed)
+{
+    if (CORK_UNLIKELY(count == 0)) {
+        *claimed = 0;
+        return 0;
+    }
+
+    if (p->last_produced_id == p->last_claimed_id) {
+        rii_check(vrt_producer_do_try_claim(p->queue, p, 0));
+    }
+    return vrt_producer_hand_out(p, count, values, claimed);
+}
+
+int
+vrt_producer_publish_many(struct vrt_producer *p, unsigned int count)
+{
+    unsigned int  i;
+    bws_derive_add(p->publishes, count);
+    for (i = 0; i < count; i++) {
+        vrt_queue_tag_partition
+            (p->queue, (unsigned int) p->last_produced_id - i);
+    }
+    return vrt_producer_publish_produced(p);
+}
+
+void
+vrt_producer_set_partition(struct vrt_producer *p, struct vrt_value *value,
+                           uint64_t key)
+{
+    struct vrt_queue  *q = p->queue;
+    if (q->partitions != NULL) {
+        q->partitions[value->id & q->value_mask] = vrt_partition_tag(key);
+    }
+}
+
 int
 vrt_producer_skip(struct vrt_producer *p)
 {
@@ -465,9 +1835,39 @@ vrt_producer_skip(struct vrt_producer *p)
     clog_trace("<%s> Skip %d", p->name, p->last_produced_id);
     v = vrt_queue_get(p->queue, p->last_produced_id);
     v->special = VRT_VALUE_HOLE;
+    vrt_queue_clear_partition(p->queue, p->last_produced_id);
     return vrt_producer_publish(p);
 }
 
+/* Fills in any values that we've claimed but not produced with holes, and
+ * then publishes the whole chunk. */
+static int
+vrt_producer_publish_claimed(struct vrt_producer *p)
+{
+    /* If we've claimed more value than we've produced, fill in the
+     * remainder with holes. */
+    if (vrt_mod_lt(p->last_produced_id, p->last_claimed_id)) {
+        unsigned int  i;
+        unsigned int  hole_count = (unsigned int) p->last_claimed_id -
+            (unsigned int) p->last_produced_id;
+        clog_trace("<%s> Holes %d-%d",
+                   p->name, p->last_produced_id + 1, p->last_claimed_id);
+        for (i = 1; i <= hole_count; i++) {
+            vrt_value_id  id = (unsigned int) p->last_produced_id + i;
+            struct vrt_value  *v = vrt_queue_get(p->queue, id);
+            v->id = id;
+            v->special = VRT_VALUE_HOLE;
+            vrt_queue_clear_partition(p->queue, id);
+            bws_derive_inc(p->flushed_holes);
+        }
+        p->last_produced_id = p->last_claimed_id;
+    }
+
+    /* Then publish the whole chunk. */
+    bws_derive_inc(p->published_batches);
+    return vrt_producer_do_publish(p->queue, p, p->last_claimed_id);
+}
+
 int
 vrt_producer_flush(struct vrt_producer *p)
 {
@@ -485,26 +1885,33 @@ vrt_producer_flush(struct vrt_producer *p)
     clog_trace("<%s> Flush %d", p->name, p->last_produced_id);
     v = vrt_queue_get(p->queue, p->last_produced_id);
     v->special = VRT_VALUE_FLUSH;
+    vrt_queue_clear_partition(p->queue, p->last_produced_id);
+    return vrt_producer_publish_claimed(p);
+}
 
-    /* If we've claimed more value than we've produced, fill in the
-     * remainder with holes. */
-    if (vrt_mod_lt(p->last_produced_id, p->last_claimed_id)) {
-        vrt_value_id  i;
-        clog_trace("<%s> Holes %d-%d",
-                   p->name, p->last_produced_id + 1, p->last_claimed_id);
-        for (i = p->last_produced_id + 1;
-             vrt_mod_le(i, p->last_claimed_id); i++) {
-            struct vrt_value  *v = vrt_queue_get(p->queue, i);
-            v->id = i;
-            v->special = VRT_VALUE_HOLE;
-            bws_derive_inc(p->flushed_holes);
-        }
-        p->last_produced_id = p->last_claimed_id;
+int
+vrt_producer_publish_batch(struct vrt_producer *p)
+{
+    if (p->last_produced_id == p->last_claimed_id) {
+        /* Either we haven't produced anything since the last publish, or
+         * we've produced exactly one batch's worth, in which case
+         * vrt_producer_publish has already published it. */
+        return 0;
     }
+    clog_trace("<%s> Publish partial batch %d", p->name, p->last_produced_id);
+    return vrt_producer_publish_claimed(p);
+}
 
-    /* Then publish the whole chunk. */
-    bws_derive_inc(p->published_batches);
-    return p->publish(p->queue, p, p->last_claimed_id);
+int
+vrt_producer_publish_partial(struct vrt_producer *p)
+{
+    if (p->last_produced_id == vrt_producer_find_last_published_id(p)) {
+        /* We haven't produced anything since the last publish. */
+        return 0;
+    }
+    clog_trace("<%s> Publish values through %d",
+               p->name, p->last_produced_id);
+    return vrt_producer_do_publish(p->queue, p, p->last_produced_id);
 }
 
 int
@@ -516,28 +1923,124 @@ vrt_producer_eof(struct vrt_producer *p)
     v = vrt_queue_get(p->queue, p->last_produced_id);
     v->id = p->last_produced_id;
     v->special = VRT_VALUE_EOF;
+    vrt_queue_clear_partition(p->queue, p->last_produced_id);
+
+    /* Let anyone attaching to the queue know about the EOF before any
+     * consumer can see it.  The barrier pairs with the one in
+     * vrt_queue_attach_producer: either the new producer sees our EOF, or
+     * consumers see the new producer by the time they see our EOF. */
+    p->eof_id = p->last_produced_id;
+    vrt_atomic_store_relaxed(&p->sent_eof, 1);
+    vrt_atomic_light_barrier();
+
     rii_check(vrt_producer_publish(p));
     return vrt_producer_flush(p);
 }
 
+int
+vrt_producer_try_eof(struct vrt_producer *p)
+{
+    /* The only part of vrt_producer_eof that can block is claiming a new
+     * batch for the EOF itself.  (Flushing only ever uses a value from a
+     * batch that we've already claimed.)  So claim that batch first, without
+     * producing anything from it. */
+    if (p->last_produced_id == p->last_claimed_id) {
+        rii_check(vrt_producer_do_try_claim(p->queue, p, 0));
+    }
+    return vrt_producer_eof(p);
+}
 
-/*-----------------------------------------------------------------------
- * Consumers
- */
-
-struct vrt_consumer *
-vrt_consumer_new(const char *name, struct vrt_queue *q)
+struct vrt_producer *
+vrt_producer_attach(const char *name, unsigned int batch_size,
+                    struct vrt_queue *q)
 {
-    struct vrt_consumer  *c = cork_new(struct vrt_consumer);
+    struct vrt_producer  *p;
+    size_t  i;
+    bool  finished = true;
+
+    if (!q->started) {
+        return vrt_producer_new(name, batch_size, q);
+    }
+    rpi_check(vrt_queue_check_not_shared(q, "producer", name));
+
+    p = vrt_producer_alloc(name, batch_size, q);
+    pthread_mutex_lock(&q->topology_lock);
+    if (CORK_UNLIKELY(vrt_queue_attach_producer(q, p) != 0)) {
+        pthread_mutex_unlock(&q->topology_lock);
+        vrt_producer_free(p);
+        return NULL;
+    }
+    for (i = 0; i < p->index; i++) {
+        struct vrt_producer  *other = cork_array_at(&q->producers, i);
+        if (!vrt_atomic_load_relaxed(&other->sent_eof)) {
+            finished = false;
+        }
+    }
+    pthread_mutex_unlock(&q->topology_lock);
+
+    if (CORK_UNLIKELY(finished)) {
+        /* Some consumers might have already seen every EOF that they're
+         * waiting for.  The rest are now waiting for ours, too. */
+        rpi_check(vrt_producer_detach(p));
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Can't attach producer %s to queue %s; "
+             "every other producer has finished", name, q->name);
+        return NULL;
+    }
+    return p;
+}
+
+int
+vrt_producer_detach(struct vrt_producer *p)
+{
+    struct vrt_queue  *q = p->queue;
+    if (CORK_UNLIKELY(q->shared != NULL)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Producer %s can't be detached from shared queue %s",
+             p->name, q->name);
+        return -1;
+    }
+    if (CORK_UNLIKELY(p->detached)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Producer %s has already detached from queue %s",
+             p->name, q->name);
+        return -1;
+    }
+
+    rii_check(vrt_producer_eof(p));
+    pthread_mutex_lock(&q->topology_lock);
+    clog_debug("[%s] Detach producer %s", q->name, p->name);
+    p->detached = true;
+    q->active_producer_count--;
+    pthread_mutex_unlock(&q->topology_lock);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Consumers
+ */
+
+/* Allocates a new consumer, without adding it to its queue. */
+static struct vrt_consumer *
+vrt_consumer_alloc(const char *name, struct vrt_queue *q)
+{
+    struct vrt_consumer  *c = cork_new(struct vrt_consumer);
     memset(c, 0, sizeof(struct vrt_consumer));
     c->name = cork_strdup(name);
     cork_array_init(&c->dependencies);
+    cork_array_init(&c->workers);
 
-    ei_check(vrt_queue_add_consumer(q, c));
-    c->cursor.value = starting_value;
+    c->cursor = &c->cursor_storage;
+    c->cursor->value = starting_value;
     c->last_available_id = starting_value;
     c->current_id = starting_value;
     c->eof_count = 0;
+    c->eventfd = -1;
+    c->armed = 0;
 
     if (q->ctx == NULL) {
         c->consumed = &dummy_derive;
@@ -547,6 +2050,9 @@ vrt_consumer_new(const char *name, struct vrt_queue *q)
         c->received_batches = &dummy_derive;
         c->values = &dummy_derive;
         c->yields = &dummy_derive;
+        c->notifications = &dummy_derive;
+        c->skipped = &dummy_derive;
+        c->commits = &dummy_derive;
     } else {
         struct bws_plugin  *plugin = bws_plugin_new(q->ctx, q->name, c->name);
         c->consumed =
@@ -563,18 +2069,113 @@ vrt_consumer_new(const char *name, struct vrt_queue *q)
             bws_derive_new(plugin, "total_objects", "values");
         c->yields =
             bws_derive_new(plugin, "contextswitch", NULL);
+        c->notifications =
+            bws_derive_new(plugin, "total_objects", "notifications");
+        c->skipped =
+            bws_derive_new(plugin, "total_objects", "skipped");
+        c->commits =
+            bws_derive_new(plugin, "total_objects", "commits");
     }
 
     return c;
+}
 
-error:
-    if (c->name != NULL) {
-        cork_strfree(c->name);
+struct vrt_consumer *
+vrt_consumer_new(const char *name, struct vrt_queue *q)
+{
+    struct vrt_consumer  *c;
+    unsigned int  slot = 0;
+    rpi_check(vrt_queue_check_not_started(q, "consumer", name));
+    if (q->shared != NULL) {
+        rpi_check(vrt_queue_reserve_shared
+                  (q, &q->shared->consumers_added, q->shared->consumer_count,
+                   "consumer", name, &slot));
     }
+    c = vrt_consumer_alloc(name, q);
+    if (q->shared != NULL) {
+        /* Our cursor lives in the shared region, where it has been holding
+         * back the queue's producers since the queue was created. */
+        c->cursor = &vrt_shared_cursors(q->shared)[slot];
+        c->last_available_id = q->shared->start_id;
+        c->current_id = q->shared->start_id;
+    }
+    vrt_queue_add_consumer(q, c);
+    return c;
+}
 
-    cork_array_done(&c->dependencies);
-    cork_delete(struct vrt_consumer, c);
-    return NULL;
+/* Removes a consumer from an array that doesn't own its elements, keeping
+ * the rest of them in order. */
+static void
+vrt_consumer_array_remove(vrt_consumer_array *array, struct vrt_consumer *c)
+{
+    size_t  i;
+    vrt_consumer_array  kept;
+
+    cork_array_init(&kept);
+    for (i = 0; i < cork_array_size(array); i++) {
+        struct vrt_consumer  *other = cork_array_at(array, i);
+        if (other != c) {
+            cork_array_append(&kept, other);
+        }
+    }
+    cork_array_done(array);
+    *array = kept;
+}
+
+int
+vrt_consumer_remove(struct vrt_consumer *c)
+{
+    struct vrt_queue  *q = c->queue;
+    size_t  i;
+    size_t  j;
+
+    rii_check(vrt_queue_check_not_started(q, "consumer", c->name));
+    if (CORK_UNLIKELY(c->group != NULL || c->pool != NULL || c->is_pool)) {
+        goto in_use;
+    }
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *other = cork_array_at(&q->consumers, i);
+        for (j = 0; j < cork_array_size(&other->dependencies); j++) {
+            if (cork_array_at(&other->dependencies, j) == c) {
+                goto in_use;
+            }
+        }
+    }
+
+    /* A shared queue's consumer can only give back its slot if no one has
+     * taken a later one; its cursor is still where it was when the queue
+     * was created, so whoever takes the slot next can use it as is. */
+    if (q->shared != NULL) {
+        unsigned int  slot = c->cursor - vrt_shared_cursors(q->shared);
+        if (CORK_UNLIKELY(cork_uint_atomic_cas
+                          (&q->shared->consumers_added, slot + 1, slot)
+                          != slot + 1)) {
+            cork_error_set_printf
+                (CORK_UNKNOWN_ERROR,
+                 "Consumer %s can't be removed from shared queue %s; "
+                 "another consumer has been added since", c->name, q->name);
+            return -1;
+        }
+    }
+
+    clog_debug("[%s] Remove consumer %s", q->name, c->name);
+    if (c->eventfd != -1) {
+        vrt_consumer_array_remove(&q->eventfd_consumers, c);
+    }
+    vrt_consumer_array_remove(&q->consumers, c);
+    for (i = c->index; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *next = cork_array_at(&q->consumers, i);
+        next->index = i;
+    }
+    vrt_consumer_free(c);
+    vrt_queue_update_gating_cursors(q);
+    return 0;
+
+in_use:
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR,
+         "Consumer %s can't be removed from queue %s", c->name, q->name);
+    return -1;
 }
 
 void
@@ -588,25 +2189,254 @@ vrt_consumer_free(struct vrt_consumer *c)
         vrt_yield_strategy_free(c->yield);
     }
 
+    if (c->eventfd != -1) {
+        close(c->eventfd);
+    }
+
     cork_array_done(&c->dependencies);
+    cork_array_done(&c->workers);
     cork_delete(struct vrt_consumer, c);
 }
 
+/* Starts a consumer right after the given value. */
+static void
+vrt_consumer_start_after(struct vrt_consumer *c, vrt_value_id id)
+{
+    vrt_consumer_set_cursor(c, id);
+    c->last_available_id = id;
+    c->current_id = id;
+}
+
+/* Returns the last value that a newly attached consumer can skip.  Every
+ * gating cursor has moved past the last consumed value, so every value up
+ * through it has been published. */
+#define vrt_queue_find_attach_id(q) \
+    (vrt_queue_find_last_published_id \
+     ((q), vrt_queue_find_last_consumed_id((q), NULL)))
+
+struct vrt_consumer *
+vrt_consumer_attach(const char *name, struct vrt_queue *q)
+{
+    struct vrt_consumer  *c;
+    vrt_value_id  start_id;
+    size_t  i;
+    unsigned int  eof_count = 0;
+
+    if (!q->started) {
+        return vrt_consumer_new(name, q);
+    }
+    rpi_check(vrt_queue_check_not_shared(q, "consumer", name));
+
+    c = vrt_consumer_alloc(name, q);
+    pthread_mutex_lock(&q->topology_lock);
+    clog_debug("[%s] Attach consumer %s", q->name, c->name);
+    cork_array_append(&q->consumers, c);
+    c->queue = q;
+    c->index = cork_array_size(&q->consumers) - 1;
+
+    /* Producers might still be working from a minimum that they calculated
+     * before they could see our cursor.  So once they can see it, we move
+     * our starting point up to the last value that's been published since
+     * then.  Anything a producer has claimed against the old set of gating
+     * cursors will be at least a full lap ahead of that. */
+    vrt_consumer_start_after(c, vrt_queue_find_attach_id(q));
+    vrt_queue_update_gating_cursors(q);
+    vrt_atomic_heavy_barrier();
+    start_id = vrt_queue_find_attach_id(q);
+    vrt_consumer_start_after(c, start_id);
+    clog_debug("<%s> Start after value %d", c->name, start_id);
+
+    /* We won't see the EOFs that were published before we attached, so
+     * count them now. */
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        if (vrt_atomic_load_acquire(&p->sent_eof) &&
+            vrt_mod_le(p->eof_id, start_id)) {
+            eof_count++;
+        }
+    }
+    c->eof_count = eof_count;
+
+    if (CORK_UNLIKELY(eof_count == cork_array_size(&q->producers))) {
+        c->detached = true;
+        vrt_queue_update_gating_cursors(q);
+        pthread_mutex_unlock(&q->topology_lock);
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Can't attach consumer %s to queue %s; "
+             "every producer has finished", name, q->name);
+        return NULL;
+    }
+
+    pthread_mutex_unlock(&q->topology_lock);
+    return c;
+}
+
+int
+vrt_consumer_detach(struct vrt_consumer *c)
+{
+    struct vrt_queue  *q = c->queue;
+    if (CORK_UNLIKELY(c->detached || c->group != NULL ||
+                      c->pool != NULL || c->is_pool || q->shared != NULL)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Consumer %s can't be detached from queue %s",
+             c->name, q->name);
+        return -1;
+    }
+
+    pthread_mutex_lock(&q->topology_lock);
+    if (CORK_UNLIKELY(c->is_dependency)) {
+        pthread_mutex_unlock(&q->topology_lock);
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Consumer %s can't be detached from queue %s; "
+             "another consumer depends on it", c->name, q->name);
+        return -1;
+    }
+
+    c->detached = true;
+    vrt_queue_collect_gating_cursors(q);
+    if (CORK_UNLIKELY(q->started && cork_array_is_empty(&q->gating_cursors))) {
+        c->detached = false;
+        vrt_queue_collect_gating_cursors(q);
+        pthread_mutex_unlock(&q->topology_lock);
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Consumer %s can't be detached from queue %s; "
+             "producers would have no one to wait for", c->name, q->name);
+        return -1;
+    }
+
+    clog_debug("[%s] Detach consumer %s", q->name, c->name);
+    vrt_queue_publish_gating_set(q);
+    pthread_mutex_unlock(&q->topology_lock);
+
+    /* Any producers waiting for us to catch up can stop waiting. */
+    vrt_queue_notify(q, &q->control->consumed);
+    return 0;
+}
+
+int
+vrt_consumer_add_dependency(struct vrt_consumer *c1, struct vrt_consumer *c2)
+{
+    rii_check(vrt_queue_check_not_started(c1->queue, "dependency", c2->name));
+    rii_check(vrt_queue_check_not_shared(c1->queue, "dependency", c2->name));
+    cork_array_append(&c1->dependencies, c2);
+    vrt_queue_update_gating_cursors(c1->queue);
+    return 0;
+}
+
+/* Once the queue has been started, a consumer with a single dependency can
+ * read that dependency's cursor directly. */
 #define vrt_consumer_find_last_dependent_id(c) \
-    (vrt_minimum_cursor(&(c)->dependencies))
+    (((c)->dependency != NULL)? \
+     vrt_consumer_get_cursor((c)->dependency): \
+     vrt_minimum_cursor(&(c)->dependencies))
+
+static void
+vrt_consumer_group_update_cursor(struct vrt_consumer_group *g);
+
+static void
+vrt_consumer_pool_update_cursor(struct vrt_consumer *pool);
+
+/* Tells the world that the consumer has finished processing every value up
+ * through last_consumed_id. */
+static inline void
+vrt_consumer_signal_cursor(struct vrt_consumer *c,
+                           vrt_value_id last_consumed_id)
+{
+    vrt_consumer_set_cursor(c, last_consumed_id);
+    if (c->group != NULL) {
+        vrt_consumer_group_update_cursor(c->group);
+    }
+    if (c->pool != NULL) {
+        vrt_consumer_pool_update_cursor(c->pool);
+    }
+    vrt_queue_notify(c->queue, &c->queue->control->consumed);
+}
+
+void
+vrt_consumer_set_commit_interval(struct vrt_consumer *c, unsigned int count,
+                                 uint64_t ns)
+{
+    clog_debug("<%s> Commit every %u values or %" PRIu64 " ns",
+               c->name, count, ns);
+    c->commit_count = count;
+    c->commit_ns = ns;
+    c->commit_deadline = (ns == 0)? 0: vrt_now_ns() + ns;
+}
+
+void
+vrt_consumer_set_commit_batches(struct vrt_consumer *c, bool commit)
+{
+    c->commit_batches = commit;
+}
+
+/* Tells the world how far we've gotten before we've run out of available
+ * values, if we haven't already. */
+static void
+vrt_consumer_commit(struct vrt_consumer *c, vrt_value_id last_consumed_id)
+{
+    if (vrt_atomic_load_relaxed(&c->cursor->value) != last_consumed_id) {
+        clog_trace("<%s> Commit consumption of %d",
+                   c->name, last_consumed_id);
+        bws_derive_inc(c->commits);
+        vrt_consumer_signal_cursor(c, last_consumed_id);
+    }
+}
+
+/* Returns whether a consumer's commit interval has run out.  The caller has
+ * finished processing every value up through last_consumed_id. */
+static bool
+vrt_consumer_commit_is_due(struct vrt_consumer *c,
+                           vrt_value_id last_consumed_id)
+{
+    vrt_value_id  cursor = vrt_atomic_load_relaxed(&c->cursor->value);
+    if (c->commit_count != 0 &&
+        (unsigned int) last_consumed_id - (unsigned int) cursor >=
+        c->commit_count) {
+        return true;
+    }
+    if (c->commit_ns != 0) {
+        uint64_t  now = vrt_now_ns();
+        if (now >= c->commit_deadline) {
+            c->commit_deadline = now + c->commit_ns;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether the consumer has a commit interval that we have to check while it
+ * still has values available. */
+#define vrt_consumer_commits_periodically(c) \
+    (CORK_UNLIKELY((c)->commit_count != 0 || (c)->commit_ns != 0))
 
 /* Retrieves the next value from the consumer's queue.  When this
  * returns c->current_id will be the ID of the next value.  You can
- * retrieve the value using vrt_queue_get. */
+ * retrieve the value using vrt_queue_get.  If there isn't a value available
+ * before the deadline, we return VRT_QUEUE_AGAIN and leave c->current_id
+ * alone, so that the caller can try again later. */
 static int
-vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c)
+vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c,
+                      uint64_t deadline)
 {
     /* We've just finished processing the current_id'th value. */
-    vrt_value_id  last_consumed_id = c->current_id++;
+    vrt_value_id  last_consumed_id = c->current_id;
+    vrt_value_id  next_id = (unsigned int) last_consumed_id + 1;
+    vrt_value_id  last_available_id;
+    bool  first = true;
+    unsigned int  key = 0;
 
     /* If we know there are values available that we haven't yet
      * consumed, go ahead and return one. */
-    if (vrt_mod_le(c->current_id, c->last_available_id)) {
+    if (vrt_mod_le(next_id, c->last_available_id)) {
+        if (vrt_consumer_commits_periodically(c) &&
+            vrt_consumer_commit_is_due(c, last_consumed_id)) {
+            vrt_consumer_commit(c, last_consumed_id);
+        }
+        c->current_id = next_id;
         clog_trace("<%s> Next value is %d (already available)",
                    c->name, c->current_id);
         bws_derive_inc(c->consumed);
@@ -614,36 +2444,42 @@ vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c)
     }
 
     /* We've run out of values that we know can been processed.  Notify
-     * the world how much we've processed so far. */
-    clog_debug("<%s> Signal consumption of %d", c->name, last_consumed_id);
-    vrt_consumer_set_cursor(c, last_consumed_id);
+     * the world how much we've processed so far.  (If an earlier call gave
+     * up waiting, we've already done this.) */
+    if (vrt_atomic_load_relaxed(&c->cursor->value) != last_consumed_id) {
+        clog_debug("<%s> Signal consumption of %d",
+                   c->name, last_consumed_id);
+        vrt_consumer_signal_cursor(c, last_consumed_id);
+    }
+    if (c->commit_ns != 0) {
+        c->commit_deadline = vrt_now_ns() + c->commit_ns;
+    }
 
     /* Check to see if there are any more values that we can process. */
     if (cork_array_is_empty(&c->dependencies)) {
-        bool  first = true;
-        vrt_value_id  last_available_id;
-        clog_debug("<%s> Wait for value %d", c->name, c->current_id);
+        clog_debug("<%s> Wait for value %d", c->name, next_id);
 
         /* If we don't have any dependencies check the queue itself to see how
          * many values have been published. */
-        last_available_id = vrt_queue_get_cursor(q);
+        last_available_id =
+            vrt_queue_find_last_published_id(q, last_consumed_id);
         while (vrt_mod_le(last_available_id, last_consumed_id)) {
             clog_trace("<%s> Last available value is %d (wait)",
                        c->name, last_available_id);
+            if (vrt_deadline_passed(deadline)) {
+                return VRT_QUEUE_AGAIN;
+            }
             bws_derive_inc(c->yields);
-            rii_check(vrt_yield_strategy_yield
-                      (c->yield, first, q->name, c->name));
+            rii_check(vrt_yield_strategy_wait
+                      (c->yield, first, &q->control->published, &key, deadline,
+                       q->name, c->name));
             first = false;
-            last_available_id = vrt_queue_get_cursor(q);
+            last_available_id =
+                vrt_queue_find_last_published_id(q, last_consumed_id);
         }
-        c->last_available_id = last_available_id;
-        clog_debug("<%s> Last available value is %d",
-                   c->name, last_available_id);
     } else {
-        bool  first = true;
-        vrt_value_id  last_available_id;
         clog_debug("<%s> Wait for value %d from dependencies",
-                   c->name, c->current_id);
+                   c->name, next_id);
 
         /* If there are dependencies we can only process what they've *all*
          * finished processing. */
@@ -651,32 +2487,203 @@ vrt_consumer_next_raw(struct vrt_queue *q, struct vrt_consumer *c)
         while (vrt_mod_le(last_available_id, last_consumed_id)) {
             clog_trace("<%s> Last available value is %d (wait)",
                        c->name, last_available_id);
+            if (vrt_deadline_passed(deadline)) {
+                return VRT_QUEUE_AGAIN;
+            }
             bws_derive_inc(c->yields);
-            rii_check(vrt_yield_strategy_yield
-                      (c->yield, first, q->name, c->name));
+            rii_check(vrt_yield_strategy_wait
+                      (c->yield, first, &q->control->consumed, &key, deadline,
+                       q->name, c->name));
             first = false;
             last_available_id = vrt_consumer_find_last_dependent_id(c);
         }
-        c->last_available_id = last_available_id;
-        clog_debug("<%s> Last available value is %d",
-                   c->name, last_available_id);
     }
 
+    c->last_available_id = last_available_id;
+    clog_debug("<%s> Last available value is %d", c->name, last_available_id);
     bws_derive_inc(c->received_batches);
 
     /* Once we fall through to here, we know that there are additional
      * values that we can process. */
+    c->current_id = next_id;
     clog_trace("<%s> Next value is %d", c->name, c->current_id);
     return 0;
 }
 
-int
-vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
+/* Returns the last value that a work pool's workers can process. */
+static inline vrt_value_id
+vrt_consumer_pool_find_last_available_id(struct vrt_consumer *pool,
+                                         vrt_value_id work_id)
+{
+    if (cork_array_is_empty(&pool->dependencies)) {
+        return vrt_queue_find_last_published_id(pool->queue, work_id);
+    } else {
+        return vrt_consumer_find_last_dependent_id(pool);
+    }
+}
+
+/* Returns whether every producer has sent an EOF to a work pool. */
+#define vrt_consumer_pool_is_finished(pool) \
+    (vrt_atomic_load_relaxed(&(pool)->eof_count) == \
+     vrt_queue_producer_count((pool)->queue))
+
+/* The work pool version of vrt_consumer_next_raw.  Instead of moving through
+ * every value in the queue, a worker claims the next value that hasn't been
+ * handed to any of the pool's other workers.  We only claim values that we
+ * know are available, so we never have to give up a claim if we run out of
+ * time.  When this returns c->current_id will be the ID of the claimed value.
+ *
+ * A worker's cursor is the last value that the pool had handed out the last
+ * time that the worker was between values.  Every value up through that one
+ * was claimed by some worker, and we've finished all of ours; any other
+ * worker that's still busy with one of them has an earlier cursor.  So the
+ * smallest of the workers' cursors is a safe cursor for the whole pool. */
+static int
+vrt_worker_next_raw(struct vrt_queue *q, struct vrt_consumer *c,
+                    uint64_t deadline)
+{
+    struct vrt_consumer  *pool = c->pool;
+    struct vrt_eventcount  *ev = vrt_consumer_wakeup_event(c);
+    bool  first = true;
+    unsigned int  key = 0;
+
+    do {
+        vrt_value_id  work_id = vrt_atomic_load_acquire(&pool->work_id.value);
+        vrt_value_id  next_id = (unsigned int) work_id + 1;
+        vrt_value_id  last_available_id;
+
+        /* If we know the next value is available, try to claim it.  If some
+         * other worker beats us to it, try again with the one after that. */
+        if (vrt_mod_le(next_id, c->last_available_id)) {
+            /* We're between values, so the pool's work_id is a safe cursor
+             * for us, just like below. */
+            if (CORK_UNLIKELY(c->commit_count != 0) &&
+                (unsigned int) work_id -
+                (unsigned int) vrt_atomic_load_relaxed(&c->cursor->value) >=
+                c->commit_count) {
+                vrt_consumer_commit(c, work_id);
+            }
+            if (cork_int_atomic_cas(&pool->work_id.value, work_id, next_id)
+                    == work_id) {
+                c->current_id = next_id;
+                clog_trace("<%s> Claimed value %d from pool %s",
+                           c->name, c->current_id, pool->name);
+                bws_derive_inc(c->consumed);
+                return 0;
+            }
+            continue;
+        }
+
+        /* We've run out of values that we know can be processed.  Notify the
+         * world how much we've processed so far. */
+        if (vrt_atomic_load_relaxed(&c->cursor->value) != work_id) {
+            clog_debug("<%s> Signal consumption of %d", c->name, work_id);
+            vrt_consumer_signal_cursor(c, work_id);
+        }
+
+        last_available_id =
+            vrt_consumer_pool_find_last_available_id(pool, work_id);
+        if (vrt_mod_lt(work_id, last_available_id)) {
+            clog_debug("<%s> Last available value is %d",
+                       c->name, last_available_id);
+            c->last_available_id = last_available_id;
+            bws_derive_inc(c->received_batches);
+            continue;
+        }
+
+        /* If another worker has already seen the last EOF, there won't be
+         * anything else to process. */
+        if (vrt_consumer_pool_is_finished(pool)) {
+            return VRT_QUEUE_EOF;
+        }
+
+        clog_trace("<%s> Last available value is %d (wait)",
+                   c->name, last_available_id);
+        if (vrt_deadline_passed(deadline)) {
+            return VRT_QUEUE_AGAIN;
+        }
+        bws_derive_inc(c->yields);
+        rii_check(vrt_yield_strategy_wait
+                  (c->yield, first, ev, &key, deadline, q->name, c->name));
+        first = false;
+    } while (true);
+}
+
+static int
+vrt_worker_next_deadline(struct vrt_consumer *c, struct vrt_value **value,
+                         uint64_t deadline)
 {
+    struct vrt_consumer  *pool = c->pool;
+    struct vrt_queue  *q = c->queue;
+
     do {
         unsigned int  producer_count;
+        unsigned int  eof_count;
         struct vrt_value  *v;
-        rii_check(vrt_consumer_next_raw(c->queue, c));
+        rii_check(vrt_worker_next_raw(q, c, deadline));
+        v = vrt_queue_get(q, c->current_id);
+
+        switch (v->special) {
+            case VRT_VALUE_NONE:
+                bws_derive_inc(c->values);
+                *value = v;
+                return 0;
+
+            case VRT_VALUE_EOF:
+                /* Each EOF only goes to one worker, so the pool as a whole
+                 * keeps track of how many we've seen. */
+                bws_derive_inc(c->eofs);
+                producer_count = vrt_queue_producer_count(q);
+                eof_count = cork_uint_atomic_add(&pool->eof_count, 1);
+                clog_debug("<%s> Detected EOF (%u of %u) at value %d",
+                           c->name, eof_count, producer_count,
+                           c->current_id);
+
+                if (eof_count == producer_count) {
+                    /* Wake up any other workers that are waiting for
+                     * values, so that they see the EOF too. */
+                    vrt_consumer_signal_cursor(c, c->current_id);
+                    vrt_queue_notify(q, &q->control->published);
+                    return VRT_QUEUE_EOF;
+                } else {
+                    break;
+                }
+
+            case VRT_VALUE_HOLE:
+                bws_derive_inc(c->holes);
+                break;
+
+            case VRT_VALUE_FLUSH:
+                bws_derive_inc(c->flushes);
+                return VRT_QUEUE_FLUSH;
+
+            default:
+                cork_unreachable();
+        }
+    } while (true);
+}
+
+static int
+vrt_consumer_next_deadline(struct vrt_consumer *c, struct vrt_value **value,
+                           uint64_t deadline)
+{
+    if (c->pool != NULL) {
+        return vrt_worker_next_deadline(c, value, deadline);
+    }
+
+    do {
+        unsigned int  producer_count;
+        struct vrt_value  *v;
+        rii_check(vrt_consumer_next_raw(c->queue, c, deadline));
+
+        /* Skip over any values that belong to other members of our
+         * partitioned group, without touching the values themselves. */
+        if (c->partition_count != 0 &&
+            !vrt_consumer_owns_value(c, c->current_id)) {
+            bws_derive_inc(c->skipped);
+            continue;
+        }
+
         v = vrt_queue_get(c->queue, c->current_id);
 
         switch (v->special) {
@@ -687,7 +2694,7 @@ vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
 
             case VRT_VALUE_EOF:
                 bws_derive_inc(c->eofs);
-                producer_count = cork_array_size(&c->queue->producers);
+                producer_count = vrt_queue_producer_count(c->queue);
                 c->eof_count++;
                 clog_debug("<%s> Detected EOF (%u of %u) at value %d",
                            c->name, c->eof_count, producer_count,
@@ -699,7 +2706,7 @@ vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
                      * processed so far. */
                     clog_debug("<%s> Signal consumption of %d",
                                c->name, c->current_id);
-                    vrt_consumer_set_cursor(c, c->current_id);
+                    vrt_consumer_signal_cursor(c, c->current_id);
                     return VRT_QUEUE_EOF;
                 } else {
                     /* There are other producers still producing values,
@@ -723,3 +2730,377 @@ vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
         }
     } while (true);
 }
+
+int
+vrt_consumer_next(struct vrt_consumer *c, struct vrt_value **value)
+{
+    return vrt_consumer_next_deadline(c, value, VRT_WAIT_FOREVER);
+}
+
+int
+vrt_consumer_try_next(struct vrt_consumer *c, struct vrt_value **value)
+{
+    return vrt_consumer_next_deadline(c, value, 0);
+}
+
+int
+vrt_consumer_next_until(struct vrt_consumer *c, struct vrt_value **value,
+                        uint64_t deadline)
+{
+    return vrt_consumer_next_deadline(c, value, deadline);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Event loop integration
+ */
+
+int
+vrt_consumer_eventfd(struct vrt_consumer *c)
+{
+#if defined(__linux__)
+    if (c->eventfd == -1) {
+        c->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (CORK_UNLIKELY(c->eventfd == -1)) {
+            cork_system_error_set();
+            return -1;
+        }
+        cork_array_append(&c->queue->eventfd_consumers, c);
+    }
+    return c->eventfd;
+#else
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR, "eventfd isn't supported on this platform");
+    return -1;
+#endif
+}
+
+bool
+vrt_consumer_arm(struct vrt_consumer *c)
+{
+    struct vrt_queue  *q = c->queue;
+    vrt_value_id  current_id;
+    vrt_value_id  last_available_id;
+
+    /* A worker in a work pool can process the next value that the pool
+     * hasn't handed out yet. */
+    if (c->pool == NULL) {
+        current_id = c->current_id;
+    } else {
+        current_id = vrt_atomic_load_acquire(&c->pool->work_id.value);
+    }
+
+    if (vrt_mod_lt(current_id, c->last_available_id)) {
+        return false;
+    }
+
+    /* Arm ourselves before checking for new values, so that a producer that
+     * publishes after the check is guaranteed to see that we're armed. */
+    c->armed = 1;
+    vrt_eventcount_prepare_arm(vrt_consumer_wakeup_event(c));
+    if (c->pool != NULL) {
+        last_available_id =
+            vrt_consumer_pool_find_last_available_id(c->pool, current_id);
+        /* Once the pool has seen every EOF, we always have an EOF to
+         * return. */
+        if (vrt_consumer_pool_is_finished(c->pool)) {
+            last_available_id = (unsigned int) current_id + 1;
+        }
+    } else if (cork_array_is_empty(&c->dependencies)) {
+        last_available_id = vrt_queue_find_last_published_id(q, current_id);
+    } else {
+        last_available_id = vrt_consumer_find_last_dependent_id(c);
+    }
+
+    if (vrt_mod_le(last_available_id, current_id)) {
+        clog_trace("<%s> Armed eventfd at value %d", c->name, current_id);
+        return true;
+    }
+
+    /* There's already something to process.  If someone else has already
+     * disarmed us, then the eventfd will be readable, which is harmless. */
+    cork_int_atomic_cas(&c->armed, 1, 0);
+    return false;
+}
+
+int
+vrt_consumer_eventfd_clear(struct vrt_consumer *c)
+{
+    uint64_t  count;
+    if (read(c->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        cork_system_error_set();
+        return -1;
+    }
+    return 0;
+}
+
+
+static int
+vrt_consumer_next_batch_deadline(struct vrt_consumer *c, vrt_value_id *first,
+                                 unsigned int *count, uint64_t deadline)
+{
+    struct vrt_value  *v;
+    unsigned int  i;
+    unsigned int  available;
+    unsigned int  skipped;
+
+    /* We're done with the previous batch, so let the world know, if we've
+     * been asked to. */
+    if (c->commit_batches && c->pool == NULL) {
+        vrt_consumer_commit(c, c->current_id);
+    }
+
+    /* vrt_consumer_next takes care of waiting for values, and of any control
+     * messages or holes before the first value in the batch. */
+    rii_check(vrt_consumer_next_deadline(c, &v, deadline));
+    *first = c->current_id;
+
+    /* A worker's values aren't contiguous, since the other workers in its
+     * pool are claiming values at the same time. */
+    if (c->pool != NULL) {
+        *count = 1;
+        return 0;
+    }
+
+    /* Then we extend the batch through the rest of the values that we know
+     * are available, stopping at the first one that isn't a regular value. */
+    available = (unsigned int) c->last_available_id -
+        (unsigned int) c->current_id;
+    if (c->partition_count == 0) {
+        for (i = 1; i <= available; i++) {
+            v = vrt_queue_get(c->queue, (unsigned int) *first + i);
+            if (v->special != VRT_VALUE_NONE) {
+                break;
+            }
+        }
+        skipped = 0;
+    } else {
+        /* The batch can include values that belong to the other members of
+         * our partitioned group.  Control messages and holes are always
+         * tagged VRT_PARTITION_ALL, so we only need to look at the partition
+         * tags to step over the other members' values. */
+        for (i = 1, skipped = 0; i <= available; i++) {
+            vrt_value_id  id = (unsigned int) *first + i;
+            if (!vrt_consumer_owns_value(c, id)) {
+                skipped++;
+                continue;
+            }
+            v = vrt_queue_get(c->queue, id);
+            if (v->special != VRT_VALUE_NONE) {
+                break;
+            }
+        }
+    }
+
+    *count = i;
+    c->current_id = (unsigned int) *first + i - 1;
+    bws_derive_add(c->consumed, i - 1);
+    bws_derive_add(c->values, i - 1 - skipped);
+    bws_derive_add(c->skipped, skipped);
+    clog_trace("<%s> Next batch is %d-%d",
+               c->name, *first, c->current_id);
+    return 0;
+}
+
+int
+vrt_consumer_next_batch(struct vrt_consumer *c, vrt_value_id *first,
+                        unsigned int *count)
+{
+    return vrt_consumer_next_batch_deadline(c, first, count, VRT_WAIT_FOREVER);
+}
+
+int
+vrt_consumer_try_next_batch(struct vrt_consumer *c, vrt_value_id *first,
+                            unsigned int *count)
+{
+    return vrt_consumer_next_batch_deadline(c, first, count, 0);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Consumer groups
+ */
+
+struct vrt_consumer_group *
+vrt_consumer_group_new(const char *name, struct vrt_queue *q)
+{
+    struct vrt_consumer_group  *g;
+    rpi_check(vrt_queue_check_not_started(q, "consumer group", name));
+    rpi_check(vrt_queue_check_not_shared(q, "consumer group", name));
+    g = cork_new(struct vrt_consumer_group);
+    memset(g, 0, sizeof(struct vrt_consumer_group));
+    g->name = cork_strdup(name);
+    g->queue = q;
+    g->cursor.value = starting_value;
+    cork_array_init(&g->members);
+    clog_debug("[%s] Add consumer group %s", q->name, g->name);
+    cork_array_append(&q->groups, g);
+    return g;
+}
+
+struct vrt_consumer_group *
+vrt_consumer_group_new_partitioned(const char *name, struct vrt_queue *q)
+{
+    struct vrt_consumer_group  *g;
+    rpp_check(g = vrt_consumer_group_new(name, q));
+    g->partitioned = true;
+    vrt_queue_init_partitions(q);
+    return g;
+}
+
+void
+vrt_consumer_group_free(struct vrt_consumer_group *g)
+{
+    if (g->name != NULL) {
+        cork_strfree(g->name);
+    }
+    cork_array_done(&g->members);
+    cork_delete(struct vrt_consumer_group, g);
+}
+
+int
+vrt_consumer_group_add(struct vrt_consumer_group *g, struct vrt_consumer *c)
+{
+    if (CORK_UNLIKELY(c->queue != g->queue || c->group != NULL ||
+                      c->pool != NULL)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Consumer %s can't be added to group %s", c->name, g->name);
+        return -1;
+    }
+    rii_check(vrt_queue_check_not_started(g->queue, "consumer", c->name));
+
+    clog_debug("[%s] Add consumer %s to group %s",
+               g->queue->name, c->name, g->name);
+    cork_array_append(&g->members, c);
+    c->group = g;
+
+    /* Every member needs to know how many ways the group is partitioned. */
+    if (g->partitioned) {
+        size_t  i;
+        size_t  member_count = cork_array_size(&g->members);
+        for (i = 0; i < member_count; i++) {
+            struct vrt_consumer  *member = cork_array_at(&g->members, i);
+            member->partition_count = member_count;
+            member->partition_index = i;
+        }
+    }
+    vrt_queue_update_gating_cursors(g->queue);
+    return 0;
+}
+
+/* Recalculates a combined cursor after one of its members has published its
+ * own cursor.  Several members might do this at the same time, and each of
+ * them might see a different minimum, so we only ever move the combined
+ * cursor forward.  The full barrier makes sure that our own cursor is visible
+ * before we read anyone else's; that way, whichever member publishes last is
+ * guaranteed to see every other member's latest cursor.  (With only one
+ * member, there's no one else to race with, so we skip it.)  Returns whether
+ * we moved the cursor. */
+static bool
+vrt_advance_minimum_cursor(struct vrt_padded_int *cursor,
+                           vrt_consumer_array *members)
+{
+    vrt_value_id  minimum;
+    vrt_value_id  current;
+
+    if (cork_array_size(members) > 1) {
+        vrt_atomic_full_barrier();
+    }
+    minimum = vrt_minimum_cursor(members);
+    current = vrt_atomic_load_relaxed(&cursor->value);
+    while (vrt_mod_lt(current, minimum)) {
+        vrt_value_id  actual =
+            cork_int_atomic_cas(&cursor->value, current, minimum);
+        if (actual == current) {
+            return true;
+        }
+        current = actual;
+    }
+    return false;
+}
+
+static void
+vrt_consumer_group_update_cursor(struct vrt_consumer_group *g)
+{
+    if (vrt_advance_minimum_cursor(&g->cursor, &g->members)) {
+        clog_trace("[%s] Group %s has consumed %d",
+                   g->queue->name, g->name, g->cursor.value);
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Work pools
+ */
+
+struct vrt_consumer *
+vrt_consumer_pool_new(const char *name, struct vrt_queue *q)
+{
+    struct vrt_consumer  *pool;
+    rpi_check(vrt_queue_check_not_shared(q, "work pool", name));
+    rpp_check(pool = vrt_consumer_new(name, q));
+    pool->is_pool = true;
+    pool->work_id.value = starting_value;
+    clog_debug("[%s] Consumer %s is a work pool", q->name, pool->name);
+    return pool;
+}
+
+int
+vrt_consumer_pool_add(struct vrt_consumer *pool, struct vrt_consumer *c)
+{
+    if (CORK_UNLIKELY(!pool->is_pool || c->is_pool ||
+                      c->queue != pool->queue ||
+                      c->pool != NULL || c->group != NULL)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Consumer %s can't be added to work pool %s",
+             c->name, pool->name);
+        return -1;
+    }
+    rii_check(vrt_queue_check_not_started(pool->queue, "worker", c->name));
+
+    clog_debug("[%s] Add worker %s to work pool %s",
+               pool->queue->name, c->name, pool->name);
+    cork_array_append(&pool->workers, c);
+    c->pool = pool;
+    vrt_queue_update_gating_cursors(pool->queue);
+    return 0;
+}
+
+/* A work pool's cursor is the smallest of its workers' cursors, just like a
+ * consumer group's. */
+static void
+vrt_consumer_pool_update_cursor(struct vrt_consumer *pool)
+{
+    if (vrt_advance_minimum_cursor(pool->cursor, &pool->workers)) {
+        clog_trace("<%s> Work pool has consumed %d",
+                   pool->name, pool->cursor->value);
+        if (pool->group != NULL) {
+            vrt_consumer_group_update_cursor(pool->group);
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Notifiers
+ */
+
+void
+vrt_queue_add_notifier(struct vrt_queue *q, struct vrt_notifier *n)
+{
+    n->armed = 0;
+    cork_array_append(&q->notifiers, n);
+}
+
+void
+vrt_queue_arm_notifier(struct vrt_queue *q, struct vrt_notifier *n)
+{
+    /* We don't know what the notifier's clients are waiting for, so ask for
+     * wakeups of both event counts.  Arm the notifier first, so that anyone
+     * who sees one of the waiter bits also sees that we're armed. */
+    n->armed = 1;
+    vrt_eventcount_prepare_arm(&q->control->published);
+    vrt_eventcount_prepare_arm(&q->control->consumed);
+}
@@ -0,0 +1,102 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <clogger.h>
+#include <libcork/core.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/queue.h"
+#include "vrt/relay.h"
+#include "vrt/value.h"
+
+#define CLOG_CHANNEL  "vrt"
+
+
+/*-----------------------------------------------------------------------
+ * Relays
+ */
+
+struct vrt_relay *
+vrt_relay_new(const char *name, struct vrt_queue *src,
+              struct vrt_queue *mirror, unsigned int batch_size)
+{
+    struct vrt_relay  *relay;
+
+    if (CORK_UNLIKELY(!vrt_value_type_is_inline(src->value_type) ||
+                      src->value_type != mirror->value_type)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Relay %s needs queues with the same inline value type", name);
+        return NULL;
+    }
+
+    relay = cork_new(struct vrt_relay);
+    relay->consumer = NULL;
+    relay->payload_size =
+        src->value_type->value_size - sizeof(struct vrt_value);
+    ep_check(relay->consumer = vrt_consumer_new(name, src));
+    /* If we can't feed the mirror, don't leave the source queue waiting on
+     * a consumer that will never run. */
+    ep_check(relay->producer = vrt_producer_new(name, batch_size, mirror));
+    clog_debug("[%s] Relay values from %s to %s",
+               name, src->name, mirror->name);
+    return relay;
+
+error:
+    if (relay->consumer != NULL) {
+        vrt_consumer_remove(relay->consumer);
+    }
+    cork_delete(struct vrt_relay, relay);
+    return NULL;
+}
+
+void
+vrt_relay_free(struct vrt_relay *relay)
+{
+    cork_delete(struct vrt_relay, relay);
+}
+
+int
+vrt_relay_run(struct vrt_relay *relay)
+{
+    struct vrt_consumer  *c = relay->consumer;
+    struct vrt_producer  *p = relay->producer;
+    int  rc;
+
+    while (true) {
+        struct vrt_value  *src;
+        struct vrt_value  *dest;
+
+        /* If we've copied every value that we know the source queue has
+         * published, then the next call to vrt_consumer_next might have to
+         * wait.  Publish what we have first, so that the mirror's consumers
+         * don't have to wait too.  (We don't pad out the rest of the batch
+         * with holes, since at low rates that would use up a whole batch of
+         * the mirror for each value.) */
+        if (c->current_id == c->last_available_id) {
+            rii_check(vrt_producer_publish_partial(p));
+        }
+
+        rc = vrt_consumer_next(c, &src);
+        if (rc == VRT_QUEUE_EOF) {
+            clog_debug("<%s> Relay EOF", c->name);
+            return vrt_producer_eof(p);
+        } else if (rc == VRT_QUEUE_FLUSH) {
+            rii_check(vrt_producer_flush(p));
+            continue;
+        }
+        rii_check(rc);
+
+        rii_check(vrt_producer_claim(p, &dest));
+        memcpy(dest + 1, src + 1, relay->payload_size);
+        rii_check(vrt_producer_publish(p));
+    }
+}
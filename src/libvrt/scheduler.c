@@ -0,0 +1,469 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include <clogger.h>
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "vrt/atomic.h"
+#include "vrt/scheduler.h"
+#include "vrt/yield.h"
+
+#define CLOG_CHANNEL  "vrt"
+
+
+/* The size of each task's stack, not including its guard page. */
+#define TASK_STACK_SIZE  (256 * 1024)
+
+/* How many times an idle worker yields its thread before it starts
+ * sleeping between attempts to find work. */
+#define IDLE_YIELDS_BEFORE_SLEEPING  100
+#define IDLE_SLEEP_USEC  50
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS  MAP_ANON
+#endif
+
+
+/*-----------------------------------------------------------------------
+ * Tasks
+ */
+
+struct vrt_task {
+    ucontext_t  context;
+    void *
+    (*run)(void *);
+    void  *ud;
+    const char  *name;
+    void  *stack;
+    size_t  stack_size;
+    bool  done;
+    /* Whether the task switched away while it was still waiting for the
+     * same thing as the last time it ran */
+    bool  stalled;
+    /* The next task in the run queue that this task is in */
+    struct vrt_task  *next;
+};
+
+struct vrt_worker {
+    struct vrt_scheduler  *scheduler;
+    unsigned int  index;
+    pthread_t  thread;
+    bool  started;
+    /* The worker thread's own context, which tasks switch back to when
+     * they yield or finish */
+    ucontext_t  context;
+    /* The task that this worker is currently running */
+    struct vrt_task  *current;
+    /* How many tasks in a row have stalled since any of them made
+     * progress */
+    unsigned int  stalled_count;
+    /* This worker's run queue.  Other workers can steal from it, so it's
+     * protected by a lock. */
+    pthread_mutex_t  lock;
+    struct vrt_task  *head;
+    struct vrt_task  *tail;
+};
+
+struct vrt_scheduler {
+    struct vrt_worker  *workers;
+    unsigned int  worker_count;
+    /* The worker that the next new task will be assigned to */
+    unsigned int  next_worker;
+    /* The number of tasks that haven't finished yet */
+    volatile int  remaining;
+};
+
+/* The worker that the current thread belongs to, if any. */
+static __thread struct vrt_worker  *current_worker = NULL;
+
+/* A task can resume on a different thread than the one it yielded from, so
+ * we can't let the compiler cache the address of the thread-local variable
+ * across a context switch. */
+static CORK_ATTR_NOINLINE struct vrt_worker *
+vrt_current_worker(void)
+{
+    return current_worker;
+}
+
+static void
+vrt_task_main(unsigned int hi, unsigned int lo)
+{
+    /* makecontext can only pass int parameters, so the task pointer is
+     * split into two halves. */
+    struct vrt_task  *task =
+        (struct vrt_task *) (uintptr_t) (((uint64_t) hi << 32) | lo);
+    clog_debug("[%s] Start task", task->name);
+    task->run(task->ud);
+    clog_debug("[%s] Finish task", task->name);
+    task->done = true;
+    setcontext(&vrt_current_worker()->context);
+}
+
+static struct vrt_task *
+vrt_task_new(const char *name, void *(*run)(void *), void *ud)
+{
+    struct vrt_task  *task = cork_new(struct vrt_task);
+    size_t  page_size = sysconf(_SC_PAGESIZE);
+    uint64_t  ptr = (uintptr_t) task;
+
+    memset(task, 0, sizeof(struct vrt_task));
+    task->name = cork_strdup(name);
+    task->run = run;
+    task->ud = ud;
+
+    /* Each stack gets a guard page at the bottom, so that an overflow
+     * crashes instead of scribbling over some other task's stack. */
+    task->stack_size = TASK_STACK_SIZE + page_size;
+    task->stack = mmap(NULL, task->stack_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (CORK_UNLIKELY(task->stack == MAP_FAILED)) {
+        cork_abort("Cannot map %zu bytes for task stack (%s)",
+                   task->stack_size, strerror(errno));
+    }
+    mprotect(task->stack, page_size, PROT_NONE);
+
+    if (CORK_UNLIKELY(getcontext(&task->context) != 0)) {
+        cork_abort("Cannot create context for task %s", name);
+    }
+    task->context.uc_stack.ss_sp = (char *) task->stack + page_size;
+    task->context.uc_stack.ss_size = TASK_STACK_SIZE;
+    task->context.uc_link = NULL;
+    makecontext(&task->context, (void (*)(void)) vrt_task_main, 2,
+                (unsigned int) (ptr >> 32), (unsigned int) ptr);
+    return task;
+}
+
+static void
+vrt_task_free(struct vrt_task *task)
+{
+    munmap(task->stack, task->stack_size);
+    cork_strfree(task->name);
+    cork_delete(struct vrt_task, task);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Run queues
+ */
+
+static void
+vrt_worker_push(struct vrt_worker *w, struct vrt_task *task)
+{
+    task->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->tail == NULL) {
+        w->head = task;
+    } else {
+        w->tail->next = task;
+    }
+    w->tail = task;
+    pthread_mutex_unlock(&w->lock);
+}
+
+static struct vrt_task *
+vrt_worker_pop(struct vrt_worker *w)
+{
+    struct vrt_task  *task;
+    /* Peek without the lock first, so that idle workers that are looking
+     * for something to steal don't all pile onto each other's locks. */
+    if (vrt_atomic_load_relaxed(&w->head) == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&w->lock);
+    task = w->head;
+    if (task != NULL) {
+        w->head = task->next;
+        if (w->head == NULL) {
+            w->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static struct vrt_task *
+vrt_worker_steal(struct vrt_worker *w)
+{
+    struct vrt_scheduler  *s = w->scheduler;
+    unsigned int  i;
+    for (i = 1; i < s->worker_count; i++) {
+        struct vrt_worker  *victim =
+            &s->workers[(w->index + i) % s->worker_count];
+        struct vrt_task  *task = vrt_worker_pop(victim);
+        if (task != NULL) {
+            clog_trace("[%s] Steal task from worker %u into worker %u",
+                       task->name, victim->index, w->index);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Workers
+ */
+
+/* Gives up the worker's thread when it doesn't have anything useful to do,
+ * first by yielding it, and then by sleeping. */
+static void
+vrt_worker_back_off(unsigned int *idle)
+{
+    if (*idle < IDLE_YIELDS_BEFORE_SLEEPING) {
+        (*idle)++;
+        sched_yield();
+    } else {
+        usleep(IDLE_SLEEP_USEC);
+    }
+}
+
+static void *
+vrt_worker_run(void *ud)
+{
+    struct vrt_worker  *w = ud;
+    struct vrt_scheduler  *s = w->scheduler;
+    unsigned int  idle = 0;
+
+    current_worker = w;
+    while (vrt_atomic_load_acquire(&s->remaining) > 0) {
+        struct vrt_task  *task = vrt_worker_pop(w);
+        if (task == NULL) {
+            task = vrt_worker_steal(w);
+        }
+
+        if (task == NULL) {
+            vrt_worker_back_off(&idle);
+            continue;
+        }
+
+        w->current = task;
+        task->stalled = false;
+        swapcontext(&w->context, &task->context);
+        w->current = NULL;
+
+        /* We only put the task back in a run queue once we've switched
+         * away from it, so that no one else can resume it while it's still
+         * running here. */
+        if (task->done) {
+            vrt_task_free(task);
+            cork_int_atomic_add(&s->remaining, -1);
+            w->stalled_count = 0;
+            idle = 0;
+        } else if (task->stalled) {
+            vrt_worker_push(w, task);
+            /* If a whole round of tasks has gone by without any of them
+             * getting past what they were waiting for, they're all waiting
+             * on some other thread, and switching between them just burns
+             * the core.  Back off like an idle worker until one of them
+             * makes progress. */
+            if (++w->stalled_count >=
+                (unsigned int) vrt_atomic_load_relaxed(&s->remaining)) {
+                w->stalled_count = 0;
+                vrt_worker_back_off(&idle);
+            }
+        } else {
+            vrt_worker_push(w, task);
+            w->stalled_count = 0;
+            idle = 0;
+        }
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Schedulers
+ */
+
+struct vrt_scheduler *
+vrt_scheduler_new(unsigned int thread_count)
+{
+    struct vrt_scheduler  *s = cork_new(struct vrt_scheduler);
+    unsigned int  i;
+
+    if (thread_count == 0) {
+        long  cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = (cpu_count > 0)? cpu_count: 1;
+    }
+
+    s->worker_count = thread_count;
+    s->workers = cork_calloc(thread_count, sizeof(struct vrt_worker));
+    s->next_worker = 0;
+    s->remaining = 0;
+    for (i = 0; i < thread_count; i++) {
+        struct vrt_worker  *w = &s->workers[i];
+        w->scheduler = s;
+        w->index = i;
+        w->started = false;
+        w->current = NULL;
+        w->stalled_count = 0;
+        w->head = NULL;
+        w->tail = NULL;
+        pthread_mutex_init(&w->lock, NULL);
+    }
+
+    clog_debug("Create scheduler with %u workers", thread_count);
+    return s;
+}
+
+void
+vrt_scheduler_free(struct vrt_scheduler *s)
+{
+    unsigned int  i;
+    for (i = 0; i < s->worker_count; i++) {
+        struct vrt_worker  *w = &s->workers[i];
+        struct vrt_task  *task;
+        while ((task = vrt_worker_pop(w)) != NULL) {
+            vrt_task_free(task);
+        }
+        pthread_mutex_destroy(&w->lock);
+    }
+    cork_cfree(s->workers, s->worker_count, sizeof(struct vrt_worker));
+    cork_delete(struct vrt_scheduler, s);
+}
+
+void
+vrt_scheduler_add(struct vrt_scheduler *s, const char *name,
+                  void *(*run)(void *), void *ud)
+{
+    struct vrt_task  *task = vrt_task_new(name, run, ud);
+    struct vrt_worker  *w = &s->workers[s->next_worker];
+    s->next_worker = (s->next_worker + 1) % s->worker_count;
+    s->remaining++;
+    clog_debug("[%s] Add task to worker %u", name, w->index);
+    vrt_worker_push(w, task);
+}
+
+int
+vrt_scheduler_run(struct vrt_scheduler *s)
+{
+    unsigned int  i;
+
+    /* The calling thread acts as the first worker, so we can always make
+     * progress even if we can't start any other threads. */
+    for (i = 1; i < s->worker_count; i++) {
+        struct vrt_worker  *w = &s->workers[i];
+        int  rc = pthread_create(&w->thread, NULL, vrt_worker_run, w);
+        if (CORK_UNLIKELY(rc != 0)) {
+            clog_warning("Cannot start scheduler worker %u (%s)",
+                         i, strerror(rc));
+        } else {
+            w->started = true;
+        }
+    }
+
+    vrt_worker_run(&s->workers[0]);
+
+    for (i = 1; i < s->worker_count; i++) {
+        struct vrt_worker  *w = &s->workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+            w->started = false;
+        }
+    }
+    return 0;
+}
+
+bool
+vrt_scheduler_in_task(void)
+{
+    struct vrt_worker  *w = vrt_current_worker();
+    return (w != NULL && w->current != NULL);
+}
+
+/* Switches from the current task back to its worker thread, noting whether
+ * the task is still waiting for the same thing as the last time it ran. */
+static void
+vrt_scheduler_switch(bool stalled)
+{
+    struct vrt_worker  *w = vrt_current_worker();
+    if (w == NULL || w->current == NULL) {
+        sched_yield();
+    } else {
+        w->current->stalled = stalled;
+        swapcontext(&w->current->context, &w->context);
+    }
+}
+
+void
+vrt_scheduler_yield(void)
+{
+    vrt_scheduler_switch(false);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Coroutine yielding strategy
+ */
+
+/* If a task has to wait through this many switches, we also yield the
+ * worker's thread each time.  If there are more workers than CPUs, the task
+ * that we're waiting on might belong to a worker that the OS has
+ * descheduled, and no amount of switching between our own tasks will let it
+ * make progress. */
+#define SWITCHES_BEFORE_YIELDING_THREAD  16
+
+struct vrt_coroutine_yield_strategy {
+    struct vrt_yield_strategy  parent;
+    unsigned int  counter;
+};
+
+static int
+vrt_coroutine_yield(struct vrt_yield_strategy *vys, bool first,
+                    const char *queue_name, const char *name)
+{
+    struct vrt_coroutine_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_coroutine_yield_strategy, parent);
+
+    if (first) {
+        ys->counter = 0;
+    }
+
+    if (ys->counter < SWITCHES_BEFORE_YIELDING_THREAD) {
+        ys->counter++;
+    } else if (vrt_scheduler_in_task()) {
+        sched_yield();
+    }
+
+    clog_trace("<%s> Yield to other tasks", name);
+    vrt_scheduler_switch(!first);
+    return 0;
+}
+
+static void
+vrt_coroutine_free(struct vrt_yield_strategy *vys)
+{
+    struct vrt_coroutine_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_coroutine_yield_strategy, parent);
+    cork_delete(struct vrt_coroutine_yield_strategy, ys);
+}
+
+struct vrt_yield_strategy *
+vrt_yield_strategy_coroutine(void)
+{
+    struct vrt_coroutine_yield_strategy  *vs =
+        cork_new(struct vrt_coroutine_yield_strategy);
+    vs->parent.yield = vrt_coroutine_yield;
+    vs->parent.free = vrt_coroutine_free;
+    vs->parent.wait = NULL;
+    vs->counter = 0;
+    return &vs->parent;
+}
@@ -0,0 +1,588 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <clogger.h>
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/helpers/errors.h>
+
+#include "vrt/queue.h"
+#include "vrt/shard.h"
+#include "vrt/yield.h"
+#include "hash.h"
+
+#define CLOG_CHANNEL  "vrt"
+
+/* The most values that a sharded consumer takes from one shard before it
+ * moves on to the next. */
+#define VRT_SHARD_BURST_SIZE  64
+
+
+/*-----------------------------------------------------------------------
+ * Sharded queues
+ */
+
+struct vrt_sharded_queue *
+vrt_sharded_queue_new(const char *name, struct vrt_value_type *value_type,
+                      unsigned int shard_count, unsigned int shard_size)
+{
+    unsigned int  i;
+    struct vrt_sharded_queue  *sq;
+
+    if (CORK_UNLIKELY(shard_count == 0)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Sharded queue %s needs at least one shard", name);
+        return NULL;
+    }
+
+    sq = cork_new(struct vrt_sharded_queue);
+    sq->name = cork_strdup(name);
+    sq->shard_count = shard_count;
+    sq->shards = cork_calloc(shard_count, sizeof(struct vrt_queue *));
+    cork_array_init(&sq->producers);
+    cork_array_init(&sq->consumers);
+
+    for (i = 0; i < shard_count; i++) {
+        char  shard_name[256];
+        snprintf(shard_name, sizeof(shard_name), "%s.%u", name, i);
+        ep_check(sq->shards[i] =
+                 vrt_queue_new(shard_name, value_type, shard_size));
+    }
+
+    clog_debug("[%s] Create sharded queue with %u shards", name, shard_count);
+    return sq;
+
+error:
+    vrt_sharded_queue_free(sq);
+    return NULL;
+}
+
+static void
+vrt_sharded_producer_free(struct vrt_sharded_producer *sp);
+
+static void
+vrt_sharded_consumer_free(struct vrt_sharded_consumer *sc);
+
+void
+vrt_sharded_queue_free(struct vrt_sharded_queue *sq)
+{
+    size_t  i;
+
+    /* The shards' producers are borrowing their sharded producer's yield
+     * strategy, so we have to take it back before the shards free them. */
+    for (i = 0; i < cork_array_size(&sq->producers); i++) {
+        vrt_sharded_producer_free(cork_array_at(&sq->producers, i));
+    }
+    cork_array_done(&sq->producers);
+
+    for (i = 0; i < sq->shard_count; i++) {
+        if (sq->shards[i] != NULL) {
+            vrt_queue_free(sq->shards[i]);
+        }
+    }
+    cork_cfree(sq->shards, sq->shard_count, sizeof(struct vrt_queue *));
+
+    /* And the shards have to be gone before we free the consumers, since
+     * the shards hold on to their notifiers. */
+    for (i = 0; i < cork_array_size(&sq->consumers); i++) {
+        vrt_sharded_consumer_free(cork_array_at(&sq->consumers, i));
+    }
+    cork_array_done(&sq->consumers);
+
+    cork_strfree(sq->name);
+    cork_delete(struct vrt_sharded_queue, sq);
+}
+
+unsigned int
+vrt_sharded_queue_shard_for_key(struct vrt_sharded_queue *sq, uint64_t key)
+{
+    /* Scale the hash into [0, shard_count) with a multiply and a shift. */
+    return (unsigned int)
+        (((vrt_hash_key(key) >> 32) * sq->shard_count) >> 32);
+}
+
+int
+vrt_sharded_queue_start(struct vrt_sharded_queue *sq)
+{
+    unsigned int  i;
+    for (i = 0; i < sq->shard_count; i++) {
+        rii_check(vrt_queue_start(sq->shards[i]));
+    }
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sharded producers
+ */
+
+static struct vrt_sharded_producer *
+vrt_sharded_producer_alloc(const char *name, struct vrt_sharded_queue *sq)
+{
+    struct vrt_sharded_producer  *sp = cork_new(struct vrt_sharded_producer);
+    sp->queue = sq;
+    sp->producers =
+        cork_calloc(sq->shard_count, sizeof(struct vrt_producer *));
+    sp->current = NULL;
+    sp->yield = NULL;
+    sp->name = cork_strdup(name);
+    return sp;
+}
+
+static void
+vrt_sharded_producer_free(struct vrt_sharded_producer *sp)
+{
+    unsigned int  i;
+    for (i = 0; i < sp->queue->shard_count; i++) {
+        if (sp->producers[i] != NULL) {
+            sp->producers[i]->yield = NULL;
+        }
+    }
+    if (sp->yield != NULL) {
+        vrt_yield_strategy_free(sp->yield);
+    }
+    cork_cfree(sp->producers, sp->queue->shard_count,
+               sizeof(struct vrt_producer *));
+    cork_strfree(sp->name);
+    cork_delete(struct vrt_sharded_producer, sp);
+}
+
+struct vrt_sharded_producer *
+vrt_sharded_producer_new(const char *name, unsigned int batch_size,
+                         struct vrt_sharded_queue *sq)
+{
+    unsigned int  i;
+    struct vrt_sharded_producer  *sp = vrt_sharded_producer_alloc(name, sq);
+    sp->home = cork_array_size(&sq->producers) % sq->shard_count;
+    sp->keyed = true;
+    cork_array_append(&sq->producers, sp);
+    for (i = 0; i < sq->shard_count; i++) {
+        rpp_check(sp->producers[i] =
+                  vrt_producer_new(name, batch_size, sq->shards[i]));
+    }
+    clog_debug("[%s] Add keyed producer %s (home shard %u)",
+               sq->name, name, sp->home);
+    return sp;
+}
+
+struct vrt_sharded_producer *
+vrt_sharded_producer_new_on_shard(const char *name, unsigned int batch_size,
+                                  struct vrt_sharded_queue *sq,
+                                  unsigned int shard)
+{
+    struct vrt_sharded_producer  *sp;
+
+    if (CORK_UNLIKELY(shard >= sq->shard_count)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Sharded queue %s doesn't have a shard %u", sq->name, shard);
+        return NULL;
+    }
+
+    sp = vrt_sharded_producer_alloc(name, sq);
+    sp->home = shard;
+    sp->keyed = false;
+    cork_array_append(&sq->producers, sp);
+    rpp_check(sp->producers[shard] =
+              vrt_producer_new(name, batch_size, sq->shards[shard]));
+    clog_debug("[%s] Add producer %s on shard %u", sq->name, name, shard);
+    return sp;
+}
+
+struct vrt_sharded_producer *
+vrt_sharded_producer_new_lane(const char *name, unsigned int batch_size,
+                              struct vrt_sharded_queue *sq)
+{
+    unsigned int  i;
+    for (i = 0; i < sq->shard_count; i++) {
+        if (cork_array_is_empty(&sq->shards[i]->producers)) {
+            return vrt_sharded_producer_new_on_shard
+                (name, batch_size, sq, i);
+        }
+    }
+    cork_error_set_printf
+        (CORK_UNKNOWN_ERROR,
+         "Sharded queue %s doesn't have any free lanes for %s",
+         sq->name, name);
+    return NULL;
+}
+
+void
+vrt_sharded_producer_set_yield(struct vrt_sharded_producer *sp,
+                               struct vrt_yield_strategy *yield)
+{
+    unsigned int  i;
+    if (sp->yield != NULL) {
+        vrt_yield_strategy_free(sp->yield);
+    }
+    sp->yield = yield;
+    for (i = 0; i < sp->queue->shard_count; i++) {
+        if (sp->producers[i] != NULL) {
+            sp->producers[i]->yield = yield;
+        }
+    }
+}
+
+int
+vrt_sharded_producer_claim(struct vrt_sharded_producer *sp,
+                           struct vrt_value **value)
+{
+    sp->current = sp->producers[sp->home];
+    return vrt_producer_claim(sp->current, value);
+}
+
+int
+vrt_sharded_producer_claim_key(struct vrt_sharded_producer *sp, uint64_t key,
+                               struct vrt_value **value)
+{
+    if (CORK_UNLIKELY(!sp->keyed)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR,
+             "Producer %s only feeds shard %u of %s",
+             sp->name, sp->home, sp->queue->name);
+        return -1;
+    }
+    sp->current =
+        sp->producers[vrt_sharded_queue_shard_for_key(sp->queue, key)];
+    return vrt_producer_claim(sp->current, value);
+}
+
+int
+vrt_sharded_producer_try_claim(struct vrt_sharded_producer *sp,
+                               struct vrt_value **value)
+{
+    sp->current = sp->producers[sp->home];
+    return vrt_producer_try_claim(sp->current, value);
+}
+
+int
+vrt_sharded_producer_publish(struct vrt_sharded_producer *sp)
+{
+    return vrt_producer_publish(sp->current);
+}
+
+void
+vrt_sharded_producer_set_publish_interval(struct vrt_sharded_producer *sp,
+                                          unsigned int interval)
+{
+    unsigned int  i;
+    for (i = 0; i < sp->queue->shard_count; i++) {
+        if (sp->producers[i] != NULL) {
+            vrt_producer_set_publish_interval(sp->producers[i], interval);
+        }
+    }
+}
+
+int
+vrt_sharded_producer_publish_batch(struct vrt_sharded_producer *sp)
+{
+    unsigned int  i;
+    for (i = 0; i < sp->queue->shard_count; i++) {
+        if (sp->producers[i] != NULL) {
+            rii_check(vrt_producer_publish_batch(sp->producers[i]));
+        }
+    }
+    return 0;
+}
+
+int
+vrt_sharded_producer_flush(struct vrt_sharded_producer *sp)
+{
+    unsigned int  i;
+    for (i = 0; i < sp->queue->shard_count; i++) {
+        if (sp->producers[i] != NULL) {
+            rii_check(vrt_producer_flush(sp->producers[i]));
+        }
+    }
+    return 0;
+}
+
+int
+vrt_sharded_producer_eof(struct vrt_sharded_producer *sp)
+{
+    unsigned int  i;
+    for (i = 0; i < sp->queue->shard_count; i++) {
+        if (sp->producers[i] != NULL) {
+            rii_check(vrt_producer_eof(sp->producers[i]));
+        }
+    }
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sharded consumers
+ */
+
+static void
+vrt_sharded_consumer_notify(struct vrt_notifier *n)
+{
+    struct vrt_sharded_consumer  *sc =
+        cork_container_of(n, struct vrt_sharded_consumer, notifier);
+    vrt_eventcount_notify(&sc->wakeup);
+}
+
+struct vrt_sharded_consumer *
+vrt_sharded_consumer_new(const char *name, struct vrt_sharded_queue *sq)
+{
+    unsigned int  i;
+    struct vrt_sharded_consumer  *sc = cork_new(struct vrt_sharded_consumer);
+    sc->queue = sq;
+    sc->consumers =
+        cork_calloc(sq->shard_count, sizeof(struct vrt_consumer *));
+    sc->finished = cork_calloc(sq->shard_count, sizeof(bool));
+    sc->finished_count = 0;
+    sc->current = 0;
+    sc->burst = 0;
+    sc->timestamp = NULL;
+    sc->heads = cork_calloc(sq->shard_count, sizeof(struct vrt_value *));
+    sc->notifier.notify = vrt_sharded_consumer_notify;
+    vrt_eventcount_init(&sc->wakeup);
+    sc->yield = NULL;
+    sc->name = cork_strdup(name);
+    cork_array_append(&sq->consumers, sc);
+
+    for (i = 0; i < sq->shard_count; i++) {
+        rpp_check(sc->consumers[i] = vrt_consumer_new(name, sq->shards[i]));
+        vrt_queue_add_notifier(sq->shards[i], &sc->notifier);
+    }
+    clog_debug("[%s] Add consumer %s", sq->name, name);
+    return sc;
+}
+
+static void
+vrt_sharded_consumer_free(struct vrt_sharded_consumer *sc)
+{
+    if (sc->yield != NULL) {
+        vrt_yield_strategy_free(sc->yield);
+    }
+    cork_cfree(sc->consumers, sc->queue->shard_count,
+               sizeof(struct vrt_consumer *));
+    cork_cfree(sc->finished, sc->queue->shard_count, sizeof(bool));
+    cork_cfree(sc->heads, sc->queue->shard_count,
+               sizeof(struct vrt_value *));
+    cork_strfree(sc->name);
+    cork_delete(struct vrt_sharded_consumer, sc);
+}
+
+void
+vrt_sharded_consumer_set_yield(struct vrt_sharded_consumer *sc,
+                               struct vrt_yield_strategy *yield)
+{
+    if (sc->yield != NULL) {
+        vrt_yield_strategy_free(sc->yield);
+    }
+    sc->yield = yield;
+}
+
+void
+vrt_sharded_consumer_set_merge(struct vrt_sharded_consumer *sc,
+                               uint64_t (*timestamp)(struct vrt_value *value))
+{
+    sc->timestamp = timestamp;
+}
+
+/* Moves on to the next shard. */
+static inline void
+vrt_sharded_consumer_advance(struct vrt_sharded_consumer *sc)
+{
+    sc->current = (sc->current + 1 == sc->queue->shard_count)?
+        0: sc->current + 1;
+    sc->burst = 0;
+}
+
+/* Checks each shard once, starting with the current one.  Returns
+ * VRT_QUEUE_AGAIN if none of them have anything for us. */
+static int
+vrt_sharded_consumer_scan(struct vrt_sharded_consumer *sc,
+                          struct vrt_value **value)
+{
+    struct vrt_sharded_queue  *sq = sc->queue;
+    unsigned int  i;
+
+    for (i = 0; i < sq->shard_count; i++) {
+        unsigned int  shard = sc->current;
+        int  rc;
+
+        if (sc->finished[shard]) {
+            vrt_sharded_consumer_advance(sc);
+            continue;
+        }
+
+        rc = vrt_consumer_try_next(sc->consumers[shard], value);
+        if (rc == 0 || rc == VRT_QUEUE_FLUSH) {
+            if (++sc->burst == VRT_SHARD_BURST_SIZE) {
+                vrt_sharded_consumer_advance(sc);
+            }
+            return rc;
+        }
+
+        /* A shard without any producers will never send an EOF. */
+        if (rc == VRT_QUEUE_EOF ||
+            (rc == VRT_QUEUE_AGAIN &&
+             cork_array_is_empty(&sq->shards[shard]->producers))) {
+            clog_debug("<%s> Shard %u is finished", sc->name, shard);
+            sc->finished[shard] = true;
+            if (++sc->finished_count == sq->shard_count) {
+                return VRT_QUEUE_EOF;
+            }
+        } else if (CORK_UNLIKELY(rc != VRT_QUEUE_AGAIN)) {
+            return rc;
+        }
+        vrt_sharded_consumer_advance(sc);
+    }
+
+    return VRT_QUEUE_AGAIN;
+}
+
+/* Makes sure that we have a head value from every shard that hasn't
+ * finished, and then returns the oldest of them.  Returns VRT_QUEUE_AGAIN if
+ * any of the shards are still empty.
+ *
+ * A shard's head stays valid until we call vrt_consumer_try_next on that
+ * shard's consumer again, which we only do once we've returned the head.
+ * That also means that a shard doesn't see that we're done with the value
+ * that we returned until the next time we're called.  There usually aren't
+ * many shards, so we just look through all of them for the oldest head
+ * instead of maintaining a heap. */
+static int
+vrt_sharded_consumer_merge(struct vrt_sharded_consumer *sc,
+                           struct vrt_value **value)
+{
+    struct vrt_sharded_queue  *sq = sc->queue;
+    bool  waiting = false;
+    bool  found = false;
+    uint64_t  oldest = 0;
+    unsigned int  oldest_shard = 0;
+    unsigned int  i;
+
+    for (i = 0; i < sq->shard_count; i++) {
+        uint64_t  timestamp;
+
+        if (sc->finished[i]) {
+            continue;
+        }
+
+        if (sc->heads[i] == NULL) {
+            int  rc = vrt_consumer_try_next(sc->consumers[i], &sc->heads[i]);
+            if (rc != 0) {
+                sc->heads[i] = NULL;
+                if (rc == VRT_QUEUE_FLUSH) {
+                    return rc;
+                } else if (rc == VRT_QUEUE_EOF ||
+                           (rc == VRT_QUEUE_AGAIN &&
+                            cork_array_is_empty(&sq->shards[i]->producers))) {
+                    clog_debug("<%s> Shard %u is finished", sc->name, i);
+                    sc->finished[i] = true;
+                    sc->finished_count++;
+                } else if (rc == VRT_QUEUE_AGAIN) {
+                    waiting = true;
+                } else {
+                    return rc;
+                }
+                continue;
+            }
+        }
+
+        timestamp = sc->timestamp(sc->heads[i]);
+        if (!found || timestamp < oldest) {
+            found = true;
+            oldest = timestamp;
+            oldest_shard = i;
+        }
+    }
+
+    if (sc->finished_count == sq->shard_count) {
+        return VRT_QUEUE_EOF;
+    } else if (waiting || !found) {
+        return VRT_QUEUE_AGAIN;
+    }
+
+    *value = sc->heads[oldest_shard];
+    sc->heads[oldest_shard] = NULL;
+    return 0;
+}
+
+static inline int
+vrt_sharded_consumer_poll(struct vrt_sharded_consumer *sc,
+                          struct vrt_value **value)
+{
+    if (sc->timestamp == NULL) {
+        return vrt_sharded_consumer_scan(sc, value);
+    } else {
+        return vrt_sharded_consumer_merge(sc, value);
+    }
+}
+
+static int
+vrt_sharded_consumer_next_deadline(struct vrt_sharded_consumer *sc,
+                                   struct vrt_value **value,
+                                   uint64_t deadline)
+{
+    struct vrt_sharded_queue  *sq = sc->queue;
+    bool  first = true;
+    unsigned int  key = 0;
+
+    if (CORK_UNLIKELY(sc->finished_count == sq->shard_count)) {
+        return VRT_QUEUE_EOF;
+    }
+
+    while (true) {
+        unsigned int  i;
+        int  rc = vrt_sharded_consumer_poll(sc, value);
+        if (rc != VRT_QUEUE_AGAIN) {
+            return rc;
+        }
+
+        if (deadline != VRT_WAIT_FOREVER &&
+            (deadline == 0 || vrt_now_ns() >= deadline)) {
+            return VRT_QUEUE_AGAIN;
+        }
+
+        /* Ask every shard to wake us up, and then (as the notifier protocol
+         * requires) check them all again before we go to sleep. */
+        for (i = 0; i < sq->shard_count; i++) {
+            vrt_queue_arm_notifier(sq->shards[i], &sc->notifier);
+        }
+        rc = vrt_sharded_consumer_poll(sc, value);
+        if (rc != VRT_QUEUE_AGAIN) {
+            return rc;
+        }
+
+        rii_check(vrt_yield_strategy_wait
+                  (sc->yield, first, &sc->wakeup, &key, deadline,
+                   sq->name, sc->name));
+        first = false;
+    }
+}
+
+int
+vrt_sharded_consumer_next(struct vrt_sharded_consumer *sc,
+                          struct vrt_value **value)
+{
+    return vrt_sharded_consumer_next_deadline(sc, value, VRT_WAIT_FOREVER);
+}
+
+int
+vrt_sharded_consumer_try_next(struct vrt_sharded_consumer *sc,
+                              struct vrt_value **value)
+{
+    return vrt_sharded_consumer_next_deadline(sc, value, 0);
+}
+
+int
+vrt_sharded_consumer_next_until(struct vrt_sharded_consumer *sc,
+                                struct vrt_value **value, uint64_t deadline)
+{
+    return vrt_sharded_consumer_next_deadline(sc, value, deadline);
+}
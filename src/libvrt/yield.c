@@ -7,10 +7,20 @@
  * ----------------------------------------------------------------------
  */
 
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #include <libcork/core.h>
 
+#include "vrt/scheduler.h"
 #include "vrt/yield.h"
 
 
@@ -50,6 +60,114 @@
 #endif
 
 
+/*-----------------------------------------------------------------------
+ * Event counts
+ */
+
+void
+vrt_eventcount_init(struct vrt_eventcount *ev)
+{
+    vrt_atomic_asymmetric_init();
+    ev->shared = false;
+    ev->seq = 0;
+}
+
+void
+vrt_eventcount_init_shared(struct vrt_eventcount *ev)
+{
+    ev->shared = true;
+    ev->seq = 0;
+}
+
+/* Sets one of the waiter bits, returning the new sequence number. */
+static unsigned int
+vrt_eventcount_set_bit(struct vrt_eventcount *ev, unsigned int bit)
+{
+    unsigned int  seq = ev->seq;
+    while (!(seq & bit)) {
+        unsigned int  old = cork_uint_atomic_cas(&ev->seq, seq, seq | bit);
+        if (old == seq) {
+            seq |= bit;
+            break;
+        }
+        seq = old;
+    }
+
+    /* Whether or not someone else set the waiter bit, we need a barrier
+     * before the caller checks its condition.  Notifiers only use a light
+     * barrier, so for a private event count, we have to use the heavy one,
+     * even though the compare-and-swap is already a full barrier. */
+    if (ev->shared) {
+        vrt_atomic_full_barrier();
+    } else {
+        vrt_atomic_heavy_barrier();
+    }
+    return seq;
+}
+
+unsigned int
+vrt_eventcount_prepare_wait(struct vrt_eventcount *ev)
+{
+    return vrt_eventcount_set_bit(ev, VRT_EVENTCOUNT_SLEEPING);
+}
+
+void
+vrt_eventcount_prepare_arm(struct vrt_eventcount *ev)
+{
+    vrt_eventcount_set_bit(ev, VRT_EVENTCOUNT_ARMED);
+}
+
+void
+vrt_eventcount_wait(struct vrt_eventcount *ev, unsigned int key,
+                    uint64_t deadline)
+{
+#if defined(__linux__)
+    struct timespec  timeout;
+    struct timespec  *timeout_ptr = NULL;
+    if (deadline != VRT_WAIT_FOREVER) {
+        uint64_t  now = vrt_now_ns();
+        uint64_t  remaining = (deadline > now)? deadline - now: 0;
+        timeout.tv_sec = remaining / 1000000000;
+        timeout.tv_nsec = remaining % 1000000000;
+        timeout_ptr = &timeout;
+    }
+    /* If the sequence number has already moved on from key, this returns
+     * immediately. */
+    syscall(SYS_futex, &ev->seq, ev->shared? FUTEX_WAIT: FUTEX_WAIT_PRIVATE,
+            key, timeout_ptr, NULL, 0);
+#else
+    THREAD_YIELD();
+#endif
+}
+
+unsigned int
+vrt_eventcount_wake(struct vrt_eventcount *ev)
+{
+    unsigned int  seq = ev->seq;
+    while (seq & VRT_EVENTCOUNT_WAITERS) {
+        /* Clear both waiter bits and move on to a new sequence number at the
+         * same time.  Only one notifier will win this race, and only the
+         * winner needs to wake anyone up.  Armed waiters don't sleep on the
+         * futex, so if they're the only ones, we can skip the system call. */
+        unsigned int  next = (seq & ~VRT_EVENTCOUNT_WAITERS) +
+                             (VRT_EVENTCOUNT_WAITERS + 1);
+        unsigned int  old = cork_uint_atomic_cas(&ev->seq, seq, next);
+        if (old == seq) {
+#if defined(__linux__)
+            if (seq & VRT_EVENTCOUNT_SLEEPING) {
+                syscall(SYS_futex, &ev->seq,
+                        ev->shared? FUTEX_WAKE: FUTEX_WAKE_PRIVATE, INT_MAX,
+                        NULL, NULL, 0);
+            }
+#endif
+            return seq & VRT_EVENTCOUNT_WAITERS;
+        }
+        seq = old;
+    }
+    return 0;
+}
+
+
 /*-----------------------------------------------------------------------
  * Thread yielding strategy
  */
@@ -96,6 +214,7 @@ vrt_yield_strategy_threaded(void)
         cork_new(struct vrt_thread_yield_strategy);
     vs->parent.yield = vrt_thread_yield;
     vs->parent.free = vrt_thread_yield_free;
+    vs->parent.wait = NULL;
     return &vs->parent;
 }
 
@@ -122,7 +241,8 @@ vrt_spin_wait_free(struct vrt_yield_strategy *vys)
 
 static const struct vrt_yield_strategy  vrt_spin_wait_strategy = {
     vrt_spin_wait_yield,
-    vrt_spin_wait_free
+    vrt_spin_wait_free,
+    NULL
 };
 
 struct vrt_yield_strategy *
@@ -160,6 +280,9 @@ vrt_hybrid_yield(struct vrt_yield_strategy *vys, bool first,
 
     if (first) {
         ys->counter = 0;
+    } else if (ys->counter < 20 && vrt_scheduler_in_task()) {
+        /* Let the other tasks in our scheduler run */
+        vrt_scheduler_yield();
     } else if (ys->counter < 10) {
         /* Spin-wait */
         PAUSE();
@@ -190,5 +313,290 @@ vrt_yield_strategy_hybrid(void)
         cork_new(struct vrt_hybrid_yield_strategy);
     vs->parent.yield = vrt_hybrid_yield;
     vs->parent.free = vrt_hybrid_yield_free;
+    vs->parent.wait = NULL;
     return &vs->parent;
 }
+
+
+/*-----------------------------------------------------------------------
+ * Blocking strategy
+ */
+
+struct vrt_blocking_yield_strategy {
+    struct vrt_yield_strategy  parent;
+    int  counter;
+};
+
+static void
+vrt_blocking_yield_free(struct vrt_yield_strategy *vys)
+{
+    struct vrt_blocking_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_blocking_yield_strategy, parent);
+    cork_delete(struct vrt_blocking_yield_strategy, ys);
+}
+
+static int
+vrt_blocking_yield(struct vrt_yield_strategy *vys, bool first,
+                   const char *queue_name, const char *name)
+{
+    /* Without an event count, the best we can do is yield to other
+     * threads. */
+    struct vrt_blocking_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_blocking_yield_strategy, parent);
+
+    if (first) {
+        ys->counter = SPIN_COUNT_BEFORE_YIELDING;
+    } else if (ys->counter == 0) {
+        THREAD_YIELD();
+    } else {
+        ys->counter--;
+        PAUSE();
+    }
+
+    return 0;
+}
+
+static int
+vrt_blocking_wait(struct vrt_yield_strategy *vys, bool first,
+                  struct vrt_eventcount *ev, unsigned int *key,
+                  uint64_t deadline, const char *queue_name, const char *name)
+{
+    struct vrt_blocking_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_blocking_yield_strategy, parent);
+
+    if (first) {
+        ys->counter = SPIN_COUNT_BEFORE_YIELDING;
+    }
+
+    if (ys->counter > 0) {
+        ys->counter--;
+        PAUSE();
+    } else if (*key == 0) {
+        /* Let the caller check its condition one more time before we go to
+         * sleep. */
+        *key = vrt_eventcount_prepare_wait(ev);
+    } else {
+        DEBUG("[%s] %s: Sleeping\n", queue_name, name);
+        vrt_eventcount_wait(ev, *key, deadline);
+        *key = 0;
+    }
+
+    return 0;
+}
+
+struct vrt_yield_strategy *
+vrt_yield_strategy_blocking(void)
+{
+    struct vrt_blocking_yield_strategy  *vs =
+        cork_new(struct vrt_blocking_yield_strategy);
+    vs->parent.yield = vrt_blocking_yield;
+    vs->parent.free = vrt_blocking_yield_free;
+    vs->parent.wait = vrt_blocking_wait;
+    return &vs->parent;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Adaptive strategy
+ */
+
+/* The adaptive strategy measures how long it's been waiting in nanoseconds,
+ * rather than counting loop iterations, since the cost of a PAUSE varies by
+ * an order of magnitude between CPUs.  On x86 we read the timestamp counter,
+ * which is much cheaper than clock_gettime, and calibrate it against the
+ * monotonic clock the first time that anyone creates an adaptive
+ * strategy. */
+
+/* The range of spin budgets that we'll use.  Any wait longer than the
+ * maximum isn't worth spinning for at all. */
+#define ADAPTIVE_MIN_SPIN_NS  1000
+#define ADAPTIVE_MAX_SPIN_NS  50000
+
+/* How long we yield to other threads, once we're done spinning, before we go
+ * to sleep. */
+#define ADAPTIVE_YIELD_NS  20000
+
+/* The weight of each new wait in the moving average is 1/2^this. */
+#define ADAPTIVE_EWMA_SHIFT  3
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+static inline uint64_t
+vrt_read_tsc(void)
+{
+    uint32_t  lo;
+    uint32_t  hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static pthread_once_t  tsc_calibrated = PTHREAD_ONCE_INIT;
+static double  tsc_ns_per_tick = 1.0;
+
+static void
+vrt_calibrate_tsc(void)
+{
+    uint64_t  start_ns = vrt_now_ns();
+    uint64_t  start_tsc = vrt_read_tsc();
+    uint64_t  end_ns;
+    uint64_t  end_tsc;
+    do {
+        end_ns = vrt_now_ns();
+    } while (end_ns - start_ns < 1000000);
+    end_tsc = vrt_read_tsc();
+    if (end_tsc > start_tsc) {
+        tsc_ns_per_tick = (double) (end_ns - start_ns) / (end_tsc - start_tsc);
+    }
+    DEBUG("TSC runs at %.3f ticks/ns\n", 1 / tsc_ns_per_tick);
+}
+
+#define vrt_adaptive_calibrate() \
+    pthread_once(&tsc_calibrated, vrt_calibrate_tsc)
+#define vrt_adaptive_ticks()  vrt_read_tsc()
+#define vrt_adaptive_ticks_to_ns(t)  ((uint64_t) ((t) * tsc_ns_per_tick))
+
+#else
+#define vrt_adaptive_calibrate()  /* do nothing */
+#define vrt_adaptive_ticks()  vrt_now_ns()
+#define vrt_adaptive_ticks_to_ns(t)  (t)
+#endif
+
+struct vrt_adaptive_yield_strategy {
+    struct vrt_yield_strategy  parent;
+    /* When the current wait started, and when we were last called during
+     * it, in ticks */
+    uint64_t  start;
+    uint64_t  last;
+    /* A moving average of how long recent waits have lasted */
+    uint64_t  average_ns;
+    /* How long we'll spin during the current wait */
+    uint64_t  spin_ns;
+    bool  waited;
+};
+
+static void
+vrt_adaptive_yield_free(struct vrt_yield_strategy *vys)
+{
+    struct vrt_adaptive_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_adaptive_yield_strategy, parent);
+    cork_delete(struct vrt_adaptive_yield_strategy, ys);
+}
+
+/* Starts a new wait, and returns how long we've been waiting, in
+ * nanoseconds. */
+static uint64_t
+vrt_adaptive_elapsed(struct vrt_adaptive_yield_strategy *ys, bool first)
+{
+    uint64_t  now = vrt_adaptive_ticks();
+
+    if (first) {
+        /* We don't get told when a wait ends, but the last time we were
+         * called during the previous wait (or woke up from a sleep during
+         * it) is a close enough estimate. */
+        if (ys->waited) {
+            int64_t  sample = vrt_adaptive_ticks_to_ns(ys->last - ys->start);
+            int64_t  average = ys->average_ns;
+            ys->average_ns = average +
+                ((sample - average) >> ADAPTIVE_EWMA_SHIFT);
+        }
+
+        /* If recent waits have been short enough to spin through, spin for
+         * a bit longer than the typical wait.  Otherwise spinning is a
+         * waste of time, and we should get out of the way as quickly as
+         * possible. */
+        if (ys->average_ns > ADAPTIVE_MAX_SPIN_NS) {
+            ys->spin_ns = ADAPTIVE_MIN_SPIN_NS;
+        } else if (2 * ys->average_ns < ADAPTIVE_MIN_SPIN_NS) {
+            ys->spin_ns = ADAPTIVE_MIN_SPIN_NS;
+        } else if (2 * ys->average_ns > ADAPTIVE_MAX_SPIN_NS) {
+            ys->spin_ns = ADAPTIVE_MAX_SPIN_NS;
+        } else {
+            ys->spin_ns = 2 * ys->average_ns;
+        }
+
+        ys->start = now;
+        ys->waited = true;
+    }
+
+    ys->last = now;
+    return vrt_adaptive_ticks_to_ns(now - ys->start);
+}
+
+static int
+vrt_adaptive_yield(struct vrt_yield_strategy *vys, bool first,
+                   const char *queue_name, const char *name)
+{
+    struct vrt_adaptive_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_adaptive_yield_strategy, parent);
+    uint64_t  elapsed = vrt_adaptive_elapsed(ys, first);
+
+    if (elapsed < ys->spin_ns) {
+        PAUSE();
+    } else if (elapsed < ys->spin_ns + ADAPTIVE_YIELD_NS) {
+        THREAD_YIELD();
+    } else {
+        /* Without an event count, we can't sleep until someone wakes us
+         * up, so sleep for a fraction of how long we've already waited. */
+        uint64_t  sleep_us = elapsed / 8000;
+        DEBUG("[%s] %s: Sleeping for %" PRIu64 "us\n",
+              queue_name, name, sleep_us);
+        usleep((sleep_us < 1000)? sleep_us: 1000);
+        ys->last = vrt_adaptive_ticks();
+    }
+
+    return 0;
+}
+
+static int
+vrt_adaptive_wait(struct vrt_yield_strategy *vys, bool first,
+                  struct vrt_eventcount *ev, unsigned int *key,
+                  uint64_t deadline, const char *queue_name, const char *name)
+{
+    struct vrt_adaptive_yield_strategy  *ys =
+        cork_container_of(vys, struct vrt_adaptive_yield_strategy, parent);
+    uint64_t  elapsed = vrt_adaptive_elapsed(ys, first);
+
+    if (elapsed < ys->spin_ns) {
+        PAUSE();
+    } else if (elapsed < ys->spin_ns + ADAPTIVE_YIELD_NS) {
+        THREAD_YIELD();
+    } else if (*key == 0) {
+        *key = vrt_eventcount_prepare_wait(ev);
+    } else {
+        DEBUG("[%s] %s: Sleeping\n", queue_name, name);
+        vrt_eventcount_wait(ev, *key, deadline);
+        *key = 0;
+        ys->last = vrt_adaptive_ticks();
+    }
+
+    return 0;
+}
+
+struct vrt_yield_strategy *
+vrt_yield_strategy_adaptive(void)
+{
+    struct vrt_adaptive_yield_strategy  *vs =
+        cork_new(struct vrt_adaptive_yield_strategy);
+    vrt_adaptive_calibrate();
+    vs->parent.yield = vrt_adaptive_yield;
+    vs->parent.free = vrt_adaptive_yield_free;
+    vs->parent.wait = vrt_adaptive_wait;
+    vs->start = 0;
+    vs->last = 0;
+    vs->average_ns = 0;
+    vs->spin_ns = ADAPTIVE_MIN_SPIN_NS;
+    vs->waited = false;
+    return &vs->parent;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Deadlines
+ */
+
+uint64_t
+vrt_now_ns(void)
+{
+    struct timespec  now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
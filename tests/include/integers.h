@@ -13,12 +13,17 @@
 
 /* A sample vrt_value_type that stores a single int64_t value. */
 
+#include <poll.h>
+#include <sched.h>
 #include <stdlib.h>
 
 #include <libcork/core.h>
 #include <libcork/helpers/errors.h>
 
+#include "vrt/journal.h"
 #include "vrt/queue.h"
+#include "vrt/relay.h"
+#include "vrt/shard.h"
 #include "vrt/value.h"
 
 
@@ -34,6 +39,10 @@ struct vrt_value_int {
 struct vrt_value_type *
 vrt_value_type_int(void);
 
+/* The same value type, but stored inline in the queue */
+struct vrt_value_type *
+vrt_value_type_int_inline(void);
+
 
 /*-----------------------------------------------------------------------
  * Generate processor
@@ -65,6 +74,151 @@ generate_integers(void *ud)
 }
 
 
+/* The same, but claiming and publishing several values at a time */
+#define GENERATE_BULK_SIZE  64
+
+CORK_ATTR_UNUSED
+static void *
+generate_integers_bulk(void *ud)
+{
+    struct generate_config  *c = ud;
+    struct vrt_value  *vvalues[GENERATE_BULK_SIZE];
+    int32_t  i = 0;
+    while (i < c->count) {
+        unsigned int  j;
+        unsigned int  wanted = GENERATE_BULK_SIZE;
+        unsigned int  claimed;
+        if (c->count - i < wanted) {
+            wanted = c->count - i;
+        }
+        rpi_check(vrt_producer_claim_many(c->p, wanted, vvalues, &claimed));
+        for (j = 0; j < claimed; j++) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalues[j], struct vrt_value_int, parent);
+            value->value = i++;
+        }
+        rpi_check(vrt_producer_publish_many(c->p, claimed));
+    }
+
+    /* Send an EOF */
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+
+/* The same, but publishing every few values instead of waiting for the end
+ * of each batch */
+#define GENERATE_PUBLISH_INTERVAL  3
+
+CORK_ATTR_UNUSED
+static void *
+generate_integers_interval(void *ud)
+{
+    struct generate_config  *c = ud;
+    vrt_producer_set_publish_interval(c->p, GENERATE_PUBLISH_INTERVAL);
+    return generate_integers(ud);
+}
+
+
+/* The same, but never blocking inside of the queue.  Whenever the queue is
+ * full, we give up the CPU ourselves, like an event loop would while it waits
+ * for the queue to drain. */
+CORK_ATTR_UNUSED
+static void *
+generate_integers_try(void *ud)
+{
+    struct generate_config  *c = ud;
+    int32_t  i;
+    for (i = 0; i < c->count; i++) {
+        int  rc;
+        struct vrt_value  *vvalue;
+        struct vrt_value_int  *value;
+        while ((rc = vrt_producer_try_claim(c->p, &vvalue))
+               == VRT_QUEUE_AGAIN) {
+            sched_yield();
+        }
+        rpi_check(rc);
+        value = cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value = i;
+        rpi_check(vrt_producer_publish(c->p));
+    }
+
+    /* Send an EOF */
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+
+/* The same, but once we've generated (and flushed) our values, we wait for
+ * *hold to be cleared, and then detach from the queue instead of sending a
+ * plain EOF.  That keeps the producer attached while other clients come and
+ * go. */
+struct generate_detach_config {
+    struct vrt_producer  *p;
+    int64_t  count;
+    volatile int  *hold;
+};
+
+CORK_ATTR_UNUSED
+static void *
+generate_integers_detach(void *ud)
+{
+    struct generate_detach_config  *c = ud;
+    int32_t  i;
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_int  *value;
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value = i;
+        rpi_check(vrt_producer_publish(c->p));
+    }
+
+    rpi_check(vrt_producer_flush(c->p));
+    while (*c->hold) {
+        sched_yield();
+    }
+    rpi_check(vrt_producer_detach(c->p));
+    return NULL;
+}
+
+
+/* The same, but tagging each value with a partition key.  There are only a
+ * handful of distinct keys, so that every member of a partitioned group gets
+ * some of them. */
+#define PARTITION_KEY_COUNT  16
+
+CORK_ATTR_UNUSED
+static void *
+generate_integers_partitioned(void *ud)
+{
+    struct generate_config  *c = ud;
+    int32_t  i;
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_int  *value;
+        rpi_check(vrt_producer_claim(c->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value = i;
+        vrt_producer_set_partition(c->p, vvalue, i % PARTITION_KEY_COUNT);
+        rpi_check(vrt_producer_publish(c->p));
+    }
+
+    /* Send an EOF */
+    rpi_check(vrt_producer_eof(c->p));
+    return NULL;
+}
+
+/* The same partition key, for use with vrt_queue_set_partition_key. */
+CORK_ATTR_UNUSED
+static uint64_t
+integer_partition_key(struct vrt_value *vvalue)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    return value->value % PARTITION_KEY_COUNT;
+}
+
 /*-----------------------------------------------------------------------
  * Multiply processor
  */
@@ -126,6 +280,204 @@ sum_integers(void *ud)
 }
 
 
+/* The same, but processing a batch of values at a time */
+CORK_ATTR_UNUSED
+static void *
+sum_integers_batch(void *ud)
+{
+    int  rc;
+    struct sum_config  *c = ud;
+    vrt_value_id  first;
+    unsigned int  count;
+    int64_t  sum = 0;
+    while ((rc = vrt_consumer_next_batch(c->c, &first, &count))
+           != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            unsigned int  i;
+            for (i = 0; i < count; i++) {
+                struct vrt_value  *vvalue =
+                    vrt_queue_get(c->c->queue, first + i);
+                struct vrt_value_int  *value =
+                    cork_container_of(vvalue, struct vrt_value_int, parent);
+                sum += value->value;
+            }
+        }
+    }
+    if (rc == VRT_QUEUE_EOF) {
+        *c->result = sum;
+    }
+    return NULL;
+}
+
+
+/* The same, but updating our cursor every few values, instead of waiting
+ * until we run out of available values */
+#define SUM_COMMIT_INTERVAL  3
+
+CORK_ATTR_UNUSED
+static void *
+sum_integers_commit(void *ud)
+{
+    struct sum_config  *c = ud;
+    vrt_consumer_set_commit_interval(c->c, SUM_COMMIT_INTERVAL, 0);
+    return sum_integers(ud);
+}
+
+
+/* The same, but waiting at most a millisecond at a time for each value */
+#define SUM_UNTIL_TIMEOUT  1000000
+
+CORK_ATTR_UNUSED
+static void *
+sum_integers_until(void *ud)
+{
+    int  rc;
+    struct sum_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int64_t  sum = 0;
+    while ((rc = vrt_consumer_next_until
+            (c->c, &vvalue, vrt_now_ns() + SUM_UNTIL_TIMEOUT))
+           != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalue, struct vrt_value_int, parent);
+            sum += value->value;
+        }
+    }
+    if (rc == VRT_QUEUE_EOF) {
+        *c->result = sum;
+    }
+    return NULL;
+}
+
+
+/* The same, but driven by an event loop that waits on the consumer's
+ * eventfd.  (The eventfd must be created before the clients start.) */
+CORK_ATTR_UNUSED
+static void *
+sum_integers_eventfd(void *ud)
+{
+    int  rc;
+    struct sum_config  *c = ud;
+    struct vrt_value  *vvalue;
+    struct pollfd  pfd;
+    int64_t  sum = 0;
+
+    pfd.fd = c->c->eventfd;
+    pfd.events = POLLIN;
+    while ((rc = vrt_consumer_try_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalue, struct vrt_value_int, parent);
+            sum += value->value;
+        } else if (rc == VRT_QUEUE_AGAIN) {
+            if (vrt_consumer_arm(c->c)) {
+                if (poll(&pfd, 1, -1) < 0) {
+                    return NULL;
+                }
+                rpi_check(vrt_consumer_eventfd_clear(c->c));
+            }
+        }
+    }
+    if (rc == VRT_QUEUE_EOF) {
+        *c->result = sum;
+    }
+    return NULL;
+}
+
+
+/* The same, but also checking that we see each partition key's values in
+ * order, and recording which keys we've seen.  If a key's values show up out
+ * of order, the result is -1. */
+struct partitioned_sum_config {
+    struct vrt_consumer  *c;
+    int64_t  *result;
+    uint32_t  keys_seen;
+};
+
+CORK_ATTR_UNUSED
+static void
+partitioned_sum_add(struct partitioned_sum_config *c, struct vrt_value *vvalue,
+                    int32_t *last_values, bool *in_order, int64_t *sum)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    unsigned int  key = value->value % PARTITION_KEY_COUNT;
+    if (value->value <= last_values[key]) {
+        *in_order = false;
+    }
+    last_values[key] = value->value;
+    c->keys_seen |= 1 << key;
+    *sum += value->value;
+}
+
+CORK_ATTR_UNUSED
+static void *
+sum_integers_partitioned(void *ud)
+{
+    int  rc;
+    struct partitioned_sum_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int64_t  sum = 0;
+    int32_t  last_values[PARTITION_KEY_COUNT];
+    bool  in_order = true;
+    unsigned int  i;
+
+    for (i = 0; i < PARTITION_KEY_COUNT; i++) {
+        last_values[i] = -1;
+    }
+    c->keys_seen = 0;
+
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            partitioned_sum_add(c, vvalue, last_values, &in_order, &sum);
+        }
+    }
+    if (rc == VRT_QUEUE_EOF) {
+        *c->result = in_order? sum: -1;
+    }
+    return NULL;
+}
+
+/* The same, but processing a batch of values at a time, and skipping the
+ * values in each batch that belong to other members of the group */
+CORK_ATTR_UNUSED
+static void *
+sum_integers_partitioned_batch(void *ud)
+{
+    int  rc;
+    struct partitioned_sum_config  *c = ud;
+    vrt_value_id  first;
+    unsigned int  count;
+    int64_t  sum = 0;
+    int32_t  last_values[PARTITION_KEY_COUNT];
+    bool  in_order = true;
+    unsigned int  i;
+
+    for (i = 0; i < PARTITION_KEY_COUNT; i++) {
+        last_values[i] = -1;
+    }
+    c->keys_seen = 0;
+
+    while ((rc = vrt_consumer_next_batch(c->c, &first, &count))
+           != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            for (i = 0; i < count; i++) {
+                vrt_value_id  id = first + i;
+                if (vrt_consumer_owns_value(c->c, id)) {
+                    partitioned_sum_add
+                        (c, vrt_queue_get(c->c->queue, id),
+                         last_values, &in_order, &sum);
+                }
+            }
+        }
+    }
+    if (rc == VRT_QUEUE_EOF) {
+        *c->result = in_order? sum: -1;
+    }
+    return NULL;
+}
+
 /*-----------------------------------------------------------------------
  * Noop processor
  */
@@ -159,4 +511,194 @@ noop_integers(void *ud)
     return NULL;
 }
 
+
+/*-----------------------------------------------------------------------
+ * Relay processor
+ */
+
+struct relay_config {
+    struct vrt_relay  *relay;
+};
+
+CORK_ATTR_UNUSED
+static void *
+relay_integers(void *ud)
+{
+    struct relay_config  *c = ud;
+    rpi_check(vrt_relay_run(c->relay));
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Journals
+ */
+
+struct journal_config {
+    struct vrt_journal  *journal;
+};
+
+CORK_ATTR_UNUSED
+static void *
+journal_integers(void *ud)
+{
+    struct journal_config  *c = ud;
+    rpi_check(vrt_journal_run(c->journal));
+    return NULL;
+}
+
+/* Replays everything in the journal after a checkpoint, and then generates
+ * new integers with the same producer. */
+struct replay_config {
+    struct vrt_journal  *journal;
+    uint64_t  after;
+    struct generate_config  generate;
+};
+
+CORK_ATTR_UNUSED
+static void *
+replay_integers(void *ud)
+{
+    struct replay_config  *c = ud;
+    rpi_check(vrt_journal_replay(c->journal, c->generate.p, c->after));
+    return generate_integers(&c->generate);
+}
+
+/* Sums the integers that come after a checkpoint in the journal, and keeps
+ * track of the last journal position that we've processed. */
+struct sum_journaled_config {
+    struct vrt_consumer  *c;
+    struct vrt_journal  *journal;
+    uint64_t  after;
+    int64_t  *result;
+    uint64_t  *last;
+};
+
+CORK_ATTR_UNUSED
+static void *
+sum_journaled_integers(void *ud)
+{
+    int  rc;
+    struct sum_journaled_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int64_t  sum = 0;
+    uint64_t  last = c->after;
+    while ((rc = vrt_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            uint64_t  sequence =
+                vrt_journal_value_sequence(c->journal, vvalue->id);
+            if (sequence > c->after) {
+                struct vrt_value_int  *value =
+                    cork_container_of(vvalue, struct vrt_value_int, parent);
+                sum += value->value;
+                last = sequence;
+            }
+        }
+    }
+    if (rc == VRT_QUEUE_EOF) {
+        *c->result = sum;
+        *c->last = last;
+    }
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Sharded queues
+ */
+
+struct generate_sharded_config {
+    struct vrt_sharded_producer  *p;
+    int64_t  count;
+};
+
+/* Generates integers into a sharded queue.  Keyed producers use each value
+ * as its key. */
+CORK_ATTR_UNUSED
+static void *
+generate_integers_sharded(void *ud)
+{
+    struct generate_sharded_config  *c = ud;
+    int32_t  i;
+    for (i = 0; i < c->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_int  *value;
+        if (c->p->keyed) {
+            rpi_check(vrt_sharded_producer_claim_key(c->p, i, &vvalue));
+        } else {
+            rpi_check(vrt_sharded_producer_claim(c->p, &vvalue));
+        }
+        value = cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value = i;
+        rpi_check(vrt_sharded_producer_publish(c->p));
+    }
+    rpi_check(vrt_sharded_producer_eof(c->p));
+    return NULL;
+}
+
+struct sum_sharded_config {
+    struct vrt_sharded_consumer  *c;
+    int64_t  *result;
+};
+
+CORK_ATTR_UNUSED
+static void *
+sum_integers_sharded(void *ud)
+{
+    int  rc;
+    struct sum_sharded_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int64_t  sum = 0;
+    while ((rc = vrt_sharded_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalue, struct vrt_value_int, parent);
+            sum += value->value;
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            return NULL;
+        }
+    }
+    *c->result = sum;
+    return NULL;
+}
+
+/* Uses an integer value as its own timestamp. */
+CORK_ATTR_UNUSED
+static uint64_t
+integer_timestamp(struct vrt_value *vvalue)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    return value->value;
+}
+
+/* Like sum_integers_sharded, but for a consumer that merges its shards using
+ * integer_timestamp.  If any values arrive out of order, the result is -1. */
+CORK_ATTR_UNUSED
+static void *
+merge_integers_sharded(void *ud)
+{
+    int  rc;
+    struct sum_sharded_config  *c = ud;
+    struct vrt_value  *vvalue;
+    int64_t  sum = 0;
+    int32_t  last = 0;
+    while ((rc = vrt_sharded_consumer_next(c->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            struct vrt_value_int  *value =
+                cork_container_of(vvalue, struct vrt_value_int, parent);
+            if (value->value < last) {
+                *c->result = -1;
+                return NULL;
+            }
+            last = value->value;
+            sum += value->value;
+        } else if (rc != VRT_QUEUE_FLUSH) {
+            return NULL;
+        }
+    }
+    *c->result = sum;
+    return NULL;
+}
+
 #endif /* VRT_TESTS_INTEGERS */
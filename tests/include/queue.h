@@ -55,5 +55,29 @@ vrt_test_queue_threaded_hybrid(struct vrt_queue *q,
                                struct vrt_queue_client *clients,
                                vrt_clock *elapsed);
 
+/** Run each client in a separate thread, but use the blocking yield
+ * strategy */
+int
+vrt_test_queue_threaded_blocking(struct vrt_queue *q,
+                                 struct vrt_queue_client *clients,
+                                 vrt_clock *elapsed);
+
+/** Run each client in a separate thread, but use the adaptive yield
+ * strategy */
+int
+vrt_test_queue_threaded_adaptive(struct vrt_queue *q,
+                                 struct vrt_queue_client *clients,
+                                 vrt_clock *elapsed);
+
+/** Run every client as a task in a scheduler with a small, fixed number of
+ * worker threads, using the coroutine yield strategy.  Most of the tests
+ * have more clients than this, so the clients have to take turns. */
+#define SCHEDULER_THREAD_COUNT  2
+
+int
+vrt_test_queue_scheduled(struct vrt_queue *q,
+                         struct vrt_queue_client *clients,
+                         vrt_clock *elapsed);
+
 
 #endif /* VRT_TESTS_QUEUE */
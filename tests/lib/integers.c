@@ -7,6 +7,8 @@
  * ----------------------------------------------------------------------
  */
 
+#include <string.h>
+
 #include <libcork/core.h>
 #include <libcork/helpers/errors.h>
 
@@ -28,9 +30,47 @@ vrt_value_int_free(struct vrt_value_type *type, struct vrt_value *vself)
     cork_delete(struct vrt_value_int, self);
 }
 
+static ssize_t
+vrt_value_int_serialize(struct vrt_value_type *type, struct vrt_value *vself,
+                        void *buf, size_t size)
+{
+    struct vrt_value_int  *self =
+        cork_container_of(vself, struct vrt_value_int, parent);
+    if (size >= sizeof(int32_t)) {
+        memcpy(buf, &self->value, sizeof(int32_t));
+    }
+    return sizeof(int32_t);
+}
+
+static int
+vrt_value_int_deserialize(struct vrt_value_type *type,
+                          struct vrt_value *vself,
+                          const void *buf, size_t size)
+{
+    struct vrt_value_int  *self =
+        cork_container_of(vself, struct vrt_value_int, parent);
+    if (size != sizeof(int32_t)) {
+        cork_error_set_printf
+            (CORK_UNKNOWN_ERROR, "Invalid serialized integer");
+        return -1;
+    }
+    memcpy(&self->value, buf, sizeof(int32_t));
+    return 0;
+}
+
 static struct vrt_value_type  _vrt_value_type_int = {
     vrt_value_int_new,
-    vrt_value_int_free
+    vrt_value_int_free,
+    0, 0,
+    vrt_value_int_serialize,
+    vrt_value_int_deserialize
+};
+
+static struct vrt_value_type  _vrt_value_type_int_inline = {
+    NULL,
+    NULL,
+    sizeof(struct vrt_value_int),
+    sizeof(int32_t)
 };
 
 
@@ -39,3 +79,9 @@ vrt_value_type_int(void)
 {
     return &_vrt_value_type_int;
 }
+
+struct vrt_value_type *
+vrt_value_type_int_inline(void)
+{
+    return &_vrt_value_type_int_inline;
+}
@@ -14,6 +14,7 @@
 #include <pthread.h>
 
 #include "vrt/queue.h"
+#include "vrt/scheduler.h"
 
 #include "helpers.h"
 #include "queue.h"
@@ -25,6 +26,7 @@ vrt_test_queue_threaded(struct vrt_queue *q, struct vrt_queue_client *clients,
     vrt_clock  start_time;
     vrt_clock  end_time;
 
+    rii_check(vrt_queue_start(q));
     vrt_get_clock(&start_time);
 
     size_t  i;
@@ -70,6 +72,7 @@ vrt_test_queue_threaded_spin(struct vrt_queue *q,
     vrt_clock  start_time;
     vrt_clock  end_time;
 
+    rii_check(vrt_queue_start(q));
     vrt_get_clock(&start_time);
 
     size_t  i;
@@ -115,6 +118,7 @@ vrt_test_queue_threaded_hybrid(struct vrt_queue *q,
     vrt_clock  start_time;
     vrt_clock  end_time;
 
+    rii_check(vrt_queue_start(q));
     vrt_get_clock(&start_time);
 
     size_t  i;
@@ -151,3 +155,132 @@ vrt_test_queue_threaded_hybrid(struct vrt_queue *q,
     *elapsed = (end_time - start_time);
     return 0;
 }
+
+int
+vrt_test_queue_threaded_blocking(struct vrt_queue *q,
+                                   struct vrt_queue_client *clients,
+                                   vrt_clock *elapsed)
+{
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    rii_check(vrt_queue_start(q));
+    vrt_get_clock(&start_time);
+
+    size_t  i;
+    size_t  client_count = 0;
+    struct vrt_queue_client  *client;
+    for (client = clients; client->run != NULL; client++) {
+        client_count++;
+    }
+
+    pthread_t  *thread_ids;
+    thread_ids = cork_calloc(client_count, sizeof(pthread_t));
+
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        p->yield = vrt_yield_strategy_blocking();
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        c->yield = vrt_yield_strategy_blocking();
+    }
+
+    for (i = 0; i < client_count; i++) {
+        pthread_create(&thread_ids[i], NULL, clients[i].run, clients[i].ud);
+    }
+
+    for (i = 0; i < client_count; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    cork_cfree(thread_ids, client_count, sizeof(pthread_t));
+    vrt_get_clock(&end_time);
+
+    *elapsed = (end_time - start_time);
+    return 0;
+}
+
+int
+vrt_test_queue_threaded_adaptive(struct vrt_queue *q,
+                                   struct vrt_queue_client *clients,
+                                   vrt_clock *elapsed)
+{
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    rii_check(vrt_queue_start(q));
+    vrt_get_clock(&start_time);
+
+    size_t  i;
+    size_t  client_count = 0;
+    struct vrt_queue_client  *client;
+    for (client = clients; client->run != NULL; client++) {
+        client_count++;
+    }
+
+    pthread_t  *thread_ids;
+    thread_ids = cork_calloc(client_count, sizeof(pthread_t));
+
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        p->yield = vrt_yield_strategy_adaptive();
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        c->yield = vrt_yield_strategy_adaptive();
+    }
+
+    for (i = 0; i < client_count; i++) {
+        pthread_create(&thread_ids[i], NULL, clients[i].run, clients[i].ud);
+    }
+
+    for (i = 0; i < client_count; i++) {
+        pthread_join(thread_ids[i], NULL);
+    }
+
+    cork_cfree(thread_ids, client_count, sizeof(pthread_t));
+    vrt_get_clock(&end_time);
+
+    *elapsed = (end_time - start_time);
+    return 0;
+}
+
+int
+vrt_test_queue_scheduled(struct vrt_queue *q,
+                         struct vrt_queue_client *clients,
+                         vrt_clock *elapsed)
+{
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    rii_check(vrt_queue_start(q));
+    vrt_get_clock(&start_time);
+
+    size_t  i;
+    struct vrt_queue_client  *client;
+    struct vrt_scheduler  *s = vrt_scheduler_new(SCHEDULER_THREAD_COUNT);
+
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        p->yield = vrt_yield_strategy_coroutine();
+    }
+
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        c->yield = vrt_yield_strategy_coroutine();
+    }
+
+    for (client = clients; client->run != NULL; client++) {
+        vrt_scheduler_add(s, "client", client->run, client->ud);
+    }
+
+    rii_check(vrt_scheduler_run(s));
+    vrt_scheduler_free(s);
+    vrt_get_clock(&end_time);
+
+    *elapsed = (end_time - start_time);
+    return 0;
+}
@@ -0,0 +1,307 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2015, RedJack, LLC.
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "vrt/coro.hh"
+
+/* check.h defines a fail macro, which clashes with the standard library, so
+ * it has to come after any C++ headers. */
+#include <check.h>
+
+extern "C" {
+#include <clogger.h>
+#include <libcork/core.h>
+
+#include "vrt.h"
+
+#include "helpers.h"
+}
+
+
+/*-----------------------------------------------------------------------
+ * Integer value type
+ */
+
+/* The same value type as in integers.h, which we can't include here since
+ * its clients are written in C. */
+
+struct vrt_value_int {
+    struct vrt_value  parent;
+    int32_t  value;
+};
+
+static struct vrt_value_type  vrt_value_type_int = {
+    NULL,
+    NULL,
+    sizeof(struct vrt_value_int),
+    alignof(struct vrt_value_int)
+};
+
+/* cork_container_of relies on void pointer arithmetic, which C++ doesn't
+ * allow, but parent is the first field, so we can cast directly. */
+static int32_t
+int_value(struct vrt_value *vvalue)
+{
+    return reinterpret_cast<struct vrt_value_int *>(vvalue)->value;
+}
+
+static void
+set_int_value(struct vrt_value *vvalue, int32_t value)
+{
+    reinterpret_cast<struct vrt_value_int *>(vvalue)->value = value;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Clients
+ */
+
+#define DEFAULT_GENERATE_COUNT  10
+static int64_t  GENERATE_COUNT = DEFAULT_GENERATE_COUNT;
+
+#define BULK_SIZE  16
+
+static vrt::task
+generate(vrt::producer p, int *rc)
+{
+    for (int32_t i = 0; i < GENERATE_COUNT; i++) {
+        auto  claimed = co_await p.claim();
+        if (claimed.rc != 0) {
+            *rc = claimed.rc;
+            co_return;
+        }
+        set_int_value(claimed.value, i);
+        if (p.publish() != 0) {
+            *rc = -1;
+            co_return;
+        }
+    }
+    *rc = co_await p.eof();
+}
+
+static vrt::task
+generate_bulk(vrt::producer p, int *rc)
+{
+    struct vrt_value  *values[BULK_SIZE];
+    int32_t  i = 0;
+    while (i < GENERATE_COUNT) {
+        unsigned int  count = GENERATE_COUNT - i;
+        if (count > BULK_SIZE) {
+            count = BULK_SIZE;
+        }
+        auto  claimed = co_await p.claim_many(count, values);
+        if (claimed.rc != 0) {
+            *rc = claimed.rc;
+            co_return;
+        }
+        for (unsigned int j = 0; j < claimed.value; j++) {
+            set_int_value(values[j], i++);
+        }
+        if (p.publish_many(claimed.value) != 0) {
+            *rc = -1;
+            co_return;
+        }
+    }
+    *rc = co_await p.eof();
+}
+
+struct sum_result {
+    int  rc;
+    int64_t  sum;
+};
+
+static vrt::task
+sum(vrt::consumer c, struct sum_result *result)
+{
+    for (;;) {
+        auto  next = co_await c.next();
+        if (next.rc == VRT_QUEUE_EOF) {
+            result->rc = 0;
+            co_return;
+        } else if (next.rc != 0) {
+            result->rc = next.rc;
+            co_return;
+        }
+        result->sum += int_value(next.value);
+    }
+}
+
+static vrt::task
+sum_batches(vrt::consumer c, struct sum_result *result)
+{
+    struct vrt_queue  *q = c.get()->queue;
+    for (;;) {
+        auto  next = co_await c.next_batch();
+        if (next.rc == VRT_QUEUE_EOF) {
+            result->rc = 0;
+            co_return;
+        } else if (next.rc != 0) {
+            result->rc = next.rc;
+            co_return;
+        }
+        for (unsigned int i = 0; i < next.value.count; i++) {
+            vrt_value_id  id = (unsigned int) next.value.first + i;
+            result->sum += int_value(vrt_queue_get(q, id));
+        }
+    }
+}
+
+static void *
+run_loop(void *ud)
+{
+    static_cast<vrt::loop *>(ud)->run();
+    return NULL;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Test cases
+ */
+
+static void
+check_sums(struct sum_result *results, size_t count)
+{
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2;
+    for (size_t i = 0; i < count; i++) {
+        fail_unless(results[i].rc == 0,
+                    "Consumer %zu failed (%d)", i, results[i].rc);
+        fail_unless(results[i].sum == expected,
+                    "Consumer %zu sum doesn't match (got %" PRId64
+                    ", expected %" PRId64 ")",
+                    i, results[i].sum, expected);
+    }
+}
+
+/* Runs one producer and consumer_count consumers, each on its own loop if
+ * threaded is true, and all on the same loop otherwise. */
+static void
+run_coro_test(unsigned int queue_size, size_t consumer_count, bool bulk,
+              bool threaded)
+{
+    struct vrt_queue  *q;
+    vrt::loop  producer_loop;
+    vrt::loop  consumer_loop;
+    vrt::loop  &ploop = threaded? producer_loop: consumer_loop;
+    struct sum_result  *results = new struct sum_result[consumer_count]();
+    int  producer_rc = 0;
+    pthread_t  thread;
+
+    fail_if_error(q = vrt_queue_new("queue_sum", &vrt_value_type_int,
+                                    queue_size));
+    ploop.watch(q);
+    if (threaded) {
+        consumer_loop.watch(q);
+    }
+
+    struct vrt_producer  *p;
+    fail_if_error(p = vrt_producer_new("generate", 4, q));
+    vrt::producer  producer(p, ploop);
+    ploop.spawn(bulk? generate_bulk(producer, &producer_rc):
+                      generate(producer, &producer_rc));
+
+    for (size_t i = 0; i < consumer_count; i++) {
+        struct vrt_consumer  *c;
+        fail_if_error(c = vrt_consumer_new("sum", q));
+        vrt::consumer  consumer(c, consumer_loop);
+        consumer_loop.spawn(bulk? sum_batches(consumer, &results[i]):
+                                  sum(consumer, &results[i]));
+    }
+
+    if (threaded) {
+        fail_unless(pthread_create(&thread, NULL, run_loop,
+                                   &producer_loop) == 0,
+                    "Cannot create producer thread");
+    }
+    consumer_loop.run();
+    if (threaded) {
+        pthread_join(thread, NULL);
+    }
+
+    fail_unless(producer_rc == 0, "Producer failed (%d)", producer_rc);
+    check_sums(results, consumer_count);
+    delete[] results;
+    vrt_queue_free(q);
+}
+
+START_TEST(test_coro_single_loop)
+{
+    DESCRIBE_TEST;
+    run_coro_test(16, 4, false, false);
+}
+END_TEST
+
+START_TEST(test_coro_single_loop_bulk)
+{
+    DESCRIBE_TEST;
+    run_coro_test(16, 4, true, false);
+}
+END_TEST
+
+START_TEST(test_coro_threaded)
+{
+    DESCRIBE_TEST;
+    run_coro_test(64, 256, false, true);
+}
+END_TEST
+
+START_TEST(test_coro_threaded_bulk)
+{
+    DESCRIBE_TEST;
+    run_coro_test(64, 256, true, true);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+test_suite()
+{
+    Suite  *s = suite_create("coro");
+
+    TCase  *tc_coro = tcase_create("coro");
+    tcase_add_test(tc_coro, test_coro_single_loop);
+    tcase_add_test(tc_coro, test_coro_single_loop_bulk);
+    tcase_add_test(tc_coro, test_coro_threaded);
+    tcase_add_test(tc_coro, test_coro_threaded_bulk);
+    suite_add_tcase(s, tc_coro);
+
+    return s;
+}
+
+int
+main(int argc, const char **argv)
+{
+    int number_failed;
+    Suite  *suite = test_suite();
+    SRunner  *runner = srunner_create(suite);
+
+    setup_allocator();
+
+    if (argc > 1) {
+        if (sscanf(argv[1], "%" PRId64, &GENERATE_COUNT) != 1) {
+            fprintf(stderr, "Invalid record count: \"%s\"\n", argv[1]);
+            return -1;
+        }
+    }
+
+    vrt_testing_mode();
+    clog_setup_logging();
+    srunner_run_all(runner, CK_NORMAL);
+    number_failed = srunner_ntests_failed(runner);
+    srunner_free(runner);
+
+    return (number_failed == 0)? EXIT_SUCCESS: EXIT_FAILURE;
+}
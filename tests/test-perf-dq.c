@@ -7,7 +7,15 @@
  * ----------------------------------------------------------------------
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <libcork/core.h>
 #include <libcork/ds.h>
 #include <vrt.h>
@@ -65,65 +73,524 @@ unicast_test(uint32_t queue_size, uint64_t batch_size,
     return 0;
 }
 
-/* Three-step Pipeline: 1P -> 1C -> 1C -> 1C */
-CORK_ATTR_UNUSED
+/* Value storage: 1P -> 1C, with a consumer that reads every value, so that we
+ * can compare separately allocated values against values stored inline, and
+ * consuming one value at a time against consuming a batch at a time. */
 static int
-three_step_pipeline_test(uint32_t queue_size, uint64_t batch_size,
+value_storage_test(uint32_t queue_size, uint64_t batch_size,
+                   struct vrt_value_type *value_type, unsigned int flags,
+                   void *(*sum_func)(void *),
                    int (*run_func)
                    (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
 {
+    int64_t  result = 0;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new_with_flags("queue_sum", value_type, queue_size, flags);
+    p = vrt_producer_new("generate", batch_size, q);
+    c = vrt_consumer_new("sum", q);
+
+    struct generate_config  gc = {
+        p, GENERATE_COUNT
+    };
+
+    struct sum_config sc = {
+        c, &result
+    };
+
+    struct vrt_queue_client  clients[] = {
+        {generate_integers, &gc},
+        {sum_func, &sc},
+        {NULL, NULL}
+    };
+
+    run_func(q, clients, &elapsed);
+    vrt_report_clock(elapsed, GENERATE_COUNT);
+    if (flags != 0) {
+        struct vrt_queue_memory_stats  stats;
+        vrt_queue_get_memory_stats(q, &stats);
+        fprintf(stdout, "       %zu/%zu bytes on huge pages, "
+                        "%zu bytes locked\n",
+                stats.huge_page_size, stats.size, stats.locked_size);
+    }
+    vrt_queue_free(q);
     return 0;
 }
 
-
-/* Sequencer: 3P -> 1C */
-CORK_ATTR_UNUSED
+/* Bulk unicast: 1P -> 1C, where the producer claims and publishes several
+ * values at a time. */
 static int
-sequencer_test(uint32_t queue_size, uint64_t batch_size,
-               int (*run_func)
-                   (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+bulk_unicast_test(uint32_t queue_size, uint64_t batch_size,
+                  void *(*generate_func)(void *),
+                  int (*run_func)
+                  (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
 {
     int64_t  result = 0;
     struct vrt_queue  *q;
-    struct vrt_producer  *p1;
-    struct vrt_producer  *p2;
-    struct vrt_producer  *p3;
+    struct vrt_producer  *p;
     struct vrt_consumer  *c;
     vrt_clock  elapsed;
 
-    q = vrt_queue_new("queue_noop", vrt_value_type_int(), queue_size);
-    p1 = vrt_producer_new("generate_1", batch_size, q);
-    p2 = vrt_producer_new("generate_2", batch_size, q);
-    p3 = vrt_producer_new("generate_3", batch_size, q);
+    q = vrt_queue_new("queue_noop", vrt_value_type_int_inline(), queue_size);
+    p = vrt_producer_new("generate", batch_size, q);
     c = vrt_consumer_new("noop", q);
 
-    struct generate_config  gc1 = {
-        p1, GENERATE_COUNT
+    struct generate_config  gc = {
+        p, GENERATE_COUNT
     };
 
-    struct generate_config  gc2 = {
-        p2, GENERATE_COUNT
+    struct noop_config nc = {
+        c, &result
     };
 
-    struct generate_config  gc3 = {
-        p3, GENERATE_COUNT
+    struct vrt_queue_client  clients[] = {
+        {generate_func, &gc},
+        {noop_integers, &nc},
+        {NULL, NULL}
     };
 
-    struct noop_config nc = {
+    run_func(q, clients, &elapsed);
+    vrt_report_clock(elapsed, GENERATE_COUNT);
+    vrt_queue_free(q);
+    return 0;
+}
+
+
+/* A yield strategy that wraps a producer's real one, so that we can see how
+ * often the producer has to wait for consumers to free up slots, and how long
+ * it spends waiting. */
+struct wait_stats {
+    struct vrt_yield_strategy  parent;
+    struct vrt_yield_strategy  *inner;
+    /* The number of times that the producer started waiting */
+    uint64_t  waits;
+    /* The number of times that it yielded or slept while waiting */
+    uint64_t  yields;
+    uint64_t  wait_ns;
+};
+
+static int
+wait_stats_yield(struct vrt_yield_strategy *self, bool first,
+                 const char *queue_name, const char *name)
+{
+    struct wait_stats  *ws =
+        cork_container_of(self, struct wait_stats, parent);
+    uint64_t  start = vrt_now_ns();
+    int  rc = vrt_yield_strategy_yield(ws->inner, first, queue_name, name);
+    ws->waits += first;
+    ws->yields++;
+    ws->wait_ns += vrt_now_ns() - start;
+    return rc;
+}
+
+static int
+wait_stats_wait(struct vrt_yield_strategy *self, bool first,
+                struct vrt_eventcount *ev, unsigned int *key,
+                uint64_t deadline, const char *queue_name, const char *name)
+{
+    struct wait_stats  *ws =
+        cork_container_of(self, struct wait_stats, parent);
+    uint64_t  start = vrt_now_ns();
+    int  rc = vrt_yield_strategy_wait
+        (ws->inner, first, ev, key, deadline, queue_name, name);
+    ws->waits += first;
+    ws->yields++;
+    ws->wait_ns += vrt_now_ns() - start;
+    return rc;
+}
+
+static void
+wait_stats_free(struct vrt_yield_strategy *self)
+{
+    struct wait_stats  *ws =
+        cork_container_of(self, struct wait_stats, parent);
+    vrt_yield_strategy_free(ws->inner);
+    cork_delete(struct wait_stats, ws);
+}
+
+struct wait_stats_generate_config {
+    struct generate_config  gc;
+    struct wait_stats  *stats;
+};
+
+/* Wraps the yield strategy that the test runner gave our producer, and then
+ * generates integers as usual. */
+static void *
+generate_integers_with_wait_stats(void *ud)
+{
+    struct wait_stats_generate_config  *wc = ud;
+    struct wait_stats  *ws = cork_new(struct wait_stats);
+    ws->parent.yield = wait_stats_yield;
+    ws->parent.free = wait_stats_free;
+    ws->parent.wait = wait_stats_wait;
+    ws->inner = wc->gc.p->yield;
+    ws->waits = 0;
+    ws->yields = 0;
+    ws->wait_ns = 0;
+    wc->gc.p->yield = &ws->parent;
+    wc->stats = ws;
+    return generate_integers(&wc->gc);
+}
+
+/* Commit interval: 1P -> 1C, where the consumer updates its cursor every
+ * commit_count values (or only when it runs out of values, if commit_count
+ * is 0).  With a small queue, the producer stalls whenever the consumer is
+ * holding on to too many slots, so we also report how much time the producer
+ * spends waiting for slots. */
+static int
+commit_interval_test(uint32_t queue_size, uint64_t batch_size,
+                     unsigned int commit_count,
+                     int (*run_func)
+                     (struct vrt_queue *, struct vrt_queue_client *,
+                      vrt_clock *))
+{
+    int64_t  result = 0;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_sum", vrt_value_type_int_inline(), queue_size);
+    p = vrt_producer_new("generate", batch_size, q);
+    c = vrt_consumer_new("sum", q);
+    vrt_consumer_set_commit_interval(c, commit_count, 0);
+
+    struct wait_stats_generate_config  wc = {
+        { p, GENERATE_COUNT }, NULL
+    };
+
+    struct sum_config sc = {
         c, &result
     };
 
     struct vrt_queue_client  clients[] = {
-        {generate_integers, &gc1},
-        {generate_integers, &gc2},
-        {generate_integers, &gc3},
-        {noop_integers, &nc},
+        {generate_integers_with_wait_stats, &wc},
+        {sum_integers, &sc},
         {NULL, NULL}
     };
 
+    run_func(q, clients, &elapsed);
+    vrt_report_clock(elapsed, GENERATE_COUNT);
+    fprintf(stdout, "       producer waited %" PRIu64 " times "
+                    "(%" PRIu64 " yields, %.3f ms)\n",
+            wc.stats->waits, wc.stats->yields,
+            (double) wc.stats->wait_ns / 1000000.0);
+    vrt_queue_free(q);
+    return 0;
+}
+
+
+/* Sequencer: NP -> 1C.  The producers share GENERATE_COUNT values between
+ * them, so that the results are comparable as we add more producers. */
+static int
+sequencer_test(uint32_t queue_size, uint64_t batch_size,
+               unsigned int producer_count,
+               int (*run_func)
+                   (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    int64_t  result = 0;
+    unsigned int  i;
+    struct vrt_queue  *q;
+    struct vrt_consumer  *c;
+    struct generate_config  *gcs;
+    struct vrt_queue_client  *clients;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_noop", vrt_value_type_int(), queue_size);
+    gcs = cork_calloc(producer_count, sizeof(struct generate_config));
+    clients = cork_calloc(producer_count + 2, sizeof(struct vrt_queue_client));
+
+    for (i = 0; i < producer_count; i++) {
+        char  name[32];
+        snprintf(name, sizeof(name), "generate_%u", i + 1);
+        gcs[i].p = vrt_producer_new(name, batch_size, q);
+        gcs[i].count = GENERATE_COUNT / producer_count;
+        clients[i].run = generate_integers;
+        clients[i].ud = &gcs[i];
+    }
+
+    c = vrt_consumer_new("noop", q);
+
+    struct noop_config nc = {
+        c, &result
+    };
+
+    clients[producer_count].run = noop_integers;
+    clients[producer_count].ud = &nc;
+    clients[producer_count + 1].run = NULL;
+    clients[producer_count + 1].ud = NULL;
+
     run_func(q, clients, &elapsed);
     /*fprintf(stdout, "Result: %" PRId64 "\n", result);*/
+    vrt_report_clock(elapsed,
+                     (GENERATE_COUNT / producer_count) * producer_count);
+    cork_cfree(clients, producer_count + 2, sizeof(struct vrt_queue_client));
+    cork_cfree(gcs, producer_count, sizeof(struct generate_config));
+    vrt_queue_free(q);
+    return 0;
+}
+
+/* Sharded sequencer: NP -> 1C, where each producer gets its own shard, and
+ * a sharded consumer merges them back together.  This is directly comparable
+ * to sequencer_test with the same number of producers.  If merge is true,
+ * the consumer merges the shards in timestamp order instead of draining
+ * them round-robin. */
+static int
+sharded_test(uint32_t shard_size, uint64_t batch_size,
+             unsigned int producer_count, bool merge)
+{
+    int64_t  result = 0;
+    unsigned int  i;
+    struct vrt_sharded_queue  *sq;
+    struct generate_sharded_config  *gcs;
+    struct sum_sharded_config  sc;
+    pthread_t  *threads;
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    sq = vrt_sharded_queue_new
+        ("queue_sharded", vrt_value_type_int(), producer_count, shard_size);
+    gcs = cork_calloc(producer_count, sizeof(struct generate_sharded_config));
+    threads = cork_calloc(producer_count + 1, sizeof(pthread_t));
+
+    for (i = 0; i < producer_count; i++) {
+        char  name[32];
+        snprintf(name, sizeof(name), "generate_%u", i + 1);
+        gcs[i].p = vrt_sharded_producer_new_lane(name, batch_size, sq);
+        vrt_sharded_producer_set_yield
+            (gcs[i].p, vrt_yield_strategy_threaded());
+        gcs[i].count = GENERATE_COUNT / producer_count;
+    }
+
+    sc.c = vrt_sharded_consumer_new("sum", sq);
+    vrt_sharded_consumer_set_yield(sc.c, vrt_yield_strategy_threaded());
+    sc.result = &result;
+    if (merge) {
+        vrt_sharded_consumer_set_merge(sc.c, integer_timestamp);
+    }
+
+    if (vrt_sharded_queue_start(sq) != 0) {
+        fprintf(stdout, "%s\n", cork_error_message());
+        cork_error_clear();
+        goto done;
+    }
+
+    vrt_get_clock(&start_time);
+    pthread_create(&threads[0], NULL,
+                   merge? merge_integers_sharded: sum_integers_sharded, &sc);
+    for (i = 0; i < producer_count; i++) {
+        pthread_create(&threads[i + 1], NULL, generate_integers_sharded,
+                       &gcs[i]);
+    }
+    for (i = 0; i <= producer_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    vrt_get_clock(&end_time);
+    vrt_report_clock(end_time - start_time,
+                     (GENERATE_COUNT / producer_count) * producer_count);
+
+done:
+    cork_cfree(threads, producer_count + 1, sizeof(pthread_t));
+    cork_cfree(gcs, producer_count, sizeof(struct generate_sharded_config));
+    vrt_sharded_queue_free(sq);
+    return 0;
+}
+
+/* Broadcast: 1P -> NC.  If group_size is nonzero, the consumers are split into
+ * consumer groups of that size, so that the producer only has to check one
+ * cursor per group. */
+static int
+broadcast_test(uint32_t queue_size, uint64_t batch_size,
+               unsigned int consumer_count, unsigned int group_size,
+               int (*run_func)
+                   (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    int64_t  result = 0;
+    unsigned int  i;
+    struct vrt_queue  *q;
+    struct vrt_consumer_group  *g = NULL;
+    struct noop_config  *ncs;
+    struct vrt_queue_client  *clients;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new("queue_noop", vrt_value_type_int(), queue_size);
+    ncs = cork_calloc(consumer_count, sizeof(struct noop_config));
+    clients = cork_calloc(consumer_count + 2, sizeof(struct vrt_queue_client));
+
+    struct generate_config  gc = {
+        vrt_producer_new("generate", batch_size, q), GENERATE_COUNT
+    };
+    clients[0].run = generate_integers;
+    clients[0].ud = &gc;
+
+    for (i = 0; i < consumer_count; i++) {
+        char  name[32];
+        snprintf(name, sizeof(name), "noop_%u", i + 1);
+        ncs[i].c = vrt_consumer_new(name, q);
+        ncs[i].result = &result;
+        if (group_size > 0) {
+            if (i % group_size == 0) {
+                snprintf(name, sizeof(name), "group_%u", i / group_size + 1);
+                g = vrt_consumer_group_new(name, q);
+            }
+            vrt_consumer_group_add(g, ncs[i].c);
+        }
+        clients[i + 1].run = noop_integers;
+        clients[i + 1].ud = &ncs[i];
+    }
+    clients[consumer_count + 1].run = NULL;
+    clients[consumer_count + 1].ud = NULL;
+
+    run_func(q, clients, &elapsed);
     vrt_report_clock(elapsed, GENERATE_COUNT);
+    cork_cfree(clients, consumer_count + 2, sizeof(struct vrt_queue_client));
+    cork_cfree(ncs, consumer_count, sizeof(struct noop_config));
+    vrt_queue_free(q);
+    return 0;
+}
+
+/* NUMA multicast: 1P -> 3C, with the producer and the queue on one NUMA node.
+ * In the LOCAL layout, the consumers run on the same node.  In the REMOTE
+ * layout, they run on another node and read the queue across the
+ * interconnect.  In the REPLICATED layout, they run on another node and read
+ * from a mirror queue on that node, which a relay keeps up to date.  (On a
+ * machine with a single NUMA node, all three layouts use the same node.) */
+
+enum numa_layout {
+    NUMA_LOCAL,
+    NUMA_REMOTE,
+    NUMA_REPLICATED
+};
+
+#define NUMA_CONSUMER_COUNT  3
+
+/* A client that pins itself to the CPUs of a NUMA node before it starts. */
+struct numa_client {
+    struct vrt_queue_client  client;
+    int  node;
+};
+
+static void
+pin_to_numa_node(int node)
+{
+#if defined(__linux__)
+    char  path[64];
+    FILE  *cpulist;
+    cpu_set_t  cpus;
+    unsigned int  first;
+    unsigned int  last;
+    int  count;
+
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/node/node%d/cpulist", node);
+    cpulist = fopen(path, "r");
+    if (cpulist == NULL) {
+        return;
+    }
+
+    /* The file contains a list of ranges, like "0-3,8-11". */
+    CPU_ZERO(&cpus);
+    while ((count = fscanf(cpulist, "%u-%u", &first, &last)) >= 1) {
+        if (count == 1) {
+            last = first;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, &cpus);
+        }
+        if (fgetc(cpulist) != ',') {
+            break;
+        }
+    }
+    fclose(cpulist);
+    sched_setaffinity(0, sizeof(cpus), &cpus);
+#endif
+}
+
+static void *
+run_on_numa_node(void *ud)
+{
+    struct numa_client  *client = ud;
+    pin_to_numa_node(client->node);
+    return client->client.run(client->client.ud);
+}
+
+static int
+numa_multicast_test(uint32_t queue_size, uint64_t batch_size,
+                    enum numa_layout layout)
+{
+    int64_t  result = 0;
+    unsigned int  i;
+    int  local_node = 0;
+    int  remote_node = vrt_numa_node_count() - 1;
+    struct vrt_queue  *q;
+    struct vrt_queue  *mirror = NULL;
+    struct vrt_queue  *consumed_queue;
+    struct vrt_relay  *relay = NULL;
+    struct generate_config  gc;
+    struct relay_config  rc;
+    struct sum_config  scs[NUMA_CONSUMER_COUNT];
+    struct numa_client  ncs[NUMA_CONSUMER_COUNT + 2];
+    struct vrt_queue_client  clients[NUMA_CONSUMER_COUNT + 3];
+    unsigned int  client_count = 0;
+    vrt_clock  elapsed;
+
+    q = vrt_queue_new_on_node
+        ("queue_sum", vrt_value_type_int_inline(), queue_size, 0, local_node);
+    gc.p = vrt_producer_new("generate", batch_size, q);
+    gc.count = GENERATE_COUNT;
+    ncs[client_count].client.run = generate_integers;
+    ncs[client_count].client.ud = &gc;
+    ncs[client_count].node = local_node;
+    client_count++;
+
+    if (layout == NUMA_REPLICATED) {
+        mirror = vrt_queue_new_on_node
+            ("queue_mirror", vrt_value_type_int_inline(), queue_size, 0,
+             remote_node);
+        relay = vrt_relay_new("relay", q, mirror, batch_size);
+        relay->producer->yield = vrt_yield_strategy_threaded();
+        rc.relay = relay;
+        ncs[client_count].client.run = relay_integers;
+        ncs[client_count].client.ud = &rc;
+        ncs[client_count].node = remote_node;
+        client_count++;
+        consumed_queue = mirror;
+    } else {
+        consumed_queue = q;
+    }
+
+    for (i = 0; i < NUMA_CONSUMER_COUNT; i++) {
+        char  name[32];
+        snprintf(name, sizeof(name), "sum_%u", i + 1);
+        scs[i].c = vrt_consumer_new(name, consumed_queue);
+        if (consumed_queue == mirror) {
+            /* The test harness only sets up the source queue's clients. */
+            scs[i].c->yield = vrt_yield_strategy_threaded();
+        }
+        scs[i].result = &result;
+        ncs[client_count].client.run = sum_integers;
+        ncs[client_count].client.ud = &scs[i];
+        ncs[client_count].node =
+            (layout == NUMA_LOCAL)? local_node: remote_node;
+        client_count++;
+    }
+
+    for (i = 0; i < client_count; i++) {
+        clients[i].run = run_on_numa_node;
+        clients[i].ud = &ncs[i];
+    }
+    clients[client_count].run = NULL;
+    clients[client_count].ud = NULL;
+
+    vrt_test_queue_threaded(q, clients, &elapsed);
+    vrt_report_clock(elapsed, GENERATE_COUNT);
+    if (relay != NULL) {
+        vrt_relay_free(relay);
+        vrt_queue_free(mirror);
+    }
     vrt_queue_free(q);
     return 0;
 }
@@ -181,24 +648,250 @@ multicast_test(uint32_t queue_size, uint64_t batch_size,
 
 }
 
-/* Diamond: 1P -> 2C -> 1C */
-CORK_ATTR_UNUSED
+/* Wake latency: 1P -> 1C, where the producer publishes one value at a time,
+ * pausing between each one so that the consumer has to go to sleep.  We
+ * measure how long it takes the consumer to see each value, and how many
+ * system calls the consumer makes per value. */
+#define WAKE_COUNT  10000
+
+struct wake_config {
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    unsigned int  interval_us;
+    uint64_t  count;
+    uint64_t  *sent;
+    uint64_t  latency;
+    uint64_t  wakeups;
+    uint64_t  syscalls;
+};
+
+static void *
+wake_generate(void *ud)
+{
+    struct wake_config  *wc = ud;
+    uint64_t  i;
+    for (i = 0; i < wc->count; i++) {
+        struct vrt_value  *vvalue;
+        struct vrt_value_int  *value;
+        if (wc->interval_us > 0) {
+            usleep(wc->interval_us);
+        }
+        rpi_check(vrt_producer_claim(wc->p, &vvalue));
+        value = cork_container_of(vvalue, struct vrt_value_int, parent);
+        value->value = i;
+        wc->sent[i] = vrt_now_ns();
+        rpi_check(vrt_producer_publish(wc->p));
+    }
+    rpi_check(vrt_producer_eof(wc->p));
+    return NULL;
+}
+
+static void
+wake_receive(struct wake_config *wc, struct vrt_value *vvalue)
+{
+    struct vrt_value_int  *value =
+        cork_container_of(vvalue, struct vrt_value_int, parent);
+    wc->latency += vrt_now_ns() - wc->sent[value->value];
+}
+
+static void *
+wake_consume_blocking(void *ud)
+{
+    int  rc;
+    struct wake_config  *wc = ud;
+    struct vrt_value  *vvalue;
+    while ((rc = vrt_consumer_next(wc->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            wake_receive(wc, vvalue);
+        }
+    }
+    return NULL;
+}
+
+static void *
+wake_consume_eventfd(void *ud)
+{
+    int  rc;
+    struct wake_config  *wc = ud;
+    struct vrt_value  *vvalue;
+    struct pollfd  pfd;
+    pfd.fd = wc->c->eventfd;
+    pfd.events = POLLIN;
+    while ((rc = vrt_consumer_try_next(wc->c, &vvalue)) != VRT_QUEUE_EOF) {
+        if (rc == 0) {
+            wake_receive(wc, vvalue);
+        } else if (rc == VRT_QUEUE_AGAIN && vrt_consumer_arm(wc->c)) {
+            if (poll(&pfd, 1, -1) < 0) {
+                return NULL;
+            }
+            rpi_check(vrt_consumer_eventfd_clear(wc->c));
+            wc->wakeups++;
+            wc->syscalls += 2;
+        }
+    }
+    return NULL;
+}
+
 static int
-diamond_test(uint32_t queue_size, uint64_t batch_size,
-             int (*run_func)
-                 (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+wake_latency_test(uint32_t queue_size, unsigned int interval_us,
+                  uint64_t count, bool use_eventfd,
+                  int (*run_func)
+                  (struct vrt_queue *, struct vrt_queue_client *, vrt_clock *))
+{
+    struct vrt_queue  *q;
+    struct vrt_queue_client  clients[3];
+    vrt_clock  elapsed;
+    struct wake_config  wc;
+
+    q = vrt_queue_new("queue_wake", vrt_value_type_int(), queue_size);
+    memset(&wc, 0, sizeof(wc));
+    wc.p = vrt_producer_new("generate", 1, q);
+    wc.c = vrt_consumer_new("wake", q);
+    wc.interval_us = interval_us;
+    wc.count = count;
+    wc.sent = cork_calloc(count, sizeof(uint64_t));
+    if (use_eventfd && vrt_consumer_eventfd(wc.c) == -1) {
+        fprintf(stdout, "%s\n", cork_error_message());
+        cork_cfree(wc.sent, count, sizeof(uint64_t));
+        vrt_queue_free(q);
+        return -1;
+    }
+
+    clients[0].run = wake_generate;
+    clients[0].ud = &wc;
+    clients[1].run = use_eventfd? wake_consume_eventfd: wake_consume_blocking;
+    clients[1].ud = &wc;
+    clients[2].run = NULL;
+    clients[2].ud = NULL;
+
+    run_func(q, clients, &elapsed);
+    if (use_eventfd) {
+        fprintf(stdout, "%.2f us wake latency, "
+                        "%.3f wakeups/value, %.3f syscalls/value\n",
+                (double) wc.latency / count / 1000,
+                (double) wc.wakeups / count,
+                (double) wc.syscalls / count);
+    } else {
+        fprintf(stdout, "%.2f us wake latency\n",
+                (double) wc.latency / count / 1000);
+    }
+    cork_cfree(wc.sent, count, sizeof(uint64_t));
+    vrt_queue_free(q);
+    return 0;
+}
+
+/* The pipeline tests: 1P -> 3C, where the consumers depend on each other.
+ * If pinned is true, each stage gets its own CPU (as long as there are
+ * enough of them). */
+#define PIPELINE_STAGE_COUNT  4
+
+static void
+pin_pipeline_stages(struct vrt_stage **stages, unsigned int count)
 {
+#if defined(__linux__)
+    cpu_set_t  allowed;
+    unsigned int  i;
+    int  cpu = 0;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+        CPU_COUNT(&allowed) < (int) count) {
+        fprintf(stdout, "(not enough CPUs to pin) ");
+        return;
+    }
+    for (i = 0; i < count; i++, cpu++) {
+        while (!CPU_ISSET(cpu, &allowed)) {
+            cpu++;
+        }
+        vrt_stage_set_cpu(stages[i], cpu);
+    }
+#endif
+}
+
+static int
+run_pipeline_test(uint32_t queue_size, uint64_t batch_size, bool diamond,
+                  bool pinned)
+{
+    int64_t  result = 0;
+    unsigned int  i;
+    struct vrt_queue  *q;
+    struct vrt_pipeline  *pl;
+    struct vrt_stage  *stages[PIPELINE_STAGE_COUNT];
+    struct generate_config  gc;
+    struct noop_config  ncs[PIPELINE_STAGE_COUNT - 1];
+    vrt_clock  start_time;
+    vrt_clock  end_time;
+
+    q = vrt_queue_new("queue_noop", vrt_value_type_int(), queue_size);
+    pl = vrt_pipeline_new("pipeline", q);
+    stages[0] = vrt_pipeline_add_producer
+        (pl, "generate", batch_size, generate_integers, &gc);
+    gc.p = stages[0]->producer;
+    gc.count = GENERATE_COUNT;
+    for (i = 1; i < PIPELINE_STAGE_COUNT; i++) {
+        char  name[32];
+        snprintf(name, sizeof(name), "noop_%u", i);
+        stages[i] = vrt_pipeline_add_consumer
+            (pl, name, noop_integers, &ncs[i - 1]);
+        ncs[i - 1].c = stages[i]->consumer;
+        ncs[i - 1].result = &result;
+    }
+
+    if (diamond) {
+        vrt_pipeline_add_dependency(stages[3], stages[1]);
+        vrt_pipeline_add_dependency(stages[3], stages[2]);
+    } else {
+        vrt_pipeline_add_dependency(stages[2], stages[1]);
+        vrt_pipeline_add_dependency(stages[3], stages[2]);
+    }
+    if (pinned) {
+        pin_pipeline_stages(stages, PIPELINE_STAGE_COUNT);
+    }
+
+    vrt_get_clock(&start_time);
+    if (vrt_pipeline_run(pl) != 0) {
+        fprintf(stdout, "%s\n", cork_error_message());
+        cork_error_clear();
+    } else {
+        vrt_get_clock(&end_time);
+        vrt_report_clock(end_time - start_time, GENERATE_COUNT);
+    }
+    vrt_pipeline_free(pl);
+    vrt_queue_free(q);
     return 0;
 }
 
+/* Three-step Pipeline: 1P -> 1C -> 1C -> 1C */
+static int
+three_step_pipeline_test(uint32_t queue_size, uint64_t batch_size,
+                         bool pinned)
+{
+    return run_pipeline_test(queue_size, batch_size, false, pinned);
+}
+
+/* Diamond: 1P -> 2C -> 1C */
+static int
+diamond_test(uint32_t queue_size, uint64_t batch_size, bool pinned)
+{
+    return run_pipeline_test(queue_size, batch_size, true, pinned);
+}
+
 int
 main(int argc, const char * argv[])
 {
     unsigned int i = 0;
     uint32_t  batch_size = 0;
+    unsigned int  producer_count;
+    unsigned int  consumer_count;
 #define MAX_BATCH_SIZE  1024
+#define MAX_PRODUCER_COUNT  16
+#define MAX_CONSUMER_COUNT  32
+#define GROUP_SIZE  8
+#define COMMIT_QUEUE_SIZE  1024
+#define COMMIT_BATCH_SIZE  64
+#define COMMIT_INTERVAL  64
 
     setup_allocator();
+    fprintf(stdout, "Using %s\n", VRT_ATOMIC_BACKEND);
 
     /* 1-1 Unicast test (batched) */
     for (batch_size = 64; batch_size <= MAX_BATCH_SIZE; batch_size <<= 1) {
@@ -230,6 +923,22 @@ main(int argc, const char * argv[])
             unicast_test(QUEUE_SIZE, batch_size, 
                          vrt_test_queue_threaded_hybrid);
         }
+
+        fprintf(stdout, "\nvrt_test_queue_threaded_blocking\n"
+                        "--------------------------------\n");
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            unicast_test(QUEUE_SIZE, batch_size,
+                         vrt_test_queue_threaded_blocking);
+        }
+
+        fprintf(stdout, "\nvrt_test_queue_threaded_adaptive\n"
+                        "--------------------------------\n");
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            unicast_test(QUEUE_SIZE, batch_size,
+                         vrt_test_queue_threaded_adaptive);
+        }
     }
 
     /* 1-1 Unicast test (unbatched) */
@@ -257,6 +966,299 @@ main(int argc, const char * argv[])
         unicast_test(QUEUE_SIZE, 1, vrt_test_queue_threaded_hybrid);
     }
 
+    fprintf(stdout, "\nvrt_test_queue_threaded_blocking\n"
+                      "--------------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        unicast_test(QUEUE_SIZE, 1, vrt_test_queue_threaded_blocking);
+    }
+
+    fprintf(stdout, "\nvrt_test_queue_threaded_adaptive\n"
+                      "--------------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        unicast_test(QUEUE_SIZE, 1, vrt_test_queue_threaded_adaptive);
+    }
+
+    fprintf(stdout, "\nvrt_test_queue_scheduled\n"
+                      "------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        unicast_test(QUEUE_SIZE, 1, vrt_test_queue_scheduled);
+    }
+
+
+    /* Wake latency test */
+    fprintf(stdout, "\n1-1 WAKE LATENCY TEST (UNBATCHED)\n"
+                    "=================================\n");
+
+    fprintf(stdout, "blocking strategy, 50us between values\n"
+                    "--------------------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        wake_latency_test(QUEUE_SIZE, 50, WAKE_COUNT, false,
+                          vrt_test_queue_threaded_blocking);
+    }
+
+    fprintf(stdout, "\nadaptive strategy, 50us between values\n"
+                    "--------------------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        wake_latency_test(QUEUE_SIZE, 50, WAKE_COUNT, false,
+                          vrt_test_queue_threaded_adaptive);
+    }
+
+    fprintf(stdout, "\neventfd, 50us between values\n"
+                    "----------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        wake_latency_test(QUEUE_SIZE, 50, WAKE_COUNT, true,
+                          vrt_test_queue_threaded_blocking);
+    }
+
+    fprintf(stdout, "\neventfd, back to back\n"
+                    "---------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        wake_latency_test(QUEUE_SIZE, 0, GENERATE_COUNT, true,
+                          vrt_test_queue_threaded_blocking);
+    }
+
+
+    /* Bulk producer test */
+    fprintf(stdout, "\n1-1 BULK PRODUCER TEST (BATCH SIZE = %u)\n"
+                    "=======================================\n",
+                    MAX_BATCH_SIZE);
+
+    fprintf(stdout, "one value per claim\n"
+                    "-------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        bulk_unicast_test(QUEUE_SIZE, MAX_BATCH_SIZE, generate_integers,
+                          vrt_test_queue_threaded);
+    }
+
+    fprintf(stdout, "\n%u values per claim\n"
+                    "-------------------\n", GENERATE_BULK_SIZE);
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        bulk_unicast_test(QUEUE_SIZE, MAX_BATCH_SIZE, generate_integers_bulk,
+                          vrt_test_queue_threaded);
+    }
+
+
+    /* Value storage test */
+    fprintf(stdout, "\n1-1 VALUE STORAGE TEST (BATCH SIZE = %u)\n"
+                    "=======================================\n",
+                    BATCH_SIZE);
+
+    fprintf(stdout, "separately allocated values\n"
+                    "---------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        value_storage_test(QUEUE_SIZE, BATCH_SIZE, vrt_value_type_int(), 0,
+                           sum_integers, vrt_test_queue_threaded);
+    }
+
+    fprintf(stdout, "\ninline values\n"
+                    "-------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        value_storage_test(QUEUE_SIZE, BATCH_SIZE, vrt_value_type_int_inline(),
+                           0, sum_integers, vrt_test_queue_threaded);
+    }
+
+    fprintf(stdout, "\ninline values (batch consumer)\n"
+                    "------------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        value_storage_test(QUEUE_SIZE, BATCH_SIZE, vrt_value_type_int_inline(),
+                           0, sum_integers_batch, vrt_test_queue_threaded);
+    }
+
+    fprintf(stdout, "\ninline values (huge pages, prefaulted, locked)\n"
+                    "----------------------------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        value_storage_test(QUEUE_SIZE, BATCH_SIZE, vrt_value_type_int_inline(),
+                           VRT_MEMORY_HUGE_PAGES | VRT_MEMORY_PREFAULT |
+                           VRT_MEMORY_MLOCK,
+                           sum_integers, vrt_test_queue_threaded);
+    }
+
+
+    /* Commit interval test */
+    fprintf(stdout, "\n1-1 COMMIT INTERVAL TEST (QUEUE SIZE = %u, "
+                    "BATCH SIZE = %u)\n"
+                    "=============================================="
+                    "===============\n",
+                    COMMIT_QUEUE_SIZE, COMMIT_BATCH_SIZE);
+
+    fprintf(stdout, "commit when out of values\n"
+                    "-------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        commit_interval_test(COMMIT_QUEUE_SIZE, COMMIT_BATCH_SIZE, 0,
+                             vrt_test_queue_threaded);
+    }
+
+    fprintf(stdout, "\ncommit every %u values\n"
+                    "-----------------------\n", COMMIT_INTERVAL);
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        commit_interval_test(COMMIT_QUEUE_SIZE, COMMIT_BATCH_SIZE,
+                             COMMIT_INTERVAL, vrt_test_queue_threaded);
+    }
+
+
+    /* N-1 Sequencer test */
+    for (producer_count = 1; producer_count <= MAX_PRODUCER_COUNT;
+         producer_count <<= 1) {
+
+        fprintf(stdout, "\n%u-1 SEQUENCER TEST (BATCH SIZE = %u)\n"
+                        "====================================\n",
+                        producer_count, BATCH_SIZE);
+
+        fprintf(stdout, "vrt_test_queue_threaded\n"
+                        "-----------------------\n");
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            sequencer_test(QUEUE_SIZE, BATCH_SIZE, producer_count,
+                           vrt_test_queue_threaded);
+        }
+
+        fprintf(stdout, "\nvrt_test_queue_threaded_hybrid\n"
+                        "------------------------------\n");
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            sequencer_test(QUEUE_SIZE, BATCH_SIZE, producer_count,
+                           vrt_test_queue_threaded_hybrid);
+        }
+    }
+
+
+    /* N-1 Sharded sequencer test */
+    for (producer_count = 1; producer_count <= MAX_PRODUCER_COUNT;
+         producer_count <<= 1) {
+
+        fprintf(stdout, "\n%u-1 SHARDED SEQUENCER TEST (BATCH SIZE = %u)\n"
+                        "============================================\n",
+                        producer_count, BATCH_SIZE);
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            sharded_test(QUEUE_SIZE / producer_count, BATCH_SIZE,
+                         producer_count, false);
+        }
+    }
+
+
+    /* N-1 Merged fan-in test */
+    for (producer_count = 1; producer_count <= MAX_PRODUCER_COUNT;
+         producer_count <<= 1) {
+
+        fprintf(stdout, "\n%u-1 MERGED FAN-IN TEST (BATCH SIZE = %u)\n"
+                        "========================================\n",
+                        producer_count, BATCH_SIZE);
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            sharded_test(QUEUE_SIZE / producer_count, BATCH_SIZE,
+                         producer_count, true);
+        }
+    }
+
+
+    /* 1-N Broadcast test */
+    for (consumer_count = 1; consumer_count <= MAX_CONSUMER_COUNT;
+         consumer_count <<= 1) {
+
+        fprintf(stdout, "\n1-%u BROADCAST TEST (BATCH SIZE = %u)\n"
+                        "====================================\n",
+                        consumer_count, BATCH_SIZE);
+
+        fprintf(stdout, "ungrouped consumers\n"
+                        "-------------------\n");
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            broadcast_test(QUEUE_SIZE, BATCH_SIZE, consumer_count, 0,
+                           vrt_test_queue_threaded);
+        }
+
+        fprintf(stdout, "\nconsumer groups of %u\n"
+                        "--------------------\n", GROUP_SIZE);
+        for (i = 1; i <= RUNS; i++) {
+            fprintf(stdout, "run %" PRIu32 ": ", i);
+            broadcast_test(QUEUE_SIZE, BATCH_SIZE, consumer_count, GROUP_SIZE,
+                           vrt_test_queue_threaded);
+        }
+    }
+
+
+    /* 1-3 NUMA multicast test */
+    fprintf(stdout, "\n1-3 NUMA MULTICAST TEST (BATCH SIZE = %u, %u NODES)\n"
+                      "=================================================\n",
+                      BATCH_SIZE, vrt_numa_node_count());
+
+    fprintf(stdout, "local consumers\n"
+                      "---------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        numa_multicast_test(QUEUE_SIZE, BATCH_SIZE, NUMA_LOCAL);
+    }
+
+    fprintf(stdout, "\nremote consumers\n"
+                      "----------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        numa_multicast_test(QUEUE_SIZE, BATCH_SIZE, NUMA_REMOTE);
+    }
+
+    fprintf(stdout, "\nremote consumers (replicated)\n"
+                      "-----------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        numa_multicast_test(QUEUE_SIZE, BATCH_SIZE, NUMA_REPLICATED);
+    }
+
+
+    /* Three-step pipeline test */
+    fprintf(stdout, "\n1-1-1-1 THREE-STEP PIPELINE TEST (BATCH SIZE = %u)\n"
+                      "=================================================\n",
+                      BATCH_SIZE);
+
+    fprintf(stdout, "unpinned\n"
+                      "--------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        three_step_pipeline_test(QUEUE_SIZE, BATCH_SIZE, false);
+    }
+
+    fprintf(stdout, "\npinned\n"
+                      "------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        three_step_pipeline_test(QUEUE_SIZE, BATCH_SIZE, true);
+    }
+
+
+    /* Diamond test */
+    fprintf(stdout, "\n1-2-1 DIAMOND TEST (BATCH SIZE = %u)\n"
+                      "===================================\n",
+                      BATCH_SIZE);
+
+    fprintf(stdout, "unpinned\n"
+                      "--------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        diamond_test(QUEUE_SIZE, BATCH_SIZE, false);
+    }
+
+    fprintf(stdout, "\npinned\n"
+                      "------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        diamond_test(QUEUE_SIZE, BATCH_SIZE, true);
+    }
+
 
     /* 1-3 Multicast test */
     fprintf(stdout, "\n1-3 MULTICAST TEST (UNBATCHED)\n"
@@ -283,6 +1285,13 @@ main(int argc, const char * argv[])
         multicast_test(QUEUE_SIZE, 1, vrt_test_queue_threaded_hybrid);
     }
 
+    fprintf(stdout, "\nvrt_test_queue_scheduled\n"
+                      "------------------------\n");
+    for (i = 1; i <= RUNS; i++) {
+        fprintf(stdout, "run %" PRIu32 ": ", i);
+        multicast_test(QUEUE_SIZE, 1, vrt_test_queue_scheduled);
+    }
+
     return EXIT_SUCCESS;
 }
 
@@ -8,11 +8,21 @@
  * ----------------------------------------------------------------------
  */
 
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/resource.h>
 #include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <clogger.h>
 #include <libcork/core.h>
@@ -34,6 +44,22 @@
 static int64_t  GENERATE_COUNT = DEFAULT_GENERATE_COUNT;
 
 #define RUN_TEST(queue_size, batch_size, run_func) \
+    RUN_TEST_TYPE(vrt_value_type_int(), queue_size, batch_size, run_func)
+
+#define RUN_TEST_TYPE(value_type, queue_size, batch_size, run_func) \
+    RUN_TEST_FLAGS(value_type, queue_size, batch_size, 0, run_func)
+
+#define RUN_TEST_FLAGS(value_type, queue_size, batch_size, flags, run_func) \
+    RUN_TEST_CONSUMER(value_type, queue_size, batch_size, flags, \
+                      sum_integers, run_func)
+
+#define RUN_TEST_CONSUMER(value_type, queue_size, batch_size, flags, \
+                          sum_func, run_func) \
+    RUN_TEST_CLIENTS(value_type, queue_size, batch_size, flags, \
+                     generate_integers, sum_func, run_func)
+
+#define RUN_TEST_CLIENTS(value_type, queue_size, batch_size, flags, \
+                         generate_func, sum_func, run_func) \
     DESCRIBE_TEST; \
     int64_t  result; \
     \
@@ -42,9 +68,8 @@ static int64_t  GENERATE_COUNT = DEFAULT_GENERATE_COUNT;
     struct vrt_consumer  *c; \
     vrt_clock  elapsed; \
     \
-    fail_if_error(q = vrt_queue_new \
-                      ("queue_sum", vrt_value_type_int(), \
-                       queue_size)); \
+    fail_if_error(q = vrt_queue_new_with_flags \
+                      ("queue_sum", value_type, queue_size, flags)); \
     fail_if_error(p = vrt_producer_new \
                       ("generate", batch_size, q)); \
     fail_if_error(c = vrt_consumer_new("sum", q)); \
@@ -57,13 +82,15 @@ static int64_t  GENERATE_COUNT = DEFAULT_GENERATE_COUNT;
     }; \
     \
     struct vrt_queue_client  clients[] = { \
-        { generate_integers, &generate_config }, \
-        { sum_integers, &sum_config }, \
+        { generate_func, &generate_config }, \
+        { sum_func, &sum_config }, \
         { NULL, NULL } \
     }; \
     \
     fail_if_error(run_func(q, clients, &elapsed)); \
     fprintf(stdout, "Result: %" PRId64 "\n", result); \
+    fail_unless(result == GENERATE_COUNT * (GENERATE_COUNT - 1) / 2, \
+                "Unexpected sum"); \
     vrt_report_clock(elapsed, GENERATE_COUNT); \
     vrt_queue_free(q);
 
@@ -108,6 +135,2516 @@ START_TEST(test_sum_threaded_hybrid)
 END_TEST
 
 
+START_TEST(test_sum_threaded_blocking_small)
+{
+    RUN_TEST(16, 4, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+START_TEST(test_sum_threaded_blocking)
+{
+    RUN_TEST(0, 0, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+
+START_TEST(test_sum_threaded_adaptive_small)
+{
+    RUN_TEST(16, 4, vrt_test_queue_threaded_adaptive);
+}
+END_TEST
+
+START_TEST(test_sum_threaded_adaptive)
+{
+    RUN_TEST(0, 0, vrt_test_queue_threaded_adaptive);
+}
+END_TEST
+
+
+START_TEST(test_sum_scheduled_small)
+{
+    RUN_TEST(16, 4, vrt_test_queue_scheduled);
+}
+END_TEST
+
+START_TEST(test_sum_scheduled)
+{
+    RUN_TEST(0, 0, vrt_test_queue_scheduled);
+}
+END_TEST
+
+
+START_TEST(test_sum_inline_threaded_small)
+{
+    RUN_TEST_TYPE(vrt_value_type_int_inline(), 16, 4,
+                  vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_inline_threaded)
+{
+    RUN_TEST_TYPE(vrt_value_type_int_inline(), 0, 0,
+                  vrt_test_queue_threaded);
+}
+END_TEST
+
+
+START_TEST(test_sum_batch_threaded_small)
+{
+    RUN_TEST_CONSUMER(vrt_value_type_int(), 16, 4, 0,
+                      sum_integers_batch, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_batch_threaded)
+{
+    RUN_TEST_CONSUMER(vrt_value_type_int(), 0, 0, 0,
+                      sum_integers_batch, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_batch_threaded_hybrid_small)
+{
+    RUN_TEST_CONSUMER(vrt_value_type_int(), 16, 4, 0,
+                      sum_integers_batch, vrt_test_queue_threaded_hybrid);
+}
+END_TEST
+
+
+START_TEST(test_sum_bulk_threaded_small)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 16, 4, 0,
+                     generate_integers_bulk, sum_integers,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_bulk_threaded)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 0, 0, 0,
+                     generate_integers_bulk, sum_integers_batch,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+
+/* We can't control whether the kernel gives us any huge pages or lets us lock
+ * memory, but whatever we get, the queue should still work. */
+#define HUGE_PAGE_FLAGS \
+    (VRT_MEMORY_HUGE_PAGES | VRT_MEMORY_PREFAULT | VRT_MEMORY_MLOCK)
+
+START_TEST(test_sum_huge_pages)
+{
+    RUN_TEST_FLAGS(vrt_value_type_int(), 0, 0, HUGE_PAGE_FLAGS,
+                   vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_inline_huge_pages)
+{
+    RUN_TEST_FLAGS(vrt_value_type_int_inline(), 0, 0, HUGE_PAGE_FLAGS,
+                   vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_try_threaded_small)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 16, 4, 0,
+                     generate_integers_try, sum_integers_until,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sum_try_threaded)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 0, 0, 0,
+                     generate_integers_try, sum_integers_until,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+#define RUN_EVENTFD_TEST(queue_size, batch_size, run_func) \
+    DESCRIBE_TEST; \
+    int64_t  result; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_producer  *p; \
+    struct vrt_consumer  *c; \
+    vrt_clock  elapsed; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int(), queue_size)); \
+    fail_if_error(p = vrt_producer_new("generate", batch_size, q)); \
+    fail_if_error(c = vrt_consumer_new("sum", q)); \
+    fail_if(vrt_consumer_eventfd(c) == -1, "Cannot create eventfd"); \
+    \
+    struct generate_config  generate_config = { \
+        p, GENERATE_COUNT \
+    }; \
+    struct sum_config  sum_config = { \
+        c, &result \
+    }; \
+    \
+    struct vrt_queue_client  clients[] = { \
+        { generate_integers, &generate_config }, \
+        { sum_integers_eventfd, &sum_config }, \
+        { NULL, NULL } \
+    }; \
+    \
+    fail_if_error(run_func(q, clients, &elapsed)); \
+    fprintf(stdout, "Result: %" PRId64 "\n", result); \
+    fail_unless(result == GENERATE_COUNT * (GENERATE_COUNT - 1) / 2, \
+                "Unexpected sum"); \
+    vrt_report_clock(elapsed, GENERATE_COUNT); \
+    vrt_queue_free(q);
+
+START_TEST(test_sum_eventfd_small)
+{
+    RUN_EVENTFD_TEST(16, 4, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+START_TEST(test_sum_eventfd)
+{
+    RUN_EVENTFD_TEST(0, 0, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+START_TEST(test_eventcount_waiters)
+{
+    DESCRIBE_TEST;
+    struct vrt_eventcount  ev;
+    vrt_eventcount_init(&ev);
+
+    /* No one is waiting yet. */
+    fail_unless(vrt_eventcount_notify(&ev) == 0, "Unexpected waiters");
+
+    /* Armed waiters don't need a futex wakeup, and vice versa. */
+    vrt_eventcount_prepare_arm(&ev);
+    fail_unless(vrt_eventcount_notify(&ev) == VRT_EVENTCOUNT_ARMED,
+                "Expected only armed waiters");
+    vrt_eventcount_prepare_wait(&ev);
+    fail_unless(vrt_eventcount_notify(&ev) == VRT_EVENTCOUNT_SLEEPING,
+                "Expected only sleeping waiters");
+
+    /* A notification wakes up both kinds at once. */
+    vrt_eventcount_prepare_arm(&ev);
+    vrt_eventcount_prepare_wait(&ev);
+    fail_unless(vrt_eventcount_notify(&ev) == VRT_EVENTCOUNT_WAITERS,
+                "Expected both kinds of waiters");
+    fail_unless(vrt_eventcount_notify(&ev) == 0, "Unexpected waiters");
+}
+END_TEST
+
+START_TEST(test_try_single_threaded)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+    unsigned int  i;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+
+    /* Nothing has been published yet. */
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+
+    /* Fill up the queue. */
+    for (i = 0; i < 16; i++) {
+        fail_if_error(vrt_producer_try_claim(p, &v));
+        fail_if_error(vrt_producer_publish(p));
+    }
+    fail_unless(vrt_producer_try_claim(p, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+    fail_unless(vrt_producer_claim_until(p, &v, vrt_now_ns())
+                == VRT_QUEUE_AGAIN, "Expected a full queue");
+
+    /* Drain it again. */
+    for (i = 0; i < 16; i++) {
+        fail_if_error(vrt_consumer_try_next(c, &v));
+    }
+    fail_unless(vrt_consumer_next_until(c, &v, vrt_now_ns())
+                == VRT_QUEUE_AGAIN, "Expected an empty queue");
+
+    /* Now that the consumer has caught up, there's room for more. */
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    fail_if_error(vrt_producer_publish(p));
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_try_multi_threaded)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p1;
+    struct vrt_producer  *p2;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+    unsigned int  i;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p1 = vrt_producer_new("producer1", 4, q));
+    fail_if_error(p2 = vrt_producer_new("producer2", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+
+    /* Each producer claims two batches, which fills up the queue. */
+    for (i = 0; i < 8; i++) {
+        fail_if_error(vrt_producer_try_claim(p1, &v));
+        fail_if_error(vrt_producer_publish(p1));
+        fail_if_error(vrt_producer_try_claim(p2, &v));
+        fail_if_error(vrt_producer_publish(p2));
+    }
+    fail_unless(vrt_producer_try_claim(p1, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+    fail_unless(vrt_producer_try_claim(p2, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+
+    for (i = 0; i < 16; i++) {
+        fail_if_error(vrt_consumer_try_next(c, &v));
+    }
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+
+    fail_if_error(vrt_producer_try_claim(p2, &v));
+    fail_if_error(vrt_producer_publish(p2));
+    vrt_queue_free(q);
+}
+END_TEST
+
+/* Publishes a single value with the given producer. */
+static void
+produce_one(struct vrt_producer *p)
+{
+    struct vrt_value  *v;
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    fail_if_error(vrt_producer_publish(p));
+}
+
+START_TEST(test_publish_interval_single_threaded)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+
+    /* Without an interval, nothing is visible until the batch is full. */
+    produce_one(p);
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an unpublished value");
+    vrt_producer_set_publish_interval(p, 2);
+    produce_one(p);
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+
+    /* The interval restarts with each batch. */
+    produce_one(p);
+    produce_one(p);
+    produce_one(p);
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an unpublished value");
+
+    vrt_producer_set_publish_interval(p, 1);
+    produce_one(p);
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_publish_interval_multi_threaded)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p1;
+    struct vrt_producer  *p2;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p1 = vrt_producer_new("producer1", 4, q));
+    fail_if_error(p2 = vrt_producer_new("producer2", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+    vrt_producer_set_publish_interval(p1, 1);
+
+    /* p1's values become visible right away... */
+    produce_one(p1);
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+
+    /* ...but not past p2's batch, which p2 hasn't published yet. */
+    produce_one(p2);
+    produce_one(p1);
+    produce_one(p1);
+    produce_one(p1);
+    produce_one(p1);
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an unpublished value");
+
+    fail_if_error(vrt_producer_publish_batch(p2));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_publish_partial)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+    vrt_value_id  first;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+
+    produce_one(p);
+    produce_one(p);
+    fail_if_error(vrt_producer_publish_partial(p));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    first = v->id;
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_if_error(vrt_producer_publish_partial(p));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+
+    /* The rest of the batch wasn't filled in with holes, so the next values
+     * pick up right where we left off. */
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    fail_unless(v->id == (vrt_value_id) ((unsigned int) first + 2),
+                "Expected the rest of the batch to still be claimed");
+    fail_if_error(vrt_producer_publish(p));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an unpublished value");
+    produce_one(p);
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_unless(vrt_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_publish_interval_threaded_small)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 16, 4, 0,
+                     generate_integers_interval, sum_integers,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_publish_interval_threaded)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 0, 0, 0,
+                     generate_integers_interval, sum_integers,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_commit_interval)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+    unsigned int  i;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+    vrt_consumer_set_commit_interval(c, 4, 0);
+
+    for (i = 0; i < 16; i++) {
+        produce_one(p);
+    }
+    fail_unless(vrt_producer_try_claim(p, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+
+    /* Once we've finished the first four values, the producer can reuse
+     * their slots, even though we still have plenty of values left. */
+    for (i = 0; i < 4; i++) {
+        fail_if_error(vrt_consumer_try_next(c, &v));
+    }
+    fail_unless(vrt_producer_try_claim(p, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+    fail_if_error(vrt_consumer_try_next(c, &v));
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_commit_batches)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c;
+    struct vrt_value  *v;
+    vrt_value_id  first;
+    unsigned int  count;
+    unsigned int  i;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+    vrt_consumer_set_commit_batches(c, true);
+
+    /* A hole splits the queue's contents into two batches. */
+    for (i = 0; i < 4; i++) {
+        produce_one(p);
+    }
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    fail_if_error(vrt_producer_skip(p));
+    for (i = 0; i < 11; i++) {
+        produce_one(p);
+    }
+
+    fail_if_error(vrt_consumer_try_next_batch(c, &first, &count));
+    fail_unless(count == 4, "Unexpected batch size %u", count);
+    fail_unless(vrt_producer_try_claim(p, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+
+    /* Asking for the next batch frees up the first one's slots. */
+    fail_if_error(vrt_consumer_try_next_batch(c, &first, &count));
+    fail_unless(count == 11, "Unexpected batch size %u", count);
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_commit_interval_threaded_small)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 16, 4, 0,
+                     generate_integers, sum_integers_commit,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_commit_interval_threaded)
+{
+    RUN_TEST_CLIENTS(vrt_value_type_int(), 0, 0, 0,
+                     generate_integers, sum_integers_commit,
+                     vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_memory_stats)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_queue_memory_stats  stats;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int_inline(), 0));
+    vrt_queue_get_memory_stats(q, &stats);
+    fail_unless(stats.size >= 65536 * sizeof(struct vrt_value_int),
+                "Unexpected memory size");
+    fail_unless(stats.prefaulted_size == 0, "Unexpected prefaulted size");
+    fail_unless(stats.locked_size == 0, "Unexpected locked size");
+    vrt_queue_free(q);
+
+    fail_if_error(q = vrt_queue_new_with_flags
+                  ("queue", vrt_value_type_int_inline(), 0,
+                   VRT_MEMORY_HUGE_PAGES | VRT_MEMORY_PREFAULT));
+    vrt_queue_get_memory_stats(q, &stats);
+    fprintf(stdout, "Huge pages: %zu/%zu bytes\n",
+            stats.huge_page_size, stats.size);
+    fail_unless(stats.size >= 65536 * sizeof(struct vrt_value_int),
+                "Unexpected memory size");
+    fail_unless(stats.huge_page_size <= stats.size,
+                "Unexpected huge page size");
+    fail_unless(stats.prefaulted_size == stats.size,
+                "Unexpected prefaulted size");
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+START_TEST(test_queue_start)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_consumer  *c1;
+    struct vrt_consumer  *c2;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_unless_error(vrt_queue_start(q), "Expected missing clients");
+    cork_error_clear();
+
+    /* A single producer, and a chain of consumers, which should get every
+     * fast path. */
+    fail_if_error(vrt_producer_new("p", 4, q));
+    fail_if_error(c1 = vrt_consumer_new("c1", q));
+    fail_if_error(c2 = vrt_consumer_new("c2", q));
+    fail_if_error(vrt_consumer_add_dependency(c2, c1));
+    fail_if_error(vrt_queue_start(q));
+    fail_unless(q->single_producer, "Expected single-producer fast path");
+    fail_unless(q->gating->count == 1 &&
+                q->gating->cursors[0] == c2->cursor,
+                "Expected single gating cursor");
+    fail_unless(c1->dependency == NULL, "Unexpected dependency");
+    fail_unless(c2->dependency == c1, "Expected single dependency");
+
+    /* Once started, the topology can't change. */
+    fail_if_error(vrt_queue_start(q));
+    fail_unless_error(vrt_producer_new("p2", 4, q),
+                      "Expected error adding producer");
+    cork_error_clear();
+    fail_unless_error(vrt_consumer_new("c3", q),
+                      "Expected error adding consumer");
+    cork_error_clear();
+    fail_unless_error(vrt_consumer_add_dependency(c1, c2),
+                      "Expected error adding dependency");
+    cork_error_clear();
+    fail_unless_error(vrt_consumer_group_new("group", q),
+                      "Expected error adding group");
+    cork_error_clear();
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Attaching and detaching
+ */
+
+/* Claims and publishes count values, starting with first, without
+ * blocking. */
+static void
+produce_integers(struct vrt_producer *p, int32_t first, unsigned int count)
+{
+    unsigned int  i;
+    for (i = 0; i < count; i++) {
+        struct vrt_value  *v;
+        fail_if_error(vrt_producer_try_claim(p, &v));
+        cork_container_of(v, struct vrt_value_int, parent)->value = first + i;
+        fail_if_error(vrt_producer_publish(p));
+    }
+}
+
+/* Processes every value that's currently available to a consumer, adding
+ * them to *sum.  Returns the result code that made us stop. */
+static int
+drain_integers(struct vrt_consumer *c, int64_t *sum)
+{
+    int  rc;
+    struct vrt_value  *v;
+    while ((rc = vrt_consumer_try_next(c, &v)) == 0 ||
+           rc == VRT_QUEUE_FLUSH) {
+        if (rc == 0) {
+            *sum += cork_container_of(v, struct vrt_value_int, parent)->value;
+        }
+    }
+    return rc;
+}
+
+START_TEST(test_attach_consumer)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c1;
+    struct vrt_consumer  *c2;
+    struct vrt_consumer  *c3;
+    struct vrt_value  *v;
+    int64_t  sum1 = 0;
+    int64_t  sum3 = 0;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c1 = vrt_consumer_new("c1", q));
+    /* Before the queue starts, attaching is the same as adding. */
+    fail_if_error(c2 = vrt_consumer_attach("c2", q));
+    fail_if_error(vrt_queue_start(q));
+    fail_unless(q->gating->count == 2, "Expected two gating cursors");
+
+    /* A consumer that detaches stops holding back the producer. */
+    produce_integers(p, 0, 8);
+    fail_unless(drain_integers(c1, &sum1) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_if_error(vrt_consumer_detach(c2));
+    fail_unless(q->gating->count == 1, "Expected one gating cursor");
+    fail_unless_error(vrt_consumer_detach(c2), "Expected error detaching");
+    cork_error_clear();
+
+    /* A consumer that attaches starts after the last published value. */
+    fail_if_error(c3 = vrt_consumer_attach("c3", q));
+    fail_unless(q->gating->count == 2, "Expected two gating cursors");
+    fail_unless(vrt_consumer_try_next(c3, &v) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    produce_integers(p, 8, 4);
+    fail_unless(drain_integers(c3, &sum3) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum3 == 8 + 9 + 10 + 11,
+                "Unexpected sum (got %" PRId64 ")", sum3);
+
+    /* And from then on, the producer can't lap it. */
+    fail_unless(drain_integers(c1, &sum1) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    produce_integers(p, 12, 16);
+    fail_unless(drain_integers(c1, &sum1) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(vrt_producer_try_claim(p, &v) == VRT_QUEUE_AGAIN,
+                "Expected a full queue");
+    fail_if_error(vrt_consumer_detach(c3));
+    fail_if_error(vrt_producer_try_claim(p, &v));
+    fail_if_error(vrt_producer_publish(p));
+
+    /* Producers always have to wait for someone. */
+    fail_unless_error(vrt_consumer_detach(c1), "Expected error detaching");
+    cork_error_clear();
+
+    /* No one can attach once every producer has finished. */
+    fail_if_error(vrt_producer_eof(p));
+    fail_unless(drain_integers(c1, &sum1) == VRT_QUEUE_EOF, "Expected EOF");
+    fail_unless_error(vrt_consumer_attach("c4", q),
+                      "Expected error attaching");
+    cork_error_clear();
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_attach_producer)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p1;
+    struct vrt_producer  *p2;
+    struct vrt_consumer  *c;
+    int64_t  sum = 0;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p1 = vrt_producer_new("p1", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+    fail_if_error(vrt_queue_start(q));
+    fail_unless(q->single_producer, "Expected single-producer mode");
+    produce_integers(p1, 0, 4);
+
+    /* A second producer switches the queue over to multiple-producer
+     * mode... */
+    fail_if_error(p2 = vrt_producer_attach("p2", 4, q));
+    fail_unless(!q->single_producer, "Expected multiple-producer mode");
+    fail_unless(q->published_ids != NULL, "Expected publication stamps");
+    produce_integers(p2, 100, 4);
+    produce_integers(p1, 4, 4);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum == 28 + 406, "Unexpected sum (got %" PRId64 ")", sum);
+
+    /* ...until it detaches again.  The consumer shouldn't finish until the
+     * other producer does, too. */
+    fail_if_error(vrt_producer_detach(p2));
+    fail_unless_error(vrt_producer_detach(p2), "Expected error detaching");
+    cork_error_clear();
+    produce_integers(p1, 8, 4);
+    fail_unless(q->single_producer, "Expected single-producer mode");
+    fail_unless(q->published_ids == NULL, "Unexpected publication stamps");
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum == 28 + 406 + 38,
+                "Unexpected sum (got %" PRId64 ")", sum);
+
+    /* No one can attach once every producer has finished. */
+    fail_if_error(vrt_producer_detach(p1));
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_EOF, "Expected EOF");
+    fail_unless_error(vrt_producer_attach("p3", 4, q),
+                      "Expected error attaching");
+    cork_error_clear();
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_attach_producer_timeout)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p1;
+    struct vrt_producer  *p2;
+    struct vrt_consumer  *c;
+    int64_t  sum = 0;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p1 = vrt_producer_new("p1", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+    fail_if_error(vrt_queue_start(q));
+
+    /* The lone producer is in the middle of a batch, so a new producer
+     * can't attach... */
+    produce_integers(p1, 0, 2);
+    fail_unless_error(vrt_producer_attach("p2", 4, q),
+                      "Expected error attaching");
+    cork_error_clear();
+    fail_unless(q->single_producer, "Expected single-producer mode");
+    fail_unless(cork_array_size(&q->producers) == 1,
+                "Expected one producer");
+    fail_unless(q->producer_count == 1, "Expected to count one producer");
+
+    /* ...until it finishes the batch. */
+    produce_integers(p1, 2, 2);
+    fail_if_error(p2 = vrt_producer_attach("p2", 4, q));
+    fail_unless(!q->single_producer, "Expected multiple-producer mode");
+    produce_integers(p2, 100, 4);
+    produce_integers(p1, 4, 4);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_if_error(vrt_producer_detach(p2));
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_if_error(vrt_producer_detach(p1));
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_EOF, "Expected EOF");
+    fail_unless(sum == 28 + 406, "Unexpected sum (got %" PRId64 ")", sum);
+    vrt_queue_free(q);
+}
+END_TEST
+
+/* Moves every ID in an idle queue forward by count, as though its producers
+ * and consumers had already worked through that many more values.  The
+ * queue's producers must have published everything they've claimed, and its
+ * consumers must all be plain ones that have caught up. */
+static void
+skip_ids(struct vrt_queue *q, unsigned int count)
+{
+    size_t  i;
+    vrt_value_id  cursor = vrt_queue_get_cursor(q);
+    vrt_padded_int_set(&q->control->last_claimed_id,
+                       (unsigned int) cursor + count);
+    vrt_queue_set_cursor(q, (unsigned int) cursor + count);
+    q->last_consumed_id = (unsigned int) q->last_consumed_id + count;
+    for (i = 0; i < cork_array_size(&q->producers); i++) {
+        struct vrt_producer  *p = cork_array_at(&q->producers, i);
+        p->last_claimed_id = (unsigned int) p->last_claimed_id + count;
+        p->last_produced_id = (unsigned int) p->last_produced_id + count;
+        p->last_published_id = (unsigned int) p->last_published_id + count;
+    }
+    for (i = 0; i < cork_array_size(&q->consumers); i++) {
+        struct vrt_consumer  *c = cork_array_at(&q->consumers, i);
+        vrt_consumer_set_cursor
+            (c, (unsigned int) vrt_consumer_get_cursor(c) + count);
+        c->last_available_id = (unsigned int) c->last_available_id + count;
+        c->current_id = (unsigned int) c->current_id + count;
+    }
+}
+
+START_TEST(test_attach_producer_late)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p1;
+    struct vrt_producer  *p2;
+    struct vrt_producer  *p3;
+    struct vrt_consumer  *c;
+    int64_t  sum = 0;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p1 = vrt_producer_new("p1", 4, q));
+    fail_if_error(c = vrt_consumer_new("consumer", q));
+    fail_if_error(vrt_queue_start(q));
+    produce_integers(p1, 0, 4);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+
+    /* Once the queue's IDs are more than halfway around from where they
+     * started, a producer that attaches has to start from the queue's
+     * current IDs, not its own.  Otherwise it would stamp p1's unfinished
+     * batch as published, too. */
+    skip_ids(q, 0x80000000u + 16);
+    fail_if_error(p2 = vrt_producer_attach("p2", 4, q));
+    produce_integers(p1, 4, 2);
+    produce_integers(p2, 100, 4);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum == 6, "Unexpected sum (got %" PRId64 ")", sum);
+    produce_integers(p1, 6, 2);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum == 28 + 406, "Unexpected sum (got %" PRId64 ")", sum);
+
+    /* The same goes for a producer that attaches to a queue that already
+     * has multiple producers. */
+    fail_if_error(p3 = vrt_producer_attach("p3", 4, q));
+    produce_integers(p1, 8, 2);
+    produce_integers(p3, 200, 4);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum == 28 + 406, "Unexpected sum (got %" PRId64 ")", sum);
+    produce_integers(p1, 10, 2);
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    fail_unless(sum == 28 + 406 + 38 + 806,
+                "Unexpected sum (got %" PRId64 ")", sum);
+
+    fail_if_error(vrt_producer_detach(p3));
+    fail_if_error(vrt_producer_detach(p2));
+    fail_if_error(vrt_producer_detach(p1));
+    fail_unless(drain_integers(c, &sum) == VRT_QUEUE_EOF, "Expected EOF");
+    vrt_queue_free(q);
+}
+END_TEST
+
+/* Returns how many snapshots of the gating cursors the queue is holding on
+ * to. */
+static size_t
+gating_set_count(struct vrt_queue *q)
+{
+    size_t  count = 0;
+    struct vrt_gating_set  *gating;
+    for (gating = q->gating; gating != NULL; gating = gating->previous) {
+        count++;
+    }
+    return count;
+}
+
+START_TEST(test_attach_frees_gating_sets)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c1;
+    struct vrt_consumer  *c2;
+    int64_t  sum = 0;
+    unsigned int  i;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("producer", 4, q));
+    fail_if_error(c1 = vrt_consumer_new("c1", q));
+    fail_if_error(vrt_queue_start(q));
+
+    /* The producer hasn't looked at the gating cursors yet, so we have to
+     * keep every snapshot. */
+    for (i = 0; i < 4; i++) {
+        fail_if_error(c2 = vrt_consumer_attach("c2", q));
+        fail_if_error(vrt_consumer_detach(c2));
+    }
+    fail_unless(gating_set_count(q) == 9, "Expected nine snapshots");
+
+    /* Once it has to wait for the consumers, it moves on to the latest
+     * snapshot, and we can free everything before it. */
+    produce_integers(p, 0, 16);
+    fail_unless(drain_integers(c1, &sum) == VRT_QUEUE_AGAIN,
+                "Expected an empty queue");
+    produce_integers(p, 16, 4);
+    fail_if_error(c2 = vrt_consumer_attach("c2", q));
+    fail_unless(gating_set_count(q) == 2, "Expected two snapshots");
+    fail_if_error(vrt_consumer_detach(c2));
+    fail_if_error(vrt_producer_eof(p));
+    vrt_queue_free(q);
+}
+END_TEST
+
+/* One producer runs the whole time, while another producer and consumer
+ * attach, run for a while, and detach again.  The long-running consumer
+ * should see every value from both producers. */
+static void
+run_attach_test(unsigned int queue_size, unsigned int batch_size)
+{
+    struct vrt_queue  *q;
+    struct vrt_producer  *p1;
+    struct vrt_producer  *p2;
+    struct vrt_consumer  *c1;
+    struct vrt_consumer  *c2;
+    pthread_t  producer_thread;
+    pthread_t  consumer_thread;
+    volatile int  hold = 1;
+    int64_t  result = -1;
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2;
+    int64_t  sum = 0;
+    int32_t  i;
+    struct vrt_value  *v;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(),
+                                    queue_size));
+    fail_if_error(p1 = vrt_producer_new("p1", batch_size, q));
+    fail_if_error(c1 = vrt_consumer_new("c1", q));
+    p1->yield = vrt_yield_strategy_threaded();
+    c1->yield = vrt_yield_strategy_threaded();
+    fail_if_error(vrt_queue_start(q));
+
+    struct generate_detach_config  generate_config = {
+        p1, GENERATE_COUNT, &hold
+    };
+    struct sum_config  sum_config = { c1, &result };
+    pthread_create(&consumer_thread, NULL, sum_integers, &sum_config);
+    pthread_create(&producer_thread, NULL, generate_integers_detach,
+                   &generate_config);
+
+    fail_if_error(p2 = vrt_producer_attach("p2", batch_size, q));
+    fail_if_error(c2 = vrt_consumer_attach("c2", q));
+    p2->yield = vrt_yield_strategy_threaded();
+    c2->yield = vrt_yield_strategy_threaded();
+
+    /* c2 holds back both producers, so we have to keep draining it. */
+    for (i = 0; i < GENERATE_COUNT; i++) {
+        int  rc;
+        while ((rc = vrt_producer_try_claim(p2, &v)) == VRT_QUEUE_AGAIN) {
+            drain_integers(c2, &sum);
+            sched_yield();
+        }
+        fail_unless(rc == 0, "Cannot claim value (%d)", rc);
+        cork_container_of(v, struct vrt_value_int, parent)->value = i;
+        fail_if_error(vrt_producer_publish(p2));
+    }
+    fail_if_error(vrt_producer_flush(p2));
+
+    /* c2 attached before p2 published anything, so it sees all of p2's
+     * values, along with some of p1's. */
+    while (sum < expected) {
+        int  rc = vrt_consumer_next(c2, &v);
+        if (rc == 0) {
+            sum += cork_container_of(v, struct vrt_value_int, parent)->value;
+        }
+        fail_unless(rc == 0 || rc == VRT_QUEUE_FLUSH,
+                    "Unexpected result from c2 (%d)", rc);
+    }
+    fail_if_error(vrt_consumer_detach(c2));
+    fail_if_error(vrt_producer_detach(p2));
+    hold = 0;
+
+    pthread_join(producer_thread, NULL);
+    pthread_join(consumer_thread, NULL);
+
+    expected *= 2;
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+    vrt_queue_free(q);
+}
+
+START_TEST(test_attach_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_attach_test(64, 4);
+}
+END_TEST
+
+START_TEST(test_attach_threaded)
+{
+    DESCRIBE_TEST;
+    run_attach_test(0, 0);
+}
+END_TEST
+
+/*----------------------------------------------------------------------
+ * Multiple producers
+ */
+
+#define PRODUCER_COUNT  3
+
+#define RUN_SEQUENCER_TEST(queue_size, batch_size, run_func) \
+    DESCRIBE_TEST; \
+    int64_t  result; \
+    int64_t  expected; \
+    unsigned int  i; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_consumer  *c; \
+    vrt_clock  elapsed; \
+    struct generate_config  generate_config[PRODUCER_COUNT]; \
+    struct vrt_queue_client  clients[PRODUCER_COUNT + 2]; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int(), \
+                       queue_size)); \
+    for (i = 0; i < PRODUCER_COUNT; i++) { \
+        fail_if_error(generate_config[i].p = vrt_producer_new \
+                          ("generate", batch_size, q)); \
+        generate_config[i].count = GENERATE_COUNT; \
+        clients[i].run = generate_integers; \
+        clients[i].ud = &generate_config[i]; \
+    } \
+    fail_if_error(c = vrt_consumer_new("sum", q)); \
+    \
+    struct sum_config  sum_config = { \
+        c, &result \
+    }; \
+    clients[PRODUCER_COUNT].run = sum_integers; \
+    clients[PRODUCER_COUNT].ud = &sum_config; \
+    clients[PRODUCER_COUNT + 1].run = NULL; \
+    clients[PRODUCER_COUNT + 1].ud = NULL; \
+    \
+    fail_if_error(run_func(q, clients, &elapsed)); \
+    fprintf(stdout, "Result: %" PRId64 "\n", result); \
+    expected = PRODUCER_COUNT * (GENERATE_COUNT * (GENERATE_COUNT - 1) / 2); \
+    fail_unless(result == expected, "Unexpected sum"); \
+    vrt_report_clock(elapsed, PRODUCER_COUNT * GENERATE_COUNT); \
+    vrt_queue_free(q);
+
+
+START_TEST(test_sequencer_threaded_small)
+{
+    RUN_SEQUENCER_TEST(16, 4, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_sequencer_threaded)
+{
+    RUN_SEQUENCER_TEST(0, 0, vrt_test_queue_threaded);
+}
+END_TEST
+
+
+START_TEST(test_sequencer_threaded_hybrid_small)
+{
+    RUN_SEQUENCER_TEST(16, 4, vrt_test_queue_threaded_hybrid);
+}
+END_TEST
+
+START_TEST(test_sequencer_threaded_blocking_small)
+{
+    RUN_SEQUENCER_TEST(16, 4, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+START_TEST(test_sequencer_threaded_adaptive_small)
+{
+    RUN_SEQUENCER_TEST(16, 4, vrt_test_queue_threaded_adaptive);
+}
+END_TEST
+
+START_TEST(test_sequencer_scheduled_small)
+{
+    RUN_SEQUENCER_TEST(16, 4, vrt_test_queue_scheduled);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Consumer groups
+ */
+
+#define GROUP_COUNT  2
+#define GROUP_SIZE  3
+
+/* A producer feeding two groups of consumers, plus one consumer that isn't in
+ * a group. */
+#define RUN_GROUP_TEST(queue_size, batch_size, run_func) \
+    DESCRIBE_TEST; \
+    int64_t  results[GROUP_COUNT * GROUP_SIZE + 1]; \
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2; \
+    unsigned int  i; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_producer  *p; \
+    struct vrt_consumer_group  *groups[GROUP_COUNT]; \
+    struct sum_config  sum_configs[GROUP_COUNT * GROUP_SIZE + 1]; \
+    struct vrt_queue_client  clients[GROUP_COUNT * GROUP_SIZE + 3]; \
+    vrt_clock  elapsed; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int(), queue_size)); \
+    fail_if_error(p = vrt_producer_new("generate", batch_size, q)); \
+    fail_if_error(groups[0] = vrt_consumer_group_new("group_1", q)); \
+    fail_if_error(groups[1] = vrt_consumer_group_new("group_2", q)); \
+    \
+    struct generate_config  generate_config = { \
+        p, GENERATE_COUNT \
+    }; \
+    clients[0].run = generate_integers; \
+    clients[0].ud = &generate_config; \
+    \
+    for (i = 0; i < GROUP_COUNT * GROUP_SIZE + 1; i++) { \
+        fail_if_error(sum_configs[i].c = vrt_consumer_new("sum", q)); \
+        if (i < GROUP_COUNT * GROUP_SIZE) { \
+            fail_if_error(vrt_consumer_group_add \
+                          (groups[i / GROUP_SIZE], sum_configs[i].c)); \
+        } \
+        sum_configs[i].result = &results[i]; \
+        clients[i + 1].run = sum_integers; \
+        clients[i + 1].ud = &sum_configs[i]; \
+    } \
+    clients[GROUP_COUNT * GROUP_SIZE + 2].run = NULL; \
+    clients[GROUP_COUNT * GROUP_SIZE + 2].ud = NULL; \
+    \
+    fail_unless(cork_array_size(&q->gating_cursors) == GROUP_COUNT + 1, \
+                "Unexpected number of gating cursors"); \
+    fail_if_error(run_func(q, clients, &elapsed)); \
+    for (i = 0; i < GROUP_COUNT * GROUP_SIZE + 1; i++) { \
+        fail_unless(results[i] == expected, "Unexpected sum"); \
+    } \
+    for (i = 0; i < GROUP_COUNT; i++) { \
+        fail_unless(vrt_consumer_group_get_cursor(groups[i]) == \
+                    vrt_consumer_get_cursor(sum_configs[0].c), \
+                    "Group didn't consume everything"); \
+    } \
+    vrt_report_clock(elapsed, GENERATE_COUNT); \
+    vrt_queue_free(q);
+
+
+START_TEST(test_group_threaded_small)
+{
+    RUN_GROUP_TEST(16, 4, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_group_threaded)
+{
+    RUN_GROUP_TEST(0, 0, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_group_threaded_hybrid_small)
+{
+    RUN_GROUP_TEST(16, 4, vrt_test_queue_threaded_hybrid);
+}
+END_TEST
+
+START_TEST(test_group_threaded_blocking_small)
+{
+    RUN_GROUP_TEST(16, 4, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+START_TEST(test_group_scheduled_small)
+{
+    RUN_GROUP_TEST(16, 4, vrt_test_queue_scheduled);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Partitioned consumer groups
+ */
+
+#define PARTITION_COUNT  3
+
+/* A producer feeding a partitioned group, plus one consumer that isn't in the
+ * group.  The members' sums should add up to the total, and no two members
+ * should see the same key.  The keys come from the producer, or from the
+ * queue's key function if use_key is true. */
+#define RUN_PARTITION_TEST(queue_size, batch_size, run_func, use_key, \
+                           sum_func) \
+    DESCRIBE_TEST; \
+    int64_t  results[PARTITION_COUNT + 1]; \
+    int64_t  total = 0; \
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2; \
+    uint32_t  keys_seen = 0; \
+    unsigned int  i; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_producer  *p; \
+    struct vrt_consumer_group  *group; \
+    struct partitioned_sum_config  sum_configs[PARTITION_COUNT]; \
+    struct sum_config  sum_config; \
+    struct vrt_queue_client  clients[PARTITION_COUNT + 3]; \
+    vrt_clock  elapsed; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int(), queue_size)); \
+    if (use_key) { \
+        vrt_queue_set_partition_key(q, integer_partition_key); \
+    } \
+    fail_if_error(p = vrt_producer_new("generate", batch_size, q)); \
+    fail_if_error(group = vrt_consumer_group_new_partitioned("group", q)); \
+    \
+    struct generate_config  generate_config = { \
+        p, GENERATE_COUNT \
+    }; \
+    clients[0].run = \
+        use_key? generate_integers: generate_integers_partitioned; \
+    clients[0].ud = &generate_config; \
+    \
+    for (i = 0; i < PARTITION_COUNT; i++) { \
+        fail_if_error(sum_configs[i].c = vrt_consumer_new("sum", q)); \
+        fail_if_error(vrt_consumer_group_add(group, sum_configs[i].c)); \
+        results[i] = 0; \
+        sum_configs[i].result = &results[i]; \
+        clients[i + 1].run = sum_func; \
+        clients[i + 1].ud = &sum_configs[i]; \
+    } \
+    fail_if_error(sum_config.c = vrt_consumer_new("sum", q)); \
+    results[PARTITION_COUNT] = 0; \
+    sum_config.result = &results[PARTITION_COUNT]; \
+    clients[PARTITION_COUNT + 1].run = sum_integers; \
+    clients[PARTITION_COUNT + 1].ud = &sum_config; \
+    clients[PARTITION_COUNT + 2].run = NULL; \
+    clients[PARTITION_COUNT + 2].ud = NULL; \
+    \
+    fail_if_error(run_func(q, clients, &elapsed)); \
+    for (i = 0; i < PARTITION_COUNT; i++) { \
+        fail_unless(results[i] >= 0, "Partition key seen out of order"); \
+        fail_unless((keys_seen & sum_configs[i].keys_seen) == 0, \
+                    "Partition key seen by more than one member"); \
+        keys_seen |= sum_configs[i].keys_seen; \
+        total += results[i]; \
+    } \
+    fail_unless(total == expected, "Unexpected sum from partitioned group"); \
+    fail_unless(results[PARTITION_COUNT] == expected, "Unexpected sum"); \
+    fail_unless(vrt_consumer_group_get_cursor(group) == \
+                vrt_consumer_get_cursor(sum_config.c), \
+                "Group didn't consume everything"); \
+    vrt_report_clock(elapsed, GENERATE_COUNT); \
+    vrt_queue_free(q);
+
+
+START_TEST(test_partition_threaded_small)
+{
+    RUN_PARTITION_TEST(16, 4, vrt_test_queue_threaded, false,
+                       sum_integers_partitioned);
+}
+END_TEST
+
+START_TEST(test_partition_threaded)
+{
+    RUN_PARTITION_TEST(0, 0, vrt_test_queue_threaded, false,
+                       sum_integers_partitioned);
+}
+END_TEST
+
+START_TEST(test_partition_threaded_key_small)
+{
+    RUN_PARTITION_TEST(16, 4, vrt_test_queue_threaded, true,
+                       sum_integers_partitioned);
+}
+END_TEST
+
+START_TEST(test_partition_threaded_blocking_small)
+{
+    RUN_PARTITION_TEST(16, 4, vrt_test_queue_threaded_blocking, false,
+                       sum_integers_partitioned);
+}
+END_TEST
+
+START_TEST(test_partition_batch_threaded_small)
+{
+    RUN_PARTITION_TEST(16, 4, vrt_test_queue_threaded, false,
+                       sum_integers_partitioned_batch);
+}
+END_TEST
+
+START_TEST(test_partition_batch_threaded)
+{
+    RUN_PARTITION_TEST(0, 0, vrt_test_queue_threaded, false,
+                       sum_integers_partitioned_batch);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Work pools
+ */
+
+#define POOL_SIZE  3
+
+/* Several producers feeding a work pool, plus one consumer that depends on
+ * the pool.  The workers' sums should add up to the total, since each value
+ * goes to exactly one of them. */
+#define RUN_POOL_TEST(queue_size, batch_size, run_func) \
+    DESCRIBE_TEST; \
+    int64_t  results[POOL_SIZE + 1]; \
+    int64_t  total = 0; \
+    int64_t  expected; \
+    unsigned int  i; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_consumer  *pool; \
+    struct generate_config  generate_config[PRODUCER_COUNT]; \
+    struct sum_config  sum_configs[POOL_SIZE + 1]; \
+    struct vrt_queue_client  clients[PRODUCER_COUNT + POOL_SIZE + 2]; \
+    vrt_clock  elapsed; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int(), queue_size)); \
+    for (i = 0; i < PRODUCER_COUNT; i++) { \
+        fail_if_error(generate_config[i].p = vrt_producer_new \
+                          ("generate", batch_size, q)); \
+        generate_config[i].count = GENERATE_COUNT; \
+        clients[i].run = generate_integers; \
+        clients[i].ud = &generate_config[i]; \
+    } \
+    fail_if_error(pool = vrt_consumer_pool_new("pool", q)); \
+    \
+    for (i = 0; i < POOL_SIZE + 1; i++) { \
+        fail_if_error(sum_configs[i].c = vrt_consumer_new("sum", q)); \
+        if (i < POOL_SIZE) { \
+            fail_if_error(vrt_consumer_pool_add(pool, sum_configs[i].c)); \
+        } else { \
+            vrt_consumer_add_dependency(sum_configs[i].c, pool); \
+        } \
+        results[i] = 0; \
+        sum_configs[i].result = &results[i]; \
+        clients[PRODUCER_COUNT + i].run = sum_integers; \
+        clients[PRODUCER_COUNT + i].ud = &sum_configs[i]; \
+    } \
+    clients[PRODUCER_COUNT + POOL_SIZE + 1].run = NULL; \
+    clients[PRODUCER_COUNT + POOL_SIZE + 1].ud = NULL; \
+    \
+    fail_unless(cork_array_size(&q->gating_cursors) == 1, \
+                "Unexpected number of gating cursors"); \
+    fail_if_error(run_func(q, clients, &elapsed)); \
+    expected = PRODUCER_COUNT * (GENERATE_COUNT * (GENERATE_COUNT - 1) / 2); \
+    for (i = 0; i < POOL_SIZE; i++) { \
+        total += results[i]; \
+    } \
+    fail_unless(total == expected, "Unexpected sum from work pool"); \
+    fail_unless(results[POOL_SIZE] == expected, "Unexpected sum"); \
+    fail_unless(vrt_consumer_get_cursor(pool) == \
+                vrt_consumer_get_cursor(sum_configs[POOL_SIZE].c), \
+                "Work pool didn't consume everything"); \
+    vrt_report_clock(elapsed, PRODUCER_COUNT * GENERATE_COUNT); \
+    vrt_queue_free(q);
+
+
+START_TEST(test_pool_threaded_small)
+{
+    RUN_POOL_TEST(16, 4, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_pool_threaded)
+{
+    RUN_POOL_TEST(0, 0, vrt_test_queue_threaded);
+}
+END_TEST
+
+START_TEST(test_pool_threaded_blocking_small)
+{
+    RUN_POOL_TEST(16, 4, vrt_test_queue_threaded_blocking);
+}
+END_TEST
+
+START_TEST(test_pool_scheduled_small)
+{
+    RUN_POOL_TEST(16, 4, vrt_test_queue_scheduled);
+}
+END_TEST
+
+START_TEST(test_pool_empty)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_consumer  *pool;
+    struct vrt_consumer  *worker;
+
+    /* A pool without any workers would never move its cursor, so the
+     * producer would eventually block forever. */
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(vrt_producer_new("p", 4, q));
+    fail_if_error(pool = vrt_consumer_pool_new("pool", q));
+    fail_unless_error(vrt_queue_start(q), "Expected empty pool");
+    cork_error_clear();
+
+    fail_if_error(worker = vrt_consumer_new("worker", q));
+    fail_if_error(vrt_consumer_pool_add(pool, worker));
+    fail_if_error(vrt_queue_start(q));
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Relays
+ */
+
+/* The test harness only sets up yield strategies for the clients of the
+ * source queue, so we have to set up the mirror queue's clients ourselves. */
+#define RUN_RELAY_TEST(queue_size, batch_size, run_func, yield_func) \
+    DESCRIBE_TEST; \
+    int64_t  result; \
+    int64_t  mirror_result; \
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_queue  *mirror; \
+    struct vrt_producer  *p; \
+    struct vrt_consumer  *c; \
+    struct vrt_consumer  *mirror_c; \
+    struct vrt_relay  *relay; \
+    vrt_clock  elapsed; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int_inline(), \
+                       queue_size)); \
+    fail_if_error(mirror = vrt_queue_new_on_node \
+                      ("queue_mirror", vrt_value_type_int_inline(), \
+                       queue_size, 0, vrt_numa_current_node())); \
+    fail_if_error(p = vrt_producer_new("generate", batch_size, q)); \
+    fail_if_error(c = vrt_consumer_new("sum", q)); \
+    fail_if_error(relay = vrt_relay_new("relay", q, mirror, batch_size)); \
+    fail_if_error(mirror_c = vrt_consumer_new("mirror_sum", mirror)); \
+    relay->producer->yield = yield_func(); \
+    mirror_c->yield = yield_func(); \
+    \
+    struct generate_config  generate_config = { \
+        p, GENERATE_COUNT \
+    }; \
+    struct sum_config  sum_config = { \
+        c, &result \
+    }; \
+    struct relay_config  relay_config = { \
+        relay \
+    }; \
+    struct sum_config  mirror_sum_config = { \
+        mirror_c, &mirror_result \
+    }; \
+    \
+    struct vrt_queue_client  clients[] = { \
+        { generate_integers, &generate_config }, \
+        { sum_integers, &sum_config }, \
+        { relay_integers, &relay_config }, \
+        { sum_integers, &mirror_sum_config }, \
+        { NULL, NULL } \
+    }; \
+    \
+    fail_if_error(run_func(q, clients, &elapsed)); \
+    fprintf(stdout, "Result: %" PRId64 "\n", result); \
+    fprintf(stdout, "Mirror result: %" PRId64 "\n", mirror_result); \
+    fail_unless(result == expected, "Unexpected sum"); \
+    fail_unless(mirror_result == expected, "Unexpected mirror sum"); \
+    vrt_report_clock(elapsed, GENERATE_COUNT); \
+    vrt_relay_free(relay); \
+    vrt_queue_free(mirror); \
+    vrt_queue_free(q);
+
+
+START_TEST(test_relay_threaded_small)
+{
+    RUN_RELAY_TEST(16, 4, vrt_test_queue_threaded,
+                   vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_relay_threaded)
+{
+    RUN_RELAY_TEST(0, 0, vrt_test_queue_threaded,
+                   vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_relay_threaded_hybrid_small)
+{
+    RUN_RELAY_TEST(16, 4, vrt_test_queue_threaded_hybrid,
+                   vrt_yield_strategy_hybrid);
+}
+END_TEST
+
+START_TEST(test_relay_scheduled_small)
+{
+    RUN_RELAY_TEST(16, 4, vrt_test_queue_scheduled,
+                   vrt_yield_strategy_coroutine);
+}
+END_TEST
+
+START_TEST(test_relay_invalid)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_queue  *mirror;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int_inline(), 16));
+    fail_if_error(mirror = vrt_queue_new
+                  ("mirror", vrt_value_type_int_inline(), 16));
+    fail_if_error(vrt_producer_new("p", 4, mirror));
+    fail_if_error(vrt_consumer_new("c", mirror));
+    fail_if_error(vrt_queue_start(mirror));
+
+    /* We can't add a producer to the running mirror, so the relay's
+     * consumer shouldn't stick around in the source queue either. */
+    fail_unless_error(vrt_relay_new("relay", q, mirror, 4),
+                      "Expected error relaying into a running queue");
+    cork_error_clear();
+    fail_unless(cork_array_is_empty(&q->consumers),
+                "Relay consumer wasn't removed");
+    fail_unless(cork_array_is_empty(&q->gating_cursors),
+                "Relay consumer is still gating producers");
+
+    vrt_queue_free(mirror);
+    vrt_queue_free(q);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Pipelines
+ */
+
+#define PIPELINE_STAGE_COUNT  3
+
+/* A producer feeding three consumers.  In a three-step pipeline, each
+ * consumer depends on the one before it; in a diamond, the last consumer
+ * depends on the other two. */
+#define RUN_PIPELINE_TEST(queue_size, batch_size, diamond, yield_func) \
+    DESCRIBE_TEST; \
+    int64_t  results[PIPELINE_STAGE_COUNT]; \
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2; \
+    unsigned int  i; \
+    \
+    struct vrt_queue  *q; \
+    struct vrt_pipeline  *pl; \
+    struct vrt_stage  *producer; \
+    struct vrt_stage  *stages[PIPELINE_STAGE_COUNT]; \
+    struct generate_config  generate_config; \
+    struct sum_config  sum_configs[PIPELINE_STAGE_COUNT]; \
+    \
+    fail_if_error(q = vrt_queue_new \
+                      ("queue_sum", vrt_value_type_int(), queue_size)); \
+    fail_if_error(pl = vrt_pipeline_new("pipeline", q)); \
+    fail_if_error(producer = vrt_pipeline_add_producer \
+                  (pl, "generate", batch_size, \
+                   generate_integers, &generate_config)); \
+    vrt_stage_set_yield(producer, yield_func()); \
+    generate_config.p = producer->producer; \
+    generate_config.count = GENERATE_COUNT; \
+    \
+    for (i = 0; i < PIPELINE_STAGE_COUNT; i++) { \
+        fail_if_error(stages[i] = vrt_pipeline_add_consumer \
+                      (pl, "sum", sum_integers, &sum_configs[i])); \
+        vrt_stage_set_yield(stages[i], yield_func()); \
+        results[i] = 0; \
+        sum_configs[i].c = stages[i]->consumer; \
+        sum_configs[i].result = &results[i]; \
+    } \
+    if (diamond) { \
+        fail_if_error(vrt_pipeline_add_dependency(stages[2], stages[0])); \
+        fail_if_error(vrt_pipeline_add_dependency(stages[2], stages[1])); \
+    } else { \
+        fail_if_error(vrt_pipeline_add_dependency(stages[1], stages[0])); \
+        fail_if_error(vrt_pipeline_add_dependency(stages[2], stages[1])); \
+    } \
+    \
+    fail_if_error(vrt_pipeline_run(pl)); \
+    fail_unless(cork_array_size(&q->gating_cursors) == 1, \
+                "Unexpected number of gating cursors"); \
+    for (i = 0; i < PIPELINE_STAGE_COUNT; i++) { \
+        fail_unless(results[i] == expected, "Unexpected sum"); \
+        fail_unless(vrt_consumer_get_cursor(stages[i]->consumer) == \
+                    vrt_consumer_get_cursor(stages[0]->consumer), \
+                    "Stage didn't consume everything"); \
+    } \
+    vrt_pipeline_free(pl); \
+    vrt_queue_free(q);
+
+
+START_TEST(test_pipeline_three_step_small)
+{
+    RUN_PIPELINE_TEST(16, 4, false, vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_pipeline_three_step)
+{
+    RUN_PIPELINE_TEST(0, 0, false, vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_pipeline_diamond_small)
+{
+    RUN_PIPELINE_TEST(16, 4, true, vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_pipeline_diamond_blocking_small)
+{
+    RUN_PIPELINE_TEST(16, 4, true, vrt_yield_strategy_blocking);
+}
+END_TEST
+
+START_TEST(test_pipeline_invalid)
+{
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_pipeline  *pl;
+    struct vrt_stage  *producer;
+    struct vrt_stage  *c1;
+    struct vrt_stage  *c2;
+
+    fail_if_error(q = vrt_queue_new("queue_sum", vrt_value_type_int(), 16));
+    fail_if_error(pl = vrt_pipeline_new("pipeline", q));
+
+    /* No producer */
+    fail_if_error(c1 = vrt_pipeline_add_consumer(pl, "c1", NULL, NULL));
+    fail_unless_error(vrt_pipeline_start(pl), "Expected missing producer");
+    cork_error_clear();
+
+    /* Producers can't be dependencies */
+    fail_if_error(producer = vrt_pipeline_add_producer
+                  (pl, "p", 0, NULL, NULL));
+    fail_unless_error(vrt_pipeline_add_dependency(c1, producer),
+                      "Expected invalid dependency");
+    cork_error_clear();
+
+    /* A dependency cycle */
+    fail_if_error(c2 = vrt_pipeline_add_consumer(pl, "c2", NULL, NULL));
+    fail_if_error(vrt_pipeline_add_dependency(c2, c1));
+    fail_if_error(vrt_pipeline_add_dependency(c1, c2));
+    fail_unless_error(vrt_pipeline_start(pl), "Expected dependency cycle");
+    cork_error_clear();
+
+    /* A queue that can't start.  The pipeline doesn't count as started, so
+     * we can try again, without wiring up the dependencies twice. */
+    vrt_pipeline_free(pl);
+    fail_if_error(pl = vrt_pipeline_new("pipeline", q));
+    fail_if_error(producer = vrt_pipeline_add_producer
+                  (pl, "p", 0, NULL, NULL));
+    fail_if_error(c1 = vrt_pipeline_add_consumer(pl, "c1", NULL, NULL));
+    fail_if_error(c2 = vrt_pipeline_add_consumer(pl, "c2", NULL, NULL));
+    fail_if_error(vrt_pipeline_add_dependency(c2, c1));
+    fail_if_error(vrt_consumer_pool_new("pool", q));
+    fail_unless_error(vrt_pipeline_start(pl), "Expected empty pool");
+    cork_error_clear();
+    fail_if(pl->started, "Pipeline shouldn't be started");
+    fail_unless_error(vrt_pipeline_start(pl), "Expected empty pool");
+    cork_error_clear();
+    fail_unless(cork_array_size(&c2->consumer->dependencies) == 1,
+                "Dependency was added twice");
+
+#if defined(__linux__)
+    /* A CPU that we can't run on */
+    vrt_pipeline_free(pl);
+    fail_if_error(pl = vrt_pipeline_new("pipeline", q));
+    fail_if_error(producer = vrt_pipeline_add_producer
+                  (pl, "p", 0, NULL, NULL));
+    fail_if_error(c1 = vrt_pipeline_add_consumer(pl, "c1", NULL, NULL));
+    vrt_stage_set_cpu(c1, 1 << 20);
+    fail_unless_error(vrt_pipeline_start(pl), "Expected invalid CPU");
+    cork_error_clear();
+#endif
+
+    vrt_pipeline_free(pl);
+    vrt_queue_free(q);
+}
+END_TEST
+
+START_TEST(test_pipeline_start_failure)
+{
+#if defined(__GLIBC__)
+    DESCRIBE_TEST;
+    struct vrt_queue  *q;
+    struct vrt_pipeline  *pl;
+    struct vrt_stage  *c1;
+    struct vrt_stage  *c2;
+    pthread_attr_t  old_attr;
+    pthread_attr_t  attr;
+    unsigned int  i;
+    int  rc;
+
+    fail_if_error(q = vrt_queue_new("queue_sum", vrt_value_type_int(), 16));
+    fail_if_error(pl = vrt_pipeline_new("pipeline", q));
+    for (i = 0; i < 5; i++) {
+        fail_if_error(vrt_pipeline_add_producer(pl, "p", 4, NULL, NULL));
+    }
+    fail_if_error(c1 = vrt_pipeline_add_consumer(pl, "c1", NULL, NULL));
+    fail_if_error(c2 = vrt_pipeline_add_consumer(pl, "c2", NULL, NULL));
+    fail_if_error(vrt_pipeline_add_dependency(c2, c1));
+
+    /* Make every new thread ask for a stack that's far too big, so that
+     * none of the stages can start.  We have to stand in for all of them,
+     * and the producers' EOFs don't all fit in the queue at once. */
+    pthread_getattr_default_np(&old_attr);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, (size_t) 1 << 46);
+    pthread_setattr_default_np(&attr);
+    rc = vrt_pipeline_start(pl);
+    pthread_setattr_default_np(&old_attr);
+    pthread_attr_destroy(&attr);
+    pthread_attr_destroy(&old_attr);
+
+    fail_unless(rc != 0, "Expected error starting stages");
+    cork_error_clear();
+    fail_unless(c2->consumer->eof_count == 5, "Expected every EOF");
+    vrt_pipeline_free(pl);
+    vrt_queue_free(q);
+#endif
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Sharded queues
+ */
+
+START_TEST(test_shard_keys)
+{
+    DESCRIBE_TEST;
+    struct vrt_sharded_queue  *sq;
+    struct vrt_sharded_producer  *p;
+    struct vrt_sharded_producer  *p0;
+    struct vrt_consumer  *cs[4];
+    struct vrt_value  *v;
+    unsigned int  i;
+
+    fail_if_error(sq = vrt_sharded_queue_new
+                  ("queue", vrt_value_type_int(), 4, 64));
+    fail_if_error(p = vrt_sharded_producer_new("p", 4, sq));
+    fail_if_error(p0 = vrt_sharded_producer_new_on_shard("p0", 4, sq, 0));
+    for (i = 0; i < 4; i++) {
+        fail_if_error(cs[i] = vrt_consumer_new
+                      ("c", vrt_sharded_queue_shard(sq, i)));
+    }
+
+    /* Values with the same key always go to the same shard, in order. */
+    for (i = 0; i < 32; i++) {
+        fail_if_error(vrt_sharded_producer_claim_key(p, i % 8, &v));
+        cork_container_of(v, struct vrt_value_int, parent)->value = i;
+        fail_if_error(vrt_sharded_producer_publish(p));
+    }
+    fail_if_error(vrt_sharded_producer_publish_batch(p));
+
+    for (i = 0; i < 4; i++) {
+        int32_t  last[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+        while (vrt_consumer_try_next(cs[i], &v) == 0) {
+            int32_t  value =
+                cork_container_of(v, struct vrt_value_int, parent)->value;
+            fail_unless(vrt_sharded_queue_shard_for_key(sq, value % 8) == i,
+                        "Value %d is in the wrong shard", value);
+            fail_unless(value > last[value % 8],
+                        "Value %d is out of order", value);
+            last[value % 8] = value;
+        }
+    }
+
+    /* A producer that only feeds one shard can't route by key. */
+    fail_unless_error(vrt_sharded_producer_claim_key(p0, 0, &v),
+                      "Expected error claiming by key");
+    cork_error_clear();
+    fail_unless_error(vrt_sharded_producer_new_on_shard("p4", 4, sq, 4),
+                      "Expected error adding producer");
+    cork_error_clear();
+    vrt_sharded_queue_free(sq);
+}
+END_TEST
+
+/* One producer for each shard, plus a keyed producer that feeds all of them,
+ * with a single consumer merging everything back together. */
+static void
+run_shard_test(unsigned int shard_count, unsigned int shard_size,
+               unsigned int batch_size,
+               struct vrt_yield_strategy *(*yield_func)(void))
+{
+    struct vrt_sharded_queue  *sq;
+    struct vrt_sharded_consumer  *c;
+    pthread_t  *threads;
+    struct generate_sharded_config  *generate_configs;
+    struct sum_sharded_config  sum_config;
+    unsigned int  producer_count = shard_count + 1;
+    int64_t  result = -1;
+    int64_t  expected =
+        producer_count * (GENERATE_COUNT * (GENERATE_COUNT - 1) / 2);
+    unsigned int  i;
+
+    threads = cork_calloc(producer_count + 1, sizeof(pthread_t));
+    generate_configs = cork_calloc
+        (producer_count, sizeof(struct generate_sharded_config));
+
+    fail_if_error(sq = vrt_sharded_queue_new
+                  ("queue", vrt_value_type_int(), shard_count, shard_size));
+    for (i = 0; i < producer_count; i++) {
+        struct vrt_sharded_producer  *p;
+        if (i < shard_count) {
+            fail_if_error(p = vrt_sharded_producer_new_on_shard
+                          ("generate", batch_size, sq, i));
+        } else {
+            fail_if_error(p = vrt_sharded_producer_new
+                          ("generate", batch_size, sq));
+        }
+        vrt_sharded_producer_set_yield(p, yield_func());
+        generate_configs[i].p = p;
+        generate_configs[i].count = GENERATE_COUNT;
+    }
+    fail_if_error(c = vrt_sharded_consumer_new("sum", sq));
+    vrt_sharded_consumer_set_yield(c, yield_func());
+    sum_config.c = c;
+    sum_config.result = &result;
+    fail_if_error(vrt_sharded_queue_start(sq));
+
+    pthread_create(&threads[0], NULL, sum_integers_sharded, &sum_config);
+    for (i = 0; i < producer_count; i++) {
+        pthread_create(&threads[i + 1], NULL, generate_integers_sharded,
+                       &generate_configs[i]);
+    }
+    for (i = 0; i <= producer_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+    vrt_sharded_queue_free(sq);
+    cork_cfree(threads, producer_count + 1, sizeof(pthread_t));
+    cork_cfree(generate_configs, producer_count,
+               sizeof(struct generate_sharded_config));
+}
+
+START_TEST(test_shard_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_shard_test(4, 16, 4, vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_shard_threaded)
+{
+    DESCRIBE_TEST;
+    run_shard_test(4, 0, 0, vrt_yield_strategy_threaded);
+}
+END_TEST
+
+START_TEST(test_shard_threaded_blocking_small)
+{
+    DESCRIBE_TEST;
+    run_shard_test(4, 16, 4, vrt_yield_strategy_blocking);
+}
+END_TEST
+
+static void
+check_merged(struct vrt_sharded_consumer *c, int32_t expected)
+{
+    struct vrt_value  *v;
+    int32_t  value;
+    fail_if_error(vrt_sharded_consumer_try_next(c, &v));
+    value = cork_container_of(v, struct vrt_value_int, parent)->value;
+    fail_unless(value == expected,
+                "Expected %" PRId32 ", got %" PRId32, expected, value);
+}
+
+START_TEST(test_shard_merge)
+{
+    DESCRIBE_TEST;
+    struct vrt_sharded_queue  *sq;
+    struct vrt_sharded_producer  *ps[3];
+    struct vrt_sharded_consumer  *c;
+    struct vrt_value  *v;
+    unsigned int  i;
+
+    fail_if_error(sq = vrt_sharded_queue_new
+                  ("queue", vrt_value_type_int(), 3, 16));
+    for (i = 0; i < 3; i++) {
+        fail_if_error(ps[i] = vrt_sharded_producer_new_lane("p", 1, sq));
+    }
+    fail_unless_error(vrt_sharded_producer_new_lane("p", 1, sq),
+                      "Expected error adding producer");
+    cork_error_clear();
+    fail_if_error(c = vrt_sharded_consumer_new("c", sq));
+    vrt_sharded_consumer_set_merge(c, integer_timestamp);
+    fail_if_error(vrt_sharded_queue_start(sq));
+
+    /* Lane i gets every value that's i mod 3, except that the last lane
+     * stops early. */
+    for (i = 0; i < 12; i++) {
+        if (i % 3 == 2 && i > 6) {
+            continue;
+        }
+        fail_if_error(vrt_sharded_producer_claim(ps[i % 3], &v));
+        cork_container_of(v, struct vrt_value_int, parent)->value = i;
+        fail_if_error(vrt_sharded_producer_publish(ps[i % 3]));
+    }
+
+    for (i = 0; i < 2; i++) {
+        fail_if_error(vrt_sharded_producer_eof(ps[i]));
+    }
+
+    for (i = 0; i < 6; i++) {
+        check_merged(c, (int32_t) i);
+    }
+
+    /* The last lane is empty but hasn't finished, so it might still produce
+     * something older than what's waiting in the other lanes. */
+    fail_unless(vrt_sharded_consumer_try_next(c, &v) == VRT_QUEUE_AGAIN,
+                "Expected to wait for the last lane");
+
+    fail_if_error(vrt_sharded_producer_eof(ps[2]));
+    check_merged(c, 6);
+    check_merged(c, 7);
+    check_merged(c, 9);
+    check_merged(c, 10);
+    fail_unless(vrt_sharded_consumer_try_next(c, &v) == VRT_QUEUE_EOF,
+                "Expected EOF");
+    vrt_sharded_queue_free(sq);
+}
+END_TEST
+
+/* Each lane gets its own producer, and the consumer merges them in order. */
+static void
+run_shard_merge_test(unsigned int lane_count, unsigned int lane_size,
+                     unsigned int batch_size)
+{
+    struct vrt_sharded_queue  *sq;
+    struct vrt_sharded_consumer  *c;
+    pthread_t  *threads;
+    struct generate_sharded_config  *generate_configs;
+    struct sum_sharded_config  merge_config;
+    int64_t  result = -2;
+    int64_t  expected =
+        lane_count * (GENERATE_COUNT * (GENERATE_COUNT - 1) / 2);
+    unsigned int  i;
+
+    threads = cork_calloc(lane_count + 1, sizeof(pthread_t));
+    generate_configs = cork_calloc
+        (lane_count, sizeof(struct generate_sharded_config));
+
+    fail_if_error(sq = vrt_sharded_queue_new
+                  ("queue", vrt_value_type_int(), lane_count, lane_size));
+    for (i = 0; i < lane_count; i++) {
+        struct vrt_sharded_producer  *p;
+        fail_if_error(p = vrt_sharded_producer_new_lane
+                      ("generate", batch_size, sq));
+        vrt_sharded_producer_set_yield(p, vrt_yield_strategy_threaded());
+        generate_configs[i].p = p;
+        generate_configs[i].count = GENERATE_COUNT;
+    }
+    fail_if_error(c = vrt_sharded_consumer_new("merge", sq));
+    vrt_sharded_consumer_set_yield(c, vrt_yield_strategy_threaded());
+    vrt_sharded_consumer_set_merge(c, integer_timestamp);
+    merge_config.c = c;
+    merge_config.result = &result;
+    fail_if_error(vrt_sharded_queue_start(sq));
+
+    pthread_create(&threads[0], NULL, merge_integers_sharded, &merge_config);
+    for (i = 0; i < lane_count; i++) {
+        pthread_create(&threads[i + 1], NULL, generate_integers_sharded,
+                       &generate_configs[i]);
+    }
+    for (i = 0; i <= lane_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+    vrt_sharded_queue_free(sq);
+    cork_cfree(threads, lane_count + 1, sizeof(pthread_t));
+    cork_cfree(generate_configs, lane_count,
+               sizeof(struct generate_sharded_config));
+}
+
+START_TEST(test_shard_merge_threaded)
+{
+    DESCRIBE_TEST;
+    run_shard_merge_test(4, 0, 0);
+}
+END_TEST
+
+START_TEST(test_shard_merge_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_shard_merge_test(4, 16, 4);
+}
+END_TEST
+
+/*----------------------------------------------------------------------
+ * Shared-memory queues
+ */
+
+static void
+shared_queue_name(char *buf, size_t size)
+{
+    snprintf(buf, size, "vrt-test-%ld", (long) getpid());
+}
+
+START_TEST(test_shared_errors)
+{
+    DESCRIBE_TEST;
+    char  name[64];
+    struct vrt_queue  *q1;
+    struct vrt_queue  *q2;
+
+    shared_queue_name(name, sizeof(name));
+    fail_unless_error(vrt_queue_new_shared
+                      (name, vrt_value_type_int(), 16, 1, 1),
+                      "Expected error with a non-inline value type");
+    cork_error_clear();
+    fail_unless_error(vrt_queue_open_shared
+                      (name, vrt_value_type_int_inline()),
+                      "Expected error opening a missing queue");
+    cork_error_clear();
+
+    fail_if_error(q1 = vrt_queue_new_shared
+                  (name, vrt_value_type_int_inline(), 16, 1, 1));
+    fail_unless_error(vrt_queue_new_shared
+                      (name, vrt_value_type_int_inline(), 16, 1, 1),
+                      "Expected error creating a queue twice");
+    cork_error_clear();
+    fail_unless_error(vrt_queue_open_shared(name, vrt_value_type_int()),
+                      "Expected error with a mismatched value type");
+    cork_error_clear();
+    fail_if_error(q2 = vrt_queue_open_shared
+                  (name, vrt_value_type_int_inline()));
+    fail_unless(vrt_queue_size(q2) == 16, "Unexpected queue size");
+
+    /* There's only room for one of each client, across both processes. */
+    fail_if_error(vrt_producer_new("p", 4, q1));
+    fail_unless_error(vrt_producer_new("p", 4, q2),
+                      "Expected error adding a second producer");
+    cork_error_clear();
+    fail_unless_error(vrt_consumer_group_new("g", q2),
+                      "Expected error adding a consumer group");
+    cork_error_clear();
+    fail_if_error(vrt_consumer_new("c", q2));
+    fail_unless_error(vrt_consumer_new("c", q1),
+                      "Expected error adding a second consumer");
+    cork_error_clear();
+
+    vrt_queue_free(q2);
+    vrt_queue_free(q1);
+    fail_unless_error(vrt_queue_open_shared
+                      (name, vrt_value_type_int_inline()),
+                      "Expected error opening a freed queue");
+    cork_error_clear();
+}
+END_TEST
+
+START_TEST(test_consumer_remove)
+{
+    DESCRIBE_TEST;
+    char  name[64];
+    struct vrt_queue  *q;
+    struct vrt_queue  *q1;
+    struct vrt_queue  *q2;
+    struct vrt_producer  *p;
+    struct vrt_consumer  *c1;
+    struct vrt_consumer  *c2;
+    struct vrt_consumer  *c3;
+    int64_t  sum = 0;
+
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_if_error(p = vrt_producer_new("p", 4, q));
+    fail_if_error(c1 = vrt_consumer_new("c1", q));
+    fail_if_error(c2 = vrt_consumer_new("c2", q));
+    fail_if_error(c3 = vrt_consumer_new("c3", q));
+    fail_if_error(vrt_consumer_add_dependency(c3, c2));
+#if defined(__linux__)
+    fail_if(vrt_consumer_eventfd(c1) == -1, "Cannot create eventfd");
+#endif
+
+    /* Nothing can be removed while another consumer depends on it... */
+    fail_unless_error(vrt_consumer_remove(c2), "Expected error removing");
+    cork_error_clear();
+
+    /* ...and the ones that are left keep their order. */
+    fail_if_error(vrt_consumer_remove(c1));
+    fail_unless(cork_array_size(&q->consumers) == 2, "Expected 2 consumers");
+    fail_unless(cork_array_is_empty(&q->eventfd_consumers),
+                "Unexpected eventfd consumers");
+    fail_unless(cork_array_at(&q->consumers, 0) == c2 && c2->index == 0,
+                "Expected c2 to move to the front");
+    fail_unless(cork_array_at(&q->consumers, 1) == c3 && c3->index == 1,
+                "Expected c3 to move forward");
+
+    fail_if_error(vrt_queue_start(q));
+    produce_integers(p, 0, 4);
+    fail_if_error(vrt_producer_eof(p));
+    fail_unless(drain_integers(c2, &sum) == VRT_QUEUE_EOF, "Expected EOF");
+    fail_unless(drain_integers(c3, &sum) == VRT_QUEUE_EOF, "Expected EOF");
+    fail_unless(sum == 12, "Unexpected sum (got %" PRId64 ")", sum);
+    vrt_queue_free(q);
+
+    /* A shared queue's consumer gives its slot back, as long as no one has
+     * taken a later one. */
+    shared_queue_name(name, sizeof(name));
+    fail_if_error(q1 = vrt_queue_new_shared
+                  (name, vrt_value_type_int_inline(), 16, 1, 2));
+    fail_if_error(q2 = vrt_queue_open_shared
+                  (name, vrt_value_type_int_inline()));
+    fail_if_error(c1 = vrt_consumer_new("c1", q1));
+    fail_if_error(c2 = vrt_consumer_new("c2", q2));
+    fail_unless_error(vrt_consumer_remove(c1), "Expected error removing");
+    cork_error_clear();
+    fail_if_error(vrt_consumer_remove(c2));
+    fail_if_error(c3 = vrt_consumer_new("c3", q1));
+    fail_unless_error(vrt_consumer_new("c4", q2),
+                      "Expected error adding a third consumer");
+    cork_error_clear();
+    vrt_queue_free(q2);
+    vrt_queue_free(q1);
+}
+END_TEST
+
+/* Runs in a child process, and produces a sequence of integers into a queue
+ * that our parent created. */
+static void
+generate_shared(const char *name, unsigned int batch_size, bool blocking)
+{
+    struct vrt_queue  *q;
+    struct generate_config  config;
+
+    q = vrt_queue_open_shared(name, vrt_value_type_int_inline());
+    if (q == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    config.p = vrt_producer_new("generate", batch_size, q);
+    config.count = GENERATE_COUNT;
+    if (config.p == NULL) {
+        _exit(EXIT_FAILURE);
+    }
+    config.p->yield = blocking?
+        vrt_yield_strategy_blocking(): vrt_yield_strategy_threaded();
+    if (vrt_queue_start(q) != 0) {
+        _exit(EXIT_FAILURE);
+    }
+    generate_integers(&config);
+    vrt_queue_free(q);
+    _exit(cork_error_occurred()? EXIT_FAILURE: EXIT_SUCCESS);
+}
+
+/* Each producer runs in its own child process, and we consume their values
+ * in this one. */
+static void
+run_shared_test(unsigned int queue_size, unsigned int batch_size,
+                unsigned int producer_count, bool blocking)
+{
+    char  name[64];
+    struct vrt_queue  *q;
+    struct vrt_consumer  *c;
+    struct sum_config  sum_config;
+    int64_t  result = -1;
+    int64_t  expected =
+        producer_count * (GENERATE_COUNT * (GENERATE_COUNT - 1) / 2);
+    unsigned int  i;
+
+    shared_queue_name(name, sizeof(name));
+    fail_if_error(q = vrt_queue_new_shared
+                  (name, vrt_value_type_int_inline(), queue_size,
+                   producer_count, 1));
+    fail_if_error(c = vrt_consumer_new("sum", q));
+    c->yield = blocking?
+        vrt_yield_strategy_blocking(): vrt_yield_strategy_threaded();
+    fail_if_error(vrt_queue_start(q));
+
+    for (i = 0; i < producer_count; i++) {
+        pid_t  pid = fork();
+        fail_if(pid == -1, "Cannot fork");
+        if (pid == 0) {
+            generate_shared(name, batch_size, blocking);
+        }
+    }
+
+    sum_config.c = c;
+    sum_config.result = &result;
+    sum_integers(&sum_config);
+
+    for (i = 0; i < producer_count; i++) {
+        int  status;
+        fail_if(wait(&status) == -1, "Cannot wait for producer");
+        fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+                    "Producer process failed");
+    }
+
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+    vrt_queue_free(q);
+}
+
+START_TEST(test_shared_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_shared_test(16, 4, 1, false);
+}
+END_TEST
+
+START_TEST(test_shared_threaded)
+{
+    DESCRIBE_TEST;
+    run_shared_test(0, 0, 1, false);
+}
+END_TEST
+
+START_TEST(test_shared_blocking_small)
+{
+    DESCRIBE_TEST;
+    run_shared_test(16, 4, 1, true);
+}
+END_TEST
+
+START_TEST(test_shared_multi_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_shared_test(16, 4, 2, false);
+}
+END_TEST
+
+START_TEST(test_shared_multi_blocking_small)
+{
+    DESCRIBE_TEST;
+    run_shared_test(16, 4, 2, true);
+}
+END_TEST
+
+
+/*----------------------------------------------------------------------
+ * Journals
+ */
+
+/* Removes a journal directory, along with everything in it. */
+static void
+remove_journal(const char *path)
+{
+    DIR  *dir = opendir(path);
+    struct dirent  *entry;
+    char  filename[PATH_MAX];
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(filename, sizeof(filename), "%s/%s",
+                     path, entry->d_name);
+            unlink(filename);
+        }
+    }
+    closedir(dir);
+    rmdir(path);
+}
+
+/* Runs a queue whose consumer depends on a journal, and returns the
+ * consumer's sum.  The producer first replays everything in the journal
+ * after the consumer's checkpoint, and the consumer skips anything that it
+ * has already seen. */
+static int64_t
+run_journal_step(struct vrt_value_type *value_type, const char *path,
+                 size_t segment_size, unsigned int flags,
+                 uint64_t *last_sequence)
+{
+    struct vrt_queue  *q;
+    struct vrt_journal  *journal;
+    struct vrt_consumer  *c;
+    struct journal_config  journal_config;
+    struct replay_config  replay_config;
+    struct sum_journaled_config  sum_config;
+    int64_t  result = -1;
+    uint64_t  last = 0;
+    vrt_clock  elapsed;
+
+    fail_if_error(q = vrt_queue_new("queue_journal", value_type, 16));
+    fail_if_error(replay_config.generate.p =
+                  vrt_producer_new("generate", 4, q));
+    fail_if_error(journal = vrt_journal_new
+                  ("journal", q, path, segment_size, flags));
+    fail_if_error(c = vrt_consumer_new("sum", q));
+    fail_if_error(vrt_consumer_add_dependency(c, journal->consumer));
+    fail_if_error(vrt_journal_load_checkpoint
+                  (path, "sum", &replay_config.after));
+    fail_unless(vrt_journal_last_sequence(journal) == *last_sequence,
+                "Journal didn't pick up where it left off");
+
+    journal_config.journal = journal;
+    replay_config.journal = journal;
+    replay_config.generate.count = GENERATE_COUNT;
+    sum_config.c = c;
+    sum_config.journal = journal;
+    sum_config.after = replay_config.after;
+    sum_config.result = &result;
+    sum_config.last = &last;
+
+    struct vrt_queue_client  clients[] = {
+        { replay_integers, &replay_config },
+        { journal_integers, &journal_config },
+        { sum_journaled_integers, &sum_config },
+        { NULL, NULL }
+    };
+
+    fail_if_error(vrt_test_queue_threaded(q, clients, &elapsed));
+    *last_sequence += GENERATE_COUNT;
+    fail_unless(vrt_journal_last_sequence(journal) == *last_sequence,
+                "Journal has the wrong number of values");
+    fail_unless(last == *last_sequence, "Consumer didn't see every value");
+    vrt_journal_free(journal);
+    vrt_queue_free(q);
+    return result;
+}
+
+static void
+run_journal_test(struct vrt_value_type *value_type, size_t segment_size,
+                 unsigned int flags)
+{
+    char  path[] = "/tmp/vrt-journal-XXXXXX";
+    uint64_t  last_sequence = 0;
+    int64_t  half = GENERATE_COUNT / 2;
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2;
+    int64_t  result;
+
+    fail_if(mkdtemp(path) == NULL, "Cannot create journal directory");
+
+    /* On the first run, there's nothing to replay. */
+    result = run_journal_step
+        (value_type, path, segment_size, flags, &last_sequence);
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+
+    /* Pretend that the consumer only got halfway through before it
+     * crashed.  It should see the second half again, followed by the new
+     * values. */
+    fail_if_error(vrt_journal_save_checkpoint(path, "sum", half));
+    expected = expected - half * (half - 1) / 2 + expected;
+    result = run_journal_step
+        (value_type, path, segment_size, flags, &last_sequence);
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+
+    remove_journal(path);
+}
+
+/* Flips a bit in the payload of the record with the given index in a
+ * journal segment.  Each record has a 16-byte header, and the segment's
+ * records start 64 bytes into the file. */
+static void
+corrupt_journal_record(const char *path, uint64_t first, unsigned int index)
+{
+    char  filename[PATH_MAX];
+    FILE  *file;
+    long  offset = 64;
+    unsigned int  i;
+    uint32_t  size;
+    unsigned char  byte;
+
+    snprintf(filename, sizeof(filename), "%s/%016" PRIx64 ".seg",
+             path, first);
+    fail_if((file = fopen(filename, "r+b")) == NULL,
+            "Cannot open journal segment %s", filename);
+    for (i = 0; i < index; i++) {
+        fail_if(fseek(file, offset + 8, SEEK_SET) != 0 ||
+                fread(&size, sizeof(size), 1, file) != 1,
+                "Cannot read journal record %u", i);
+        offset += 16 + ((size + 7) & ~7);
+    }
+    fail_if(fseek(file, offset + 16, SEEK_SET) != 0 ||
+            fread(&byte, 1, 1, file) != 1, "Cannot read journal record");
+    byte ^= 0x01;
+    fail_if(fseek(file, offset + 16, SEEK_SET) != 0 ||
+            fwrite(&byte, 1, 1, file) != 1, "Cannot write journal record");
+    fclose(file);
+}
+
+START_TEST(test_journal_corrupt)
+{
+    DESCRIBE_TEST;
+    char  path[] = "/tmp/vrt-journal-XXXXXX";
+    uint64_t  last_sequence = 0;
+    int64_t  kept = GENERATE_COUNT / 2;
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2;
+    int64_t  result;
+
+    fail_if(mkdtemp(path) == NULL, "Cannot create journal directory");
+    result = run_journal_step
+        (vrt_value_type_int(), path, 0, 0, &last_sequence);
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+
+    /* Damage a record in the middle of the journal.  When we reopen it,
+     * everything from there on should be gone, and the new values should
+     * pick up right after the last intact record. */
+    corrupt_journal_record(path, 1, kept);
+    last_sequence = kept;
+    expected = kept * (kept - 1) / 2 + expected;
+    result = run_journal_step
+        (vrt_value_type_int(), path, 0, 0, &last_sequence);
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+
+    remove_journal(path);
+}
+END_TEST
+
+START_TEST(test_journal_blank_segment)
+{
+    DESCRIBE_TEST;
+    char  path[] = "/tmp/vrt-journal-XXXXXX";
+    char  filename[PATH_MAX];
+    uint64_t  last_sequence = 0;
+    int64_t  expected = GENERATE_COUNT * (GENERATE_COUNT - 1) / 2;
+    int64_t  result;
+    FILE  *file;
+
+    fail_if(mkdtemp(path) == NULL, "Cannot create journal directory");
+    result = run_journal_step
+        (vrt_value_type_int(), path, 0, VRT_JOURNAL_SYNC, &last_sequence);
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+
+    /* Pretend that we crashed just after starting a new segment, before its
+     * header made it to disk.  The journal should start that segment over,
+     * rather than refusing to open. */
+    snprintf(filename, sizeof(filename), "%s/%016" PRIx64 ".seg",
+             path, last_sequence + 1);
+    fail_if((file = fopen(filename, "w")) == NULL,
+            "Cannot create journal segment %s", filename);
+    fclose(file);
+    expected *= 2;
+    result = run_journal_step
+        (vrt_value_type_int(), path, 0, VRT_JOURNAL_SYNC, &last_sequence);
+    fail_unless(result == expected,
+                "Sums don't match (got %" PRId64 ", expected %" PRId64 ")",
+                result, expected);
+
+    remove_journal(path);
+}
+END_TEST
+
+START_TEST(test_journal_invalid)
+{
+    DESCRIBE_TEST;
+    char  path[] = "/tmp/vrt-journal-XXXXXX";
+    char  filename[PATH_MAX];
+    struct vrt_queue  *q;
+    FILE  *file;
+
+    fail_if(mkdtemp(path) == NULL, "Cannot create journal directory");
+    snprintf(filename, sizeof(filename), "%s/%016x.seg", path, 1);
+    fail_if((file = fopen(filename, "w")) == NULL,
+            "Cannot create journal segment %s", filename);
+    fputs("This isn't a journal segment\n", file);
+    fclose(file);
+
+    /* If we can't open the journal, its consumer shouldn't stick around in
+     * the queue. */
+    fail_if_error(q = vrt_queue_new("queue", vrt_value_type_int(), 16));
+    fail_unless_error(vrt_journal_new("journal", q, path, 0, 0),
+                      "Expected error opening an invalid journal");
+    cork_error_clear();
+    fail_unless(cork_array_is_empty(&q->consumers),
+                "Journal consumer wasn't removed");
+    fail_unless(cork_array_is_empty(&q->gating_cursors),
+                "Journal consumer is still gating producers");
+
+    vrt_queue_free(q);
+    remove_journal(path);
+}
+END_TEST
+
+START_TEST(test_journal_threaded)
+{
+    DESCRIBE_TEST;
+    run_journal_test(vrt_value_type_int(), 0, 0);
+}
+END_TEST
+
+START_TEST(test_journal_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_journal_test(vrt_value_type_int(), 256, VRT_JOURNAL_SYNC);
+}
+END_TEST
+
+START_TEST(test_journal_inline_threaded_small)
+{
+    DESCRIBE_TEST;
+    run_journal_test(vrt_value_type_int_inline(), 256, 0);
+}
+END_TEST
+
+
 /*----------------------------------------------------------------------
  * Testing harness
  */
@@ -124,6 +2661,99 @@ test_suite()
     tcase_add_test(tc_vrt, test_sum_threaded_spin_small);
     tcase_add_test(tc_vrt, test_sum_threaded_hybrid);
     tcase_add_test(tc_vrt, test_sum_threaded_hybrid_small);
+    tcase_add_test(tc_vrt, test_sum_threaded_blocking);
+    tcase_add_test(tc_vrt, test_sum_threaded_blocking_small);
+    tcase_add_test(tc_vrt, test_sum_threaded_adaptive);
+    tcase_add_test(tc_vrt, test_sum_threaded_adaptive_small);
+    tcase_add_test(tc_vrt, test_sum_scheduled);
+    tcase_add_test(tc_vrt, test_sum_scheduled_small);
+    tcase_add_test(tc_vrt, test_sum_inline_threaded);
+    tcase_add_test(tc_vrt, test_sum_inline_threaded_small);
+    tcase_add_test(tc_vrt, test_sum_batch_threaded);
+    tcase_add_test(tc_vrt, test_sum_batch_threaded_small);
+    tcase_add_test(tc_vrt, test_sum_batch_threaded_hybrid_small);
+    tcase_add_test(tc_vrt, test_sum_bulk_threaded);
+    tcase_add_test(tc_vrt, test_sum_bulk_threaded_small);
+    tcase_add_test(tc_vrt, test_sum_huge_pages);
+    tcase_add_test(tc_vrt, test_sum_inline_huge_pages);
+    tcase_add_test(tc_vrt, test_sum_try_threaded);
+    tcase_add_test(tc_vrt, test_sum_try_threaded_small);
+    tcase_add_test(tc_vrt, test_sum_eventfd);
+    tcase_add_test(tc_vrt, test_sum_eventfd_small);
+    tcase_add_test(tc_vrt, test_eventcount_waiters);
+    tcase_add_test(tc_vrt, test_try_single_threaded);
+    tcase_add_test(tc_vrt, test_try_multi_threaded);
+    tcase_add_test(tc_vrt, test_publish_interval_single_threaded);
+    tcase_add_test(tc_vrt, test_publish_interval_multi_threaded);
+    tcase_add_test(tc_vrt, test_publish_partial);
+    tcase_add_test(tc_vrt, test_publish_interval_threaded);
+    tcase_add_test(tc_vrt, test_publish_interval_threaded_small);
+    tcase_add_test(tc_vrt, test_commit_interval);
+    tcase_add_test(tc_vrt, test_commit_batches);
+    tcase_add_test(tc_vrt, test_commit_interval_threaded);
+    tcase_add_test(tc_vrt, test_commit_interval_threaded_small);
+    tcase_add_test(tc_vrt, test_memory_stats);
+    tcase_add_test(tc_vrt, test_queue_start);
+    tcase_add_test(tc_vrt, test_attach_consumer);
+    tcase_add_test(tc_vrt, test_attach_producer);
+    tcase_add_test(tc_vrt, test_attach_producer_timeout);
+    tcase_add_test(tc_vrt, test_attach_producer_late);
+    tcase_add_test(tc_vrt, test_attach_frees_gating_sets);
+    tcase_add_test(tc_vrt, test_attach_threaded);
+    tcase_add_test(tc_vrt, test_attach_threaded_small);
+    tcase_add_test(tc_vrt, test_sequencer_threaded);
+    tcase_add_test(tc_vrt, test_sequencer_threaded_small);
+    tcase_add_test(tc_vrt, test_sequencer_threaded_hybrid_small);
+    tcase_add_test(tc_vrt, test_sequencer_threaded_blocking_small);
+    tcase_add_test(tc_vrt, test_sequencer_threaded_adaptive_small);
+    tcase_add_test(tc_vrt, test_sequencer_scheduled_small);
+    tcase_add_test(tc_vrt, test_group_threaded);
+    tcase_add_test(tc_vrt, test_group_threaded_small);
+    tcase_add_test(tc_vrt, test_group_threaded_hybrid_small);
+    tcase_add_test(tc_vrt, test_group_threaded_blocking_small);
+    tcase_add_test(tc_vrt, test_group_scheduled_small);
+    tcase_add_test(tc_vrt, test_pool_threaded);
+    tcase_add_test(tc_vrt, test_partition_threaded_small);
+    tcase_add_test(tc_vrt, test_partition_threaded);
+    tcase_add_test(tc_vrt, test_partition_threaded_key_small);
+    tcase_add_test(tc_vrt, test_partition_threaded_blocking_small);
+    tcase_add_test(tc_vrt, test_partition_batch_threaded_small);
+    tcase_add_test(tc_vrt, test_partition_batch_threaded);
+    tcase_add_test(tc_vrt, test_pool_threaded_small);
+    tcase_add_test(tc_vrt, test_pool_threaded_blocking_small);
+    tcase_add_test(tc_vrt, test_pool_scheduled_small);
+    tcase_add_test(tc_vrt, test_pool_empty);
+    tcase_add_test(tc_vrt, test_relay_threaded);
+    tcase_add_test(tc_vrt, test_relay_threaded_small);
+    tcase_add_test(tc_vrt, test_relay_threaded_hybrid_small);
+    tcase_add_test(tc_vrt, test_relay_scheduled_small);
+    tcase_add_test(tc_vrt, test_relay_invalid);
+    tcase_add_test(tc_vrt, test_pipeline_three_step_small);
+    tcase_add_test(tc_vrt, test_pipeline_three_step);
+    tcase_add_test(tc_vrt, test_pipeline_diamond_small);
+    tcase_add_test(tc_vrt, test_pipeline_diamond_blocking_small);
+    tcase_add_test(tc_vrt, test_pipeline_invalid);
+    tcase_add_test(tc_vrt, test_pipeline_start_failure);
+    tcase_add_test(tc_vrt, test_shard_keys);
+    tcase_add_test(tc_vrt, test_shard_threaded);
+    tcase_add_test(tc_vrt, test_shard_threaded_small);
+    tcase_add_test(tc_vrt, test_shard_threaded_blocking_small);
+    tcase_add_test(tc_vrt, test_shard_merge);
+    tcase_add_test(tc_vrt, test_shard_merge_threaded);
+    tcase_add_test(tc_vrt, test_shard_merge_threaded_small);
+    tcase_add_test(tc_vrt, test_shared_errors);
+    tcase_add_test(tc_vrt, test_consumer_remove);
+    tcase_add_test(tc_vrt, test_shared_threaded);
+    tcase_add_test(tc_vrt, test_shared_threaded_small);
+    tcase_add_test(tc_vrt, test_shared_blocking_small);
+    tcase_add_test(tc_vrt, test_shared_multi_threaded_small);
+    tcase_add_test(tc_vrt, test_shared_multi_blocking_small);
+    tcase_add_test(tc_vrt, test_journal_threaded);
+    tcase_add_test(tc_vrt, test_journal_threaded_small);
+    tcase_add_test(tc_vrt, test_journal_inline_threaded_small);
+    tcase_add_test(tc_vrt, test_journal_corrupt);
+    tcase_add_test(tc_vrt, test_journal_blank_segment);
+    tcase_add_test(tc_vrt, test_journal_invalid);
     suite_add_tcase(s, tc_vrt);
 
     return s;